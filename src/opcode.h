@@ -18,8 +18,66 @@ typedef enum ST_VM_Opcode {
     ST_VM_OP_PUSHSYMBOL,
 
     /* Misc */
+
+    /* Layout: [op][symbol: 16bit][argc: 8bit][body length: 32bit][body...]
+       The body immediately follows the header, and execution continues after
+       the body; the method runs when the selector is sent to the target. */
     ST_VM_OP_SETMETHOD,
 
+    /* One 8bit arg. Short forms of the symbol operand instructions above,
+       for the first 256 entries of the symbol table. */
+    ST_VM_OP_GETGLOBAL8,
+    ST_VM_OP_SETGLOBAL8,
+    ST_VM_OP_SENDMSG8,
+    ST_VM_OP_PUSHSYMBOL8,
+
+    /* Layout: [op][selector: 16bit][class name: 16bit][argc: 8bit]
+       [definition: 16bit][method offset: 32bit]
+       A send that whole program analysis found has a single target: the
+       method body at the offset, defined by the code's SETMETHOD number
+       <definition> (counting from zero) on the class the global of that
+       name holds. The VM calls it directly if looking the selector up from
+       the receiver's class finds the method that definition installed,
+       otherwise it falls back to a normal send. The class name is only
+       there for tools. */
+    ST_VM_OP_SENDDIRECT,
+
+    /* Layout: [op][selector: 16bit][class name: 16bit][definition: 16bit]
+       [inlined length: 32bit][inlined body...]
+       A send whose single target (as for SENDDIRECT) was inlined into the
+       caller. If the SENDDIRECT guards hold, execution falls through into
+       the inlined body, otherwise the VM skips it and sends the selector. */
+    ST_VM_OP_INLINEGUARD,
+
     /* End. Don't exceed 255 */
     ST_VM_OP_COUNT = 256
 } ST_VM_Opcode;
+
+/* Bytecode container. All numbers are little endian.
+   header:   magic (0x89 'S' 'T' 'B'), version (16bit), section count (16bit)
+   sections: per section its id, offset from the start of the container,
+             length and CRC32C (Castagnoli) of its bytes, 32bit each
+   then the CRC32C of everything above (32bit), and the section contents.
+
+   Loaders only read and check the sections they use, anything else (e.g. an
+   unknown id) is skipped. The sections:
+   SYMBOLS   null-terminated symbol names
+   CODE      the instructions
+   LITERALS  reserved
+   DEBUG     line table, see ST_SourceLocation in smalltalk.h
+   PROFILE   reserved
+   CODE_LZ4  instead of CODE: the length of the instructions (32bit), then
+             the instructions compressed as one LZ4 block
+
+   Code without the magic is in the older bare format: the symbol names, an
+   extra terminator, then the instructions. */
+enum { ST_VM_CONTAINER_VERSION = 1 };
+
+typedef enum ST_VM_SectionId {
+    ST_VM_SECTION_SYMBOLS = 1,
+    ST_VM_SECTION_CODE,
+    ST_VM_SECTION_LITERALS,
+    ST_VM_SECTION_DEBUG,
+    ST_VM_SECTION_PROFILE,
+    ST_VM_SECTION_CODE_LZ4
+} ST_VM_SectionId;
@@ -3,11 +3,10 @@
 struct ST_Context;
 struct ST_Internal_Object;
 
-/* Note: stack operations are not currently bounds-checked. But I'm thinking
-   there's a more efficient way of preventing bad access than checking every
-   call. e.g. A compiler would know how many local variables are in a method,
-   so lets eventually make the vm do the stack size check upon entry into a
-   method. */
+/* Note: only pushes are bounds-checked. One at operandStack.end is dropped
+   and sets operandStack.overflowed, and compiled methods answer nil without
+   running until the host's stack unwinds, see ST_VM_invokeCompiled. Pops and
+   refs trust the bytecode to stay within its own frame. */
 static void ST_pushStack(struct ST_Context *ctx, ST_Object val);
 static void ST_popStack(struct ST_Context *ctx);
 static ST_Object ST_refStack(struct ST_Context *ctx, ST_Size offset);
@@ -22,9 +21,23 @@ static void ST_memcpy(ST_Object ctx, void *dest, const void *src, ST_Size n);
 static void ST_free(ST_Object ctx, void *memory);
 
 struct ST_Class;
+struct ST_LinkedCode;
 static struct ST_Internal_Object *
 ST_GC_allocInstance(struct ST_Context *ctx, const struct ST_Class *class);
 
+/* Runs the current stack frame until it returns. */
+static void ST_Internal_VM_execute(struct ST_Context *ctx);
+static void ST_Scheduler_preempt(struct ST_Context *ctx);
+static void ST_Scheduler_wakeReceivers(struct ST_Context *ctx);
+static void ST_VM_invokeCompiled(struct ST_Context *ctx, ST_Code *code,
+                                 ST_Size offset, ST_U8 argc);
+static void ST_VM_clearOverflow(struct ST_Context *ctx);
+static void ST_VM_releaseLoaders(struct ST_Context *ctx,
+                                 const struct ST_Loader *until);
+static void ST_VM_releaseLinkedCode(struct ST_Context *ctx,
+                                    const struct ST_LinkedCode *until);
+static void ST_Checkpoint_free(struct ST_Context *ctx);
+
 /*//////////////////////////////////////////////////////////////////////////////
 // Helper functions
 /////////////////////////////////////////////////////////////////////////////*/
@@ -37,6 +50,16 @@ typedef enum { false, true } bool;
 #define UNEXPECTED(COND) COND
 #endif
 
+#ifdef __GNUC__
+#define ST_ATOMIC_EXCHANGE(PTR, VALUE)                                         \
+    __atomic_exchange_n(PTR, VALUE, __ATOMIC_ACQ_REL)
+#define ST_ATOMIC_LOAD(PTR) __atomic_load_n(PTR, __ATOMIC_ACQUIRE)
+#define ST_ATOMIC_STORE(PTR, VALUE)                                            \
+    __atomic_store_n(PTR, VALUE, __ATOMIC_RELEASE)
+#else
+#error "mailboxes and interrupts need the __atomic builtins of GCC or Clang"
+#endif
+
 typedef enum ST_Cmp {
     ST_Cmp_Greater = 1,
     ST_Cmp_Less = -1,
@@ -63,9 +86,8 @@ static ST_Size ST_strlen(const char *s) {
 }
 
 static void ST_strcpy(char *dst, const char *src) {
-    char c;
-    while ((c = *(src++)))
-        *(dst++) = c;
+    while ((*(dst++) = *(src++)))
+        ;
 }
 
 static char *ST_strdup(ST_Object ctx, const char *s) {
@@ -91,7 +113,10 @@ typedef struct ST_Pool_Node {
  to use your imagination */
 } ST_Pool_Node;
 
-typedef struct ST_Pool_Slab { struct ST_Pool_Slab *next; } ST_Pool_Slab;
+typedef struct ST_Pool_Slab {
+    struct ST_Pool_Slab *next;
+    ST_Size count;
+} ST_Pool_Slab;
 
 typedef struct ST_Pool {
     ST_Size elemSize;
@@ -100,21 +125,29 @@ typedef struct ST_Pool {
     ST_Size lastAllocCount;
 } ST_Pool;
 
-static void ST_Pool_grow(ST_Object ctx, ST_Pool *pool, ST_Size count) {
+/* Clears the slab and puts all its nodes on the free list */
+static void ST_Pool_chain(ST_Object ctx, ST_Pool *pool, ST_Pool_Slab *slab) {
     const ST_Size poolNodeSize = pool->elemSize + sizeof(ST_Pool_Node);
-    const ST_Size headerSize = sizeof(ST_Pool_Slab *);
-    const ST_Size allocSize = poolNodeSize * count + headerSize;
-    ST_U8 *mem = ST_alloc(ctx, allocSize);
+    const ST_Size allocSize = poolNodeSize * slab->count + sizeof *slab;
+    ST_U8 *mem = (ST_U8 *)slab;
     ST_Size i;
-    ST_memset(ctx, mem, 0, allocSize);
-    pool->lastAllocCount = count;
-    for (i = headerSize; i < allocSize; i += poolNodeSize) {
+    ST_memset(ctx, mem + sizeof *slab, 0, allocSize - sizeof *slab);
+    for (i = sizeof *slab; i < allocSize; i += poolNodeSize) {
         ST_Pool_Node *node = (void *)(mem + i);
         node->next = pool->freelist;
         pool->freelist = node;
     }
-    ((ST_Pool_Slab *)mem)->next = pool->slabs;
-    pool->slabs = (ST_Pool_Slab *)mem;
+}
+
+static void ST_Pool_grow(ST_Object ctx, ST_Pool *pool, ST_Size count) {
+    const ST_Size poolNodeSize = pool->elemSize + sizeof(ST_Pool_Node);
+    ST_Pool_Slab *slab =
+        ST_alloc(ctx, poolNodeSize * count + sizeof(ST_Pool_Slab));
+    pool->lastAllocCount = count;
+    slab->count = count;
+    ST_Pool_chain(ctx, pool, slab);
+    slab->next = pool->slabs;
+    pool->slabs = slab;
 }
 
 static void ST_Pool_init(ST_Object ctx, ST_Pool *pool, ST_Size elemSize,
@@ -140,12 +173,77 @@ static void *ST_Pool_alloc(ST_Object ctx, ST_Pool *pool) {
     return (ST_U8 *)ret + sizeof(ST_Pool_Node);
 }
 
+/* Makes room for count more elements, in a slab of their own unless the
+   free list holds that many already (as after ST_Pool_rewind), without
+   changing how much the pool grows by when it runs out */
+static void ST_Pool_reserve(ST_Object ctx, ST_Pool *pool, ST_Size count) {
+    const ST_Size lastAllocCount = pool->lastAllocCount;
+    ST_Pool_Node *node = pool->freelist;
+    ST_Size available = 0;
+    while (node && available < count) {
+        node = node->next;
+        ++available;
+    }
+    if (available == count) {
+        return;
+    }
+    ST_Pool_grow(ctx, pool, count);
+    pool->lastAllocCount = lastAllocCount;
+}
+
 static void ST_Pool_free(ST_Object ctx, ST_Pool *pool, void *mem) {
     ST_Pool_Node *node = (void *)((char *)mem - sizeof(ST_Pool_Node));
     node->next = pool->freelist;
     pool->freelist = node;
 }
 
+/* Where a pool stood at a checkpoint: the slabs it had then, and its state
+   since the last rewind. Nodes that were free at the checkpoint stay unused
+   from then on, so rewinding never has to tell them apart. */
+typedef struct ST_Pool_Mark {
+    ST_Pool_Slab *slabs;
+    ST_Pool_Slab *top;
+    ST_Pool_Node *freelist;
+} ST_Pool_Mark;
+
+static void ST_Pool_mark(ST_Pool *pool, ST_Pool_Mark *mark) {
+    pool->freelist = NULL;
+    mark->slabs = pool->slabs;
+    mark->top = pool->slabs;
+    mark->freelist = NULL;
+}
+
+/* Whether any node was taken or given back since the mark or rewind */
+static bool ST_Pool_touched(const ST_Pool *pool, const ST_Pool_Mark *mark) {
+    return pool->slabs != mark->top || pool->freelist != mark->freelist;
+}
+
+/* Frees every node allocated since the checkpoint at once, keeping the
+   slabs they came from for reuse */
+static void ST_Pool_rewind(ST_Object ctx, ST_Pool *pool, ST_Pool_Mark *mark) {
+    ST_Pool_Slab *slab;
+    pool->freelist = NULL;
+    for (slab = pool->slabs; slab != mark->slabs; slab = slab->next) {
+        ST_Pool_chain(ctx, pool, slab);
+    }
+    mark->top = pool->slabs;
+    mark->freelist = pool->freelist;
+}
+
+/* Calls visit with each element in the slabs added since the checkpoint */
+static void ST_Pool_visitSince(ST_Pool *pool, const ST_Pool_Mark *mark,
+                               ST_Visitor *visitor) {
+    const ST_Size poolNodeSize = pool->elemSize + sizeof(ST_Pool_Node);
+    ST_Pool_Slab *slab;
+    for (slab = pool->slabs; slab != mark->slabs; slab = slab->next) {
+        ST_U8 *node = (ST_U8 *)(slab + 1);
+        ST_Size i;
+        for (i = 0; i < slab->count; ++i, node += poolNodeSize) {
+            visitor->visit(visitor, node + sizeof(ST_Pool_Node));
+        }
+    }
+}
+
 static void ST_Pool_release(ST_Object ctx, ST_Pool *pool) {
     ST_Pool_Slab *slab = pool->slabs;
     while (slab) {
@@ -179,10 +277,73 @@ typedef struct ST_ContextObject { ST_Internal_Object object; } ST_ContextObject;
 typedef struct ST_StackFrame {
     ST_Size ip;
     ST_Size bp;
-    const ST_Code *code;
+    ST_Code *code;
     struct ST_StackFrame *parent;
 } ST_StackFrame;
 
+/* Pushes at end are dropped and mark the stack overflowed, after which
+   compiled methods answer nil without running, see ST_VM_invokeCompiled */
+typedef struct ST_OperandStack {
+    struct ST_Internal_Object **base;
+    struct ST_Internal_Object **top;
+    struct ST_Internal_Object **end;
+    bool overflowed;
+} ST_OperandStack;
+
+/* Green threads, see ST_runProcesses */
+typedef enum ST_ProcessState {
+    ST_PROCESS_READY,
+    ST_PROCESS_RUNNING,
+    ST_PROCESS_WAITING,
+    ST_PROCESS_RECEIVING,
+    ST_PROCESS_PENDING,
+    ST_PROCESS_DELAYED,
+    ST_PROCESS_SUSPENDED,
+    ST_PROCESS_TERMINATED
+} ST_ProcessState;
+
+typedef struct ST_ProcessList {
+    struct ST_Process *first;
+    struct ST_Process *last;
+} ST_ProcessList;
+
+typedef struct ST_Process {
+    /* Links in whichever list the state puts the process in: a ready queue,
+       a Semaphore's waiting list, the receiving, pending or delayed list. */
+    struct ST_Process *prev;
+    struct ST_Process *next;
+    /* Every live process, for the GC */
+    struct ST_Process *prevLive;
+    struct ST_Process *nextLive;
+    ST_ProcessState state;
+    ST_U8 priority;
+    /* Saved while the process isn't running */
+    ST_StackFrame *stackFrame;
+    ST_OperandStack stack;
+    /* The Process instance, and the Semaphore or Mailbox it waits on (moved
+       by the GC) */
+    struct ST_Internal_Object *object;
+    struct ST_Internal_Object *semaphore;
+    ST_Size wakeup;
+    /* While pending, what ST_resume identifies it by */
+    ST_Size token;
+    /* The bottom frame runs this, sending the selector to the receiver and
+       arguments at the bottom of the stack. */
+    ST_Code entry;
+    ST_Object selector;
+} ST_Process;
+
+/* Method lookups of the guards of bound sends and inlined bodies, which
+   stand for as long as methodEpoch does, see ST_VM_directSendValid */
+enum { ST_METHOD_CACHE_SIZE = 64 };
+
+typedef struct ST_MethodCache_Entry {
+    struct ST_Class *class;
+    ST_Object symbol;
+    struct ST_Internal_Method *method;
+    ST_Size epoch;
+} ST_MethodCache_Entry;
+
 typedef struct ST_Context {
     ST_ContextObject object;
     ST_Configuration config;
@@ -192,10 +353,7 @@ typedef struct ST_Context {
     struct ST_Internal_Object *trueValue;
     struct ST_Internal_Object *falseValue;
     ST_StackFrame *stackFrame;
-    struct OperandStack {
-        struct ST_Internal_Object **base;
-        struct ST_Internal_Object **top;
-    } operandStack;
+    ST_OperandStack operandStack;
     struct Heap {
         ST_U8 *begin;
         ST_U8 *end;
@@ -206,11 +364,63 @@ typedef struct ST_Context {
     ST_Pool strmapNodePool;
     ST_Pool classPool;
     ST_Pool symbolPool;
+    /* Bumped whenever a method is defined anywhere, see ST_VM_OP_SENDDIRECT */
+    ST_Size methodEpoch;
+    ST_MethodCache_Entry methodCache[ST_METHOD_CACHE_SIZE];
     bool gcDisabled;
+    /* Code restored by ST_loadImage, owned by the context. */
+    ST_U8 *imageCode;
+    /* An image that outlives the context, which symbol names point into
+       rather than being copied, see ST_Context_freeName */
+    const ST_U8 *imageBegin;
+    const ST_U8 *imageEnd;
+    /* Everything ST_VM_beginLoad allocated, see ST_VM_releaseLoaders */
+    struct ST_Loader *loaders;
+    /* Link tables from ST_VM_link, see ST_VM_releaseLinkedCode */
+    struct ST_LinkedCode *linkedCode;
+    /* Scheduler. While a process runs, the frames and stack above are its
+       own, and the host's are saved in mainFrame and mainStack. */
+    ST_Pool processPool;
+    ST_Process *processes;
+    ST_Size processCount;
+    ST_Process *activeProcess;
+    ST_ProcessList ready[ST_PRIORITY_HIGHEST + 1];
+    ST_ProcessList delayed;
+    ST_ProcessList receiving;
+    ST_ProcessList pending;
+    ST_Size lastToken;
+    ST_StackFrame *mainFrame;
+    ST_OperandStack mainStack;
+    ST_Size now;
+    /* Nesting of interpreter loops, processes only switch in the one the
+       scheduler runs them in, at processDepth. */
+    ST_Size vmDepth;
+    ST_Size processDepth;
+    /* Instructions run, and the count at which the time slice ends */
+    ST_Size executed;
+    ST_Size sliceEnd;
+    bool switchRequested;
+    /* Budgeted runs, see ST_VM_executeFor: the time slice also ends at
+       budgetEnd, and the run at budgetDepth stops at its next send once
+       stopRequested. interruptRequested is set from any thread. */
+    ST_Size budgetEnd;
+    ST_Size budgetDepth;
+    bool stopRequested;
+    int interruptRequested;
+    struct ST_Suspension *suspended;
+    /* See ST_checkpointContext */
+    struct ST_Checkpoint *checkpoint;
+    /* See ST_startWorkers */
+    struct ST_Context **workers;
+    ST_Size workerCount;
+    ST_Size workerStarts;
+    ST_RunJobs runJobs;
+    void *jobHost;
 } ST_Context;
 
-static void ST_pushStackFrame(ST_Context *ctx, ST_Size ip,
-                              const ST_Code *code) {
+static void ST_Scheduler_requestSwitch(ST_Context *ctx, ST_ProcessState state);
+
+static void ST_pushStackFrame(ST_Context *ctx, ST_Size ip, ST_Code *code) {
     ST_StackFrame *newFrame = ST_Pool_alloc(ctx, &ctx->vmFramePool);
     newFrame->ip = ip;
     newFrame->code = code;
@@ -221,15 +431,8 @@ static void ST_pushStackFrame(ST_Context *ctx, ST_Size ip,
 
 static void ST_popStackFrame(ST_Context *ctx) {
     ST_StackFrame *completeFrame = ctx->stackFrame;
-    ST_Size i;
-    const ST_Size stackDiff = ST_stackSize(ctx) - completeFrame->bp;
-    if (completeFrame->bp < completeFrame->parent->bp) {
-        /* FIXME */
-    }
-    for (i = 0; i < stackDiff; ++i) {
-        ST_popStack(ctx);
-    }
-    completeFrame = completeFrame->parent;
+    ctx->operandStack.top = ctx->operandStack.base + completeFrame->bp;
+    ctx->stackFrame = completeFrame->parent;
     ST_Pool_free(ctx, &ctx->vmFramePool, completeFrame);
 }
 
@@ -244,6 +447,11 @@ ST_Object *ST_pushLocals(ST_Object ctx, ST_Size count) {
 
 void ST_popLocals(ST_Object ctx) { ST_popStackFrame(ctx); }
 
+static bool ST_inHeap(ST_Context *ctx, const void *ptr) {
+    return (const ST_U8 *)ptr >= ctx->heap.begin &&
+           (const ST_U8 *)ptr < ctx->heap.end;
+}
+
 /*//////////////////////////////////////////////////////////////////////////////
 // Search Tree (Intrusive BST)
 /////////////////////////////////////////////////////////////////////////////*/
@@ -272,8 +480,8 @@ static void ST_List_prev(ST_BiNode **list) { *list = (*list)->left; }
 static ST_BiNode *ST_List_end(ST_BiNode *list) {
     ST_BiNode *current = list;
     if (list) {
-        while (list->right) {
-            current = list->right;
+        while (current->right) {
+            current = current->right;
         }
     }
     return current;
@@ -405,6 +613,45 @@ static ST_BiNode *ST_BST_remove(ST_BiNode **root, void *key,
     }
 }
 
+/* Merge sort, as ordered in a tree: comparator(nodes[i], nodes[i + 1]) is
+   never ST_Cmp_Greater afterwards. scratch holds count nodes too. */
+static void ST_BST_sort(ST_BiNode **nodes, ST_BiNode **scratch, ST_Size count,
+                        ST_Cmp (*comp)(void *, void *)) {
+    const ST_Size half = count / 2;
+    ST_Size left = 0, right = half, i;
+    if (count < 2) {
+        return;
+    }
+    ST_BST_sort(nodes, scratch, half, comp);
+    ST_BST_sort(nodes + half, scratch, count - half, comp);
+    for (i = 0; i < count; ++i) {
+        const bool takeLeft =
+            right == count ||
+            (left < half && comp(nodes[left], nodes[right]) != ST_Cmp_Greater);
+        if (takeLeft) {
+            scratch[i] = nodes[left++];
+        } else {
+            scratch[i] = nodes[right++];
+        }
+    }
+    for (i = 0; i < count; ++i) {
+        nodes[i] = scratch[i];
+    }
+}
+
+/* A balanced tree of sorted nodes, without comparing them again */
+static ST_BiNode *ST_BST_build(ST_BiNode **nodes, ST_Size count) {
+    const ST_Size middle = count / 2;
+    ST_BiNode *root;
+    if (!count) {
+        return NULL;
+    }
+    root = nodes[middle];
+    root->left = ST_BST_build(nodes, middle);
+    root->right = ST_BST_build(nodes + middle + 1, count - middle - 1);
+    return root;
+}
+
 static ST_BiNode *ST_BST_find(ST_BiNode **root, void *key,
                               ST_Cmp (*comp)(void *, void *)) {
     ST_BiNode *current = *root;
@@ -483,8 +730,10 @@ static ST_Cmp ST_SymbolMap_comparator(void *left, void *right) {
 
 typedef ST_Method ST_PrimitiveMethod;
 typedef struct ST_CompiledMethod {
-    const ST_Code *source;
+    ST_Code *source;
     ST_Size offset;
+    /* Which of source's SETMETHODs defined it, counted as they ran */
+    ST_Size definition;
 } ST_CompiledMethod;
 
 typedef struct ST_Internal_Method {
@@ -554,19 +803,34 @@ ST_Internal_Object *ST_Class_makeInstance(ST_Context *ctx, ST_Class *class) {
     return instance;
 }
 
+/* Classes like Semaphore keep a payload where instance variables would go,
+   which the primitives they inherit write into. Subclasses keep it too, and
+   can't add instance variables: NULL if they try. */
 static ST_Class *ST_Class_subclass(ST_Context *ctx, ST_Class *super,
                                    ST_Object nameSymb,
                                    ST_Size instanceVariableCount,
                                    ST_Size classVariableCount) {
-    ST_Class *sub = ST_Pool_alloc(ctx, &((ST_Context *)ctx)->classPool);
+    const ST_Size payloadSize =
+        super->instanceSize -
+        ST_getObjectFootprint(super->instanceVariableCount);
+    ST_Class *sub;
+    if (payloadSize && instanceVariableCount) {
+        return NULL;
+    }
+    sub = ST_Pool_alloc(ctx, &((ST_Context *)ctx)->classPool);
     sub->object.class = sub;
     sub->super = super;
     sub->instanceVariableCount =
         ((ST_Class *)super)->instanceVariableCount + instanceVariableCount;
-    sub->instanceSize = ST_getObjectFootprint(sub->instanceVariableCount);
+    sub->instanceSize =
+        ST_getObjectFootprint(sub->instanceVariableCount) + payloadSize;
     if (instanceVariableCount) {
-        sub->instanceVariableNames =
-            ST_alloc(ctx, instanceVariableCount * sizeof(ST_Internal_Object *));
+        const ST_Size namesSize =
+            instanceVariableCount * sizeof(ST_Internal_Object *);
+        /* Not every subclass names its ivars (see ST_Array_new), and images
+           need to tell the unnamed ones apart. */
+        sub->instanceVariableNames = ST_alloc(ctx, namesSize);
+        ST_memset(ctx, sub->instanceVariableNames, 0, namesSize);
     } else {
         sub->instanceVariableNames = NULL;
     }
@@ -617,42 +881,86 @@ static void ST_failedMethodLookup(ST_Object ctx, ST_Object receiver,
     ST_sendMsg(ctx, receiver, ST_symb(ctx, "doesNotUnderstand:"), 1, &err);
 }
 
+static ST_Object ST_invokeMethod(ST_Object ctx, ST_Internal_Method *method,
+                                 ST_Object receiver, ST_U8 argc,
+                                 ST_Object argv[]) {
+    switch (method->type) {
+    case ST_METHOD_TYPE_PRIMITIVE:
+        if (argc != method->argc) {
+            /* FIXME: wrong number of args */
+            return ST_getNil(ctx);
+        }
+        return method->payload.primitiveMethod(ctx, receiver, argv);
+
+    case ST_METHOD_TYPE_COMPILED: {
+        ST_U8 i;
+        ST_Object result;
+        /* Same layout the VM's SENDMSG sees: argv[0] right below the
+           receiver. */
+        for (i = argc; i > 0; --i) {
+            ST_pushStack(ctx, argv[i - 1]);
+        }
+        ST_pushStack(ctx, receiver);
+        ST_VM_invokeCompiled(ctx, method->payload.compiledMethod.source,
+                             method->payload.compiledMethod.offset, argc);
+        ST_Internal_VM_execute(ctx);
+        result = ST_refStack(ctx, 0);
+        ST_popStack(ctx);
+        ST_VM_clearOverflow(ctx);
+        return result;
+    }
+    }
+    return ST_getNil(ctx);
+}
+
 ST_Object ST_sendMsg(ST_Object ctx, ST_Object receiver, ST_Object symbol,
                      ST_U8 argc, ST_Object argv[]) {
     ST_Internal_Method *method =
         ST_Internal_Object_getMethod(ctx, receiver, symbol);
     if (method) {
-        switch (method->type) {
-        case ST_METHOD_TYPE_PRIMITIVE:
-            if (argc != method->argc) {
-                /* FIXME: wrong number of args */
-                return ST_getNil(ctx);
-            }
-            return method->payload.primitiveMethod(ctx, receiver, argv);
-
-        case ST_METHOD_TYPE_COMPILED: {
-            ST_U8 i;
-            ST_Object result;
-            for (i = 0; i < argc; ++i) {
-                ST_pushStack(ctx, argv[i]);
-            }
-            ST_VM_execute(ctx, method->payload.compiledMethod.source,
-                          method->payload.compiledMethod.offset);
-            result = ST_refStack(ctx, 0);
-            ST_popStack(ctx);            /* Pop result */
-            for (i = 0; i < argc; ++i) { /* Need to pop argv too */
-                ST_popStack(ctx);
-            }
-            return result;
-        }
-        }
+        return ST_invokeMethod(ctx, method, receiver, argc, argv);
     }
     ST_failedMethodLookup(ctx, receiver, symbol);
     return ST_getNil(ctx);
 }
 
+/* Classes never change their superclass, and methods are only ever added,
+   each addition bumping methodEpoch: the method found stands for as long
+   as the epoch does. */
+ST_PreparedSend ST_prepareSend(ST_Object ctx, ST_Object targetClass,
+                               ST_Object symbol, ST_U8 argc) {
+    ST_PreparedSend send;
+    send.targetClass = targetClass;
+    send.symbol = symbol;
+    send.argc = argc;
+    /* A class is its own class, so it stands for its instances here */
+    send.method = ST_Internal_Object_getMethod(ctx, targetClass, symbol);
+    send.epoch = ((ST_Context *)ctx)->methodEpoch;
+    return send;
+}
+
+ST_Object ST_invokePrepared(ST_Object ctx, ST_PreparedSend *send,
+                            ST_Object receiver, ST_Object argv[]) {
+    ST_Context *ctxImpl = ctx;
+    if (UNEXPECTED(((ST_Internal_Object *)receiver)->class !=
+                   send->targetClass)) {
+        return ST_sendMsg(ctx, receiver, send->symbol, send->argc, argv);
+    }
+    if (UNEXPECTED(send->epoch != ctxImpl->methodEpoch)) {
+        send->method =
+            ST_Internal_Object_getMethod(ctx, receiver, send->symbol);
+        send->epoch = ctxImpl->methodEpoch;
+    }
+    if (UNEXPECTED(!send->method)) {
+        ST_failedMethodLookup(ctx, receiver, send->symbol);
+        return ST_getNil(ctx);
+    }
+    return ST_invokeMethod(ctx, send->method, receiver, send->argc, argv);
+}
+
 static bool ST_Class_insertMethodEntry(ST_Object ctx, ST_Class *class,
                                        ST_MethodMap_Entry *entry) {
+    ++((ST_Context *)ctx)->methodEpoch;
     if (!ST_BST_insert((ST_BiNode **)&((ST_Class *)class)->methodTree,
                        &entry->header.node, ST_SymbolMap_comparator)) {
         return false;
@@ -676,12 +984,161 @@ void ST_setMethod(ST_Object ctx, ST_Object object, ST_Object symbol,
     }
 }
 
+/* The entries come from one slab sized for the table, and go into a
+   balanced tree built from the sorted table, rather than one insert and
+   splay each. Later definitions of a selector are dropped, like
+   ST_setMethod drops redefinitions. */
+ST_Object ST_defineClass(ST_Object ctx, ST_Object superclass,
+                         const char *name, const char *const ivarNames[],
+                         const ST_MethodDef methods[], ST_Size methodCount) {
+    ST_Context *ctxImpl = ctx;
+    ST_Object nameSymb = ST_symb(ctx, name);
+    ST_Size ivarCount = 0, i, defined = 0;
+    ST_BiNode **nodes;
+    ST_Class *class;
+    while (ivarNames && ivarNames[ivarCount]) {
+        ++ivarCount;
+    }
+    class = ST_Class_subclass(ctx, superclass, nameSymb, ivarCount, 0);
+    if (!class) {
+        return ST_getNil(ctx);
+    }
+    for (i = 0; i < ivarCount; ++i) {
+        class->instanceVariableNames[i] = ST_symb(ctx, ivarNames[i]);
+    }
+    ST_setGlobal(ctx, nameSymb, class);
+    if (!methodCount) {
+        return class;
+    }
+    ST_Pool_reserve(ctx, &ctxImpl->methodNodePool, methodCount);
+    nodes = ST_alloc(ctx, 2 * methodCount * sizeof *nodes);
+    for (i = 0; i < methodCount; ++i) {
+        ST_MethodMap_Entry *entry =
+            ST_Pool_alloc(ctx, &ctxImpl->methodNodePool);
+        entry->header.symbol = ST_symb(ctx, methods[i].selector);
+        entry->method.type = ST_METHOD_TYPE_PRIMITIVE;
+        entry->method.payload.primitiveMethod = methods[i].method;
+        entry->method.argc = methods[i].argc;
+        nodes[i] = &entry->header.node;
+    }
+    /* A stable sort keeps the first definition first */
+    ST_BST_sort(nodes, nodes + methodCount, methodCount,
+                ST_SymbolMap_comparator);
+    for (i = 0; i < methodCount; ++i) {
+        if (defined && ST_SymbolMap_comparator(nodes[defined - 1], nodes[i]) ==
+                           ST_Cmp_Eq) {
+            ST_Pool_free(ctx, &ctxImpl->methodNodePool, nodes[i]);
+        } else {
+            nodes[defined++] = nodes[i];
+        }
+    }
+    class->methodTree = (ST_MethodMap_Entry *)ST_BST_build(nodes, defined);
+    ST_free(ctx, nodes);
+    ++ctxImpl->methodEpoch;
+    return class;
+}
+
 /*//////////////////////////////////////////////////////////////////////////////
 // Context
 /////////////////////////////////////////////////////////////////////////////*/
 
+/* Allocations are rounded up to a multiple of this, which keeps them
+   aligned for any member of an ST_Context */
+typedef union ST_Arena_Align {
+    void *pointer;
+    long integer;
+    double real;
+} ST_Arena_Align;
+
+typedef struct ST_Arena_Chunk {
+    struct ST_Arena_Chunk *next;
+    ST_Arena_Align align;
+} ST_Arena_Chunk;
+
+struct ST_Arena {
+    void *(*allocFn)(size_t);
+    void (*freeFn)(void *);
+    ST_Size chunkSize;
+    ST_Arena_Chunk *chunks;
+    ST_U8 *pos;
+    ST_U8 *end;
+};
+
+static ST_Size ST_Arena_round(ST_Size size) {
+    const ST_Size align = sizeof(ST_Arena_Align);
+    return (size + align - 1) / align * align;
+}
+
+ST_Arena *ST_createArena(const ST_Configuration *config, ST_Size chunkSize) {
+    ST_Arena *arena = config->memory.allocFn(sizeof(ST_Arena));
+    if (!arena) {
+        return NULL;
+    }
+    arena->allocFn = config->memory.allocFn;
+    arena->freeFn = config->memory.freeFn;
+    arena->chunkSize = ST_Arena_round(chunkSize);
+    arena->chunks = NULL;
+    arena->pos = NULL;
+    arena->end = NULL;
+    return arena;
+}
+
+void ST_destroyArena(ST_Arena *arena) {
+    while (arena->chunks) {
+        ST_Arena_Chunk *chunk = arena->chunks;
+        arena->chunks = chunk->next;
+        arena->freeFn(chunk);
+    }
+    arena->freeFn(arena);
+}
+
+static void *ST_Arena_alloc(void *user, size_t size) {
+    ST_Arena *arena = user;
+    ST_U8 *memory;
+    size = ST_Arena_round(size);
+    if (size > (ST_Size)(arena->end - arena->pos)) {
+        /* Large allocations go behind the current chunk, so the rest of it
+           still gets used */
+        const bool own = size > arena->chunkSize / 2;
+        ST_Arena_Chunk *chunk = arena->allocFn(
+            offsetof(ST_Arena_Chunk, align) + (own ? size : arena->chunkSize));
+        ST_Arena_Chunk **link =
+            own && arena->chunks ? &arena->chunks->next : &arena->chunks;
+        if (!chunk) {
+            return NULL;
+        }
+        chunk->next = *link;
+        *link = chunk;
+        if (own) {
+            return &chunk->align;
+        }
+        arena->pos = (ST_U8 *)&chunk->align;
+        arena->end = arena->pos + arena->chunkSize;
+    }
+    memory = arena->pos;
+    arena->pos += size;
+    return memory;
+}
+
+/* Everything goes at once, in ST_destroyArena */
+static void ST_Arena_free(void *user, void *memory) {}
+
+static void ST_Arena_release(void *user) { ST_destroyArena(user); }
+
+void ST_useArena(ST_Configuration *config, ST_Arena *arena) {
+    config->memory.userAllocFn = ST_Arena_alloc;
+    config->memory.userFreeFn = ST_Arena_free;
+    config->memory.releaseFn = ST_Arena_release;
+    config->memory.user = arena;
+}
+
+static void *ST_Memory_alloc(const struct Memory *memory, ST_Size size) {
+    return memory->userAllocFn ? memory->userAllocFn(memory->user, size)
+                               : memory->allocFn(size);
+}
+
 static void *ST_alloc(ST_Object ctx, ST_Size size) {
-    void *mem = ((ST_Context *)ctx)->config.memory.allocFn(size);
+    void *mem = ST_Memory_alloc(&((ST_Context *)ctx)->config.memory, size);
     if (UNEXPECTED(!mem)) {
         /* FIXME! */
     }
@@ -689,7 +1146,12 @@ static void *ST_alloc(ST_Object ctx, ST_Size size) {
 }
 
 static void ST_free(ST_Object ctx, void *memory) {
-    ((ST_Context *)ctx)->config.memory.freeFn(memory);
+    const struct Memory *config = &((ST_Context *)ctx)->config.memory;
+    if (config->userFreeFn) {
+        config->userFreeFn(config->user, memory);
+    } else {
+        config->freeFn(memory);
+    }
 }
 
 static void ST_memcpy(ST_Object ctx, void *dest, const void *src, ST_Size n) {
@@ -722,6 +1184,10 @@ typedef struct ST_GlobalVarMap_Entry {
 } ST_GlobalVarMap_Entry;
 
 static void ST_pushStack(ST_Context *ctx, ST_Object val) {
+    if (UNEXPECTED(ctx->operandStack.top == ctx->operandStack.end)) {
+        ctx->operandStack.overflowed = true;
+        return;
+    }
     *(ctx->operandStack.top++) = val;
 }
 
@@ -744,7 +1210,7 @@ ST_Object ST_getGlobal(ST_Object ctx, ST_Object symbol) {
     if (UNEXPECTED(!found)) {
         return ST_getNil(ctx);
     }
-    ST_BST_splay(globalScope, &symbol, ST_SymbolMap_comparator);
+    ST_BST_splay(globalScope, &searchTmpl, ST_SymbolMap_comparator);
     return ((ST_GlobalVarMap_Entry *)found)->value;
 }
 
@@ -830,6 +1296,36 @@ const char *ST_Symbol_toString(ST_Object ctx, ST_Object symbol) {
     return visitor.result;
 }
 
+typedef struct ST_SelectorVisitor {
+    ST_Visitor visitor;
+    ST_Object symbol;
+    bool found;
+} ST_SelectorVisitor;
+
+static void ST_findSelectorInClass(ST_Visitor *visitor, void *element) {
+    ST_SelectorVisitor *visitorImpl = (ST_SelectorVisitor *)visitor;
+    ST_Class *class = element;
+    ST_SymbolMap_Entry searchTmpl;
+    searchTmpl.symbol = visitorImpl->symbol;
+    if (class->object.class &&
+        ST_BST_find((ST_BiNode **)&class->methodTree, &searchTmpl,
+                    ST_SymbolMap_comparator)) {
+        visitorImpl->found = true;
+    }
+}
+
+int ST_definesSelector(ST_Object ctx, ST_Object symbol) {
+    ST_SelectorVisitor visitor;
+    ST_Pool_Mark everything;
+    everything.slabs = NULL;
+    visitor.visitor.visit = ST_findSelectorInClass;
+    visitor.symbol = symbol;
+    visitor.found = false;
+    ST_Pool_visitSince(&((ST_Context *)ctx)->classPool, &everything,
+                       (ST_Visitor *)&visitor);
+    return visitor.found;
+}
+
 /*//////////////////////////////////////////////////////////////////////////////
 // VM
 /////////////////////////////////////////////////////////////////////////////*/
@@ -850,19 +1346,155 @@ static void ST_VM_invokePrimitiveMethod_NArg(ST_Context *ctx,
 
 /* Note: ST_readLE[n] used to do a byteswap, but it happens at load time now. */
 static ST_U16 ST_readLE16(ST_StackFrame *f) {
-    const ST_U16 rt = *(ST_U16 *)(f->code->instructions + f->ip);
+    const ST_U16 rt = *(const ST_U16 *)(f->code->instructions + f->ip);
     f->ip += sizeof(ST_U16);
     return rt;
 }
 
 static ST_U32 ST_readLE32(ST_StackFrame *f) {
-    const ST_U32 rt = *(ST_U32 *)(f->code->instructions + f->ip);
+    const ST_U32 rt = *(const ST_U32 *)(f->code->instructions + f->ip);
     f->ip += sizeof(ST_U32);
     return rt;
 }
 
-static void ST_Internal_VM_execute(ST_Context *ctx) {
-    while (ctx->stackFrame->ip < ctx->stackFrame->code->length) {
+static ST_Object ST_VM_readSymbol16(ST_Context *ctx) {
+    return ctx->stackFrame->code->symbTab[ST_readLE16(ctx->stackFrame)];
+}
+
+static ST_Object ST_VM_readSymbol8(ST_Context *ctx) {
+    return ctx->stackFrame->code
+        ->symbTab[ctx->stackFrame->code->instructions[ctx->stackFrame->ip++]];
+}
+
+static void ST_VM_setGlobal(ST_Context *ctx, ST_Object symbol) {
+    ST_setGlobal(ctx, symbol, ST_refStack(ctx, 0));
+    ST_popStack(ctx);
+}
+
+static void ST_VM_sendMsg(ST_Context *ctx, ST_Object symbol) {
+    ST_Object receiver = ST_refStack(ctx, 0);
+    ST_Internal_Method *method;
+    method = ST_Internal_Object_getMethod(ctx, receiver, symbol);
+    if (method) {
+        switch (method->type) {
+        case ST_METHOD_TYPE_PRIMITIVE:
+            ST_popStack(ctx); /* pop receiver */
+            ST_VM_invokePrimitiveMethod_NArg(ctx, receiver, method);
+            break;
+
+        case ST_METHOD_TYPE_COMPILED: {
+            ST_VM_invokeCompiled(ctx, method->payload.compiledMethod.source,
+                                 method->payload.compiledMethod.offset,
+                                 method->argc);
+        } break;
+        }
+    } else {
+        ST_failedMethodLookup(ctx, receiver, symbol);
+    }
+}
+
+/* Completes as soon as it runs, answering nil */
+static ST_Code ST_emptyCode;
+
+/* The callee's frame starts at the receiver, so RETURN replaces the receiver
+   and arguments with the result, like a primitive send does. On an
+   overflowed stack the callee answers nil instead of running, and the
+   process that overflowed it is terminated. */
+static void ST_VM_invokeCompiled(ST_Context *ctx, ST_Code *code, ST_Size offset,
+                                 ST_U8 argc) {
+    if (UNEXPECTED(ctx->operandStack.overflowed)) {
+        const ST_Size stackSize = ST_stackSize(ctx);
+        if (ctx->activeProcess &&
+            ctx->activeProcess->state != ST_PROCESS_TERMINATED) {
+            ST_Scheduler_requestSwitch(ctx, ST_PROCESS_TERMINATED);
+        }
+        ST_pushStackFrame(ctx, 0, &ST_emptyCode);
+        ctx->stackFrame->bp = stackSize > argc ? stackSize - argc - 1 : 0;
+        return;
+    }
+    ST_pushStackFrame(ctx, offset, code);
+    ctx->stackFrame->bp -= argc + 1;
+}
+
+/* The host's stack has unwound once the outermost run returns */
+static void ST_VM_clearOverflow(ST_Context *ctx) {
+    if (!ctx->vmDepth) {
+        ctx->operandStack.overflowed = false;
+    }
+}
+
+/* Whether the send finds the method that the code's definition-th
+   SETMETHOD installed, whose body the instruction was bound to. Anything
+   else, a method defined before or after it on the receiver's class or one
+   in between, or a class global bound to another class since, and the
+   send has to happen. */
+static bool ST_VM_directSendValid(ST_Context *ctx, const ST_Code *code,
+                                  ST_Internal_Object *receiver,
+                                  ST_Object symbol, ST_U16 definition) {
+    ST_MethodCache_Entry *cached =
+        &ctx->methodCache[((ST_Size)receiver->class ^ (ST_Size)symbol) /
+                          sizeof(ST_Object) % ST_METHOD_CACHE_SIZE];
+    const ST_Internal_Method *method;
+    if (cached->class != receiver->class || cached->symbol != symbol ||
+        cached->epoch != ctx->methodEpoch) {
+        cached->class = receiver->class;
+        cached->symbol = symbol;
+        cached->method = ST_Internal_Object_getMethod(ctx, receiver, symbol);
+        cached->epoch = ctx->methodEpoch;
+    }
+    method = cached->method;
+    return method && method->type == ST_METHOD_TYPE_COMPILED &&
+           method->payload.compiledMethod.source == code &&
+           method->payload.compiledMethod.definition == definition;
+}
+
+/* The time slice ends at end, or earlier if the budget does */
+static void ST_VM_setSliceEnd(ST_Context *ctx, ST_Size end) {
+    ctx->sliceEnd = end < ctx->budgetEnd ? end : ctx->budgetEnd;
+}
+
+static void ST_VM_requestStop(ST_Context *ctx) {
+    ctx->stopRequested = true;
+    ctx->budgetEnd = (ST_Size)-1;
+}
+
+/* Sends are where processes switch: the send may have been a primitive
+   that blocked or yielded, or the time slice ran out. The switch happens
+   once back in the loop running the process, and this returns whether that
+   is the current one. Budgeted runs stop the same way. */
+static bool ST_VM_switchPoint(ST_Context *ctx) {
+    if (UNEXPECTED(ctx->executed >= ctx->sliceEnd)) {
+        if (ctx->executed >= ctx->budgetEnd) {
+            ST_VM_requestStop(ctx);
+        }
+        ST_Scheduler_preempt(ctx);
+    }
+    if (UNEXPECTED(ST_ATOMIC_LOAD(&ctx->interruptRequested)) &&
+        ctx->budgetDepth) {
+        ST_ATOMIC_STORE(&ctx->interruptRequested, 0);
+        ST_VM_requestStop(ctx);
+    }
+    return (UNEXPECTED(ctx->switchRequested) &&
+            ctx->vmDepth == ctx->processDepth) ||
+           (UNEXPECTED(ctx->stopRequested) &&
+            ctx->vmDepth == ctx->budgetDepth);
+}
+
+/* Runs until the frame below exitFrame completes, or the scheduler switches
+   away from the running process. */
+static void ST_VM_run(ST_Context *ctx, ST_StackFrame *exitFrame) {
+    while (ctx->stackFrame != exitFrame) {
+        if (UNEXPECTED(ctx->stackFrame->ip >= ctx->stackFrame->code->length)) {
+            if (ctx->stackFrame->code->loading) {
+                /* More code may still arrive, see ST_VM_runLoaded */
+                return;
+            }
+            /* Running off the end of the code completes the frame. */
+            ST_popStackFrame(ctx);
+            ST_pushStack(ctx, ST_getNil(ctx));
+            continue;
+        }
+        ++ctx->executed;
         switch (ctx->stackFrame->code->instructions[ctx->stackFrame->ip++]) {
         case ST_VM_OP_PUSHNIL:
             ST_pushStack(ctx, ST_getNil(ctx));
@@ -891,6 +1523,12 @@ static void ST_Internal_VM_execute(ST_Context *ctx) {
             break;
         }
 
+        case ST_VM_OP_SWAP: {
+            ST_Object top = ST_refStack(ctx, 0);
+            ctx->operandStack.top[-1] = ST_refStack(ctx, 1);
+            ctx->operandStack.top[-2] = top;
+        } break;
+
         case ST_VM_OP_RETURN: {
             ST_Object ret = ST_refStack(ctx, 0);
             ST_popStackFrame(ctx);
@@ -899,19 +1537,21 @@ static void ST_Internal_VM_execute(ST_Context *ctx) {
                before the call--which is why we don't increment frame->ip. */
         } break;
 
-        case ST_VM_OP_GETGLOBAL: {
-            ST_Object gVarSymb =
-                ctx->stackFrame->code->symbTab[ST_readLE16(ctx->stackFrame)];
-            ST_Object global = ST_getGlobal(ctx, gVarSymb);
-            ST_pushStack(ctx, global);
-        } break;
+        case ST_VM_OP_GETGLOBAL:
+            ST_pushStack(ctx, ST_getGlobal(ctx, ST_VM_readSymbol16(ctx)));
+            break;
 
-        case ST_VM_OP_SETGLOBAL: {
-            ST_Object gVarSymb =
-                ctx->stackFrame->code->symbTab[ST_readLE16(ctx->stackFrame)];
-            ST_setGlobal(ctx, gVarSymb, ST_refStack(ctx, 0));
-            ST_popStack(ctx);
-        } break;
+        case ST_VM_OP_GETGLOBAL8:
+            ST_pushStack(ctx, ST_getGlobal(ctx, ST_VM_readSymbol8(ctx)));
+            break;
+
+        case ST_VM_OP_SETGLOBAL:
+            ST_VM_setGlobal(ctx, ST_VM_readSymbol16(ctx));
+            break;
+
+        case ST_VM_OP_SETGLOBAL8:
+            ST_VM_setGlobal(ctx, ST_VM_readSymbol8(ctx));
+            break;
 
         case ST_VM_OP_GETIVAR: {
             ST_U16 ivarIndex = ST_readLE16(ctx->stackFrame);
@@ -929,34 +1569,26 @@ static void ST_Internal_VM_execute(ST_Context *ctx) {
             ST_Object_getIVars(target)[ivarIndex] = value;
         } break;
 
-        case ST_VM_OP_SENDMSG: {
-            const ST_Object symbol =
-                ctx->stackFrame->code->symbTab[ST_readLE16(ctx->stackFrame)];
-            ST_Object receiver = ST_refStack(ctx, 0);
-            ST_Internal_Method *method;
-            method = ST_Internal_Object_getMethod(ctx, receiver, symbol);
-            if (method) {
-                switch (method->type) {
-                case ST_METHOD_TYPE_PRIMITIVE:
-                    ST_popStack(ctx); /* pop receiver */
-                    ST_VM_invokePrimitiveMethod_NArg(ctx, receiver, method);
-                    break;
-
-                case ST_METHOD_TYPE_COMPILED: {
-                    ST_pushStackFrame(ctx,
-                                      method->payload.compiledMethod.offset,
-                                      method->payload.compiledMethod.source);
-                } break;
-                }
-            } else {
-                ST_failedMethodLookup(ctx, receiver, symbol);
+        case ST_VM_OP_SENDMSG:
+            ST_VM_sendMsg(ctx, ST_VM_readSymbol16(ctx));
+            if (ST_VM_switchPoint(ctx)) {
+                return;
             }
-        } break;
+            break;
+
+        case ST_VM_OP_SENDMSG8:
+            ST_VM_sendMsg(ctx, ST_VM_readSymbol8(ctx));
+            if (ST_VM_switchPoint(ctx)) {
+                return;
+            }
+            break;
 
         case ST_VM_OP_PUSHSYMBOL:
-            ST_pushStack(
-                ctx,
-                ctx->stackFrame->code->symbTab[ST_readLE16(ctx->stackFrame)]);
+            ST_pushStack(ctx, ST_VM_readSymbol16(ctx));
+            break;
+
+        case ST_VM_OP_PUSHSYMBOL8:
+            ST_pushStack(ctx, ST_VM_readSymbol8(ctx));
             break;
 
         /* TODO: re-verify that this still works */
@@ -968,17 +1600,64 @@ static void ST_Internal_VM_execute(ST_Context *ctx) {
                 ctx->stackFrame->code->instructions[ctx->stackFrame->ip++];
             ST_MethodMap_Entry *entry =
                 ST_Pool_alloc(ctx, &ctx->methodNodePool);
+            const ST_U32 bodyLength = ST_readLE32(ctx->stackFrame);
             entry->header.symbol = symbol;
             entry->method.type = ST_METHOD_TYPE_COMPILED;
             entry->method.argc = argc;
             entry->method.payload.compiledMethod.source = ctx->stackFrame->code;
-            entry->method.payload.compiledMethod.offset =
-                ctx->stackFrame->ip + sizeof(ST_U32) + 1;
+            entry->method.payload.compiledMethod.offset = ctx->stackFrame->ip;
+            entry->method.payload.compiledMethod.definition =
+                ctx->stackFrame->code->methodsDefined;
             if (!ST_Class_insertMethodEntry(ctx, target, entry)) {
+                /* The class already had one, which sends bound to this
+                   definition find instead: they fall back */
                 ST_Pool_free(ctx, &ctx->methodNodePool, entry);
             }
+            ++ctx->stackFrame->code->methodsDefined;
             ST_popStack(ctx);
-            ctx->stackFrame->ip += ST_readLE32(ctx->stackFrame);
+            ctx->stackFrame->ip += bodyLength;
+        } break;
+
+        case ST_VM_OP_SENDDIRECT: {
+            const ST_Object symbol = ST_VM_readSymbol16(ctx);
+            ST_U8 argc;
+            ST_U16 definition;
+            ST_U32 offset;
+            /* The class the method went to is for tools, the guard looks
+               for the method itself */
+            ctx->stackFrame->ip += 2;
+            argc = ctx->stackFrame->code->instructions[ctx->stackFrame->ip++];
+            definition = ST_readLE16(ctx->stackFrame);
+            offset = ST_readLE32(ctx->stackFrame);
+            if (ST_VM_directSendValid(ctx, ctx->stackFrame->code,
+                                      ST_refStack(ctx, 0), symbol,
+                                      definition)) {
+                ST_VM_invokeCompiled(ctx, ctx->stackFrame->code, offset, argc);
+            } else {
+                ST_VM_sendMsg(ctx, symbol);
+            }
+            if (ST_VM_switchPoint(ctx)) {
+                return;
+            }
+        } break;
+
+        case ST_VM_OP_INLINEGUARD: {
+            const ST_Object symbol = ST_VM_readSymbol16(ctx);
+            ST_U16 definition;
+            ST_U32 inlinedLength;
+            ctx->stackFrame->ip += 2; /* The class, as for SENDDIRECT */
+            definition = ST_readLE16(ctx->stackFrame);
+            inlinedLength = ST_readLE32(ctx->stackFrame);
+            if (!ST_VM_directSendValid(ctx, ctx->stackFrame->code,
+                                       ST_refStack(ctx, 0), symbol,
+                                       definition)) {
+                /* Skip first, the send may push a new frame */
+                ctx->stackFrame->ip += inlinedLength;
+                ST_VM_sendMsg(ctx, symbol);
+                if (ST_VM_switchPoint(ctx)) {
+                    return;
+                }
+            }
         } break;
 
         default:
@@ -987,19 +1666,101 @@ static void ST_Internal_VM_execute(ST_Context *ctx) {
     }
 }
 
-void ST_VM_execute(ST_Object ctx, const ST_Code *code, ST_Size offset) {
+static void ST_Internal_VM_execute(ST_Context *ctx) {
+    ++ctx->vmDepth;
+    ST_VM_run(ctx, ctx->stackFrame->parent);
+    --ctx->vmDepth;
+}
+
+void ST_VM_execute(ST_Object ctx, ST_Code *code, ST_Size offset) {
+    ST_Context *ctxImpl = ctx;
+    const ST_Size stackSize = ST_stackSize(ctxImpl);
     ST_pushStackFrame(ctx, offset, code);
     ST_Internal_VM_execute(ctx);
+    ctxImpl->operandStack.top = ctxImpl->operandStack.base + stackSize;
+    ST_VM_clearOverflow(ctxImpl);
     /* FIXME: users should never call execute directly with the offset set
        to the beginning of a method. Under normal circumstances, */
 }
 
+/* A budgeted run that stopped, its frames still on the stack */
+typedef struct ST_Suspension {
+    ST_StackFrame *exitFrame;
+    ST_Size stackSize;
+    struct ST_Suspension *next;
+} ST_Suspension;
+
+/* Runs until the code completes, or the budget or an interrupt stops it at
+   a send. Only from the host: the frames stay on the stack. */
+static int ST_VM_runBudgeted(ST_Context *ctx, ST_StackFrame *exitFrame,
+                             ST_Size stackSize, ST_Size maxInstructions) {
+    ST_Suspension *suspension;
+    ctx->budgetDepth = ++ctx->vmDepth;
+    ctx->stopRequested = false;
+    ctx->budgetEnd = ctx->executed + maxInstructions < ctx->executed
+                         ? (ST_Size)-1
+                         : ctx->executed + maxInstructions;
+    ST_VM_setSliceEnd(ctx, (ST_Size)-1);
+    ST_VM_run(ctx, exitFrame);
+    --ctx->vmDepth;
+    ctx->budgetDepth = 0;
+    ctx->budgetEnd = (ST_Size)-1;
+    ctx->stopRequested = false;
+    ST_VM_setSliceEnd(ctx, (ST_Size)-1);
+    if (ctx->stackFrame == exitFrame) {
+        ctx->operandStack.top = ctx->operandStack.base + stackSize;
+        return 1;
+    }
+    suspension = ST_alloc(ctx, sizeof *suspension);
+    suspension->exitFrame = exitFrame;
+    suspension->stackSize = stackSize;
+    suspension->next = ctx->suspended;
+    ctx->suspended = suspension;
+    return 0;
+}
+
+int ST_VM_executeFor(ST_Object ctx, ST_Code *code, ST_Size offset,
+                     ST_Size maxInstructions) {
+    ST_Context *ctxImpl = ctx;
+    const ST_Size stackSize = ST_stackSize(ctxImpl);
+    ST_StackFrame *exitFrame = ctxImpl->stackFrame;
+    ST_pushStackFrame(ctx, offset, code);
+    if (ctxImpl->vmDepth) {
+        /* A primitive running code, which can't be left on the stack */
+        ST_Internal_VM_execute(ctx);
+        ctxImpl->operandStack.top = ctxImpl->operandStack.base + stackSize;
+        return 1;
+    }
+    return ST_VM_runBudgeted(ctx, exitFrame, stackSize, maxInstructions);
+}
+
+int ST_VM_continue(ST_Object ctx, ST_Size maxInstructions) {
+    ST_Context *ctxImpl = ctx;
+    ST_Suspension *suspension = ctxImpl->suspended;
+    ST_StackFrame *exitFrame;
+    ST_Size stackSize;
+    if (!suspension || ctxImpl->vmDepth) {
+        return !suspension;
+    }
+    exitFrame = suspension->exitFrame;
+    stackSize = suspension->stackSize;
+    ctxImpl->suspended = suspension->next;
+    ST_free(ctx, suspension);
+    return ST_VM_runBudgeted(ctx, exitFrame, stackSize, maxInstructions);
+}
+
+void ST_VM_interrupt(ST_Object ctx) {
+    ST_ATOMIC_STORE(&((ST_Context *)ctx)->interruptRequested, 1);
+}
+
 /*//////////////////////////////////////////////////////////////////////////////
 // Integer
 /////////////////////////////////////////////////////////////////////////////*/
 
-static const char *ST_subcMethodName = "subclass:";
-static const char *ST_subcExtMethodName =
+/* Arrays rather than pointers, so there's no writable static state: every
+   context is independent, see ST_createContext. */
+static const char ST_subcMethodName[] = "subclass:";
+static const char ST_subcExtMethodName[] =
     "subclass:instanceVariableNames:classVariableNames:";
 
 static ST_Object ST_nopMethod(ST_Object ctx, ST_Object self, ST_Object argv[]) {
@@ -1116,6 +1877,9 @@ static ST_Object ST_Array_new(ST_Object ctx, ST_Object self, ST_Object argv[]) {
     ST_Object lengthParam = argv[0];
     ST_S32 size = (intptr_t)ST_sendMsg(ctx, lengthParam, rgetSymb, 0, NULL);
     ST_Class *arraySpec = ST_Class_subclass(ctx, self, NULL, size, 0);
+    if (!arraySpec) {
+        return ST_getNil(ctx);
+    }
     arraySpec->name = ((ST_Class *)self)->name;
     return ST_Class_makeInstance(ctx, arraySpec);
 }
@@ -1159,420 +1923,4208 @@ static void ST_initArray(ST_Context *ctx) {
 }
 
 /*//////////////////////////////////////////////////////////////////////////////
-// Language types and methods
+// Processes
 /////////////////////////////////////////////////////////////////////////////*/
 
-static ST_Object ST_new(ST_Object ctx, ST_Object self, ST_Object argv[]) {
-    ST_Class *class = self;
-    return ST_Class_makeInstance(ctx, class);
+/* Instructions a process runs before it can be preempted */
+enum { ST_PROCESS_QUANTUM = 1000 };
+
+/* Sends the selector in ST_Process.entry's one symbol */
+static const ST_U8 ST_processEntry[] = {ST_VM_OP_SENDMSG8, 0};
+
+typedef struct ST_ProcessObject {
+    ST_Internal_Object object;
+    /* NULL once the process is terminated */
+    ST_Process *process;
+} ST_ProcessObject;
+
+typedef struct ST_SemaphoreObject {
+    ST_Internal_Object object;
+    ST_Size signals;
+    ST_ProcessList waiting;
+} ST_SemaphoreObject;
+
+typedef struct ST_DelayObject {
+    ST_Internal_Object object;
+    ST_Size milliseconds;
+} ST_DelayObject;
+
+static void ST_ProcessList_append(ST_ProcessList *list, ST_Process *process) {
+    process->next = NULL;
+    process->prev = list->last;
+    if (list->last) {
+        list->last->next = process;
+    } else {
+        list->first = process;
+    }
+    list->last = process;
 }
 
-static ST_Object ST_subclass(ST_Object ctx, ST_Object self, ST_Object argv[]) {
-    return ST_Class_subclass(ctx, self, argv[0], 0, 0);
+static void ST_ProcessList_remove(ST_ProcessList *list, ST_Process *process) {
+    if (process->prev) {
+        process->prev->next = process->next;
+    } else {
+        list->first = process->next;
+    }
+    if (process->next) {
+        process->next->prev = process->prev;
+    } else {
+        list->last = process->prev;
+    }
 }
 
-static ST_Object ST_subclassExtended(ST_Object ctx, ST_Object self,
-                                     ST_Object argv[]) {
-    ST_Class *subc;
-    ST_Object rawgetSymb = ST_symb(ctx, "rawGet");
-    ST_Object newSymb = ST_symb(ctx, "new");
-    ST_Object lenSymb = ST_symb(ctx, "length");
-    ST_Object rawsetSymb = ST_symb(ctx, "rawSet:");
-    ST_Object atSymb = ST_symb(ctx, "at:");
-    enum { LOC_ivarsLen, LOC_cvarsLen, LOC_cInt, LOC_index, LOC_count };
-    ST_Object *locals = ST_pushLocals(ctx, LOC_count);
-    ST_S32 ivarCount, cvarCount, i;
-    locals[LOC_ivarsLen] = ST_sendMsg(ctx, argv[1], lenSymb, 0, NULL);
-    locals[LOC_cvarsLen] = ST_sendMsg(ctx, argv[2], lenSymb, 0, NULL);
-    locals[LOC_cInt] = ST_getGlobal(ctx, ST_symb(ctx, "Integer"));
-    ivarCount =
-        (intptr_t)ST_sendMsg(ctx, locals[LOC_ivarsLen], rawgetSymb, 0, NULL);
-    cvarCount =
-        (intptr_t)ST_sendMsg(ctx, locals[LOC_cvarsLen], rawgetSymb, 0, NULL);
-    locals[LOC_index] = ST_sendMsg(ctx, locals[LOC_cInt], newSymb, 0, NULL);
-    subc = ST_Class_subclass(ctx, self, argv[0], ivarCount, cvarCount);
-    for (i = 0; i < ivarCount; ++i) {
-        ST_Object ivarName;
-        ST_sendMsg(ctx, locals[LOC_index], rawsetSymb, 1, (ST_Object)&i);
-        ivarName = ST_sendMsg(ctx, argv[1], atSymb, 1, &locals[LOC_index]);
-        subc->instanceVariableNames[i] = ivarName;
+/* The list a suspended process is in, NULL if none */
+static ST_ProcessList *ST_Scheduler_list(ST_Context *ctx,
+                                         ST_Process *process) {
+    switch (process->state) {
+    case ST_PROCESS_READY:
+        return &ctx->ready[process->priority];
+    case ST_PROCESS_WAITING:
+        return &((ST_SemaphoreObject *)process->semaphore)->waiting;
+    case ST_PROCESS_RECEIVING:
+        return &ctx->receiving;
+    case ST_PROCESS_PENDING:
+        return &ctx->pending;
+    case ST_PROCESS_DELAYED:
+        return &ctx->delayed;
+    default:
+        return NULL;
     }
-    ST_popLocals(ctx);
-    return subc;
 }
 
-static ST_Object ST_class(ST_Object ctx, ST_Object self, ST_Object argv[]) {
-    return ((ST_Internal_Object *)self)->class;
+static bool ST_Scheduler_readyAtOrAbove(ST_Context *ctx, ST_U8 priority) {
+    ST_Size i;
+    for (i = priority; i <= ST_PRIORITY_HIGHEST; ++i) {
+        if (ctx->ready[i].first) {
+            return true;
+        }
+    }
+    return false;
 }
 
-static bool ST_Context_bootstrap(ST_Context *ctx) {
-    /* We need to do things manually for a bit, until we've defined the
- symbol class and the new method, because most of the functions in
- the runtime depend on Symbol. */
-    ST_Class *cObject = ST_Pool_alloc(ctx, &ctx->classPool);
-    ST_Class *cSymbol;
-    ST_Internal_Object *symbolSymbol;
-    ST_Internal_Object *newSymbol;
-    ST_StringMap_Entry *newEntry = ST_Pool_alloc(ctx, &ctx->strmapNodePool);
-    cObject->object.class = cObject;
-    cObject->super = NULL;
-    cObject->methodTree = NULL;
-    cObject->instanceVariableCount = 0;
-    cObject->instanceVariableNames = NULL;
-    cObject->instanceSize = sizeof(ST_Internal_Object);
-    cSymbol = ST_Class_subclass(ctx, cObject, NULL, 0, 0);
-    symbolSymbol = ST_Pool_alloc(ctx, &ctx->symbolPool);
-    symbolSymbol->class = cSymbol;
-    newSymbol = ST_Pool_alloc(ctx, &ctx->symbolPool);
-    newSymbol->class = cSymbol;
-    ST_Object_setGCMask(symbolSymbol, ST_GC_MASK_PRESERVE);
-    ST_Object_setGCMask(newSymbol, ST_GC_MASK_PRESERVE);
-    ctx->symbolRegistry = ST_Pool_alloc(ctx, &ctx->strmapNodePool);
-    ctx->symbolRegistry->key = ST_strdup(ctx, "Symbol");
-    ctx->symbolRegistry->value = symbolSymbol;
-    ctx->globalScope = ST_Pool_alloc(ctx, &ctx->gvarNodePool);
-    ctx->globalScope->header.symbol = symbolSymbol;
-    ctx->globalScope->value = (ST_Object)cSymbol;
-    newEntry->key = ST_strdup(ctx, "new");
-    newEntry->value = newSymbol;
-    ST_BST_insert((ST_BiNode **)&ctx->symbolRegistry, &newEntry->nodeHeader,
-                  ST_StringMap_comparator);
-    ST_setMethod(ctx, cObject, newSymbol, ST_new, 0);
-    cSymbol->name = ST_symb(ctx, "Symbol");
-    ST_setGlobal(ctx, ST_symb(ctx, "Object"), cObject);
-    return true;
+/* Switches away from the running process at the next switch point, see
+   ST_VM_switchPoint. */
+static void ST_Scheduler_requestSwitch(ST_Context *ctx,
+                                       ST_ProcessState state) {
+    ctx->activeProcess->state = state;
+    ctx->switchRequested = true;
+    ST_VM_setSliceEnd(ctx, (ST_Size)-1);
 }
 
-static void ST_initNil(ST_Context *ctx) {
-    ST_Object cObj = ST_getGlobal(ctx, ST_symb(ctx, "Object"));
-    ST_Object undefObjSymb = ST_symb(ctx, "UndefinedObject");
-    ST_Object cUndefObj = ST_Class_subclass(ctx, cObj, undefObjSymb, 0, 0);
-    ctx->nilValue = ST_sendMsg(ctx, cUndefObj, ST_symb(ctx, "new"), 0, NULL);
-    ST_Object_setGCMask(ctx->nilValue, ST_GC_MASK_PRESERVE);
-    ST_setGlobal(ctx, undefObjSymb, cUndefObj);
+/* Whether the running process can block now: only in the loop the
+   scheduler runs it in, not in code a primitive sends to. */
+static bool ST_Scheduler_canWait(ST_Context *ctx) {
+    return ctx->activeProcess &&
+           ctx->activeProcess->state != ST_PROCESS_TERMINATED &&
+           ctx->vmDepth == ctx->processDepth;
 }
 
-static void ST_initBoolean(ST_Context *ctx) {
-    ST_Object cObj = ST_getGlobal(ctx, ST_symb(ctx, "Object"));
-    ST_Object boolSymb = ST_symb(ctx, "Boolean");
-    ST_Object trueSymb = ST_symb(ctx, "True");
-    ST_Object falseSymb = ST_symb(ctx, "False");
-    ST_Object cBoolean = ST_Class_subclass(ctx, cObj, boolSymb, 0, 0);
-    ST_Object cTrue = ST_Class_subclass(ctx, cBoolean, trueSymb, 0, 0);
-    ST_Object cFalse = ST_Class_subclass(ctx, cBoolean, falseSymb, 0, 0);
-    ST_Object newSymb = ST_symb(ctx, "new");
-    ctx->trueValue = ST_sendMsg(ctx, cTrue, newSymb, 0, NULL);
-    ctx->falseValue = ST_sendMsg(ctx, cFalse, newSymb, 0, NULL);
-    ST_Object_setGCMask(ctx->trueValue, ST_GC_MASK_PRESERVE);
-    ST_Object_setGCMask(ctx->falseValue, ST_GC_MASK_PRESERVE);
-    ST_setGlobal(ctx, boolSymb, cBoolean);
-    ST_setGlobal(ctx, trueSymb, cTrue);
-    ST_setGlobal(ctx, falseSymb, cFalse);
+static void ST_Scheduler_preempt(ST_Context *ctx) {
+    ST_Process *active = ctx->activeProcess;
+    if (active && active->state == ST_PROCESS_RUNNING &&
+        ST_Scheduler_readyAtOrAbove(ctx, active->priority)) {
+        ST_Scheduler_requestSwitch(ctx, ST_PROCESS_READY);
+    } else {
+        ST_VM_setSliceEnd(ctx, active ? ctx->executed + ST_PROCESS_QUANTUM
+                                      : (ST_Size)-1);
+    }
 }
 
-static void ST_initObject(ST_Context *ctx) {
-    ST_Object cObj = ST_getGlobal(ctx, ST_symb(ctx, "Object"));
-    ST_setMethod(ctx, cObj, ST_symb(ctx, ST_subcMethodName), ST_subclass, 1);
-    ST_setMethod(ctx, cObj, ST_symb(ctx, "class"), ST_class, 0);
-    ST_setMethod(ctx, cObj, ST_symb(ctx, ST_subcExtMethodName),
-                 ST_subclassExtended, 3);
+static void ST_Scheduler_resume(ST_Context *ctx, ST_Process *process) {
+    ST_Process *active = ctx->activeProcess;
+    process->state = ST_PROCESS_READY;
+    process->semaphore = NULL;
+    ST_ProcessList_append(&ctx->ready[process->priority], process);
+    if (active && active->state == ST_PROCESS_RUNNING &&
+        process->priority > active->priority) {
+        ST_Scheduler_requestSwitch(ctx, ST_PROCESS_READY);
+    }
 }
 
-static void ST_initErrorHandling(ST_Context *ctx) {
-    ST_Object cObj = ST_getGlobal(ctx, ST_symb(ctx, "Object"));
-    ST_Object mnuSymb = ST_symb(ctx, "MessageNotUnderstood");
-    ST_Object cMNU = ST_Class_subclass(ctx, cObj, mnuSymb, 0, 0);
-    ST_setGlobal(ctx, mnuSymb, cMNU);
+/* Ordered by wakeup time, after those with the same time */
+static void ST_Scheduler_delay(ST_Context *ctx, ST_Process *process,
+                               ST_Size milliseconds) {
+    ST_Process *after = ctx->delayed.last;
+    process->wakeup = ctx->now + milliseconds;
+    while (after && after->wakeup > process->wakeup) {
+        after = after->prev;
+    }
+    process->prev = after;
+    process->next = after ? after->next : ctx->delayed.first;
+    if (process->prev) {
+        process->prev->next = process;
+    } else {
+        ctx->delayed.first = process;
+    }
+    if (process->next) {
+        process->next->prev = process;
+    } else {
+        ctx->delayed.last = process;
+    }
 }
 
-static ST_Object ST_enableGC(ST_Object ctx, ST_Object self, ST_Object argv[]) {
-    ((ST_Context *)self)->gcDisabled = false;
+static void ST_Scheduler_wakeDelayed(ST_Context *ctx) {
+    while (ctx->delayed.first && ctx->delayed.first->wakeup <= ctx->now) {
+        ST_Process *process = ctx->delayed.first;
+        ST_ProcessList_remove(&ctx->delayed, process);
+        ST_Scheduler_resume(ctx, process);
+    }
+}
+
+static void ST_Scheduler_free(ST_Context *ctx, ST_Process *process) {
+    ST_StackFrame *frame = process->stackFrame;
+    while (frame) {
+        ST_StackFrame *parent = frame->parent;
+        ST_Pool_free(ctx, &ctx->vmFramePool, frame);
+        frame = parent;
+    }
+    if (process->object) {
+        ((ST_ProcessObject *)process->object)->process = NULL;
+    }
+    if (process->prevLive) {
+        process->prevLive->nextLive = process->nextLive;
+    } else {
+        ctx->processes = process->nextLive;
+    }
+    if (process->nextLive) {
+        process->nextLive->prevLive = process->prevLive;
+    }
+    --ctx->processCount;
+    ST_free(ctx, process->stack.base);
+    ST_Pool_free(ctx, &ctx->processPool, process);
+}
+
+static void ST_Scheduler_terminate(ST_Context *ctx, ST_Process *process) {
+    ST_ProcessList *list;
+    if (process == ctx->activeProcess) {
+        ST_Scheduler_requestSwitch(ctx, ST_PROCESS_TERMINATED);
+        return;
+    }
+    list = ST_Scheduler_list(ctx, process);
+    if (list) {
+        ST_ProcessList_remove(list, process);
+    }
+    ST_Scheduler_free(ctx, process);
+}
+
+static ST_Process *ST_Scheduler_next(ST_Context *ctx) {
+    int i;
+    for (i = ST_PRIORITY_HIGHEST; i >= ST_PRIORITY_LOWEST; --i) {
+        ST_Process *process = ctx->ready[i].first;
+        if (process) {
+            ST_ProcessList_remove(&ctx->ready[i], process);
+            return process;
+        }
+    }
+    return NULL;
+}
+
+static void ST_Scheduler_run(ST_Context *ctx, ST_Process *process) {
+    ctx->activeProcess = process;
+    process->state = ST_PROCESS_RUNNING;
+    ctx->stackFrame = process->stackFrame;
+    ctx->operandStack = process->stack;
+    ctx->switchRequested = false;
+    ST_VM_setSliceEnd(ctx, ctx->executed + ST_PROCESS_QUANTUM);
+    ++ctx->vmDepth;
+    ST_VM_run(ctx, NULL);
+    --ctx->vmDepth;
+    process->stackFrame = ctx->stackFrame;
+    process->stack = ctx->operandStack;
+    ctx->stackFrame = ctx->mainFrame;
+    ctx->operandStack = ctx->mainStack;
+    ctx->activeProcess = NULL;
+    ST_VM_setSliceEnd(ctx, (ST_Size)-1);
+    if (!process->stackFrame || process->state == ST_PROCESS_TERMINATED) {
+        ST_Scheduler_free(ctx, process);
+    } else if (process->state == ST_PROCESS_READY) {
+        ST_ProcessList_append(&ctx->ready[process->priority], process);
+    } else if (process->state == ST_PROCESS_RUNNING) {
+        /* Stopped without switching: an unknown instruction, or the end of
+           code that is still loading. Nothing will resume it. */
+        process->state = ST_PROCESS_SUSPENDED;
+    }
+}
+
+ST_Object ST_fork(ST_Object ctx, ST_Object receiver, ST_Object symbol,
+                  ST_U8 argc, ST_Object argv[], ST_U8 priority) {
+    ST_Context *ctxImpl = ctx;
+    const ST_Size capacity = ctxImpl->config.memory.processStackCapacity;
+    ST_Process *process;
+    ST_StackFrame *frame;
+    ST_ProcessObject *object;
+    ST_U8 i;
+    /* The receiver and arguments have to fit on the process's stack */
+    if ((ST_Size)argc >= capacity) {
+        return ST_getNil(ctx);
+    }
+    process = ST_Pool_alloc(ctx, &ctxImpl->processPool);
+    frame = ST_Pool_alloc(ctx, &ctxImpl->vmFramePool);
+    ST_memset(ctx, process, 0, sizeof *process);
+    process->state = ST_PROCESS_SUSPENDED;
+    process->priority =
+        priority > ST_PRIORITY_HIGHEST ? ST_PRIORITY_HIGHEST : priority;
+    process->stack.base = ST_alloc(ctx, capacity * sizeof(ST_Object));
+    process->stack.top = process->stack.base;
+    process->stack.end = process->stack.base + capacity;
+    /* Same layout ST_sendMsg pushes */
+    for (i = argc; i > 0; --i) {
+        *process->stack.top++ = argv[i - 1];
+    }
+    *process->stack.top++ = receiver;
+    process->selector = symbol;
+    process->entry.symbTab = &process->selector;
+    process->entry.symbolCount = 1;
+    process->entry.instructions = ST_processEntry;
+    process->entry.length = sizeof ST_processEntry;
+    frame->ip = 0;
+    frame->bp = 0;
+    frame->code = &process->entry;
+    frame->parent = NULL;
+    process->stackFrame = frame;
+    process->nextLive = ctxImpl->processes;
+    if (ctxImpl->processes) {
+        ctxImpl->processes->prevLive = process;
+    }
+    ctxImpl->processes = process;
+    ++ctxImpl->processCount;
+    /* The arguments are on the process's stack by now, where the GC finds
+       them if this collects. */
+    object = (ST_ProcessObject *)ST_Class_makeInstance(
+        ctx, ST_getGlobal(ctx, ST_symb(ctx, "Process")));
+    object->process = process;
+    process->object = &object->object;
+    ST_Scheduler_resume(ctx, process);
+    return object;
+}
+
+ST_Size ST_runProcesses(ST_Object ctx, ST_Size now, ST_Size *wakeup) {
+    ST_Context *ctxImpl = ctx;
+    ST_Process *process;
+    /* Processes can't run the scheduler themselves */
+    if (!ctxImpl->activeProcess) {
+        ctxImpl->now = now;
+        ctxImpl->mainFrame = ctxImpl->stackFrame;
+        ctxImpl->mainStack = ctxImpl->operandStack;
+        ctxImpl->processDepth = ctxImpl->vmDepth + 1;
+        ST_Scheduler_wakeDelayed(ctxImpl);
+        ST_Scheduler_wakeReceivers(ctxImpl);
+        while ((process = ST_Scheduler_next(ctxImpl))) {
+            ST_Scheduler_run(ctxImpl, process);
+            ST_Scheduler_wakeDelayed(ctxImpl);
+            ST_Scheduler_wakeReceivers(ctxImpl);
+        }
+        ctxImpl->processDepth = 0;
+    }
+    if (wakeup && ctxImpl->delayed.first) {
+        *wakeup = ctxImpl->delayed.first->wakeup;
+    }
+    return ctxImpl->processCount;
+}
+
+ST_Size ST_pending(ST_Object ctx) {
+    ST_Context *ctxImpl = ctx;
+    ST_Process *process = ctxImpl->activeProcess;
+    if (!ST_Scheduler_canWait(ctx) || process->state != ST_PROCESS_RUNNING) {
+        return 0;
+    }
+    /* 0 is the failure value, skip it if the count wraps */
+    if (!++ctxImpl->lastToken) {
+        ++ctxImpl->lastToken;
+    }
+    process->token = ctxImpl->lastToken;
+    ST_ProcessList_append(&ctxImpl->pending, process);
+    ST_Scheduler_requestSwitch(ctx, ST_PROCESS_PENDING);
+    return process->token;
+}
+
+int ST_resume(ST_Object ctx, ST_Size token, ST_Object value) {
+    ST_Context *ctxImpl = ctx;
+    ST_Process *process = ctxImpl->pending.first;
+    while (process && process->token != token) {
+        process = process->next;
+    }
+    if (!process) {
+        return 0;
+    }
+    ST_ProcessList_remove(&ctxImpl->pending, process);
+    if (process == ctxImpl->activeProcess) {
+        /* Its primitive hasn't returned yet, and answers for itself */
+        process->state = ST_PROCESS_RUNNING;
+        ctxImpl->switchRequested = false;
+        ST_VM_setSliceEnd(ctx, ctxImpl->executed + ST_PROCESS_QUANTUM);
+        return 1;
+    }
+    /* The send's answer, on top of the stack the primitive returned to */
+    process->stack.top[-1] = value;
+    ST_Scheduler_resume(ctx, process);
+    return 1;
+}
+
+static ST_U8 ST_Scheduler_priority(ST_Context *ctx) {
+    return ctx->activeProcess ? ctx->activeProcess->priority
+                              : ST_PRIORITY_DEFAULT;
+}
+
+static ST_Object ST_Object_fork(ST_Object ctx, ST_Object self,
+                                ST_Object argv[]) {
+    return ST_fork(ctx, self, argv[0], 0, NULL, ST_Scheduler_priority(ctx));
+}
+
+static ST_Object ST_Object_forkAt(ST_Object ctx, ST_Object self,
+                                  ST_Object argv[]) {
+    const ST_S32 priority = ST_unboxInt(ctx, argv[1]);
+    return ST_fork(ctx, self, argv[0], 0, NULL,
+                   priority < ST_PRIORITY_LOWEST ? ST_PRIORITY_LOWEST
+                   : priority > ST_PRIORITY_HIGHEST ? ST_PRIORITY_HIGHEST
+                                                    : priority);
+}
+
+static ST_Object ST_Process_terminate(ST_Object ctx, ST_Object self,
+                                      ST_Object argv[]) {
+    ST_Process *process = ((ST_ProcessObject *)self)->process;
+    if (process) {
+        ST_Scheduler_terminate(ctx, process);
+    }
     return ST_getNil(ctx);
 }
 
-static ST_Object ST_disableGC(ST_Object ctx, ST_Object self, ST_Object argv[]) {
-    ((ST_Context *)self)->gcDisabled = true;
+static ST_Object ST_Process_priority(ST_Object ctx, ST_Object self,
+                                     ST_Object argv[]) {
+    ST_Process *process = ((ST_ProcessObject *)self)->process;
+    return process ? ST_getInteger(ctx, process->priority) : ST_getNil(ctx);
+}
+
+static ST_Object ST_Process_isTerminated(ST_Object ctx, ST_Object self,
+                                         ST_Object argv[]) {
+    return ((ST_ProcessObject *)self)->process ? ST_getFalse(ctx)
+                                               : ST_getTrue(ctx);
+}
+
+/* Yields the running process, whatever the receiver, to the next ready
+   one of the same priority. */
+static ST_Object ST_Process_yield(ST_Object ctx, ST_Object self,
+                                  ST_Object argv[]) {
+    ST_Context *ctxImpl = ctx;
+    if (ST_Scheduler_canWait(ctx) &&
+        ST_Scheduler_readyAtOrAbove(ctx, ctxImpl->activeProcess->priority)) {
+        ST_Scheduler_requestSwitch(ctx, ST_PROCESS_READY);
+    }
     return ST_getNil(ctx);
 }
 
-static void ST_initContext(ST_Context *ctx) {
-    ST_Class voidClass;
-    ST_Object cCtxSymb;
-    ST_Class *cCtx;
-    voidClass.instanceVariableCount = 0;
-    cCtxSymb = ST_symb(ctx, "Context");
-    cCtx = ST_Class_subclass(ctx, &voidClass, cCtxSymb, 0, 0);
-    ST_Object_setGCMask(cCtx, ST_GC_MASK_PRESERVE);
-    cCtx->super = NULL;
-    ctx->object.object.class = cCtx;
-    ST_setMethod(ctx, cCtx, ST_symb(ctx, ST_subcMethodName), ST_nopMethod, 1);
-    ST_setMethod(ctx, cCtx, ST_symb(ctx, ST_subcExtMethodName), ST_nopMethod,
-                 3);
-    ST_setMethod(ctx, cCtx, ST_symb(ctx, "disableGC"), ST_disableGC, 0);
-    ST_setMethod(ctx, cCtx, ST_symb(ctx, "enableGC"), ST_enableGC, 0);
-    ST_setGlobal(ctx, ST_symb(ctx, "SmalltalkContext"), ctx);
+static ST_Object ST_Semaphore_new(ST_Object ctx, ST_Object self,
+                                  ST_Object argv[]) {
+    ST_SemaphoreObject *semaphore =
+        (ST_SemaphoreObject *)ST_Class_makeInstance(ctx, self);
+    semaphore->signals = 0;
+    semaphore->waiting.first = semaphore->waiting.last = NULL;
+    return semaphore;
 }
 
-ST_Object ST_createContext(const ST_Configuration *config) {
-    ST_Context *ctx = config->memory.allocFn(sizeof(ST_Context));
-    if (!ctx)
-        return NULL;
-    ctx->config = *config;
-    ST_Pool_init(ctx, &ctx->gvarNodePool, sizeof(ST_GlobalVarMap_Entry), 100);
-    ST_Pool_init(ctx, &ctx->vmFramePool, sizeof(ST_StackFrame), 50);
-    ST_Pool_init(ctx, &ctx->methodNodePool, sizeof(ST_MethodMap_Entry), 512);
-    ST_Pool_init(ctx, &ctx->strmapNodePool, sizeof(ST_StringMap_Entry), 512);
-    ST_Pool_init(ctx, &ctx->classPool, sizeof(ST_Class), 100);
-    ST_Pool_init(ctx, &ctx->symbolPool, sizeof(ST_Internal_Object), 100);
-    ctx->operandStack.base = ST_alloc(ctx, sizeof(ST_Internal_Object *) *
-                                               config->memory.stackCapacity);
-    ctx->operandStack.top = ctx->operandStack.base;
-    ctx->heap.begin = ST_alloc(ctx, config->memory.heapCapacity);
-    ctx->heap.end = ctx->heap.begin;
-    ST_pushStackFrame(ctx, 0, NULL);
-    ST_Context_bootstrap(ctx);
-    ST_initObject(ctx);
-    ST_initContext(ctx);
-    ST_initNil(ctx);
-    ST_initBoolean(ctx);
-    ST_initErrorHandling(ctx);
-    ST_initInteger(ctx);
-    ST_initArray(ctx);
-    return ctx;
+static ST_Object ST_Semaphore_signal(ST_Object ctx, ST_Object self,
+                                     ST_Object argv[]) {
+    ST_SemaphoreObject *semaphore = self;
+    ST_Process *process = semaphore->waiting.first;
+    if (process) {
+        ST_ProcessList_remove(&semaphore->waiting, process);
+        ST_Scheduler_resume(ctx, process);
+    } else {
+        ++semaphore->signals;
+    }
+    return ST_getNil(ctx);
 }
 
-void ST_destroyContext(ST_Object ctx) {
+static ST_Object ST_Semaphore_wait(ST_Object ctx, ST_Object self,
+                                   ST_Object argv[]) {
     ST_Context *ctxImpl = ctx;
-    while (ctxImpl->symbolRegistry) {
-        ST_StringMap_Entry *removedSymb = (ST_StringMap_Entry *)ST_BST_remove(
-            (ST_BiNode **)&ctxImpl->symbolRegistry, ctxImpl->symbolRegistry,
-            ST_StringMap_comparator);
-        ST_free(ctx, removedSymb->key);
+    ST_SemaphoreObject *semaphore = self;
+    if (semaphore->signals) {
+        --semaphore->signals;
+    } else if (ST_Scheduler_canWait(ctx)) {
+        ST_ProcessList_append(&semaphore->waiting, ctxImpl->activeProcess);
+        ctxImpl->activeProcess->semaphore = self;
+        ST_Scheduler_requestSwitch(ctx, ST_PROCESS_WAITING);
+    } else {
+        return ST_getFalse(ctx);
     }
-    ST_free(ctx, ctxImpl->operandStack.base);
-    ST_free(ctx, ctxImpl->heap.begin);
-    ST_Pool_release(ctx, &ctxImpl->gvarNodePool);
-    ST_Pool_release(ctx, &ctxImpl->vmFramePool);
-    ST_Pool_release(ctx, &ctxImpl->methodNodePool);
-    ST_Pool_release(ctx, &ctxImpl->strmapNodePool);
-    ST_Pool_release(ctx, &ctxImpl->classPool);
-    ST_Pool_release(ctx, &ctxImpl->symbolPool);
-    ST_free(ctx, ctx);
+    return ST_getTrue(ctx);
+}
+
+static ST_Object ST_Delay_forMilliseconds(ST_Object ctx, ST_Object self,
+                                          ST_Object argv[]) {
+    const ST_S32 milliseconds = ST_unboxInt(ctx, argv[0]);
+    ST_DelayObject *delay = (ST_DelayObject *)ST_Class_makeInstance(ctx, self);
+    delay->milliseconds = milliseconds > 0 ? milliseconds : 0;
+    return delay;
+}
+
+static ST_Object ST_Delay_wait(ST_Object ctx, ST_Object self,
+                               ST_Object argv[]) {
+    ST_Context *ctxImpl = ctx;
+    if (!ST_Scheduler_canWait(ctx)) {
+        return ST_getFalse(ctx);
+    }
+    ST_Scheduler_delay(ctx, ctxImpl->activeProcess,
+                       ((ST_DelayObject *)self)->milliseconds);
+    ST_Scheduler_requestSwitch(ctx, ST_PROCESS_DELAYED);
+    return ST_getTrue(ctx);
+}
+
+static ST_Class *ST_rawSubclass(ST_Context *ctx, const char *name,
+                                ST_Size instanceSize) {
+    ST_Class *cObj = ST_getGlobal(ctx, ST_symb(ctx, "Object"));
+    ST_Object symbol = ST_symb(ctx, name);
+    ST_Class *class = ST_Class_subclass(ctx, cObj, symbol, 0, 0);
+    class->instanceSize = instanceSize;
+    ST_setGlobal(ctx, symbol, class);
+    return class;
+}
+
+static void ST_initProcesses(ST_Context *ctx) {
+    ST_Class *cObj = ST_getGlobal(ctx, ST_symb(ctx, "Object"));
+    ST_Class *cProcess =
+        ST_rawSubclass(ctx, "Process", sizeof(ST_ProcessObject));
+    ST_Class *cSemaphore =
+        ST_rawSubclass(ctx, "Semaphore", sizeof(ST_SemaphoreObject));
+    ST_Class *cDelay = ST_rawSubclass(ctx, "Delay", sizeof(ST_DelayObject));
+    ST_setMethod(ctx, cObj, ST_symb(ctx, "fork:"), ST_Object_fork, 1);
+    ST_setMethod(ctx, cObj, ST_symb(ctx, "fork:at:"), ST_Object_forkAt, 2);
+    ST_setMethod(ctx, cProcess, ST_symb(ctx, "terminate"),
+                 ST_Process_terminate, 0);
+    ST_setMethod(ctx, cProcess, ST_symb(ctx, "priority"), ST_Process_priority,
+                 0);
+    ST_setMethod(ctx, cProcess, ST_symb(ctx, "isTerminated"),
+                 ST_Process_isTerminated, 0);
+    ST_setMethod(ctx, cProcess, ST_symb(ctx, "yield"), ST_Process_yield, 0);
+    ST_setMethod(ctx, cSemaphore, ST_symb(ctx, "new"), ST_Semaphore_new, 0);
+    ST_setMethod(ctx, cSemaphore, ST_symb(ctx, "signal"), ST_Semaphore_signal,
+                 0);
+    ST_setMethod(ctx, cSemaphore, ST_symb(ctx, "wait"), ST_Semaphore_wait, 0);
+    ST_setMethod(ctx, cDelay, ST_symb(ctx, "forMilliseconds:"),
+                 ST_Delay_forMilliseconds, 1);
+    ST_setMethod(ctx, cDelay, ST_symb(ctx, "wait"), ST_Delay_wait, 0);
 }
 
 /*//////////////////////////////////////////////////////////////////////////////
-// GC
+// Mailboxes
 /////////////////////////////////////////////////////////////////////////////*/
 
-/* FIXME: non-recursive version of markObject */
-static void ST_GC_markObject(ST_Context *ctx, ST_Internal_Object *object) {
-    ST_Object_setGCMask(object, ST_GC_MASK_MARKED);
-    if (!ST_isClass(object)) {
-        ST_Internal_Object **ivars = ST_Object_getIVars(object);
-        ST_Size i;
-        for (i = 0; i < object->class->instanceVariableCount; ++i) {
-            if ((ST_GC_MASK_MARKED & ivars[i]->gcMask) == 0) {
-                ST_GC_markObject(ctx, ivars[i]);
+typedef struct ST_Message {
+    struct ST_Message *next;
+    ST_Size length;
+    /* Followed by the encoded objects, see ST_Message_writeValue */
+} ST_Message;
+
+/* Vyukov's intrusive MPSC queue: posters swap their message in at head and
+   then link it, the receiver takes from tail. The stub keeps the queue from
+   ever being empty, so neither end has to touch the other. */
+struct ST_Mailbox {
+    ST_Message *head;
+    ST_Message *tail;
+    ST_Message stub;
+    void *(*allocFn)(size_t);
+    void (*freeFn)(void *);
+};
+
+typedef struct ST_MailboxObject {
+    ST_Internal_Object object;
+    ST_Mailbox *mailbox;
+} ST_MailboxObject;
+
+ST_Mailbox *ST_createMailbox(const ST_Configuration *config) {
+    ST_Mailbox *mailbox = config->memory.allocFn(sizeof(ST_Mailbox));
+    if (!mailbox) {
+        return NULL;
+    }
+    mailbox->stub.next = NULL;
+    mailbox->head = mailbox->tail = &mailbox->stub;
+    mailbox->allocFn = config->memory.allocFn;
+    mailbox->freeFn = config->memory.freeFn;
+    return mailbox;
+}
+
+static void ST_Mailbox_push(ST_Mailbox *mailbox, ST_Message *message) {
+    ST_Message *prev;
+    message->next = NULL;
+    prev = ST_ATOMIC_EXCHANGE(&mailbox->head, message);
+    ST_ATOMIC_STORE(&prev->next, message);
+}
+
+/* NULL if empty, or if the last poster hasn't linked its message yet */
+static ST_Message *ST_Mailbox_pop(ST_Mailbox *mailbox) {
+    ST_Message *tail = mailbox->tail;
+    ST_Message *next = ST_ATOMIC_LOAD(&tail->next);
+    if (tail == &mailbox->stub) {
+        if (!next) {
+            return NULL;
+        }
+        mailbox->tail = tail = next;
+        next = ST_ATOMIC_LOAD(&next->next);
+    }
+    if (next) {
+        mailbox->tail = next;
+        return tail;
+    }
+    if (tail != ST_ATOMIC_LOAD(&mailbox->head)) {
+        return NULL;
+    }
+    /* tail is the last message, queue the stub behind it to take it */
+    ST_Mailbox_push(mailbox, &mailbox->stub);
+    next = ST_ATOMIC_LOAD(&tail->next);
+    if (next) {
+        mailbox->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+void ST_destroyMailbox(ST_Mailbox *mailbox) {
+    ST_Message *message;
+    while ((message = ST_Mailbox_pop(mailbox))) {
+        mailbox->freeFn(message);
+    }
+    mailbox->freeFn(mailbox);
+}
+
+/* A message is an object graph flattened so that it doesn't point into the
+   sender's heap: the number of heap objects and the heap space they take,
+   then the value. Values start with a tag. nil, true and false stand for
+   the receiver's own, symbols and classes go by name, and mailboxes by
+   address. Heap objects are written out in full the first time they come up
+   (class name, whether the class is an unnamed subclass like an Array's,
+   raw payload and instance variables), and by index after that, so shared
+   and cyclic structure survives. */
+enum {
+    ST_MESSAGE_NIL,
+    ST_MESSAGE_TRUE,
+    ST_MESSAGE_FALSE,
+    ST_MESSAGE_SYMBOL,
+    ST_MESSAGE_CLASS,
+    ST_MESSAGE_MAILBOX,
+    ST_MESSAGE_OBJECT,
+    ST_MESSAGE_REF
+};
+
+typedef struct ST_Message_MapEntry {
+    ST_SymbolMap_Entry header;
+    ST_Size index;
+} ST_Message_MapEntry;
+
+/* Symbol names by symbol. ST_Symbol_toString walks the whole registry for
+   each name, so the first name an encoding needs sorts them all once
+   instead, for every pass that shares the table. */
+typedef struct ST_Message_Name {
+    ST_SymbolMap_Entry header;
+    const char *name;
+} ST_Message_Name;
+
+typedef struct ST_Message_Names {
+    ST_Visitor visitor;
+    ST_Message_Name *entries;
+    ST_Size count;
+    ST_Message_Name *root;
+    bool built;
+} ST_Message_Names;
+
+static void ST_Message_Names_init(ST_Message_Names *names) {
+    names->entries = NULL;
+    names->count = 0;
+    names->root = NULL;
+    names->built = false;
+}
+
+static void ST_Message_Names_release(ST_Context *ctx,
+                                     ST_Message_Names *names) {
+    if (names->entries) {
+        ST_free(ctx, names->entries);
+    }
+    ST_Message_Names_init(names);
+}
+
+/* Counts the registry's entries, then copies them once there's room */
+static void ST_Message_Names_collect(ST_Visitor *visitor, void *node) {
+    ST_Message_Names *names = (ST_Message_Names *)visitor;
+    ST_StringMap_Entry *entry = node;
+    if (names->entries) {
+        names->entries[names->count].header.symbol = entry->value;
+        names->entries[names->count].name = entry->key;
+    }
+    ++names->count;
+}
+
+static void ST_Message_Names_build(ST_Context *ctx, ST_Message_Names *names) {
+    ST_BiNode **nodes;
+    ST_Size i;
+    names->built = true;
+    names->visitor.visit = ST_Message_Names_collect;
+    ST_BST_traverse((ST_BiNode *)ctx->symbolRegistry, &names->visitor);
+    if (!names->count) {
+        return;
+    }
+    names->entries = ST_alloc(ctx, names->count * sizeof *names->entries);
+    nodes = ST_alloc(ctx, 2 * names->count * sizeof *nodes);
+    names->count = 0;
+    ST_BST_traverse((ST_BiNode *)ctx->symbolRegistry, &names->visitor);
+    for (i = 0; i < names->count; ++i) {
+        nodes[i] = &names->entries[i].header.node;
+    }
+    ST_BST_sort(nodes, nodes + names->count, names->count,
+                ST_SymbolMap_comparator);
+    names->root = (ST_Message_Name *)ST_BST_build(nodes, names->count);
+    ST_free(ctx, nodes);
+}
+
+static const char *ST_Message_Names_find(ST_Context *ctx,
+                                         ST_Message_Names *names,
+                                         ST_Object symbol) {
+    ST_Message_Name searchTmpl, *found;
+    if (!names->built) {
+        ST_Message_Names_build(ctx, names);
+    }
+    searchTmpl.header.symbol = symbol;
+    found = (ST_Message_Name *)ST_BST_find(
+        (ST_BiNode **)&names->root, &searchTmpl, ST_SymbolMap_comparator);
+    return found ? found->name : NULL;
+}
+
+/* The slots of the graph still to write or read, the next one on top.
+   Nested objects wait here rather than on the C stack, which a deep enough
+   graph would overflow. */
+typedef struct ST_Message_Stack {
+    ST_Internal_Object ***slots;
+    ST_Size count;
+    ST_Size capacity;
+} ST_Message_Stack;
+
+/* Pushes count slots so that the first is on top, false if there isn't
+   room */
+static bool ST_Message_Stack_push(ST_Context *ctx, ST_Message_Stack *stack,
+                                  ST_Internal_Object **slots, ST_Size count) {
+    ST_Size i;
+    if (stack->capacity - stack->count < count) {
+        ST_Size capacity = stack->capacity ? stack->capacity : 64;
+        ST_Internal_Object ***grown;
+        while (capacity - stack->count < count) {
+            capacity *= 2;
+        }
+        grown = ST_alloc(ctx, capacity * sizeof *grown);
+        if (!grown) {
+            return false;
+        }
+        if (stack->slots) {
+            ST_memcpy(ctx, grown, stack->slots,
+                      stack->count * sizeof *grown);
+            ST_free(ctx, stack->slots);
+        }
+        stack->slots = grown;
+        stack->capacity = capacity;
+    }
+    for (i = count; i > 0; --i) {
+        stack->slots[stack->count++] = &slots[i - 1];
+    }
+    return true;
+}
+
+static void ST_Message_Stack_release(ST_Context *ctx,
+                                     ST_Message_Stack *stack) {
+    if (stack->slots) {
+        ST_free(ctx, stack->slots);
+    }
+}
+
+typedef struct ST_Message_Writer {
+    ST_Context *ctx;
+    ST_U8 *out;
+    ST_Size size;
+    bool failed;
+    ST_Pool entryPool;
+    ST_Message_MapEntry *objects;
+    ST_Size objectCount;
+    ST_Size heapSize;
+    ST_Message_Names *names;
+    ST_Message_Stack pending;
+    ST_Class *cMailbox;
+    /* Instances hold scheduler state that doesn't carry over */
+    ST_Class *cProcess;
+    ST_Class *cSemaphore;
+} ST_Message_Writer;
+
+static void ST_Message_write(ST_Message_Writer *w, const void *data,
+                             ST_Size n) {
+    if (w->out) {
+        ST_memcpy(w->ctx, w->out + w->size, data, n);
+    }
+    w->size += n;
+}
+
+static void ST_Message_writeSize(ST_Message_Writer *w, ST_Size value) {
+    ST_Message_write(w, &value, sizeof value);
+}
+
+static void ST_Message_writeTag(ST_Message_Writer *w, ST_U8 tag) {
+    ST_Message_write(w, &tag, sizeof tag);
+}
+
+static void ST_Message_writeName(ST_Message_Writer *w, ST_Object symbol) {
+    const char *name =
+        symbol ? ST_Message_Names_find(w->ctx, w->names, symbol) : NULL;
+    if (!name) {
+        w->failed = true;
+        return;
+    }
+    ST_Message_write(w, name, ST_strlen(name) + 1);
+}
+
+/* Unnamed subclasses that take their superclass's name, see ST_Array_new */
+static bool ST_Message_isSpecialized(const ST_Class *class) {
+    return class->super && class->super->name == class->name;
+}
+
+/* Writes one value, leaving the instance variables of an object on the
+   stack to write next */
+static void ST_Message_writeValue(ST_Message_Writer *w,
+                                  ST_Internal_Object *value) {
+    ST_Context *ctx = w->ctx;
+    ST_Message_MapEntry searchTmpl, *entry;
+    ST_Internal_Object **ivars;
+    ST_Class *class;
+    ST_Size ivarsEnd;
+    if (w->failed) {
+        return;
+    }
+    if (value == ctx->nilValue) {
+        ST_Message_writeTag(w, ST_MESSAGE_NIL);
+        return;
+    } else if (value == ctx->trueValue) {
+        ST_Message_writeTag(w, ST_MESSAGE_TRUE);
+        return;
+    } else if (value == ctx->falseValue) {
+        ST_Message_writeTag(w, ST_MESSAGE_FALSE);
+        return;
+    } else if (value == (void *)ctx) {
+        w->failed = true;
+        return;
+    } else if (!ST_inHeap(ctx, value)) {
+        const bool isClass = ST_isClass(value);
+        ST_Message_writeTag(w, isClass ? ST_MESSAGE_CLASS : ST_MESSAGE_SYMBOL);
+        ST_Message_writeName(w, isClass ? ((ST_Class *)value)->name : value);
+        return;
+    }
+    class = value->class;
+    if (class == w->cMailbox) {
+        ST_Message_writeTag(w, ST_MESSAGE_MAILBOX);
+        ST_Message_write(w, &((ST_MailboxObject *)value)->mailbox,
+                         sizeof(ST_Mailbox *));
+        w->heapSize += class->instanceSize;
+        return;
+    } else if (class == w->cProcess || class == w->cSemaphore) {
+        w->failed = true;
+        return;
+    }
+    searchTmpl.header.symbol = value;
+    if (w->objects) {
+        /* Splayed, or objects that come up in address order, as a chain's
+           do, would make a list of the tree. The root is read back through
+           the pointer the splay wrote. */
+        ST_BiNode **tree = (ST_BiNode **)&w->objects;
+        ST_BST_splay(tree, &searchTmpl, ST_SymbolMap_comparator);
+        entry = (ST_Message_MapEntry *)*tree;
+        if (entry->header.symbol == value) {
+            ST_Message_writeTag(w, ST_MESSAGE_REF);
+            ST_Message_writeSize(w, entry->index);
+            return;
+        }
+    }
+    entry = ST_Pool_alloc(ctx, &w->entryPool);
+    entry->header.symbol = value;
+    entry->index = w->objectCount++;
+    ST_BST_insert((ST_BiNode **)&w->objects, &entry->header.node,
+                  ST_SymbolMap_comparator);
+    w->heapSize += class->instanceSize;
+    ivarsEnd = ST_getObjectFootprint(class->instanceVariableCount);
+    ST_Message_writeTag(w, ST_MESSAGE_OBJECT);
+    ST_Message_writeName(w, class->name);
+    ST_Message_writeTag(w, ST_Message_isSpecialized(class));
+    ST_Message_writeSize(w, class->instanceVariableCount);
+    ST_Message_writeSize(w, class->instanceSize - ivarsEnd);
+    /* Raw payload, e.g. the value of an Integer */
+    ST_Message_write(w, (ST_U8 *)value + ivarsEnd,
+                     class->instanceSize - ivarsEnd);
+    ivars = ST_Object_getIVars(value);
+    if (!ST_Message_Stack_push(ctx, &w->pending, ivars,
+                               class->instanceVariableCount)) {
+        w->failed = true;
+    }
+}
+
+static void ST_Message_writePending(ST_Message_Writer *w) {
+    while (w->pending.count && !w->failed) {
+        ST_Message_writeValue(w, *w->pending.slots[--w->pending.count]);
+    }
+}
+
+/* count elements of an Array from begin on, written as an Array of their
+   own without copying them out first */
+typedef struct ST_Message_Slice {
+    ST_Size begin;
+    ST_Size count;
+} ST_Message_Slice;
+
+static void ST_Message_writeSlice(ST_Message_Writer *w,
+                                  ST_Internal_Object *array,
+                                  const ST_Message_Slice *slice) {
+    ST_Internal_Object **elements = ST_Object_getIVars(array) + slice->begin;
+    ++w->objectCount;
+    w->heapSize += ST_getObjectFootprint(slice->count);
+    ST_Message_writeTag(w, ST_MESSAGE_OBJECT);
+    ST_Message_writeName(w, array->class->name);
+    ST_Message_writeTag(w, true);
+    ST_Message_writeSize(w, slice->count);
+    ST_Message_writeSize(w, 0);
+    if (!ST_Message_Stack_push(w->ctx, &w->pending, elements, slice->count)) {
+        w->failed = true;
+    }
+}
+
+/* Writes the message to out, or just sizes it if out is NULL. The counts
+   only come out of sizing, the writing pass takes them from there. With a
+   slice, value is the Array to take it from. */
+static ST_Size ST_Message_encode(ST_Context *ctx, ST_Object value,
+                                 const ST_Message_Slice *slice,
+                                 ST_Message_Names *names, ST_U8 *out,
+                                 ST_Size *objectCount, ST_Size *heapSize) {
+    ST_Message_Writer w;
+    ST_memset(ctx, &w, 0, sizeof w);
+    w.ctx = ctx;
+    w.out = out;
+    w.names = names;
+    w.cMailbox = ST_getGlobal(ctx, ST_symb(ctx, "Mailbox"));
+    w.cProcess = ST_getGlobal(ctx, ST_symb(ctx, "Process"));
+    w.cSemaphore = ST_getGlobal(ctx, ST_symb(ctx, "Semaphore"));
+    ST_Pool_init(ctx, &w.entryPool, sizeof(ST_Message_MapEntry), 64);
+    ST_Message_writeSize(&w, *objectCount);
+    ST_Message_writeSize(&w, *heapSize);
+    if (slice) {
+        ST_Message_writeSlice(&w, value, slice);
+    } else {
+        ST_Message_writeValue(&w, value);
+    }
+    ST_Message_writePending(&w);
+    ST_Message_Stack_release(ctx, &w.pending);
+    ST_Pool_release(ctx, &w.entryPool);
+    *objectCount = w.objectCount;
+    *heapSize = w.heapSize;
+    return w.failed ? 0 : w.size;
+}
+
+/* NULL if the value can't be copied or the message allocated. names can
+   be shared with other messages from the context, as long as it doesn't
+   make new symbols in between. */
+static ST_Message *ST_Message_create(ST_Context *ctx, ST_Object value,
+                                     const ST_Message_Slice *slice,
+                                     ST_Message_Names *names,
+                                     void *(*allocFn)(size_t)) {
+    ST_Size objectCount = 0, heapSize = 0;
+    const ST_Size length = ST_Message_encode(ctx, value, slice, names, NULL,
+                                             &objectCount, &heapSize);
+    ST_Message *message =
+        length ? allocFn(sizeof(ST_Message) + length) : NULL;
+    if (!message) {
+        return NULL;
+    }
+    message->length = length;
+    ST_Message_encode(ctx, value, slice, names, (ST_U8 *)(message + 1),
+                      &objectCount, &heapSize);
+    return message;
+}
+
+int ST_postMessage(ST_Object context, ST_Mailbox *mailbox, ST_Object value) {
+    ST_Message_Names names;
+    ST_Message *message;
+    ST_Message_Names_init(&names);
+    message =
+        ST_Message_create(context, value, NULL, &names, mailbox->allocFn);
+    ST_Message_Names_release(context, &names);
+    if (!message) {
+        return 0;
+    }
+    ST_Mailbox_push(mailbox, message);
+    return 1;
+}
+
+typedef struct ST_Message_Reader {
+    ST_Context *ctx;
+    const ST_U8 *pos;
+    const ST_U8 *end;
+    bool failed;
+    ST_Internal_Object **objects;
+    ST_Size objectCount;
+    ST_Size decoded;
+    ST_Message_Stack pending;
+} ST_Message_Reader;
+
+static void ST_Message_read(ST_Message_Reader *r, void *dest, ST_Size n) {
+    if (r->failed || (ST_Size)(r->end - r->pos) < n) {
+        r->failed = true;
+        ST_memset(r->ctx, dest, 0, n);
+        return;
+    }
+    ST_memcpy(r->ctx, dest, r->pos, n);
+    r->pos += n;
+}
+
+static ST_Size ST_Message_readSize(ST_Message_Reader *r) {
+    ST_Size value;
+    ST_Message_read(r, &value, sizeof value);
+    return value;
+}
+
+static ST_U8 ST_Message_readTag(ST_Message_Reader *r) {
+    ST_U8 tag;
+    ST_Message_read(r, &tag, sizeof tag);
+    return tag;
+}
+
+static const char *ST_Message_readName(ST_Message_Reader *r) {
+    const ST_U8 *name = r->pos;
+    while (r->pos < r->end && *r->pos) {
+        ++r->pos;
+    }
+    if (r->failed || r->pos == r->end) {
+        r->failed = true;
+        return NULL;
+    }
+    ++r->pos;
+    return (const char *)name;
+}
+
+/* The class a name stands for in the receiving context */
+static ST_Class *ST_Message_readClass(ST_Message_Reader *r) {
+    const char *name = ST_Message_readName(r);
+    ST_Internal_Object *class =
+        name ? ST_getGlobal(r->ctx, ST_symb(r->ctx, name)) : NULL;
+    if (!class || !ST_isClass(class)) {
+        r->failed = true;
+        return NULL;
+    }
+    return (ST_Class *)class;
+}
+
+/* Leaves the instance variables on the stack to read next */
+static ST_Object ST_Message_readObject(ST_Message_Reader *r) {
+    ST_Context *ctx = r->ctx;
+    ST_Class *class = ST_Message_readClass(r);
+    const bool specialized = ST_Message_readTag(r) != 0;
+    const ST_Size ivarCount = ST_Message_readSize(r);
+    const ST_Size payloadSize = ST_Message_readSize(r);
+    ST_Internal_Object *object, **ivars;
+    if (r->failed || r->decoded == r->objectCount) {
+        r->failed = true;
+        return NULL;
+    }
+    if (specialized && ivarCount >= class->instanceVariableCount) {
+        ST_Class *base = class;
+        class = ST_Class_subclass(ctx, base, NULL,
+                                  ivarCount - base->instanceVariableCount, 0);
+        if (class) {
+            class->name = base->name;
+        }
+    }
+    if (!class || class->instanceVariableCount != ivarCount ||
+        class->instanceSize != ST_getObjectFootprint(ivarCount) + payloadSize) {
+        r->failed = true;
+        return NULL;
+    }
+    object = ST_Class_makeInstance(ctx, class);
+    r->objects[r->decoded++] = object;
+    ST_Message_read(r, (ST_U8 *)object + ST_getObjectFootprint(ivarCount),
+                    payloadSize);
+    ivars = ST_Object_getIVars(object);
+    if (!ST_Message_Stack_push(ctx, &r->pending, ivars, ivarCount)) {
+        r->failed = true;
+    }
+    return object;
+}
+
+static ST_Object ST_Message_readValue(ST_Message_Reader *r) {
+    ST_Context *ctx = r->ctx;
+    const char *name;
+    ST_MailboxObject *mailbox;
+    ST_Size index;
+    switch (ST_Message_readTag(r)) {
+    case ST_MESSAGE_NIL:
+        return ctx->nilValue;
+
+    case ST_MESSAGE_TRUE:
+        return ctx->trueValue;
+
+    case ST_MESSAGE_FALSE:
+        return ctx->falseValue;
+
+    case ST_MESSAGE_SYMBOL:
+        name = ST_Message_readName(r);
+        return name ? ST_symb(ctx, name) : NULL;
+
+    case ST_MESSAGE_CLASS:
+        return ST_Message_readClass(r);
+
+    case ST_MESSAGE_MAILBOX:
+        mailbox = (ST_MailboxObject *)ST_Class_makeInstance(
+            ctx, ST_getGlobal(ctx, ST_symb(ctx, "Mailbox")));
+        ST_Message_read(r, &mailbox->mailbox, sizeof(ST_Mailbox *));
+        return mailbox;
+
+    case ST_MESSAGE_OBJECT:
+        return ST_Message_readObject(r);
+
+    case ST_MESSAGE_REF:
+        index = ST_Message_readSize(r);
+        if (!r->failed && index < r->decoded) {
+            return r->objects[index];
+        }
+        break;
+    }
+    r->failed = true;
+    return NULL;
+}
+
+/* Makes room for the objects first, so that decoding doesn't collect: the
+   objects decoded so far aren't rooted anywhere. */
+static ST_Object ST_Message_decode(ST_Context *ctx,
+                                   const ST_Message *message) {
+    ST_Message_Reader r;
+    ST_Size heapSize;
+    ST_Object value;
+    ST_memset(ctx, &r, 0, sizeof r);
+    r.ctx = ctx;
+    r.pos = (const ST_U8 *)(message + 1);
+    r.end = r.pos + message->length;
+    r.objectCount = ST_Message_readSize(&r);
+    heapSize = ST_Message_readSize(&r);
+    if (r.failed || r.objectCount > message->length ||
+        heapSize >= ctx->config.memory.heapCapacity) {
+        return NULL;
+    }
+    if ((ST_Size)(ctx->heap.end - ctx->heap.begin) + heapSize >=
+        ctx->config.memory.heapCapacity) {
+        ST_GC_run(ctx);
+        if ((ST_Size)(ctx->heap.end - ctx->heap.begin) + heapSize >=
+            ctx->config.memory.heapCapacity) {
+            return NULL;
+        }
+    }
+    r.objects = ST_alloc(ctx, (r.objectCount + 1) * sizeof *r.objects);
+    value = ST_Message_readValue(&r);
+    while (r.pending.count && !r.failed) {
+        ST_Internal_Object **slot = r.pending.slots[--r.pending.count];
+        *slot = ST_Message_readValue(&r);
+    }
+    ST_Message_Stack_release(ctx, &r.pending);
+    ST_free(ctx, r.objects);
+    return r.failed ? NULL : value;
+}
+
+ST_Object ST_receiveMessage(ST_Object context, ST_Mailbox *mailbox) {
+    ST_Context *ctx = context;
+    ST_Message *message = ST_Mailbox_pop(mailbox);
+    ST_Object value;
+    if (!message) {
+        return NULL;
+    }
+    value = ST_Message_decode(ctx, message);
+    mailbox->freeFn(message);
+    return value ? value : ctx->nilValue;
+}
+
+ST_Object ST_wrapMailbox(ST_Object ctx, ST_Mailbox *mailbox) {
+    ST_MailboxObject *object = (ST_MailboxObject *)ST_Class_makeInstance(
+        ctx, ST_getGlobal(ctx, ST_symb(ctx, "Mailbox")));
+    object->mailbox = mailbox;
+    return object;
+}
+
+/* Hands the messages that arrived to the processes waiting on them, in the
+   order they started waiting. A message takes the place of the nil their
+   receive answered, on top of their stack. */
+static void ST_Scheduler_wakeReceivers(ST_Context *ctx) {
+    ST_Process *process = ctx->receiving.first;
+    while (process) {
+        ST_Process *next = process->next;
+        ST_Mailbox *mailbox =
+            ((ST_MailboxObject *)process->semaphore)->mailbox;
+        ST_Message *message = ST_Mailbox_pop(mailbox);
+        if (message) {
+            const ST_Object value = ST_Message_decode(ctx, message);
+            mailbox->freeFn(message);
+            process->stack.top[-1] = value ? value : ctx->nilValue;
+            ST_ProcessList_remove(&ctx->receiving, process);
+            ST_Scheduler_resume(ctx, process);
+        }
+        process = next;
+    }
+}
+
+static ST_Object ST_Mailbox_post(ST_Object ctx, ST_Object self,
+                                 ST_Object argv[]) {
+    return ST_postMessage(ctx, ((ST_MailboxObject *)self)->mailbox, argv[0])
+               ? ST_getTrue(ctx)
+               : ST_getFalse(ctx);
+}
+
+static ST_Object ST_Mailbox_receive(ST_Object ctx, ST_Object self,
+                                    ST_Object argv[]) {
+    ST_Context *ctxImpl = ctx;
+    ST_Object value =
+        ST_receiveMessage(ctx, ((ST_MailboxObject *)self)->mailbox);
+    if (value) {
+        return value;
+    }
+    if (ST_Scheduler_canWait(ctx)) {
+        ST_ProcessList_append(&ctxImpl->receiving, ctxImpl->activeProcess);
+        ctxImpl->activeProcess->semaphore = self;
+        ST_Scheduler_requestSwitch(ctx, ST_PROCESS_RECEIVING);
+    }
+    return ST_getNil(ctx);
+}
+
+static void ST_initMailboxes(ST_Context *ctx) {
+    ST_Class *cMailbox =
+        ST_rawSubclass(ctx, "Mailbox", sizeof(ST_MailboxObject));
+    ST_setMethod(ctx, cMailbox, ST_symb(ctx, "post:"), ST_Mailbox_post, 1);
+    ST_setMethod(ctx, cMailbox, ST_symb(ctx, "receive"), ST_Mailbox_receive,
+                 0);
+}
+
+/*//////////////////////////////////////////////////////////////////////////////
+// Parallel collections
+/////////////////////////////////////////////////////////////////////////////*/
+
+typedef enum ST_ParallelOp {
+    ST_PARALLEL_COLLECT,
+    ST_PARALLEL_SELECT,
+    ST_PARALLEL_INJECT
+} ST_ParallelOp;
+
+/* A slice of the receiver for one worker. The messages move the elements
+   and results between contexts, so each worker only touches its own. */
+typedef struct ST_ParallelJob {
+    ST_Context *worker;
+    ST_ParallelOp op;
+    const char *selector;
+    ST_Message *input;
+    ST_Message *output;
+} ST_ParallelJob;
+
+static ST_Context *ST_Context_clone(ST_Context *ctx, bool shareCode);
+
+static void ST_stopWorkers(ST_Context *ctx) {
+    ST_Size i;
+    for (i = 0; i < ctx->workerCount; ++i) {
+        ST_destroyContext(ctx->workers[i]);
+    }
+    if (ctx->workers) {
+        ST_free(ctx, ctx->workers);
+    }
+    ctx->workers = NULL;
+    ctx->workerCount = 0;
+}
+
+int ST_startWorkers(ST_Object context, ST_Size count, ST_RunJobs runJobs,
+                    void *host) {
+    ST_Context *ctx = context;
+    ST_stopWorkers(ctx);
+    ++ctx->workerStarts;
+    if (!count) {
+        return 1;
+    }
+    ctx->workers = ST_alloc(ctx, count * sizeof *ctx->workers);
+    while (ctx->workerCount < count) {
+        /* Workers die first, so they can run the context's own code */
+        ST_Context *worker = ST_Context_clone(ctx, true);
+        if (!worker) {
+            ST_stopWorkers(ctx);
+            return 0;
+        }
+        ctx->workers[ctx->workerCount++] = worker;
+    }
+    ctx->runJobs = runJobs;
+    ctx->jobHost = host;
+    return 1;
+}
+
+/* Runs on the worker's thread: sends the selector over the slice, and
+   leaves the result in output, or NULL if it couldn't be copied back. */
+static void ST_ParallelJob_run(void *data, ST_Size index) {
+    ST_ParallelJob *job = (ST_ParallelJob *)data + index;
+    ST_Context *ctx = job->worker;
+    ST_Object symbol = ST_symb(ctx, job->selector);
+    ST_Message_Slice slice = {0, 0};
+    ST_Message_Names names;
+    ST_Object *locals, argv[1], elements;
+    ST_Size i, length;
+    job->output = NULL;
+    elements = ST_Message_decode(ctx, job->input);
+    if (!elements) {
+        return;
+    }
+    locals = ST_pushLocals(ctx, 2);
+    locals[0] = elements;
+    length = ((ST_Internal_Object *)elements)->class->instanceVariableCount;
+    /* Elements are looked up again after each send, which may move them */
+    switch (job->op) {
+    case ST_PARALLEL_COLLECT:
+        for (i = 0; i < length; ++i) {
+            ST_Object result = ST_sendMsg(
+                ctx, ST_Object_getIVars(locals[0])[i], symbol, 0, NULL);
+            ST_Object_getIVars(locals[0])[i] = result;
+        }
+        slice.count = length;
+        break;
+
+    case ST_PARALLEL_SELECT:
+        for (i = 0; i < length; ++i) {
+            if (ST_sendMsg(ctx, ST_Object_getIVars(locals[0])[i], symbol, 0,
+                           NULL) == ctx->trueValue) {
+                ST_Internal_Object **ivars = ST_Object_getIVars(locals[0]);
+                ivars[slice.count++] = ivars[i];
+            }
+        }
+        break;
+
+    case ST_PARALLEL_INJECT:
+        locals[1] = ST_Object_getIVars(locals[0])[0];
+        for (i = 1; i < length; ++i) {
+            argv[0] = ST_Object_getIVars(locals[0])[i];
+            locals[1] = ST_sendMsg(ctx, locals[1], symbol, 1, argv);
+        }
+        break;
+    }
+    ST_Message_Names_init(&names);
+    job->output = ST_Message_create(
+        ctx, job->op == ST_PARALLEL_INJECT ? locals[1] : locals[0],
+        job->op == ST_PARALLEL_INJECT ? NULL : &slice, &names,
+        ctx->config.memory.allocFn);
+    ST_Message_Names_release(ctx, &names);
+    ST_popLocals(ctx);
+}
+
+/* Splits the receiver into a slice per worker (or runs it whole in the
+   context itself if it has none), then merges the results in order: the
+   slices concatenated, or folded from initial for inject. Answers nil if
+   anything can't be copied or the selector isn't a Symbol. The slices are
+   encoded here one after the other, so they share the names the first one
+   looked up. */
+static ST_Object ST_Array_parallel(ST_Context *ctx, ST_Object self,
+                                   ST_ParallelOp op, ST_Object selector,
+                                   ST_Object initial) {
+    const ST_Size length =
+        ((ST_Internal_Object *)self)->class->instanceVariableCount;
+    const ST_Size jobCount = ctx->workerCount < length
+                                 ? (ctx->workerCount ? ctx->workerCount : 1)
+                                 : length;
+    ST_Message_Names names;
+    const char *name;
+    ST_ParallelJob *jobs;
+    ST_Object *locals, argv[1];
+    ST_Size i, j, total = 0;
+    bool failed;
+    ST_Message_Names_init(&names);
+    name = ST_Message_Names_find(ctx, &names, selector);
+    failed = name == NULL;
+    if (failed || !length) {
+        ST_Message_Names_release(ctx, &names);
+    }
+    if (failed) {
+        return ctx->nilValue;
+    } else if (!length && op == ST_PARALLEL_INJECT) {
+        return initial;
+    } else if (!length) {
+        argv[0] = ST_getInteger(ctx, 0);
+        return ST_Array_new(ctx, ST_getGlobal(ctx, ST_symb(ctx, "Array")),
+                            argv);
+    }
+    /* The results, then the Array or value they merge into. Running the
+       slice in this context may collect, so initial is kept here first. */
+    locals = ST_pushLocals(ctx, jobCount + 1);
+    locals[jobCount] = initial ? initial : ctx->nilValue;
+    jobs = ST_alloc(ctx, jobCount * sizeof *jobs);
+    for (i = 0; i < jobCount; ++i) {
+        ST_Message_Slice slice;
+        slice.begin = length * i / jobCount;
+        slice.count = length * (i + 1) / jobCount - slice.begin;
+        jobs[i].worker = ctx->workerCount ? ctx->workers[i] : ctx;
+        jobs[i].op = op;
+        jobs[i].selector = name;
+        jobs[i].input = ST_Message_create(ctx, self, &slice, &names,
+                                          ctx->config.memory.allocFn);
+        jobs[i].output = NULL;
+        failed = failed || !jobs[i].input;
+    }
+    ST_Message_Names_release(ctx, &names);
+    if (!failed && ctx->workerCount) {
+        ctx->runJobs(ctx->jobHost, ST_ParallelJob_run, jobs, jobCount);
+    } else if (!failed) {
+        ST_ParallelJob_run(jobs, 0);
+    }
+    for (i = 0; i < jobCount && !failed; ++i) {
+        locals[i] =
+            jobs[i].output ? ST_Message_decode(ctx, jobs[i].output) : NULL;
+        failed = !locals[i];
+        if (failed) {
+            locals[i] = ctx->nilValue;
+        } else if (op != ST_PARALLEL_INJECT) {
+            total += ((ST_Internal_Object *)locals[i])
+                         ->class->instanceVariableCount;
+        }
+    }
+    if (!failed && op == ST_PARALLEL_INJECT) {
+        for (i = 0; i < jobCount; ++i) {
+            argv[0] = locals[i];
+            locals[jobCount] =
+                ST_sendMsg(ctx, locals[jobCount], selector, 1, argv);
+        }
+    } else if (!failed) {
+        ST_Size at = 0;
+        argv[0] = ST_getInteger(ctx, total);
+        locals[jobCount] = ST_Array_new(
+            ctx, ST_getGlobal(ctx, ST_symb(ctx, "Array")), argv);
+        for (i = 0; i < jobCount; ++i) {
+            ST_Internal_Object *part = locals[i];
+            for (j = 0; j < part->class->instanceVariableCount; ++j) {
+                ST_Object_getIVars(locals[jobCount])[at++] =
+                    ST_Object_getIVars(part)[j];
+            }
+        }
+    }
+    /* Messages come from allocFn, in workers too, never from an arena */
+    for (i = 0; i < jobCount; ++i) {
+        if (jobs[i].input) {
+            ctx->config.memory.freeFn(jobs[i].input);
+        }
+        if (jobs[i].output) {
+            ctx->config.memory.freeFn(jobs[i].output);
+        }
+    }
+    ST_free(ctx, jobs);
+    initial = failed ? ctx->nilValue : locals[jobCount];
+    ST_popLocals(ctx);
+    return initial;
+}
+
+static ST_Object ST_Array_parallelCollect(ST_Object ctx, ST_Object self,
+                                          ST_Object argv[]) {
+    return ST_Array_parallel(ctx, self, ST_PARALLEL_COLLECT, argv[0], NULL);
+}
+
+static ST_Object ST_Array_parallelSelect(ST_Object ctx, ST_Object self,
+                                         ST_Object argv[]) {
+    return ST_Array_parallel(ctx, self, ST_PARALLEL_SELECT, argv[0], NULL);
+}
+
+static ST_Object ST_Array_parallelInject(ST_Object ctx, ST_Object self,
+                                         ST_Object argv[]) {
+    return ST_Array_parallel(ctx, self, ST_PARALLEL_INJECT, argv[1], argv[0]);
+}
+
+static void ST_initParallel(ST_Context *ctx) {
+    ST_Class *cArr = ST_getGlobal(ctx, ST_symb(ctx, "Array"));
+    ST_setMethod(ctx, cArr, ST_symb(ctx, "parallelCollect:"),
+                 ST_Array_parallelCollect, 1);
+    ST_setMethod(ctx, cArr, ST_symb(ctx, "parallelSelect:"),
+                 ST_Array_parallelSelect, 1);
+    ST_setMethod(ctx, cArr, ST_symb(ctx, "parallelInject:into:"),
+                 ST_Array_parallelInject, 2);
+}
+
+/*//////////////////////////////////////////////////////////////////////////////
+// Language types and methods
+/////////////////////////////////////////////////////////////////////////////*/
+
+static ST_Object ST_new(ST_Object ctx, ST_Object self, ST_Object argv[]) {
+    ST_Class *class = self;
+    return ST_Class_makeInstance(ctx, class);
+}
+
+static ST_Object ST_subclass(ST_Object ctx, ST_Object self, ST_Object argv[]) {
+    return ST_Class_subclass(ctx, self, argv[0], 0, 0);
+}
+
+static ST_Object ST_subclassExtended(ST_Object ctx, ST_Object self,
+                                     ST_Object argv[]) {
+    ST_Class *subc;
+    ST_Object rawgetSymb = ST_symb(ctx, "rawGet");
+    ST_Object newSymb = ST_symb(ctx, "new");
+    ST_Object lenSymb = ST_symb(ctx, "length");
+    ST_Object rawsetSymb = ST_symb(ctx, "rawSet:");
+    ST_Object atSymb = ST_symb(ctx, "at:");
+    enum { LOC_ivarsLen, LOC_cvarsLen, LOC_cInt, LOC_index, LOC_count };
+    ST_Object *locals = ST_pushLocals(ctx, LOC_count);
+    ST_S32 ivarCount, cvarCount, i;
+    locals[LOC_ivarsLen] = ST_sendMsg(ctx, argv[1], lenSymb, 0, NULL);
+    locals[LOC_cvarsLen] = ST_sendMsg(ctx, argv[2], lenSymb, 0, NULL);
+    locals[LOC_cInt] = ST_getGlobal(ctx, ST_symb(ctx, "Integer"));
+    ivarCount =
+        (intptr_t)ST_sendMsg(ctx, locals[LOC_ivarsLen], rawgetSymb, 0, NULL);
+    cvarCount =
+        (intptr_t)ST_sendMsg(ctx, locals[LOC_cvarsLen], rawgetSymb, 0, NULL);
+    locals[LOC_index] = ST_sendMsg(ctx, locals[LOC_cInt], newSymb, 0, NULL);
+    subc = ST_Class_subclass(ctx, self, argv[0], ivarCount, cvarCount);
+    for (i = 0; subc && i < ivarCount; ++i) {
+        ST_Object ivarName;
+        ST_Object rawIndex = (ST_Object)(intptr_t)i;
+        ST_sendMsg(ctx, locals[LOC_index], rawsetSymb, 1, &rawIndex);
+        ivarName = ST_sendMsg(ctx, argv[1], atSymb, 1, &locals[LOC_index]);
+        subc->instanceVariableNames[i] = ivarName;
+    }
+    ST_popLocals(ctx);
+    return subc ? (ST_Object)subc : ST_getNil(ctx);
+}
+
+static ST_Object ST_class(ST_Object ctx, ST_Object self, ST_Object argv[]) {
+    return ((ST_Internal_Object *)self)->class;
+}
+
+static bool ST_Context_bootstrap(ST_Context *ctx) {
+    /* We need to do things manually for a bit, until we've defined the
+ symbol class and the new method, because most of the functions in
+ the runtime depend on Symbol. */
+    ST_Class *cObject = ST_Pool_alloc(ctx, &ctx->classPool);
+    ST_Class *cSymbol;
+    ST_Internal_Object *symbolSymbol;
+    ST_Internal_Object *newSymbol;
+    ST_StringMap_Entry *newEntry = ST_Pool_alloc(ctx, &ctx->strmapNodePool);
+    cObject->object.class = cObject;
+    cObject->super = NULL;
+    cObject->methodTree = NULL;
+    cObject->instanceVariableCount = 0;
+    cObject->instanceVariableNames = NULL;
+    cObject->instanceSize = sizeof(ST_Internal_Object);
+    cSymbol = ST_Class_subclass(ctx, cObject, NULL, 0, 0);
+    symbolSymbol = ST_Pool_alloc(ctx, &ctx->symbolPool);
+    symbolSymbol->class = cSymbol;
+    newSymbol = ST_Pool_alloc(ctx, &ctx->symbolPool);
+    newSymbol->class = cSymbol;
+    ST_Object_setGCMask(symbolSymbol, ST_GC_MASK_PRESERVE);
+    ST_Object_setGCMask(newSymbol, ST_GC_MASK_PRESERVE);
+    ctx->symbolRegistry = ST_Pool_alloc(ctx, &ctx->strmapNodePool);
+    ctx->symbolRegistry->key = ST_strdup(ctx, "Symbol");
+    ctx->symbolRegistry->value = symbolSymbol;
+    ctx->globalScope = ST_Pool_alloc(ctx, &ctx->gvarNodePool);
+    ctx->globalScope->header.symbol = symbolSymbol;
+    ctx->globalScope->value = (ST_Object)cSymbol;
+    newEntry->key = ST_strdup(ctx, "new");
+    newEntry->value = newSymbol;
+    ST_BST_insert((ST_BiNode **)&ctx->symbolRegistry, &newEntry->nodeHeader,
+                  ST_StringMap_comparator);
+    ST_setMethod(ctx, cObject, newSymbol, ST_new, 0);
+    cSymbol->name = ST_symb(ctx, "Symbol");
+    ST_setGlobal(ctx, ST_symb(ctx, "Object"), cObject);
+    return true;
+}
+
+static void ST_initNil(ST_Context *ctx) {
+    ST_Object cObj = ST_getGlobal(ctx, ST_symb(ctx, "Object"));
+    ST_Object undefObjSymb = ST_symb(ctx, "UndefinedObject");
+    ST_Object cUndefObj = ST_Class_subclass(ctx, cObj, undefObjSymb, 0, 0);
+    ctx->nilValue = ST_sendMsg(ctx, cUndefObj, ST_symb(ctx, "new"), 0, NULL);
+    ST_Object_setGCMask(ctx->nilValue, ST_GC_MASK_PRESERVE);
+    ST_setGlobal(ctx, undefObjSymb, cUndefObj);
+}
+
+static void ST_initBoolean(ST_Context *ctx) {
+    ST_Object cObj = ST_getGlobal(ctx, ST_symb(ctx, "Object"));
+    ST_Object boolSymb = ST_symb(ctx, "Boolean");
+    ST_Object trueSymb = ST_symb(ctx, "True");
+    ST_Object falseSymb = ST_symb(ctx, "False");
+    ST_Object cBoolean = ST_Class_subclass(ctx, cObj, boolSymb, 0, 0);
+    ST_Object cTrue = ST_Class_subclass(ctx, cBoolean, trueSymb, 0, 0);
+    ST_Object cFalse = ST_Class_subclass(ctx, cBoolean, falseSymb, 0, 0);
+    ST_Object newSymb = ST_symb(ctx, "new");
+    ctx->trueValue = ST_sendMsg(ctx, cTrue, newSymb, 0, NULL);
+    ctx->falseValue = ST_sendMsg(ctx, cFalse, newSymb, 0, NULL);
+    ST_Object_setGCMask(ctx->trueValue, ST_GC_MASK_PRESERVE);
+    ST_Object_setGCMask(ctx->falseValue, ST_GC_MASK_PRESERVE);
+    ST_setGlobal(ctx, boolSymb, cBoolean);
+    ST_setGlobal(ctx, trueSymb, cTrue);
+    ST_setGlobal(ctx, falseSymb, cFalse);
+}
+
+static void ST_initObject(ST_Context *ctx) {
+    ST_Object cObj = ST_getGlobal(ctx, ST_symb(ctx, "Object"));
+    ST_setMethod(ctx, cObj, ST_symb(ctx, ST_subcMethodName), ST_subclass, 1);
+    ST_setMethod(ctx, cObj, ST_symb(ctx, "class"), ST_class, 0);
+    ST_setMethod(ctx, cObj, ST_symb(ctx, ST_subcExtMethodName),
+                 ST_subclassExtended, 3);
+}
+
+static void ST_initErrorHandling(ST_Context *ctx) {
+    ST_Object cObj = ST_getGlobal(ctx, ST_symb(ctx, "Object"));
+    ST_Object mnuSymb = ST_symb(ctx, "MessageNotUnderstood");
+    ST_Object cMNU = ST_Class_subclass(ctx, cObj, mnuSymb, 0, 0);
+    ST_setGlobal(ctx, mnuSymb, cMNU);
+}
+
+static ST_Object ST_enableGC(ST_Object ctx, ST_Object self, ST_Object argv[]) {
+    ((ST_Context *)self)->gcDisabled = false;
+    return ST_getNil(ctx);
+}
+
+static ST_Object ST_disableGC(ST_Object ctx, ST_Object self, ST_Object argv[]) {
+    ((ST_Context *)self)->gcDisabled = true;
+    return ST_getNil(ctx);
+}
+
+static void ST_initContext(ST_Context *ctx) {
+    ST_Class voidClass;
+    ST_Object cCtxSymb;
+    ST_Class *cCtx;
+    voidClass.instanceVariableCount = 0;
+    voidClass.instanceSize = ST_getObjectFootprint(0);
+    cCtxSymb = ST_symb(ctx, "Context");
+    cCtx = ST_Class_subclass(ctx, &voidClass, cCtxSymb, 0, 0);
+    ST_Object_setGCMask(cCtx, ST_GC_MASK_PRESERVE);
+    cCtx->super = NULL;
+    ctx->object.object.class = cCtx;
+    ST_setMethod(ctx, cCtx, ST_symb(ctx, ST_subcMethodName), ST_nopMethod, 1);
+    ST_setMethod(ctx, cCtx, ST_symb(ctx, ST_subcExtMethodName), ST_nopMethod,
+                 3);
+    ST_setMethod(ctx, cCtx, ST_symb(ctx, "disableGC"), ST_disableGC, 0);
+    ST_setMethod(ctx, cCtx, ST_symb(ctx, "enableGC"), ST_enableGC, 0);
+    ST_setGlobal(ctx, ST_symb(ctx, "SmalltalkContext"), ctx);
+}
+
+/* Everything but the objects, shared by ST_createContext and
+   ST_loadImage. */
+static ST_Context *ST_Context_allocate(const ST_Configuration *config) {
+    ST_Context *ctx = ST_Memory_alloc(&config->memory, sizeof(ST_Context));
+    if (!ctx)
+        return NULL;
+    ctx->config = *config;
+    ST_Pool_init(ctx, &ctx->gvarNodePool, sizeof(ST_GlobalVarMap_Entry), 100);
+    ST_Pool_init(ctx, &ctx->vmFramePool, sizeof(ST_StackFrame), 50);
+    ST_Pool_init(ctx, &ctx->methodNodePool, sizeof(ST_MethodMap_Entry), 512);
+    ST_Pool_init(ctx, &ctx->strmapNodePool, sizeof(ST_StringMap_Entry), 512);
+    ST_Pool_init(ctx, &ctx->classPool, sizeof(ST_Class), 100);
+    ST_Pool_init(ctx, &ctx->symbolPool, sizeof(ST_Internal_Object), 100);
+    ctx->operandStack.base = ST_alloc(ctx, sizeof(ST_Internal_Object *) *
+                                               config->memory.stackCapacity);
+    ctx->operandStack.top = ctx->operandStack.base;
+    ctx->operandStack.end =
+        ctx->operandStack.base + config->memory.stackCapacity;
+    ctx->operandStack.overflowed = false;
+    ctx->heap.begin = ST_alloc(ctx, config->memory.heapCapacity);
+    ctx->heap.end = ctx->heap.begin;
+    ctx->symbolRegistry = NULL;
+    ctx->globalScope = NULL;
+    ctx->methodEpoch = 0;
+    ST_memset(ctx, ctx->methodCache, 0, sizeof ctx->methodCache);
+    ctx->gcDisabled = false;
+    ctx->imageCode = NULL;
+    ctx->imageBegin = ctx->imageEnd = NULL;
+    ctx->loaders = NULL;
+    ctx->linkedCode = NULL;
+    ST_Pool_init(ctx, &ctx->processPool, sizeof(ST_Process), 16);
+    ctx->processes = NULL;
+    ctx->processCount = 0;
+    ctx->activeProcess = NULL;
+    ST_memset(ctx, ctx->ready, 0, sizeof ctx->ready);
+    ctx->delayed.first = ctx->delayed.last = NULL;
+    ctx->receiving.first = ctx->receiving.last = NULL;
+    ctx->pending.first = ctx->pending.last = NULL;
+    ctx->lastToken = 0;
+    ctx->now = 0;
+    ctx->vmDepth = 0;
+    ctx->processDepth = 0;
+    ctx->executed = 0;
+    ctx->sliceEnd = (ST_Size)-1;
+    ctx->switchRequested = false;
+    ctx->budgetEnd = (ST_Size)-1;
+    ctx->budgetDepth = 0;
+    ctx->stopRequested = false;
+    ctx->interruptRequested = 0;
+    ctx->suspended = NULL;
+    ctx->checkpoint = NULL;
+    ctx->workers = NULL;
+    ctx->workerCount = 0;
+    ctx->workerStarts = 0;
+    ctx->stackFrame = NULL;
+    ST_pushStackFrame(ctx, 0, NULL);
+    return ctx;
+}
+
+#ifdef ST_BOOT_IMAGE
+/* Generated at build time by util/bootgen.cpp, the state the code below
+   builds, as an image. */
+#include "bootImage.h"
+
+static ST_Context *ST_Image_loadStatic(const ST_Configuration *config,
+                                      const ST_U8 *data, ST_Size len);
+#endif
+
+ST_Object ST_createContext(const ST_Configuration *config) {
+    ST_Context *ctx;
+#ifdef ST_BOOT_IMAGE
+    /* Only fails if the image was generated for another platform, or the
+       heap is too small to hold it. */
+    if ((ctx = ST_Image_loadStatic(config, ST_bootImage,
+                                   sizeof ST_bootImage))) {
+        return ctx;
+    }
+#endif
+    ctx = ST_Context_allocate(config);
+    if (!ctx)
+        return NULL;
+    ST_Context_bootstrap(ctx);
+    ST_initObject(ctx);
+    ST_initContext(ctx);
+    ST_initNil(ctx);
+    ST_initBoolean(ctx);
+    ST_initErrorHandling(ctx);
+    ST_initInteger(ctx);
+    ST_initArray(ctx);
+    ST_initProcesses(ctx);
+    ST_initMailboxes(ctx);
+    ST_initParallel(ctx);
+    return ctx;
+}
+
+/* Names in the image the context was loaded from belong to the image */
+static void ST_Context_freeName(ST_Context *ctx, char *name) {
+    if ((const ST_U8 *)name < ctx->imageBegin ||
+        (const ST_U8 *)name >= ctx->imageEnd) {
+        ST_free(ctx, name);
+    }
+}
+
+/* Frees allocations one by one, also for contexts that failed to load and
+   so don't own their arena yet */
+static void ST_Context_free(ST_Object ctx) {
+    ST_Context *ctxImpl = ctx;
+    ST_stopWorkers(ctxImpl);
+    while (ctxImpl->symbolRegistry) {
+        ST_StringMap_Entry *removedSymb = (ST_StringMap_Entry *)ST_BST_remove(
+            (ST_BiNode **)&ctxImpl->symbolRegistry, ctxImpl->symbolRegistry,
+            ST_StringMap_comparator);
+        ST_Context_freeName(ctxImpl, removedSymb->key);
+    }
+    if (ctxImpl->imageCode) {
+        ST_free(ctx, ctxImpl->imageCode);
+    }
+    while (ctxImpl->suspended) {
+        ST_Suspension *suspension = ctxImpl->suspended;
+        ctxImpl->suspended = suspension->next;
+        ST_free(ctx, suspension);
+    }
+    ST_VM_releaseLoaders(ctxImpl, NULL);
+    ST_VM_releaseLinkedCode(ctxImpl, NULL);
+    ST_Checkpoint_free(ctxImpl);
+    while (ctxImpl->processes) {
+        ST_Process *process = ctxImpl->processes;
+        ctxImpl->processes = process->nextLive;
+        ST_free(ctx, process->stack.base);
+    }
+    ST_Pool_release(ctx, &ctxImpl->processPool);
+    ST_free(ctx, ctxImpl->operandStack.base);
+    ST_free(ctx, ctxImpl->heap.begin);
+    ST_Pool_release(ctx, &ctxImpl->gvarNodePool);
+    ST_Pool_release(ctx, &ctxImpl->vmFramePool);
+    ST_Pool_release(ctx, &ctxImpl->methodNodePool);
+    ST_Pool_release(ctx, &ctxImpl->strmapNodePool);
+    ST_Pool_release(ctx, &ctxImpl->classPool);
+    ST_Pool_release(ctx, &ctxImpl->symbolPool);
+    ST_free(ctx, ctx);
+}
+
+void ST_destroyContext(ST_Object ctx) {
+    ST_Context *ctxImpl = ctx;
+    const struct Memory memory = ctxImpl->config.memory;
+    if (!memory.releaseFn) {
+        ST_Context_free(ctx);
+        return;
+    }
+    /* Workers are clones, which allocate on their own */
+    ST_stopWorkers(ctxImpl);
+    memory.releaseFn(memory.user);
+}
+
+/*//////////////////////////////////////////////////////////////////////////////
+// GC
+/////////////////////////////////////////////////////////////////////////////*/
+
+/* FIXME: non-recursive version of markObject */
+static void ST_GC_markObject(ST_Context *ctx, ST_Internal_Object *object) {
+    ST_Object_setGCMask(object, ST_GC_MASK_MARKED);
+    if (!ST_isClass(object)) {
+        ST_Internal_Object **ivars = ST_Object_getIVars(object);
+        ST_Size i;
+        for (i = 0; i < object->class->instanceVariableCount; ++i) {
+            if ((ST_GC_MASK_MARKED & ivars[i]->gcMask) == 0) {
+                ST_GC_markObject(ctx, ivars[i]);
+            }
+        }
+        ST_GC_markObject(ctx, (ST_Object)object->class);
+    } else /* We're a class */ {
+        ST_Class *class = (ST_Class *)object;
+        if (class->super) {
+            ST_GC_markObject(ctx, (ST_Object) class->super);
+        }
+        /* TODO: eventually, mark class variables too */
+    }
+}
+
+typedef struct ST_GC_Visitor {
+    ST_Visitor visitor;
+    ST_Context *ctx;
+} ST_GC_Visitor;
+
+static void ST_GC_visitGVar(ST_Visitor *visitor, void *gvar) {
+    ST_GC_markObject(((ST_GC_Visitor *)visitor)->ctx,
+                     ((ST_GlobalVarMap_Entry *)gvar)->value);
+}
+
+static void ST_GC_markStack(ST_Context *ctx, const ST_OperandStack *stack) {
+    ST_Internal_Object **slot;
+    for (slot = stack->base; slot < stack->top; ++slot) {
+        ST_GC_markObject(ctx, *slot);
+    }
+}
+
+/* Suspended processes keep their stacks, Process instances and the
+   Semaphores they wait on alive, and so does the host's stack while a
+   process runs. */
+static void ST_GC_markProcesses(ST_Context *ctx) {
+    ST_Process *process;
+    for (process = ctx->processes; process; process = process->nextLive) {
+        if (process != ctx->activeProcess) {
+            ST_GC_markStack(ctx, &process->stack);
+        }
+        if (process->object) {
+            ST_GC_markObject(ctx, process->object);
+        }
+        if (process->semaphore) {
+            ST_GC_markObject(ctx, process->semaphore);
+        }
+    }
+    if (ctx->activeProcess) {
+        ST_GC_markStack(ctx, &ctx->mainStack);
+    }
+}
+
+static void ST_GC_mark(ST_Context *ctx) {
+    ST_GC_Visitor visitor;
+    ST_GC_markStack(ctx, &ctx->operandStack);
+    ST_GC_markProcesses(ctx);
+    visitor.ctx = ctx;
+    visitor.visitor.visit = ST_GC_visitGVar;
+    ST_BST_traverse((ST_BiNode *)ctx->globalScope, (ST_Visitor *)&visitor);
+}
+
+typedef struct ST_GC_CompactionBreak {
+    ST_BiNode node;
+    ST_U8 *gapAddr;
+    ST_Size gapSize;
+} ST_GC_CompactionBreak;
+
+typedef struct ST_GC_CompactionState {
+    ST_GC_CompactionBreak *breakList;
+    ST_Pool breakPool;
+} ST_GC_CompactionState;
+
+static ST_Internal_Object *
+ST_GC_remapObjectAddr(ST_Context *ctx, ST_GC_CompactionBreak *brLstEnd,
+                      ST_Internal_Object *obj) {
+    ST_Size shiftAmount = 0;
+    /* Against the whole heap, compaction already moved heap.end below the
+       objects it moved down */
+    if ((ST_U8 *)obj >= ctx->heap.begin &&
+        (ST_U8 *)obj < ctx->heap.begin + ctx->config.memory.heapCapacity) {
+        ST_GC_CompactionBreak *current = brLstEnd;
+        while (current && current->gapAddr < (ST_U8 *)obj) {
+            shiftAmount += current->gapSize;
+            ST_List_prev((ST_BiNode **)&current);
+        }
+    }
+    return (ST_Internal_Object *)((ST_U8 *)obj - shiftAmount);
+}
+
+static void ST_GC_compactHeap(ST_Context *ctx, ST_GC_CompactionState *cpState) {
+    ST_Internal_Object *current = (ST_Internal_Object *)ctx->heap.begin;
+    ST_Size bytesCompacted = 0;
+    while ((ST_U8 *)current < ctx->heap.end) {
+        enum { LIVE_OBJ_MASK = ST_GC_MASK_MARKED | ST_GC_MASK_PRESERVE };
+        const ST_Size currentSize = current->class->instanceSize;
+        if (current->gcMask & LIVE_OBJ_MASK) {
+            if (bytesCompacted) {
+                ST_U8 *targetAddr = (ST_U8 *)current - bytesCompacted;
+                ST_memmove(ctx, targetAddr, current, currentSize);
+            }
+            ST_Object_unsetGCMask(current, ST_GC_MASK_MARKED);
+        } else /* current is a dead object */ {
+            const bool adjacentDealloc =
+                cpState->breakList &&
+                cpState->breakList->gapAddr + cpState->breakList->gapSize ==
+                    (ST_U8 *)current;
+            if (adjacentDealloc) {
+                cpState->breakList->gapSize += currentSize;
+            } else {
+                ST_GC_CompactionBreak *cbreak =
+                    ST_Pool_alloc(ctx, &cpState->breakPool);
+                cbreak->gapAddr = (ST_U8 *)current;
+                cbreak->gapSize = currentSize;
+                ST_List_insert((ST_BiNode **)&cpState->breakList,
+                               (ST_BiNode *)cbreak);
+            }
+            bytesCompacted += currentSize;
+        }
+        current = (ST_Internal_Object *)((ST_U8 *)current + currentSize);
+    }
+    ctx->heap.end = ctx->heap.end - bytesCompacted;
+}
+
+static void ST_GC_remapIVars(ST_Context *ctx, ST_GC_CompactionBreak *brLstEnd) {
+    ST_Internal_Object *current = (ST_Internal_Object *)ctx->heap.begin;
+    while ((ST_U8 *)current < ctx->heap.end) {
+        const ST_Size currentSize = current->class->instanceSize;
+        ST_Internal_Object **ivars = ST_Object_getIVars(current);
+        ST_Size i;
+        for (i = 0; i < current->class->instanceVariableCount; ++i) {
+            const ST_Object newAddr =
+                ST_GC_remapObjectAddr(ctx, brLstEnd, ivars[i]);
+            ivars[i] = newAddr;
+        }
+        current = (ST_Internal_Object *)((ST_U8 *)current + currentSize);
+    }
+}
+
+typedef struct ST_GC_RemapVisitor {
+    ST_Visitor visitor;
+    ST_Context *ctx;
+    ST_GC_CompactionBreak *cpList;
+} ST_GC_RemapVisitor;
+
+static void ST_GC_remapGVar(ST_Visitor *visitor, void *gvar) {
+    ((ST_GlobalVarMap_Entry *)gvar)->value =
+        ST_GC_remapObjectAddr(((ST_GC_RemapVisitor *)visitor)->ctx,
+                              ((ST_GC_RemapVisitor *)visitor)->cpList,
+                              ((ST_GlobalVarMap_Entry *)gvar)->value);
+}
+
+static void ST_GC_remapGVarsAfterCompact(ST_Context *ctx,
+                                         ST_GC_CompactionBreak *brLstEnd) {
+    ST_GC_RemapVisitor visitor;
+    visitor.cpList = brLstEnd;
+    visitor.ctx = ctx;
+    visitor.visitor.visit = ST_GC_remapGVar;
+    ST_BST_traverse((ST_BiNode *)ctx->globalScope, (ST_Visitor *)&visitor);
+}
+
+static void ST_GC_remapStackAfterCompact(ST_Context *ctx,
+                                         ST_GC_CompactionBreak *brLstEnd,
+                                         ST_OperandStack *stack) {
+    ST_Internal_Object **slot;
+    for (slot = stack->base; slot < stack->top; ++slot) {
+        *slot = ST_GC_remapObjectAddr(ctx, brLstEnd, *slot);
+    }
+}
+
+static void ST_GC_remapProcessesAfterCompact(ST_Context *ctx,
+                                             ST_GC_CompactionBreak *brLstEnd) {
+    ST_Process *process;
+    for (process = ctx->processes; process; process = process->nextLive) {
+        if (process != ctx->activeProcess) {
+            ST_GC_remapStackAfterCompact(ctx, brLstEnd, &process->stack);
+        }
+        process->object =
+            ST_GC_remapObjectAddr(ctx, brLstEnd, process->object);
+        process->semaphore =
+            ST_GC_remapObjectAddr(ctx, brLstEnd, process->semaphore);
+    }
+    if (ctx->activeProcess) {
+        ST_GC_remapStackAfterCompact(ctx, brLstEnd, &ctx->mainStack);
+    }
+}
+
+static void ST_GC_compact(ST_Context *ctx) {
+    struct ST_GC_CompactionState cpState;
+    ST_GC_CompactionBreak *brListEnd;
+    cpState.breakList = NULL;
+    ST_Pool_init(ctx, &cpState.breakPool, sizeof(ST_GC_CompactionBreak), 128);
+    ST_GC_compactHeap(ctx, &cpState);
+    brListEnd =
+        (ST_GC_CompactionBreak *)ST_List_end((ST_BiNode *)cpState.breakList);
+    ST_GC_remapIVars(ctx, brListEnd);
+    ST_GC_remapGVarsAfterCompact(ctx, brListEnd);
+    ST_GC_remapStackAfterCompact(ctx, brListEnd, &ctx->operandStack);
+    ST_GC_remapProcessesAfterCompact(ctx, brListEnd);
+    ST_Pool_release(ctx, &cpState.breakPool);
+}
+
+void ST_GC_run(ST_Object ctx) {
+    ST_GC_mark(ctx);
+    ST_GC_compact(ctx);
+}
+
+static struct ST_Internal_Object *ST_GC_allocInstance(ST_Context *ctx,
+                                                      const ST_Class *class) {
+    const ST_Size allocSize = class->instanceSize;
+    const bool outOfMemory =
+        (ST_Size)(ctx->heap.end - ctx->heap.begin) + allocSize >=
+        ctx->config.memory.heapCapacity;
+    ST_Internal_Object *result;
+    if (UNEXPECTED(outOfMemory)) {
+        ST_GC_run(ctx);
+    }
+    result = (ST_Internal_Object *)ctx->heap.end;
+    ctx->heap.end += allocSize;
+    return result;
+}
+
+/*//////////////////////////////////////////////////////////////////////////////
+// Bytecode loading
+/////////////////////////////////////////////////////////////////////////////*/
+
+static const ST_U8 ST_containerMagic[] = {0x89, 'S', 'T', 'B'};
+/* Magic, version and section count, then per section id, offset, length and
+   checksum, see opcode.h. */
+#define ST_CONTAINER_HEADER_SIZE (sizeof ST_containerMagic + 2 * sizeof(ST_U16))
+#define ST_CONTAINER_ENTRY_SIZE (4 * sizeof(ST_U32))
+
+/* CRC32C (Castagnoli, reflected 0x82f63b78), one byte at a time. */
+static const ST_U32 ST_crc32cTable[256] = {
+    0x00000000u, 0xf26b8303u, 0xe13b70f7u, 0x1350f3f4u, 0xc79a971fu,
+    0x35f1141cu, 0x26a1e7e8u, 0xd4ca64ebu, 0x8ad958cfu, 0x78b2dbccu,
+    0x6be22838u, 0x9989ab3bu, 0x4d43cfd0u, 0xbf284cd3u, 0xac78bf27u,
+    0x5e133c24u, 0x105ec76fu, 0xe235446cu, 0xf165b798u, 0x030e349bu,
+    0xd7c45070u, 0x25afd373u, 0x36ff2087u, 0xc494a384u, 0x9a879fa0u,
+    0x68ec1ca3u, 0x7bbcef57u, 0x89d76c54u, 0x5d1d08bfu, 0xaf768bbcu,
+    0xbc267848u, 0x4e4dfb4bu, 0x20bd8edeu, 0xd2d60dddu, 0xc186fe29u,
+    0x33ed7d2au, 0xe72719c1u, 0x154c9ac2u, 0x061c6936u, 0xf477ea35u,
+    0xaa64d611u, 0x580f5512u, 0x4b5fa6e6u, 0xb93425e5u, 0x6dfe410eu,
+    0x9f95c20du, 0x8cc531f9u, 0x7eaeb2fau, 0x30e349b1u, 0xc288cab2u,
+    0xd1d83946u, 0x23b3ba45u, 0xf779deaeu, 0x05125dadu, 0x1642ae59u,
+    0xe4292d5au, 0xba3a117eu, 0x4851927du, 0x5b016189u, 0xa96ae28au,
+    0x7da08661u, 0x8fcb0562u, 0x9c9bf696u, 0x6ef07595u, 0x417b1dbcu,
+    0xb3109ebfu, 0xa0406d4bu, 0x522bee48u, 0x86e18aa3u, 0x748a09a0u,
+    0x67dafa54u, 0x95b17957u, 0xcba24573u, 0x39c9c670u, 0x2a993584u,
+    0xd8f2b687u, 0x0c38d26cu, 0xfe53516fu, 0xed03a29bu, 0x1f682198u,
+    0x5125dad3u, 0xa34e59d0u, 0xb01eaa24u, 0x42752927u, 0x96bf4dccu,
+    0x64d4cecfu, 0x77843d3bu, 0x85efbe38u, 0xdbfc821cu, 0x2997011fu,
+    0x3ac7f2ebu, 0xc8ac71e8u, 0x1c661503u, 0xee0d9600u, 0xfd5d65f4u,
+    0x0f36e6f7u, 0x61c69362u, 0x93ad1061u, 0x80fde395u, 0x72966096u,
+    0xa65c047du, 0x5437877eu, 0x4767748au, 0xb50cf789u, 0xeb1fcbadu,
+    0x197448aeu, 0x0a24bb5au, 0xf84f3859u, 0x2c855cb2u, 0xdeeedfb1u,
+    0xcdbe2c45u, 0x3fd5af46u, 0x7198540du, 0x83f3d70eu, 0x90a324fau,
+    0x62c8a7f9u, 0xb602c312u, 0x44694011u, 0x5739b3e5u, 0xa55230e6u,
+    0xfb410cc2u, 0x092a8fc1u, 0x1a7a7c35u, 0xe811ff36u, 0x3cdb9bddu,
+    0xceb018deu, 0xdde0eb2au, 0x2f8b6829u, 0x82f63b78u, 0x709db87bu,
+    0x63cd4b8fu, 0x91a6c88cu, 0x456cac67u, 0xb7072f64u, 0xa457dc90u,
+    0x563c5f93u, 0x082f63b7u, 0xfa44e0b4u, 0xe9141340u, 0x1b7f9043u,
+    0xcfb5f4a8u, 0x3dde77abu, 0x2e8e845fu, 0xdce5075cu, 0x92a8fc17u,
+    0x60c37f14u, 0x73938ce0u, 0x81f80fe3u, 0x55326b08u, 0xa759e80bu,
+    0xb4091bffu, 0x466298fcu, 0x1871a4d8u, 0xea1a27dbu, 0xf94ad42fu,
+    0x0b21572cu, 0xdfeb33c7u, 0x2d80b0c4u, 0x3ed04330u, 0xccbbc033u,
+    0xa24bb5a6u, 0x502036a5u, 0x4370c551u, 0xb11b4652u, 0x65d122b9u,
+    0x97baa1bau, 0x84ea524eu, 0x7681d14du, 0x2892ed69u, 0xdaf96e6au,
+    0xc9a99d9eu, 0x3bc21e9du, 0xef087a76u, 0x1d63f975u, 0x0e330a81u,
+    0xfc588982u, 0xb21572c9u, 0x407ef1cau, 0x532e023eu, 0xa145813du,
+    0x758fe5d6u, 0x87e466d5u, 0x94b49521u, 0x66df1622u, 0x38cc2a06u,
+    0xcaa7a905u, 0xd9f75af1u, 0x2b9cd9f2u, 0xff56bd19u, 0x0d3d3e1au,
+    0x1e6dcdeeu, 0xec064eedu, 0xc38d26c4u, 0x31e6a5c7u, 0x22b65633u,
+    0xd0ddd530u, 0x0417b1dbu, 0xf67c32d8u, 0xe52cc12cu, 0x1747422fu,
+    0x49547e0bu, 0xbb3ffd08u, 0xa86f0efcu, 0x5a048dffu, 0x8ecee914u,
+    0x7ca56a17u, 0x6ff599e3u, 0x9d9e1ae0u, 0xd3d3e1abu, 0x21b862a8u,
+    0x32e8915cu, 0xc083125fu, 0x144976b4u, 0xe622f5b7u, 0xf5720643u,
+    0x07198540u, 0x590ab964u, 0xab613a67u, 0xb831c993u, 0x4a5a4a90u,
+    0x9e902e7bu, 0x6cfbad78u, 0x7fab5e8cu, 0x8dc0dd8fu, 0xe330a81au,
+    0x115b2b19u, 0x020bd8edu, 0xf0605beeu, 0x24aa3f05u, 0xd6c1bc06u,
+    0xc5914ff2u, 0x37faccf1u, 0x69e9f0d5u, 0x9b8273d6u, 0x88d28022u,
+    0x7ab90321u, 0xae7367cau, 0x5c18e4c9u, 0x4f48173du, 0xbd23943eu,
+    0xf36e6f75u, 0x0105ec76u, 0x12551f82u, 0xe03e9c81u, 0x34f4f86au,
+    0xc69f7b69u, 0xd5cf889du, 0x27a40b9eu, 0x79b737bau, 0x8bdcb4b9u,
+    0x988c474du, 0x6ae7c44eu, 0xbe2da0a5u, 0x4c4623a6u, 0x5f16d052u,
+    0xad7d5351u
+};
+
+/* Continues crc over data, start from zero. */
+static ST_U32 ST_crc32c(ST_U32 crc, const ST_U8 *data, ST_Size len) {
+    crc = ~crc;
+    while (len--) {
+        crc = ST_crc32cTable[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static ST_U32 ST_readU32(const ST_U8 *bytes) {
+    return (ST_U32)bytes[0] | (ST_U32)bytes[1] << 8 | (ST_U32)bytes[2] << 16 |
+           (ST_U32)bytes[3] << 24;
+}
+
+/* Where the parts of encoded code are, found without a context. */
+typedef struct ST_VM_Parts {
+    /* symbolCount consecutive null-terminated names, symbolsLength bytes */
+    const ST_U8 *symbols;
+    ST_Size symbolCount;
+    ST_Size symbolsLength;
+    const ST_U8 *instructions;
+    ST_Size length;
+    /* Nonzero if instructions is an LZ4 block of packedLength bytes, that
+       unpacks to length bytes, see ST_VM_unpack. */
+    ST_Size packedLength;
+    const ST_U8 *debugInfo;
+    ST_Size debugLength;
+} ST_VM_Parts;
+
+static const ST_VM_Parts ST_VM_noParts = {NULL, 0, 0, NULL, 0, 0, NULL, 0};
+
+/* Bare format: the symbol table, then the instructions. Returns false if
+   the symbol table isn't terminated. */
+static bool ST_VM_parseBare(const ST_U8 *data, ST_Size len,
+                            ST_VM_Parts *parts) {
+    /* Note: symbol table is a list of null-terminated symbol strings, where
+       the final symbol in the table is followed by two terminators. */
+    ST_Size i;
+    for (i = 0; i + 1 < len; ++i) {
+        if (data[i] == '\0') {
+            parts->symbolCount += 1;
+            if (data[i + 1] == '\0') {
+                break;
+            }
+        }
+    }
+    if (i + 1 >= len) {
+        return false;
+    }
+    parts->symbols = data;
+    parts->symbolsLength = i + 1;
+    parts->instructions = data + i + 2;
+    parts->length = len - i - 2;
+    return true;
+}
+
+typedef struct ST_VM_Section {
+    ST_Size offset;
+    ST_Size length;
+    ST_U32 checksum;
+    bool present;
+} ST_VM_Section;
+
+enum { ST_VM_SECTION_SLOTS = ST_VM_SECTION_CODE_LZ4 + 1 };
+
+/* The sections loaders read and check, the others are skipped unread. */
+static bool ST_VM_sectionUsed(ST_U32 id) {
+    return id == ST_VM_SECTION_SYMBOLS || id == ST_VM_SECTION_CODE ||
+           id == ST_VM_SECTION_DEBUG || id == ST_VM_SECTION_CODE_LZ4;
+}
+
+/* Size of the container header including the section table and its
+   checksum, from its first ST_CONTAINER_HEADER_SIZE bytes. */
+static ST_Size ST_VM_containerHeaderSize(const ST_U8 *data) {
+    const ST_Size sectionCount = (ST_Size)data[6] | (ST_Size)data[7] << 8;
+    return ST_CONTAINER_HEADER_SIZE + sectionCount * ST_CONTAINER_ENTRY_SIZE +
+           sizeof(ST_U32);
+}
+
+/* Checks a complete container header, and fills in where the used sections
+   are. A section id that appears twice is only used the first time. Returns
+   false if the header is malformed. */
+static bool ST_VM_readContainerHeader(const ST_U8 *data, ST_Size headerSize,
+                                      ST_VM_Section sections[]) {
+    const ST_Size tableEnd = headerSize - sizeof(ST_U32);
+    ST_Size i;
+    for (i = 0; i < sizeof ST_containerMagic; ++i) {
+        if (data[i] != ST_containerMagic[i]) {
+            return false;
+        }
+    }
+    if (((ST_Size)data[4] | (ST_Size)data[5] << 8) !=
+            ST_VM_CONTAINER_VERSION ||
+        ST_crc32c(0, data, tableEnd) != ST_readU32(data + tableEnd)) {
+        return false;
+    }
+    for (i = 0; i < ST_VM_SECTION_SLOTS; ++i) {
+        sections[i].present = false;
+    }
+    for (i = ST_CONTAINER_HEADER_SIZE; i < tableEnd;
+         i += ST_CONTAINER_ENTRY_SIZE) {
+        const ST_U32 id = ST_readU32(data + i);
+        ST_VM_Section *section;
+        if (!ST_VM_sectionUsed(id) || sections[id].present) {
+            continue;
+        }
+        section = &sections[id];
+        section->offset = ST_readU32(data + i + 4);
+        section->length = ST_readU32(data + i + 8);
+        section->checksum = ST_readU32(data + i + 12);
+        section->present = true;
+        if (section->offset < headerSize ||
+            section->length > (ST_Size)-1 - section->offset) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Counts the names in a symbol section. Returns false if the section is
+   malformed, i.e. its last name isn't terminated. */
+static bool ST_VM_countSymbols(const ST_U8 *data, ST_Size len,
+                               ST_Size *count) {
+    ST_Size i;
+    *count = 0;
+    for (i = 0; i < len; ++i) {
+        *count += data[i] == '\0';
+    }
+    return !len || data[len - 1] == '\0';
+}
+
+/* Container format, see opcode.h. Checks the sections it uses, and returns
+   false if they or the header are malformed or damaged. */
+static bool ST_VM_parseSections(const ST_U8 *data, ST_Size len,
+                                ST_VM_Parts *parts) {
+    ST_VM_Section sections[ST_VM_SECTION_SLOTS];
+    const ST_VM_Section *symbols = &sections[ST_VM_SECTION_SYMBOLS];
+    const ST_VM_Section *instructions = &sections[ST_VM_SECTION_CODE];
+    const ST_VM_Section *packed = &sections[ST_VM_SECTION_CODE_LZ4];
+    const ST_VM_Section *debug = &sections[ST_VM_SECTION_DEBUG];
+    ST_Size i, headerSize;
+    if (len < ST_CONTAINER_HEADER_SIZE ||
+        len < (headerSize = ST_VM_containerHeaderSize(data)) ||
+        !ST_VM_readContainerHeader(data, headerSize, sections)) {
+        return false;
+    }
+    for (i = 0; i < ST_VM_SECTION_SLOTS; ++i) {
+        const ST_VM_Section *section = &sections[i];
+        if (section->present &&
+            (section->offset > len || section->length > len - section->offset ||
+             ST_crc32c(0, data + section->offset, section->length) !=
+                 section->checksum)) {
+            return false;
+        }
+    }
+    if (symbols->present) {
+        if (!ST_VM_countSymbols(data + symbols->offset, symbols->length,
+                                &parts->symbolCount)) {
+            return false;
+        }
+        parts->symbols = data + symbols->offset;
+        parts->symbolsLength = symbols->length;
+    }
+    if (instructions->present) {
+        parts->instructions = data + instructions->offset;
+        parts->length = instructions->length;
+    } else if (packed->present) {
+        if (packed->length < sizeof(ST_U32)) {
+            return false;
+        }
+        parts->length = ST_readU32(data + packed->offset);
+        parts->instructions = data + packed->offset + sizeof(ST_U32);
+        parts->packedLength = packed->length - sizeof(ST_U32);
+    }
+    if (debug->present) {
+        parts->debugInfo = data + debug->offset;
+        parts->debugLength = debug->length;
+    }
+    return true;
+}
+
+/* Either format. Malformed or damaged code parses as empty code, and
+   returns false. */
+static bool ST_VM_parse(const ST_U8 *data, ST_Size len, ST_VM_Parts *parts) {
+    bool valid;
+    *parts = ST_VM_noParts;
+    if (len && data[0] == ST_containerMagic[0]) {
+        valid = ST_VM_parseSections(data, len, parts);
+    } else {
+        valid = ST_VM_parseBare(data, len, parts);
+    }
+    if (!valid) {
+        *parts = ST_VM_noParts;
+    }
+    return valid;
+}
+
+/* Reads an LZ4 length continuation: bytes are added up for as long as they
+   are 255. Returns false if the block ends first. */
+static bool ST_lz4Length(const ST_U8 **src, const ST_U8 *end,
+                         ST_Size *length) {
+    ST_U8 byte;
+    do {
+        if (*src == end) {
+            return false;
+        }
+        byte = *(*src)++;
+        *length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+/* Decompresses one LZ4 block into exactly dstLen bytes. Every sequence is
+   checked against both buffers, so a malformed block returns false rather
+   than reading or writing out of bounds. */
+static bool ST_lz4Decompress(const ST_U8 *src, ST_Size srcLen, ST_U8 *dst,
+                             ST_Size dstLen) {
+    const ST_U8 *const end = src + srcLen;
+    ST_Size out = 0;
+    while (src < end) {
+        const ST_U8 token = *src++;
+        ST_Size literals = token >> 4, match = token & 15, offset, i;
+        if ((literals == 15 && !ST_lz4Length(&src, end, &literals)) ||
+            literals > (ST_Size)(end - src) || literals > dstLen - out) {
+            return false;
+        }
+        for (i = 0; i < literals; ++i) {
+            dst[out++] = *src++;
+        }
+        if (src == end) {
+            /* The last sequence is only literals */
+            break;
+        }
+        if (end - src < 2) {
+            return false;
+        }
+        offset = (ST_Size)src[0] | (ST_Size)src[1] << 8;
+        src += 2;
+        if (!offset || offset > out ||
+            (match == 15 && !ST_lz4Length(&src, end, &match))) {
+            return false;
+        }
+        match += 4;
+        if (match > dstLen - out) {
+            return false;
+        }
+        /* Byte by byte, the match may overlap what it's copying */
+        for (i = 0; i < match; ++i, ++out) {
+            dst[out] = dst[out - offset];
+        }
+    }
+    return out == dstLen;
+}
+
+/* Copies, or decompresses, the instructions into dst. Returns false if
+   they don't decompress. */
+static bool ST_VM_unpack(const ST_VM_Parts *parts, ST_U8 *dst,
+                         void *(*copyFn)(void *, const void *, size_t)) {
+    if (parts->packedLength) {
+        return ST_lz4Decompress(parts->instructions, parts->packedLength, dst,
+                                parts->length);
+    }
+    copyFn(dst, parts->instructions, parts->length);
+    return true;
+}
+
+/* Interns the symbols into a new symbol table, and points the code at the
+   instructions and debug section where they are. */
+static ST_Code ST_VM_linkParts(ST_Object ctx, const ST_VM_Parts *parts) {
+    const ST_U8 *name = parts->symbols;
+    ST_Code code;
+    ST_Size i;
+    code.symbolCount = parts->symbolCount;
+    code.symbTab = ST_alloc(ctx, sizeof(ST_Object) * parts->symbolCount);
+    for (i = 0; i < parts->symbolCount; ++i) {
+        code.symbTab[i] = ST_symb(ctx, (const char *)name);
+        name += ST_strlen((const char *)name) + 1;
+    }
+    code.instructions = parts->instructions;
+    code.length = parts->length;
+    code.methodsDefined = 0;
+    code.debugInfo = parts->debugInfo;
+    code.debugLength = parts->debugLength;
+    code.loading = 0;
+    return code;
+}
+
+ST_Code ST_VM_load(ST_Object ctx, const ST_U8 *data, ST_Size len) {
+    ST_VM_Parts parts;
+    ST_Code code;
+    ST_U8 *instructions;
+    ST_VM_parse(data, len, &parts);
+    code = ST_VM_linkParts(ctx, &parts);
+    /* Keep the debug section right after the instructions */
+    instructions = ST_alloc(ctx, code.length + code.debugLength);
+    if (!ST_VM_unpack(&parts, instructions,
+                      ((ST_Context *)ctx)->config.memory.copyFn)) {
+        code.length = 0;
+    }
+    if (code.debugInfo) {
+        ST_memcpy(ctx, instructions + code.length, code.debugInfo,
+                  code.debugLength);
+        code.debugInfo = instructions + code.length;
+    }
+    code.instructions = instructions;
+    return code;
+}
+
+ST_Code ST_VM_loadInPlace(ST_Object ctx, const ST_U8 *data, ST_Size len) {
+    ST_VM_Parts parts;
+    ST_VM_parse(data, len, &parts);
+    if (parts.packedLength) {
+        /* Compressed code can't run in place */
+        return ST_VM_load(ctx, data, len);
+    }
+    return ST_VM_linkParts(ctx, &parts);
+}
+
+struct ST_SharedCode {
+    void (*freeFn)(void *);
+    ST_VM_Parts parts;
+    /* Followed by the symbol names, instructions and debug section */
+};
+
+ST_SharedCode *ST_VM_loadShared(const ST_Configuration *config,
+                                const ST_U8 *data, ST_Size len) {
+    ST_VM_Parts parts;
+    ST_SharedCode *shared;
+    ST_U8 *copy;
+    if (!ST_VM_parse(data, len, &parts)) {
+        return NULL;
+    }
+    shared = config->memory.allocFn(sizeof(ST_SharedCode) +
+                                    parts.symbolsLength + parts.length +
+                                    parts.debugLength);
+    if (!shared) {
+        return NULL;
+    }
+    shared->freeFn = config->memory.freeFn;
+    shared->parts = parts;
+    copy = (ST_U8 *)(shared + 1);
+    config->memory.copyFn(copy, parts.symbols, parts.symbolsLength);
+    shared->parts.symbols = copy;
+    copy += parts.symbolsLength;
+    if (!ST_VM_unpack(&parts, copy, config->memory.copyFn)) {
+        config->memory.freeFn(shared);
+        return NULL;
+    }
+    shared->parts.instructions = copy;
+    shared->parts.packedLength = 0;
+    copy += parts.length;
+    if (parts.debugInfo) {
+        config->memory.copyFn(copy, parts.debugInfo, parts.debugLength);
+        shared->parts.debugInfo = copy;
+    }
+    return shared;
+}
+
+typedef struct ST_LinkedCode {
+    ST_Code code;
+    struct ST_LinkedCode *next;
+} ST_LinkedCode;
+
+ST_Code *ST_VM_link(ST_Object ctx, const ST_SharedCode *shared) {
+    ST_LinkedCode *linked = ST_alloc(ctx, sizeof(ST_LinkedCode));
+    linked->code = ST_VM_linkParts(ctx, &shared->parts);
+    linked->next = ((ST_Context *)ctx)->linkedCode;
+    ((ST_Context *)ctx)->linkedCode = linked;
+    return &linked->code;
+}
+
+/* Releases the link tables made since until, or all of them */
+static void ST_VM_releaseLinkedCode(ST_Context *ctx,
+                                    const ST_LinkedCode *until) {
+    while (ctx->linkedCode != until) {
+        ST_LinkedCode *linked = ctx->linkedCode;
+        ctx->linkedCode = linked->next;
+        ST_free(ctx, linked->code.symbTab);
+        ST_free(ctx, linked);
+    }
+}
+
+void ST_VM_releaseShared(ST_SharedCode *shared) {
+    shared->freeFn(shared);
+}
+
+/* Length of the top level instruction at ip, counting the bodies SETMETHOD
+   and INLINEGUARD carry, or zero if fewer than available bytes don't even
+   hold its header. Unknown opcodes count as one byte, the VM stops there
+   anyway. */
+static ST_Size ST_VM_instructionLength(const ST_U8 *ip, ST_Size available) {
+    ST_Size header, bodyLengthOffset, i, length = 0;
+    switch (ip[0]) {
+    case ST_VM_OP_GETGLOBAL:
+    case ST_VM_OP_SETGLOBAL:
+    case ST_VM_OP_GETIVAR:
+    case ST_VM_OP_SETIVAR:
+    case ST_VM_OP_SENDMSG:
+    case ST_VM_OP_PUSHSYMBOL:
+        return available >= 3 ? 3 : 0;
+    case ST_VM_OP_GETGLOBAL8:
+    case ST_VM_OP_SETGLOBAL8:
+    case ST_VM_OP_SENDMSG8:
+    case ST_VM_OP_PUSHSYMBOL8:
+        return available >= 2 ? 2 : 0;
+    case ST_VM_OP_SENDDIRECT:
+        return available >= 12 ? 12 : 0;
+    case ST_VM_OP_SETMETHOD:
+        header = 8;
+        bodyLengthOffset = 4;
+        break;
+    case ST_VM_OP_INLINEGUARD:
+        header = 11;
+        bodyLengthOffset = 7;
+        break;
+    default:
+        return 1;
+    }
+    if (available < header) {
+        return 0;
+    }
+    for (i = 0; i < sizeof(ST_U32); ++i) {
+        length |= (ST_Size)ip[bodyLengthOffset + i] << (8 * i);
+    }
+    return header + length;
+}
+
+typedef enum ST_Loader_Format {
+    ST_LOADER_FORMAT_UNKNOWN,
+    ST_LOADER_FORMAT_BARE,
+    ST_LOADER_FORMAT_CONTAINER,
+    ST_LOADER_FORMAT_FAILED
+} ST_Loader_Format;
+
+struct ST_Loader {
+    /* First, and never moves: methods the code defines point at it. */
+    ST_Code code;
+    ST_Context *ctx;
+    ST_Loader_Format format;
+    ST_U8 *buffer;
+    ST_Size size;
+    ST_Size capacity;
+    /* End of the last top level instruction that arrived whole */
+    ST_Size complete;
+    /* The frame running the code, which stays on the stack while it waits
+       for more, and the stack size to restore once it completes. */
+    ST_StackFrame *frame;
+    ST_Size stackSize;
+    bool started;
+    /* Symbol table parsing, the name being read may span chunks. */
+    bool inSymbols;
+    bool afterTerminator;
+    char *name;
+    ST_Size nameLength;
+    ST_Size nameCapacity;
+    ST_Size symbTabCapacity;
+    /* Containers: the header until it's complete, how much of the container
+       arrived, where the used sections are and their checksums so far. */
+    ST_U8 *header;
+    ST_Size headerCapacity;
+    bool headerDone;
+    ST_Size position;
+    ST_VM_Section sections[ST_VM_SECTION_SLOTS];
+    ST_U32 checksums[ST_VM_SECTION_SLOTS];
+    ST_U8 *debug;
+    ST_Size debugSize;
+    ST_Size debugCapacity;
+    /* A compressed code section, unpacked once it's complete */
+    ST_U8 *packed;
+    ST_Size packedSize;
+    ST_Size packedCapacity;
+    /* The capacities of all the buffers above, and their limit, see
+       ST_VM_limitLoad */
+    ST_Size reserved;
+    ST_Size maxBytes;
+    struct ST_Loader *next;
+};
+
+/* Doubles *capacity until it holds needed bytes, and moves the contents of
+   *memory over if it had to grow. Returns false and fails the load if the
+   buffers would take more than the loader's limit, counting the old buffer
+   until it's freed. */
+static bool ST_Loader_reserve(ST_Loader *loader, void **memory,
+                              ST_Size *capacity, ST_Size used,
+                              ST_Size needed) {
+    ST_Context *ctx = loader->ctx;
+    const ST_Size others = loader->reserved - *capacity;
+    ST_Size newCapacity = *capacity ? *capacity : 64;
+    void *grown;
+    if (needed <= *capacity) {
+        return true;
+    }
+    if (loader->reserved > loader->maxBytes ||
+        needed > loader->maxBytes - loader->reserved) {
+        loader->format = ST_LOADER_FORMAT_FAILED;
+        return false;
+    }
+    while (newCapacity < needed) {
+        newCapacity *= 2;
+    }
+    if (newCapacity > loader->maxBytes - loader->reserved) {
+        newCapacity = loader->maxBytes - loader->reserved;
+    }
+    grown = ST_alloc(ctx, newCapacity);
+    if (!grown) {
+        loader->format = ST_LOADER_FORMAT_FAILED;
+        return false;
+    }
+    if (*memory) {
+        ST_memcpy(ctx, grown, *memory, used);
+        ST_free(ctx, *memory);
+    }
+    *memory = grown;
+    *capacity = newCapacity;
+    loader->reserved = others + newCapacity;
+    return true;
+}
+
+/* Appends len bytes to a buffer grown with ST_Loader_reserve */
+static void ST_Loader_append(ST_Loader *loader, ST_U8 **buffer,
+                             ST_Size *size, ST_Size *capacity,
+                             const ST_U8 *data, ST_Size len) {
+    if (ST_Loader_reserve(loader, (void **)buffer, capacity, *size,
+                          *size + len)) {
+        ST_memcpy(loader->ctx, *buffer + *size, data, len);
+        *size += len;
+    }
+}
+
+/* Frees a buffer grown with ST_Loader_reserve before the load ends */
+static void ST_Loader_release(ST_Loader *loader, void **memory,
+                              ST_Size *capacity) {
+    if (*memory) {
+        ST_free(loader->ctx, *memory);
+        *memory = NULL;
+    }
+    loader->reserved -= *capacity;
+    *capacity = 0;
+}
+
+ST_Loader *ST_VM_beginLoad(ST_Object ctx) {
+    ST_Loader *loader = ST_alloc(ctx, sizeof(ST_Loader));
+    ST_memset(ctx, loader, 0, sizeof(ST_Loader));
+    loader->ctx = ctx;
+    loader->next = ((ST_Context *)ctx)->loaders;
+    ((ST_Context *)ctx)->loaders = loader;
+    loader->format = ST_LOADER_FORMAT_UNKNOWN;
+    loader->inSymbols = true;
+    loader->code.loading = 1;
+    loader->maxBytes = (ST_Size)-1;
+    return loader;
+}
+
+void ST_VM_limitLoad(ST_Loader *loader, ST_Size maxBytes) {
+    loader->maxBytes = maxBytes;
+}
+
+/* Consumes symbol table bytes, returns how many. The first NUL ends a
+   symbol. In the bare format a second one in a row ends the table, as
+   ST_VM_loadSymbols() expects, containers delimit it by section length. */
+static ST_Size ST_Loader_feedSymbols(ST_Loader *loader, const ST_U8 *data,
+                                     ST_Size len, bool bare) {
+    ST_Context *ctx = loader->ctx;
+    ST_Size i;
+    for (i = 0; i < len && loader->inSymbols; ++i) {
+        if (data[i] != '\0') {
+            if (!ST_Loader_reserve(loader, (void **)&loader->name,
+                                   &loader->nameCapacity, loader->nameLength,
+                                   loader->nameLength + 2)) {
+                break;
             }
+            loader->name[loader->nameLength++] = data[i];
+            loader->afterTerminator = false;
+        } else if (bare && loader->afterTerminator) {
+            loader->inSymbols = false;
+        } else {
+            const ST_Size tableSize =
+                sizeof(ST_Object) * loader->code.symbolCount;
+            if (!ST_Loader_reserve(loader, (void **)&loader->code.symbTab,
+                                   &loader->symbTabCapacity, tableSize,
+                                   tableSize + sizeof(ST_Object)) ||
+                (!loader->name &&
+                 !ST_Loader_reserve(loader, (void **)&loader->name,
+                                    &loader->nameCapacity, 0, 1))) {
+                break;
+            }
+            loader->name[loader->nameLength] = '\0';
+            loader->code.symbTab[loader->code.symbolCount++] =
+                ST_symb(ctx, loader->name);
+            loader->nameLength = 0;
+            loader->afterTerminator = true;
         }
-        ST_GC_markObject(ctx, (ST_Object)object->class);
-    } else /* We're a class */ {
-        ST_Class *class = (ST_Class *)object;
-        if (class->super) {
-            ST_GC_markObject(ctx, (ST_Object) class->super);
+    }
+    return i;
+}
+
+/* Moves complete past the top level instructions that arrived whole */
+static void ST_Loader_scan(ST_Loader *loader) {
+    ST_Size length;
+    loader->code.instructions = loader->buffer;
+    while (loader->complete < loader->size &&
+           (length = ST_VM_instructionLength(
+                loader->buffer + loader->complete,
+                loader->size - loader->complete)) &&
+           length <= loader->size - loader->complete) {
+        loader->complete += length;
+    }
+}
+
+static void ST_Loader_feedCode(ST_Loader *loader, const ST_U8 *data,
+                               ST_Size len) {
+    ST_Loader_append(loader, &loader->buffer, &loader->size,
+                     &loader->capacity, data, len);
+    ST_Loader_scan(loader);
+}
+
+/* Decompresses a complete CODE_LZ4 section straight into the instruction
+   buffer. Returns false if it doesn't decompress. */
+static bool ST_Loader_unpack(ST_Loader *loader) {
+    ST_Size length;
+    if (loader->packedSize < sizeof(ST_U32)) {
+        return false;
+    }
+    length = ST_readU32(loader->packed);
+    if (!ST_Loader_reserve(loader, (void **)&loader->buffer,
+                           &loader->capacity, loader->size, length) ||
+        !ST_lz4Decompress(loader->packed + sizeof(ST_U32),
+                          loader->packedSize - sizeof(ST_U32),
+                          loader->buffer, length)) {
+        return false;
+    }
+    loader->size = length;
+    ST_Loader_release(loader, (void **)&loader->packed,
+                      &loader->packedCapacity);
+    ST_Loader_scan(loader);
+    return true;
+}
+
+/* Whether a used section arrived whole and intact */
+static bool ST_Loader_sectionDone(const ST_Loader *loader, ST_Size id) {
+    const ST_VM_Section *section = &loader->sections[id];
+    if (!section->present) {
+        return true;
+    }
+    return loader->headerDone &&
+           loader->position >= section->offset + section->length &&
+           loader->checksums[id] == section->checksum &&
+           (id != ST_VM_SECTION_SYMBOLS || !loader->nameLength);
+}
+
+/* Buffers the header, then hands the bytes of each used section to the
+   code, symbol or debug parts of the loader and skips everything else. */
+static void ST_Loader_feedContainer(ST_Loader *loader, const ST_U8 *data,
+                                    ST_Size len) {
+    while (len && loader->format == ST_LOADER_FORMAT_CONTAINER) {
+        ST_Size span = len, id = 0, i;
+        if (!loader->headerDone) {
+            const ST_Size headerSize =
+                loader->position < ST_CONTAINER_HEADER_SIZE
+                    ? ST_CONTAINER_HEADER_SIZE
+                    : ST_VM_containerHeaderSize(loader->header);
+            if (span > headerSize - loader->position) {
+                span = headerSize - loader->position;
+            }
+            ST_Loader_append(loader, &loader->header, &loader->position,
+                             &loader->headerCapacity, data, span);
+            data += span;
+            len -= span;
+            if (loader->position >= ST_CONTAINER_HEADER_SIZE &&
+                loader->position ==
+                    ST_VM_containerHeaderSize(loader->header)) {
+                loader->headerDone = ST_VM_readContainerHeader(
+                    loader->header, loader->position, loader->sections);
+                if (!loader->headerDone) {
+                    loader->format = ST_LOADER_FORMAT_FAILED;
+                }
+            }
+            continue;
         }
-        /* TODO: eventually, mark class variables too */
+        for (i = 0; i < ST_VM_SECTION_SLOTS; ++i) {
+            const ST_VM_Section *section = &loader->sections[i];
+            const ST_Size end = section->offset + section->length;
+            if (!section->present || end <= loader->position) {
+                continue;
+            }
+            if (section->offset > loader->position) {
+                if (span > section->offset - loader->position) {
+                    span = section->offset - loader->position;
+                }
+                continue;
+            }
+            if (!id) {
+                id = i;
+            }
+            if (span > end - loader->position) {
+                span = end - loader->position;
+            }
+        }
+        if (id == ST_VM_SECTION_SYMBOLS) {
+            ST_Loader_feedSymbols(loader, data, span, false);
+        } else if (id == ST_VM_SECTION_CODE) {
+            ST_Loader_feedCode(loader, data, span);
+        } else if (id == ST_VM_SECTION_DEBUG) {
+            ST_Loader_append(loader, &loader->debug, &loader->debugSize,
+                             &loader->debugCapacity, data, span);
+        } else if (id == ST_VM_SECTION_CODE_LZ4) {
+            ST_Loader_append(loader, &loader->packed, &loader->packedSize,
+                             &loader->packedCapacity, data, span);
+        }
+        if (id) {
+            loader->checksums[id] =
+                ST_crc32c(loader->checksums[id], data, span);
+        }
+        loader->position += span;
+        data += span;
+        len -= span;
+        if (id &&
+            loader->position == loader->sections[id].offset +
+                                    loader->sections[id].length &&
+            (!ST_Loader_sectionDone(loader, id) ||
+             (id == ST_VM_SECTION_CODE_LZ4 && !ST_Loader_unpack(loader)))) {
+            loader->format = ST_LOADER_FORMAT_FAILED;
+        }
+    }
+}
+
+void ST_VM_feed(ST_Loader *loader, const ST_U8 *data, ST_Size len) {
+    ST_Size symbolBytes;
+    if (!len) {
+        return;
+    }
+    if (loader->format == ST_LOADER_FORMAT_UNKNOWN) {
+        loader->format = data[0] == ST_containerMagic[0]
+                             ? ST_LOADER_FORMAT_CONTAINER
+                             : ST_LOADER_FORMAT_BARE;
+    }
+    if (loader->format == ST_LOADER_FORMAT_CONTAINER) {
+        ST_Loader_feedContainer(loader, data, len);
+    } else if (loader->format == ST_LOADER_FORMAT_BARE) {
+        symbolBytes = ST_Loader_feedSymbols(loader, data, len, true);
+        if (len > symbolBytes && loader->format == ST_LOADER_FORMAT_BARE) {
+            ST_Loader_feedCode(loader, data + symbolBytes, len - symbolBytes);
+        }
+    }
+}
+
+void ST_VM_runLoaded(ST_Loader *loader) {
+    ST_Context *ctx = loader->ctx;
+    if (loader->code.loading &&
+        (loader->format == ST_LOADER_FORMAT_FAILED ||
+         !ST_Loader_sectionDone(loader, ST_VM_SECTION_SYMBOLS))) {
+        return;
+    }
+    if (!loader->started) {
+        loader->started = true;
+        loader->stackSize = ST_stackSize(ctx);
+        ST_pushStackFrame(ctx, 0, &loader->code);
+        loader->frame = ctx->stackFrame;
+    } else if (ctx->stackFrame != loader->frame) {
+        /* Completed, or another load is suspended on top of this one */
+        return;
+    }
+    if (loader->code.loading) {
+        loader->code.length = loader->complete;
+    }
+    ST_Internal_VM_execute(ctx);
+    if (ctx->stackFrame != loader->frame) {
+        ctx->operandStack.top = ctx->operandStack.base + loader->stackSize;
+    }
+}
+
+/* Releases the code loaded since until, or all of it */
+static void ST_VM_releaseLoaders(ST_Context *ctx, const ST_Loader *until) {
+    while (ctx->loaders != until) {
+        ST_Loader *loader = ctx->loaders;
+        ctx->loaders = loader->next;
+        if (loader->buffer) {
+            ST_free(ctx, loader->buffer);
+        }
+        if (loader->code.symbTab) {
+            ST_free(ctx, loader->code.symbTab);
+        }
+        if (loader->name) {
+            ST_free(ctx, loader->name);
+        }
+        if (loader->header) {
+            ST_free(ctx, loader->header);
+        }
+        if (loader->debug) {
+            ST_free(ctx, loader->debug);
+        }
+        if (loader->packed) {
+            ST_free(ctx, loader->packed);
+        }
+        ST_free(ctx, loader);
+    }
+}
+
+ST_Code *ST_VM_finishLoad(ST_Loader *loader) {
+    ST_Size i;
+    if (loader->format == ST_LOADER_FORMAT_CONTAINER) {
+        for (i = 0; i < ST_VM_SECTION_SLOTS; ++i) {
+            if (!ST_Loader_sectionDone(loader, i)) {
+                loader->format = ST_LOADER_FORMAT_FAILED;
+            }
+        }
+        if (loader->sections[ST_VM_SECTION_DEBUG].present) {
+            loader->code.debugInfo = loader->debug;
+            loader->code.debugLength = loader->debugSize;
+        }
+    }
+    if (loader->format == ST_LOADER_FORMAT_FAILED) {
+        /* Whatever already ran stays, but nothing more will */
+        loader->complete = 0;
+        loader->code.debugInfo = NULL;
+        loader->code.debugLength = 0;
+    }
+    /* Otherwise a truncated last instruction is dropped */
+    loader->code.length = loader->complete;
+    loader->code.loading = 0;
+    ST_Loader_release(loader, (void **)&loader->name, &loader->nameCapacity);
+    return &loader->code;
+}
+
+/* Unsigned LEB128. Stops at the end of the section if it's truncated. */
+static ST_U32 ST_readVarint(const ST_U8 **pos, const ST_U8 *end) {
+    ST_U32 value = 0;
+    unsigned shift = 0;
+    while (*pos < end) {
+        const ST_U8 byte = *(*pos)++;
+        if (shift < 32) {
+            value |= (ST_U32)(byte & 0x7f) << shift;
+        }
+        if (!(byte & 0x80)) {
+            break;
+        }
+        shift += 7;
+    }
+    return value;
+}
+
+static const char *ST_VM_debugString(const ST_U8 *strings, const ST_U8 *end,
+                                     ST_U32 index) {
+    const ST_U8 *pos = strings;
+    while (index--) {
+        while (pos < end && *pos) {
+            ++pos;
+        }
+        ++pos;
+    }
+    return pos < end ? (const char *)pos : NULL;
+}
+
+ST_SourceLocation ST_VM_sourceLocation(const ST_Code *code, ST_Size offset) {
+    const ST_U8 *pos = code->debugInfo;
+    const ST_U8 *end = pos + code->debugLength;
+    const ST_U8 *strings, *stringsEnd;
+    ST_SourceLocation result = {NULL, NULL, 0};
+    ST_U32 stringCount, entryCount, i, start = 0, line = 0;
+    if (!pos || offset >= code->length) {
+        return result;
+    }
+    stringCount = ST_readVarint(&pos, end);
+    strings = pos;
+    for (i = 0; i < stringCount && pos < end; ++i) {
+        while (pos < end && *pos) {
+            ++pos;
+        }
+        ++pos;
+    }
+    stringsEnd = pos;
+    entryCount = ST_readVarint(&pos, end);
+    for (i = 0; i < entryCount && pos < end; ++i) {
+        ST_U32 lineDelta, file, method;
+        start += ST_readVarint(&pos, end);
+        if (start > offset) {
+            break;
+        }
+        /* Zigzag encoded, lines can go backwards between ranges */
+        lineDelta = ST_readVarint(&pos, end);
+        line += (lineDelta >> 1) ^ (ST_U32)-(ST_S32)(lineDelta & 1);
+        file = ST_readVarint(&pos, end);
+        method = ST_readVarint(&pos, end);
+        result.file = ST_VM_debugString(strings, stringsEnd, file);
+        result.method = ST_VM_debugString(strings, stringsEnd, method);
+        result.line = line;
+    }
+    return result;
+}
+
+/*//////////////////////////////////////////////////////////////////////////////
+// Image
+/////////////////////////////////////////////////////////////////////////////*/
+
+/* Image layout, all numbers are native ST_Size unless noted:
+   header:  magic "STIM", size of ST_Size (1 byte), version, symbol count,
+            code count, class count, code storage size
+   symbols: per symbol its null-terminated name, gcMask (1 byte), class
+   code:    per code its length, debug section length, symbol count, method
+            epoch, methods defined, symbol table, then the instructions and
+            debug section bytes (with ST_IMAGE_CODE_SHARED, a flag first and
+            if it is set the addresses of the instructions and debug section
+            instead)
+   classes: per class gcMask, super, name, ivar count, instance size, count
+            of ivar names it adds and the names, method count and methods
+            (selector, type, argc, then a builtin primitive index or a code
+            index and offset)
+   heap:    size, then the heap verbatim, with class and ivar pointers
+            replaced by references
+   globals: count, then symbol and value per global
+   roots:   nil, true, false, the context's class and gcMask, gcDisabled
+            and the method epoch
+   References are an index (or heap offset) shifted left, tagged with the
+   kind of object referred to. */
+
+static const ST_U8 ST_imageMagic[] = {'S', 'T', 'I', 'M'};
+
+/* Where the code of the loaded context lives */
+typedef enum ST_Image_Code {
+    /* In storage of its own, copied from the image */
+    ST_IMAGE_CODE_COPIED,
+    /* In the image, which outlives the context, see ST_snapshotContext.
+       Symbol names stay in the image too. */
+    ST_IMAGE_CODE_IN_IMAGE,
+    /* Where the saved context has it, for workers that die first */
+    ST_IMAGE_CODE_SHARED
+} ST_Image_Code;
+
+enum { ST_IMAGE_VERSION = 3, ST_IMAGE_REF_SHIFT = 3 };
+
+enum ST_Image_RefKind {
+    ST_IMAGE_REF_NULL,
+    ST_IMAGE_REF_HEAP,
+    ST_IMAGE_REF_SYMBOL,
+    ST_IMAGE_REF_CLASS,
+    ST_IMAGE_REF_CONTEXT,
+    ST_IMAGE_REF_MASK = (1 << ST_IMAGE_REF_SHIFT) - 1
+};
+
+/* Primitives are stored as an index into this table, function addresses
+   don't survive into another process. */
+static const ST_PrimitiveMethod ST_builtinPrimitives[] = {
+    ST_new,           ST_subclass,         ST_subclassExtended,
+    ST_class,         ST_nopMethod,        ST_enableGC,
+    ST_disableGC,     ST_Integer_add,      ST_Integer_sub,
+    ST_Integer_mul,   ST_Integer_div,      ST_Integer_rawGet,
+    ST_Integer_rawSet, ST_Array_new,       ST_Array_at,
+    ST_Array_set,     ST_Array_len,        ST_Object_fork,
+    ST_Object_forkAt, ST_Process_terminate, ST_Process_priority,
+    ST_Process_isTerminated, ST_Process_yield, ST_Semaphore_new,
+    ST_Semaphore_signal, ST_Semaphore_wait, ST_Delay_forMilliseconds,
+    ST_Delay_wait,    ST_Mailbox_post,     ST_Mailbox_receive,
+    ST_Array_parallelCollect, ST_Array_parallelSelect,
+    ST_Array_parallelInject};
+
+enum {
+    ST_BUILTIN_PRIMITIVE_COUNT =
+        sizeof ST_builtinPrimitives / sizeof ST_builtinPrimitives[0]
+};
+
+/* Address to index map, keyed like ST_SymbolMap_Entry. The entries are also
+   chained in index order. */
+typedef struct ST_Image_MapEntry {
+    ST_SymbolMap_Entry header;
+    ST_Size index;
+    struct ST_Image_MapEntry *next;
+} ST_Image_MapEntry;
+
+typedef struct ST_Image_Map {
+    ST_Image_MapEntry *tree;
+    ST_Image_MapEntry *first;
+    ST_Image_MapEntry *last;
+    ST_Size count;
+} ST_Image_Map;
+
+typedef struct ST_Image_Writer {
+    ST_Context *ctx;
+    ST_U8 *out;
+    ST_Size capacity;
+    ST_Size size;
+    bool failed;
+    /* For ST_cloneContext: the image is loaded by the same process, so host
+       primitives can be written as function pointers. */
+    bool native;
+    ST_Image_Code code;
+    ST_Pool entryPool;
+    ST_Image_Map symbols;
+    ST_Image_Map classes;
+    ST_Image_Map codes;
+    ST_Size codeStorage;
+} ST_Image_Writer;
+
+typedef struct ST_Image_Visitor {
+    ST_Visitor visitor;
+    ST_Image_Writer *writer;
+    ST_Size count;
+} ST_Image_Visitor;
+
+static ST_Size ST_Image_alignedSize(ST_Size size) {
+    return (size + sizeof(ST_Object) - 1) / sizeof(ST_Object) *
+           sizeof(ST_Object);
+}
+
+/* Instructions, then the debug section if there is one */
+static ST_Size ST_Image_codeBytes(const ST_Code *code) {
+    return code->length + (code->debugInfo ? code->debugLength : 0);
+}
+
+/* Code still loading may move as more of it arrives, so it is copied */
+static bool ST_Image_sharesCode(const ST_Image_Writer *w,
+                                const ST_Code *code) {
+    return w->code == ST_IMAGE_CODE_SHARED && !code->loading;
+}
+
+/* Splays, as the inserts do: symbols come up in about the order they were
+   allocated, and a plain search of what that builds takes as long as the
+   map is */
+static ST_Image_MapEntry *ST_Image_find(ST_Image_Map *map, const void *key) {
+    ST_BiNode **tree = (ST_BiNode **)&map->tree;
+    ST_SymbolMap_Entry searchTmpl;
+    ST_Image_MapEntry *root;
+    if (!*tree) {
+        return NULL;
+    }
+    searchTmpl.symbol = (ST_Object)key;
+    ST_BST_splay(tree, &searchTmpl, ST_SymbolMap_comparator);
+    /* Through tree, which the splay wrote */
+    root = (ST_Image_MapEntry *)*tree;
+    return root->header.symbol == key ? root : NULL;
+}
+
+/* Returns false if the key was already in the map. */
+static bool ST_Image_insert(ST_Image_Writer *w, ST_Image_Map *map,
+                            const void *key) {
+    ST_Image_MapEntry *entry;
+    if (ST_Image_find(map, key)) {
+        return false;
+    }
+    entry = ST_Pool_alloc(w->ctx, &w->entryPool);
+    entry->header.symbol = (ST_Object)key;
+    entry->index = map->count++;
+    entry->next = NULL;
+    if (map->last) {
+        map->last->next = entry;
+    } else {
+        map->first = entry;
+    }
+    map->last = entry;
+    ST_BST_insert((ST_BiNode **)&map->tree, &entry->header.node,
+                  ST_SymbolMap_comparator);
+    ST_BST_splay((ST_BiNode **)&map->tree, &entry->header.node,
+                 ST_SymbolMap_comparator);
+    return true;
+}
+
+static ST_Size ST_Image_ref(ST_Image_Writer *w, const void *ptr) {
+    ST_Context *ctx = w->ctx;
+    ST_Image_MapEntry *entry;
+    if (!ptr) {
+        return ST_IMAGE_REF_NULL;
+    }
+    if (ST_inHeap(ctx, ptr)) {
+        return (ST_Size)((const ST_U8 *)ptr - ctx->heap.begin)
+                   << ST_IMAGE_REF_SHIFT |
+               ST_IMAGE_REF_HEAP;
+    }
+    if (ptr == (void *)ctx) {
+        return ST_IMAGE_REF_CONTEXT;
+    }
+    if ((entry = ST_Image_find(&w->symbols, ptr))) {
+        return entry->index << ST_IMAGE_REF_SHIFT | ST_IMAGE_REF_SYMBOL;
+    }
+    if ((entry = ST_Image_find(&w->classes, ptr))) {
+        return entry->index << ST_IMAGE_REF_SHIFT | ST_IMAGE_REF_CLASS;
+    }
+    w->failed = true;
+    return ST_IMAGE_REF_NULL;
+}
+
+static void ST_Image_write(ST_Image_Writer *w, const void *data, ST_Size n) {
+    if (w->out && w->size + n <= w->capacity) {
+        ST_memcpy(w->ctx, w->out + w->size, data, n);
+    }
+    w->size += n;
+}
+
+static void ST_Image_writeSize(ST_Image_Writer *w, ST_Size value) {
+    ST_Image_write(w, &value, sizeof value);
+}
+
+static void ST_Image_writeRef(ST_Image_Writer *w, const void *ptr) {
+    ST_Image_writeSize(w, ST_Image_ref(w, ptr));
+}
+
+static void ST_Image_addClass(ST_Image_Writer *w, ST_Class *class) {
+    while (class && ST_Image_insert(w, &w->classes, class)) {
+        class = class->super;
+    }
+}
+
+/* Collects the class if value is one. Heap objects, symbols and the context
+   get their classes collected along with them. */
+static void ST_Image_addValue(ST_Image_Writer *w, ST_Internal_Object *value) {
+    if (value && !ST_inHeap(w->ctx, value) &&
+        value != (void *)w->ctx && !ST_Image_find(&w->symbols, value) &&
+        ST_isClass(value)) {
+        ST_Image_addClass(w, (ST_Class *)value);
+    }
+}
+
+static void ST_Image_collectSymbol(ST_Visitor *visitor, void *node) {
+    ST_Image_Writer *w = ((ST_Image_Visitor *)visitor)->writer;
+    ST_Image_insert(w, &w->symbols, ((ST_StringMap_Entry *)node)->value);
+}
+
+static void ST_Image_collectGlobal(ST_Visitor *visitor, void *node) {
+    ST_Image_addValue(((ST_Image_Visitor *)visitor)->writer,
+                      ((ST_GlobalVarMap_Entry *)node)->value);
+}
+
+static ST_Size ST_Image_primitiveIndex(ST_PrimitiveMethod primitive) {
+    ST_Size i;
+    for (i = 0; i < ST_BUILTIN_PRIMITIVE_COUNT; ++i) {
+        if (ST_builtinPrimitives[i] == primitive) {
+            break;
+        }
+    }
+    return i;
+}
+
+static void ST_Image_collectMethod(ST_Visitor *visitor, void *node) {
+    ST_Image_Writer *w = ((ST_Image_Visitor *)visitor)->writer;
+    ST_Internal_Method *method = &((ST_MethodMap_Entry *)node)->method;
+    if (method->type == ST_METHOD_TYPE_COMPILED) {
+        const ST_Code *code = method->payload.compiledMethod.source;
+        if (ST_Image_insert(w, &w->codes, code)) {
+            w->codeStorage += sizeof(ST_Code) +
+                              code->symbolCount * sizeof(ST_Object);
+            if (w->code != ST_IMAGE_CODE_IN_IMAGE &&
+                !ST_Image_sharesCode(w, code)) {
+                w->codeStorage +=
+                    ST_Image_alignedSize(ST_Image_codeBytes(code));
+            }
+        }
+    } else if (!w->native &&
+               ST_Image_primitiveIndex(method->payload.primitiveMethod) ==
+                   ST_BUILTIN_PRIMITIVE_COUNT) {
+        w->failed = true;
+    }
+    ++((ST_Image_Visitor *)visitor)->count;
+}
+
+static void ST_Image_collect(ST_Image_Writer *w) {
+    ST_Context *ctx = w->ctx;
+    /* Mailboxes live outside the context, only a clone can point to them */
+    const ST_Class *cMailbox = ST_getGlobal(ctx, ST_symb(ctx, "Mailbox"));
+    ST_Image_Visitor visitor;
+    ST_Image_MapEntry *entry;
+    ST_Internal_Object *current;
+    visitor.writer = w;
+    visitor.visitor.visit = ST_Image_collectSymbol;
+    ST_BST_traverse((ST_BiNode *)ctx->symbolRegistry, (ST_Visitor *)&visitor);
+    ST_Image_addClass(w, ctx->object.object.class);
+    for (entry = w->symbols.first; entry; entry = entry->next) {
+        ST_Image_addClass(
+            w, ((ST_Internal_Object *)entry->header.symbol)->class);
+    }
+    for (current = (ST_Internal_Object *)ctx->heap.begin;
+         (ST_U8 *)current < ctx->heap.end;
+         current = (ST_Internal_Object *)((ST_U8 *)current +
+                                          current->class->instanceSize)) {
+        ST_Internal_Object **ivars = ST_Object_getIVars(current);
+        ST_Size i;
+        if (!w->native && current->class == cMailbox) {
+            w->failed = true;
+        }
+        ST_Image_addClass(w, current->class);
+        for (i = 0; i < current->class->instanceVariableCount; ++i) {
+            ST_Image_addValue(w, ivars[i]);
+        }
+    }
+    visitor.visitor.visit = ST_Image_collectGlobal;
+    ST_BST_traverse((ST_BiNode *)ctx->globalScope, (ST_Visitor *)&visitor);
+    visitor.visitor.visit = ST_Image_collectMethod;
+    for (entry = w->classes.first; entry; entry = entry->next) {
+        ST_BST_traverse(
+            (ST_BiNode *)((ST_Class *)entry->header.symbol)->methodTree,
+            (ST_Visitor *)&visitor);
+    }
+}
+
+static void ST_Image_writeSymbol(ST_Visitor *visitor, void *node) {
+    ST_Image_Writer *w = ((ST_Image_Visitor *)visitor)->writer;
+    ST_StringMap_Entry *entry = node;
+    ST_Internal_Object *symbol = entry->value;
+    ST_Image_write(w, entry->key, ST_strlen(entry->key) + 1);
+    ST_Image_write(w, &symbol->gcMask, sizeof symbol->gcMask);
+    ST_Image_writeRef(w, symbol->class);
+}
+
+static void ST_Image_writeCode(ST_Image_Writer *w, const ST_Code *code) {
+    ST_Size i;
+    ST_Image_writeSize(w, code->length);
+    ST_Image_writeSize(w, ST_Image_codeBytes(code) - code->length);
+    ST_Image_writeSize(w, code->symbolCount);
+    ST_Image_writeSize(w, code->methodsDefined);
+    for (i = 0; i < code->symbolCount; ++i) {
+        ST_Image_writeRef(w, code->symbTab[i]);
+    }
+    if (w->code == ST_IMAGE_CODE_SHARED) {
+        ST_Image_writeSize(w, ST_Image_sharesCode(w, code));
+    }
+    if (ST_Image_sharesCode(w, code)) {
+        ST_Image_write(w, &code->instructions, sizeof code->instructions);
+        ST_Image_write(w, &code->debugInfo, sizeof code->debugInfo);
+        return;
+    }
+    ST_Image_write(w, code->instructions, code->length);
+    if (code->debugInfo) {
+        ST_Image_write(w, code->debugInfo, code->debugLength);
+    }
+}
+
+static void ST_Image_writeMethod(ST_Visitor *visitor, void *node) {
+    ST_Image_Writer *w = ((ST_Image_Visitor *)visitor)->writer;
+    ST_MethodMap_Entry *entry = node;
+    ST_Internal_Method *method = &entry->method;
+    ST_Image_writeRef(w, entry->header.symbol);
+    ST_Image_writeSize(w, method->type);
+    ST_Image_writeSize(w, method->argc);
+    if (method->type == ST_METHOD_TYPE_COMPILED) {
+        ST_Image_writeSize(
+            w, ST_Image_find(&w->codes, method->payload.compiledMethod.source)
+                   ->index);
+        ST_Image_writeSize(w, method->payload.compiledMethod.offset);
+        ST_Image_writeSize(w, method->payload.compiledMethod.definition);
+    } else {
+        const ST_Size index =
+            ST_Image_primitiveIndex(method->payload.primitiveMethod);
+        ST_Image_writeSize(w, index);
+        if (index == ST_BUILTIN_PRIMITIVE_COUNT) {
+            ST_Image_write(w, &method->payload.primitiveMethod,
+                           sizeof method->payload.primitiveMethod);
+        }
+    }
+}
+
+static void ST_Image_countNode(ST_Visitor *visitor, void *node) {
+    ++((ST_Image_Visitor *)visitor)->count;
+}
+
+static void ST_Image_writeClass(ST_Image_Writer *w, ST_Class *class) {
+    const ST_Size superIvars =
+        class->super ? class->super->instanceVariableCount : 0;
+    const ST_Size namedIvars = class->instanceVariableNames
+                                   ? class->instanceVariableCount - superIvars
+                                   : 0;
+    ST_Image_Visitor visitor;
+    ST_Size i;
+    ST_Image_writeSize(w, class->object.gcMask);
+    ST_Image_writeRef(w, class->super);
+    ST_Image_writeRef(w, class->name);
+    ST_Image_writeSize(w, class->instanceVariableCount);
+    ST_Image_writeSize(w, class->instanceSize);
+    ST_Image_writeSize(w, namedIvars);
+    for (i = 0; i < namedIvars; ++i) {
+        ST_Image_writeRef(w, class->instanceVariableNames[i]);
+    }
+    visitor.writer = w;
+    visitor.count = 0;
+    visitor.visitor.visit = ST_Image_countNode;
+    ST_BST_traverse((ST_BiNode *)class->methodTree, (ST_Visitor *)&visitor);
+    ST_Image_writeSize(w, visitor.count);
+    visitor.visitor.visit = ST_Image_writeMethod;
+    ST_BST_traverse((ST_BiNode *)class->methodTree, (ST_Visitor *)&visitor);
+}
+
+static void ST_Image_writeHeap(ST_Image_Writer *w) {
+    ST_Context *ctx = w->ctx;
+    ST_Internal_Object *current = (ST_Internal_Object *)ctx->heap.begin;
+    ST_Image_writeSize(w, ctx->heap.end - ctx->heap.begin);
+    while ((ST_U8 *)current < ctx->heap.end) {
+        const ST_Class *class = current->class;
+        const ST_Size ivarsEnd = ST_getObjectFootprint(
+            class->instanceVariableCount);
+        ST_Internal_Object **ivars = ST_Object_getIVars(current);
+        ST_Size i;
+        ST_Internal_Object header;
+        ST_memset(ctx, &header, 0, sizeof header); /* No stray padding */
+        header.gcMask = current->gcMask;
+        ST_Image_writeRef(w, class);
+        ST_Image_write(w, (ST_U8 *)&header + sizeof(ST_Class *),
+                       sizeof header - sizeof(ST_Class *));
+        for (i = 0; i < class->instanceVariableCount; ++i) {
+            ST_Image_writeRef(w, ivars[i]);
+        }
+        /* Raw payload, e.g. the value of an Integer */
+        ST_Image_write(w, (ST_U8 *)current + ivarsEnd,
+                       class->instanceSize - ivarsEnd);
+        current = (ST_Internal_Object *)((ST_U8 *)current +
+                                         class->instanceSize);
+    }
+}
+
+static void ST_Image_writeGlobal(ST_Visitor *visitor, void *node) {
+    ST_Image_Writer *w = ((ST_Image_Visitor *)visitor)->writer;
+    ST_Image_writeRef(w, ((ST_GlobalVarMap_Entry *)node)->header.symbol);
+    ST_Image_writeRef(w, ((ST_GlobalVarMap_Entry *)node)->value);
+}
+
+static ST_Size ST_Image_save(ST_Context *ctx, ST_U8 *buffer,
+                             ST_Size capacity, bool native,
+                             ST_Image_Code code) {
+    ST_Image_Writer w;
+    ST_Image_Visitor visitor;
+    ST_Image_MapEntry *entry;
+    const ST_U8 sizeofSize = sizeof(ST_Size);
+    if (ctx->stackFrame->parent || ST_stackSize(ctx) || ctx->processes) {
+        return 0;
+    }
+    ST_memset(ctx, &w, 0, sizeof w);
+    w.ctx = ctx;
+    w.out = buffer;
+    w.capacity = capacity;
+    w.native = native;
+    w.code = code;
+    ST_Pool_init(ctx, &w.entryPool, sizeof(ST_Image_MapEntry), 512);
+    ST_Image_collect(&w);
+
+    ST_Image_write(&w, ST_imageMagic, sizeof ST_imageMagic);
+    ST_Image_write(&w, &sizeofSize, sizeof sizeofSize);
+    ST_Image_writeSize(&w, ST_IMAGE_VERSION);
+    ST_Image_writeSize(&w, w.symbols.count);
+    ST_Image_writeSize(&w, w.codes.count);
+    ST_Image_writeSize(&w, w.classes.count);
+    ST_Image_writeSize(&w, w.codeStorage);
+
+    visitor.writer = &w;
+    visitor.visitor.visit = ST_Image_writeSymbol;
+    ST_BST_traverse((ST_BiNode *)ctx->symbolRegistry, (ST_Visitor *)&visitor);
+    for (entry = w.codes.first; entry; entry = entry->next) {
+        ST_Image_writeCode(&w, entry->header.symbol);
+    }
+    for (entry = w.classes.first; entry; entry = entry->next) {
+        ST_Image_writeClass(&w, entry->header.symbol);
+    }
+    ST_Image_writeHeap(&w);
+
+    visitor.count = 0;
+    visitor.visitor.visit = ST_Image_countNode;
+    ST_BST_traverse((ST_BiNode *)ctx->globalScope, (ST_Visitor *)&visitor);
+    ST_Image_writeSize(&w, visitor.count);
+    visitor.visitor.visit = ST_Image_writeGlobal;
+    ST_BST_traverse((ST_BiNode *)ctx->globalScope, (ST_Visitor *)&visitor);
+
+    ST_Image_writeRef(&w, ctx->nilValue);
+    ST_Image_writeRef(&w, ctx->trueValue);
+    ST_Image_writeRef(&w, ctx->falseValue);
+    ST_Image_writeRef(&w, ctx->object.object.class);
+    ST_Image_writeSize(&w, ctx->object.object.gcMask);
+    ST_Image_writeSize(&w, ctx->gcDisabled);
+    ST_Image_writeSize(&w, ctx->methodEpoch);
+
+    ST_Pool_release(ctx, &w.entryPool);
+    return w.failed ? 0 : w.size;
+}
+
+ST_Size ST_saveImage(ST_Object context, ST_U8 *buffer, ST_Size capacity) {
+    return ST_Image_save(context, buffer, capacity, false,
+                         ST_IMAGE_CODE_COPIED);
+}
+
+typedef struct ST_Image_Reader {
+    ST_Context *ctx;
+    const ST_U8 *pos;
+    const ST_U8 *end;
+    bool failed;
+    bool native;
+    ST_Image_Code code;
+    ST_Internal_Object **symbols;
+    ST_Size symbolCount;
+    ST_Class **classes;
+    ST_Size classCount;
+    ST_Code *codes;
+    ST_Size codeCount;
+    /* Entries of the table being read, and as many again to sort them */
+    ST_BiNode **nodes;
+    /* A bit for each byte of the heap that starts an object, NULL until the
+       heap has been walked */
+    ST_U8 *objectStarts;
+} ST_Image_Reader;
+
+static void ST_Image_read(ST_Image_Reader *r, void *dest, ST_Size n) {
+    if (r->failed || (ST_Size)(r->end - r->pos) < n) {
+        r->failed = true;
+        ST_memset(r->ctx, dest, 0, n);
+        return;
+    }
+    ST_memcpy(r->ctx, dest, r->pos, n);
+    r->pos += n;
+}
+
+static ST_Size ST_Image_readSize(ST_Image_Reader *r) {
+    ST_Size value;
+    ST_Image_read(r, &value, sizeof value);
+    return value;
+}
+
+static void *ST_Image_deref(ST_Image_Reader *r, ST_Size ref) {
+    const ST_Size index = ref >> ST_IMAGE_REF_SHIFT;
+    switch (ref & ST_IMAGE_REF_MASK) {
+    case ST_IMAGE_REF_NULL:
+        return NULL;
+
+    case ST_IMAGE_REF_HEAP:
+        if (r->objectStarts &&
+            index < (ST_Size)(r->ctx->heap.end - r->ctx->heap.begin) &&
+            r->objectStarts[index / 8] & 1 << index % 8) {
+            return r->ctx->heap.begin + index;
+        }
+        break;
+
+    case ST_IMAGE_REF_SYMBOL:
+        if (index < r->symbolCount) {
+            return r->symbols[index];
+        }
+        break;
+
+    case ST_IMAGE_REF_CLASS:
+        if (index < r->classCount) {
+            return r->classes[index];
+        }
+        break;
+
+    case ST_IMAGE_REF_CONTEXT:
+        return r->ctx;
     }
+    r->failed = true;
+    return NULL;
 }
 
-typedef struct ST_GC_Visitor {
-    ST_Visitor visitor;
-    ST_Context *ctx;
-} ST_GC_Visitor;
+static void *ST_Image_readRef(ST_Image_Reader *r) {
+    return ST_Image_deref(r, ST_Image_readSize(r));
+}
 
-static void ST_GC_visitGVar(ST_Visitor *visitor, void *gvar) {
-    ST_GC_markObject(((ST_GC_Visitor *)visitor)->ctx,
-                     ((ST_GlobalVarMap_Entry *)gvar)->value);
+/* The symbols were saved in order, so the registry is built from them as
+   they are, once their names are known to be in order */
+static void ST_Image_readSymbols(ST_Image_Reader *r) {
+    ST_Context *ctx = r->ctx;
+    char *last = NULL;
+    ST_Size i;
+    for (i = 0; i < r->symbolCount && !r->failed; ++i) {
+        /* Never written through, see ST_Context_freeName */
+        char *name = (char *)r->pos;
+        ST_StringMap_Entry *entry;
+        ST_Internal_Object *symbol;
+        while (r->pos < r->end && *r->pos) {
+            ++r->pos;
+        }
+        if (r->pos == r->end ||
+            (last && ST_strcmp(last, name) != ST_Cmp_Less)) {
+            r->failed = true;
+            break;
+        }
+        ++r->pos;
+        last = name;
+        symbol = ST_Pool_alloc(ctx, &ctx->symbolPool);
+        ST_Image_read(r, &symbol->gcMask, sizeof symbol->gcMask);
+        symbol->class = ST_Image_readRef(r);
+        entry = ST_Pool_alloc(ctx, &ctx->strmapNodePool);
+        entry->key =
+            r->code == ST_IMAGE_CODE_IN_IMAGE ? name : ST_strdup(ctx, name);
+        entry->value = symbol;
+        r->symbols[i] = symbol;
+        r->nodes[i] = &entry->nodeHeader;
+    }
+    ctx->symbolRegistry = (ST_StringMap_Entry *)ST_BST_build(r->nodes, i);
 }
 
-static void ST_GC_mark(ST_Context *ctx) {
-    ST_Size opStackSize = ST_stackSize(ctx);
+/* Sorts the count entries in r->nodes into a tree, failing on
+   duplicates */
+static ST_BiNode *ST_Image_buildTree(ST_Image_Reader *r, ST_Size count) {
     ST_Size i;
-    ST_GC_Visitor visitor;
-    for (i = 0; i < opStackSize; ++i) {
-        ST_GC_markObject(ctx, ctx->operandStack.base[i]);
+    ST_BST_sort(r->nodes, r->nodes + count, count, ST_SymbolMap_comparator);
+    for (i = 1; i < count; ++i) {
+        if (ST_SymbolMap_comparator(r->nodes[i - 1], r->nodes[i]) ==
+            ST_Cmp_Eq) {
+            r->failed = true;
+        }
     }
-    visitor.ctx = ctx;
-    visitor.visitor.visit = ST_GC_visitGVar;
-    ST_BST_traverse((ST_BiNode *)ctx->globalScope, (ST_Visitor *)&visitor);
+    return ST_BST_build(r->nodes, count);
 }
 
-typedef struct ST_GC_CompactionBreak {
-    ST_BiNode node;
-    ST_U8 *gapAddr;
-    ST_Size gapSize;
-} ST_GC_CompactionBreak;
+static void ST_Image_readCode(ST_Image_Reader *r, ST_U8 **storage,
+                              const ST_U8 *storageEnd) {
+    ST_Size i, j;
+    for (i = 0; i < r->codeCount && !r->failed; ++i) {
+        ST_Code *code = &r->codes[i];
+        ST_U8 *instructions;
+        const ST_Size length = ST_Image_readSize(r);
+        const ST_Size debugLength = ST_Image_readSize(r);
+        code->symbolCount = ST_Image_readSize(r);
+        code->methodsDefined = ST_Image_readSize(r);
+        code->loading = 0;
+        code->length = length;
+        code->debugLength = debugLength;
+        if ((ST_Size)(storageEnd - *storage) / sizeof(ST_Object) <
+            code->symbolCount) {
+            r->failed = true;
+            return;
+        }
+        code->symbTab = (ST_Object *)*storage;
+        *storage += code->symbolCount * sizeof(ST_Object);
+        for (j = 0; j < code->symbolCount; ++j) {
+            code->symbTab[j] = ST_Image_readRef(r);
+        }
+        if (r->code == ST_IMAGE_CODE_SHARED && ST_Image_readSize(r)) {
+            ST_Image_read(r, &code->instructions, sizeof code->instructions);
+            ST_Image_read(r, &code->debugInfo, sizeof code->debugInfo);
+            continue;
+        }
+        if (r->code == ST_IMAGE_CODE_IN_IMAGE) {
+            if ((ST_Size)(r->end - r->pos) < length + debugLength) {
+                r->failed = true;
+                return;
+            }
+            code->instructions = r->pos;
+            code->debugInfo = debugLength ? r->pos + length : NULL;
+            r->pos += length + debugLength;
+            continue;
+        }
+        if ((ST_Size)(storageEnd - *storage) <
+            ST_Image_alignedSize(length + debugLength)) {
+            r->failed = true;
+            return;
+        }
+        instructions = *storage;
+        *storage += ST_Image_alignedSize(length + debugLength);
+        ST_Image_read(r, instructions, length + debugLength);
+        code->instructions = instructions;
+        code->debugInfo = debugLength ? instructions + length : NULL;
+    }
+}
 
-typedef struct ST_GC_CompactionState {
-    ST_GC_CompactionBreak *breakList;
-    ST_Pool breakPool;
-} ST_GC_CompactionState;
+static void ST_Image_readMethods(ST_Image_Reader *r, ST_Class *class) {
+    ST_Context *ctx = r->ctx;
+    const ST_Size count = ST_Image_readSize(r);
+    ST_Size i;
+    /* Selectors are symbols, and a class has one method for each at most */
+    if (count > r->symbolCount) {
+        r->failed = true;
+        return;
+    }
+    for (i = 0; i < count && !r->failed; ++i) {
+        ST_MethodMap_Entry *entry = ST_Pool_alloc(ctx, &ctx->methodNodePool);
+        ST_Internal_Method *method = &entry->method;
+        ST_Size index;
+        entry->header.symbol = ST_Image_readRef(r);
+        method->type = ST_Image_readSize(r);
+        method->argc = (ST_U8)ST_Image_readSize(r);
+        index = ST_Image_readSize(r);
+        if (method->type == ST_METHOD_TYPE_COMPILED && index < r->codeCount) {
+            method->payload.compiledMethod.source = &r->codes[index];
+            method->payload.compiledMethod.offset = ST_Image_readSize(r);
+            method->payload.compiledMethod.definition = ST_Image_readSize(r);
+            r->failed = r->failed || method->payload.compiledMethod.offset >=
+                                         r->codes[index].length;
+        } else if (method->type == ST_METHOD_TYPE_PRIMITIVE &&
+                   index < ST_BUILTIN_PRIMITIVE_COUNT) {
+            method->payload.primitiveMethod = ST_builtinPrimitives[index];
+        } else if (method->type == ST_METHOD_TYPE_PRIMITIVE && r->native &&
+                   index == ST_BUILTIN_PRIMITIVE_COUNT) {
+            ST_Image_read(r, &method->payload.primitiveMethod,
+                          sizeof method->payload.primitiveMethod);
+        } else {
+            r->failed = true;
+        }
+        r->nodes[i] = &entry->header.node;
+    }
+    class->methodTree = (ST_MethodMap_Entry *)ST_Image_buildTree(r, i);
+}
 
-static ST_Internal_Object *
-ST_GC_remapObjectAddr(ST_Context *ctx, ST_GC_CompactionBreak *brLstEnd,
-                      ST_Internal_Object *obj) {
-    ST_Size shiftAmount = 0;
-    if ((ST_U8 *)obj >= ctx->heap.begin && (ST_U8 *)obj < ctx->heap.end) {
-        ST_GC_CompactionBreak *current = brLstEnd;
-        while (current && current->gapAddr < (ST_U8 *)obj) {
-            shiftAmount += current->gapSize;
-            ST_List_prev((ST_BiNode **)&current);
+/* Whether following each class's superclass, by index, ends rather than
+   coming back around. walks tells which walk got to a class first, a class
+   an earlier one got to is known to end. */
+static bool ST_Image_superclassesEnd(const ST_Size *supers, ST_Size *walks,
+                                     ST_Size count) {
+    ST_Size i, j;
+    for (i = 0; i < count; ++i) {
+        walks[i] = 0;
+    }
+    for (i = 0; i < count; ++i) {
+        for (j = i; j < count && !walks[j]; j = supers[j]) {
+            walks[j] = i + 1;
+        }
+        if (j < count && walks[j] == i + 1) {
+            return false;
         }
     }
-    return (ST_Internal_Object *)((ST_U8 *)obj - shiftAmount);
+    return true;
 }
 
-static void ST_GC_compactHeap(ST_Context *ctx, ST_GC_CompactionState *cpState) {
-    ST_Internal_Object *current = (ST_Internal_Object *)ctx->heap.begin;
-    ST_Size bytesCompacted = 0;
-    while ((ST_U8 *)current < ctx->heap.end) {
-        enum { LIVE_OBJ_MASK = ST_GC_MASK_MARKED | ST_GC_MASK_PRESERVE };
-        const ST_Size currentSize = current->class->instanceSize;
-        if (current->gcMask & LIVE_OBJ_MASK) {
-            if (bytesCompacted) {
-                ST_U8 *targetAddr = (ST_U8 *)current - bytesCompacted;
-                ST_memmove(ctx, targetAddr, current, currentSize);
-            }
-            ST_Object_unsetGCMask(current, ST_GC_MASK_MARKED);
-        } else /* current is a dead object */ {
-            const bool adjacentDealloc =
-                cpState->breakList &&
-                cpState->breakList->gapAddr + cpState->breakList->gapSize ==
-                    (ST_U8 *)current;
-            if (adjacentDealloc) {
-                cpState->breakList->gapSize += currentSize;
-            } else {
-                ST_GC_CompactionBreak *cbreak =
-                    ST_Pool_alloc(ctx, &cpState->breakPool);
-                cbreak->gapAddr = (ST_U8 *)current;
-                cbreak->gapSize = currentSize;
-                ST_List_insert((ST_BiNode **)&cpState->breakList,
-                               (ST_BiNode *)cbreak);
-            }
-            bytesCompacted += currentSize;
+static void ST_Image_readClasses(ST_Image_Reader *r) {
+    /* Superclass indices, classCount for none, and room to check them */
+    ST_Size *supers =
+        ST_alloc(r->ctx, 2 * (r->classCount + 1) * sizeof *supers);
+    ST_Size i, j;
+    for (i = 0; i < r->classCount && !r->failed; ++i) {
+        ST_Class *class = r->classes[i];
+        ST_Size superRef, namedIvars;
+        class->object.class = class;
+        class->object.gcMask = (ST_U8)ST_Image_readSize(r);
+        class->methodTree = NULL;
+        superRef = ST_Image_readSize(r);
+        class->super = ST_Image_deref(r, superRef);
+        supers[i] = class->super ? superRef >> ST_IMAGE_REF_SHIFT
+                                 : r->classCount;
+        class->name = ST_Image_readRef(r);
+        class->instanceVariableCount = (ST_U16)ST_Image_readSize(r);
+        class->instanceSize = ST_Image_readSize(r);
+        namedIvars = ST_Image_readSize(r);
+        if ((class->super &&
+             (superRef & ST_IMAGE_REF_MASK) != ST_IMAGE_REF_CLASS) ||
+            class->instanceSize <
+                ST_getObjectFootprint(class->instanceVariableCount) ||
+            namedIvars > class->instanceVariableCount) {
+            r->failed = true;
+            break;
         }
-        current = (ST_Internal_Object *)((ST_U8 *)current + currentSize);
+        class->instanceVariableNames =
+            namedIvars ? ST_alloc(r->ctx, namedIvars * sizeof(ST_Object))
+                       : NULL;
+        for (j = 0; j < namedIvars; ++j) {
+            class->instanceVariableNames[j] = ST_Image_readRef(r);
+        }
+        ST_Image_readMethods(r, class);
     }
-    ctx->heap.end = ctx->heap.end - bytesCompacted;
+    r->failed = r->failed || !ST_Image_superclassesEnd(
+                                 supers, supers + r->classCount + 1,
+                                 r->classCount);
+    ST_free(r->ctx, supers);
 }
 
-static void ST_GC_remapIVars(ST_Context *ctx, ST_GC_CompactionBreak *brLstEnd) {
-    ST_Internal_Object *current = (ST_Internal_Object *)ctx->heap.begin;
-    while ((ST_U8 *)current < ctx->heap.end) {
-        const ST_Size currentSize = current->class->instanceSize;
+static void ST_Image_readHeap(ST_Image_Reader *r) {
+    ST_Context *ctx = r->ctx;
+    const ST_Size heapSize = ST_Image_readSize(r);
+    ST_Internal_Object *current;
+    ST_U8 *objectStarts;
+    if (r->failed || heapSize > ctx->config.memory.heapCapacity ||
+        (ST_Size)(r->end - r->pos) < heapSize) {
+        r->failed = true;
+        return;
+    }
+    /* One copy, then patch the references in place: the classes first,
+       which tells where objects start, and then what refers to them */
+    ST_memcpy(ctx, ctx->heap.begin, r->pos, heapSize);
+    r->pos += heapSize;
+    ctx->heap.end = ctx->heap.begin + heapSize;
+    objectStarts = ST_alloc(ctx, heapSize / 8 + 1);
+    ST_memset(ctx, objectStarts, 0, heapSize / 8 + 1);
+    current = (ST_Internal_Object *)ctx->heap.begin;
+    while ((ST_U8 *)current < ctx->heap.end && !r->failed) {
+        const ST_Size offset = (ST_U8 *)current - ctx->heap.begin;
+        ST_Class *class = ST_Image_deref(r, (ST_Size)current->class);
+        if (!class || (ST_Size)(ctx->heap.end - (ST_U8 *)current) <
+                          class->instanceSize) {
+            r->failed = true;
+            break;
+        }
+        current->class = class;
+        objectStarts[offset / 8] |= 1 << offset % 8;
+        current = (ST_Internal_Object *)((ST_U8 *)current +
+                                         class->instanceSize);
+    }
+    r->objectStarts = objectStarts;
+    current = (ST_Internal_Object *)ctx->heap.begin;
+    while ((ST_U8 *)current < ctx->heap.end && !r->failed) {
         ST_Internal_Object **ivars = ST_Object_getIVars(current);
         ST_Size i;
         for (i = 0; i < current->class->instanceVariableCount; ++i) {
-            const ST_Object newAddr =
-                ST_GC_remapObjectAddr(ctx, brLstEnd, ivars[i]);
-            ivars[i] = newAddr;
+            ivars[i] = ST_Image_deref(r, (ST_Size)ivars[i]);
         }
-        current = (ST_Internal_Object *)((ST_U8 *)current + currentSize);
+        current = (ST_Internal_Object *)((ST_U8 *)current +
+                                         current->class->instanceSize);
     }
 }
 
-typedef struct ST_GC_RemapVisitor {
+static void ST_Image_readGlobals(ST_Image_Reader *r) {
+    ST_Context *ctx = r->ctx;
+    const ST_Size count = ST_Image_readSize(r);
+    ST_Size i, defined = 0;
+    if (count > r->symbolCount) {
+        r->failed = true;
+        return;
+    }
+    for (i = 0; i < count && !r->failed; ++i) {
+        ST_GlobalVarMap_Entry *entry =
+            ST_Pool_alloc(ctx, &ctx->gvarNodePool);
+        entry->header.symbol = ST_Image_readRef(r);
+        entry->value = ST_Image_readRef(r);
+        if (entry->value) {
+            r->nodes[defined++] = &entry->header.node;
+        } else {
+            ST_Pool_free(ctx, &ctx->gvarNodePool, entry);
+        }
+    }
+    ctx->globalScope =
+        (ST_GlobalVarMap_Entry *)ST_Image_buildTree(r, defined);
+}
+
+static ST_Context *ST_Image_load(const ST_Configuration *config,
+                                const ST_U8 *data, ST_Size len, bool native,
+                                ST_Image_Code code) {
+    ST_Context *ctx;
+    ST_Image_Reader r;
+    ST_U8 magic[sizeof ST_imageMagic], sizeofSize, *storage;
+    ST_Size i, codeStorage;
+    ctx = ST_Context_allocate(config);
+    if (!ctx) {
+        return NULL;
+    }
+    ST_memset(ctx, &r, 0, sizeof r);
+    r.ctx = ctx;
+    r.pos = data;
+    r.end = data + len;
+    r.native = native;
+    r.code = code;
+    ST_Image_read(&r, magic, sizeof magic);
+    ST_Image_read(&r, &sizeofSize, sizeof sizeofSize);
+    for (i = 0; i < sizeof magic; ++i) {
+        r.failed = r.failed || magic[i] != ST_imageMagic[i];
+    }
+    if (r.failed || sizeofSize != sizeof(ST_Size) ||
+        ST_Image_readSize(&r) != ST_IMAGE_VERSION) {
+        ST_Context_free(ctx);
+        return NULL;
+    }
+    r.symbolCount = ST_Image_readSize(&r);
+    r.codeCount = ST_Image_readSize(&r);
+    r.classCount = ST_Image_readSize(&r);
+    codeStorage = ST_Image_readSize(&r);
+    /* Every record takes at least a byte, which bounds the counts before
+       anything gets allocated for them. */
+    if (r.failed || r.symbolCount > len || r.codeCount > len ||
+        r.classCount > len || codeStorage / sizeof(ST_Code) < r.codeCount) {
+        ST_Context_free(ctx);
+        return NULL;
+    }
+    r.symbols = ST_alloc(ctx, (r.symbolCount + 1) * sizeof(ST_Object));
+    r.classes = ST_alloc(ctx, (r.classCount + 1) * sizeof(ST_Class *));
+    r.nodes = ST_alloc(ctx, 2 * (r.symbolCount + 1) * sizeof(ST_BiNode *));
+    if (code == ST_IMAGE_CODE_IN_IMAGE) {
+        ctx->imageBegin = data;
+        ctx->imageEnd = data + len;
+    }
+    ctx->imageCode = ST_alloc(ctx, codeStorage + 1);
+    r.codes = (ST_Code *)ctx->imageCode;
+    storage = ctx->imageCode + r.codeCount * sizeof(ST_Code);
+    for (i = 0; i < r.classCount; ++i) {
+        r.classes[i] = ST_Pool_alloc(ctx, &ctx->classPool);
+        r.classes[i]->methodTree = NULL;
+    }
+    ST_Image_readSymbols(&r);
+    ST_Image_readCode(&r, &storage, ctx->imageCode + codeStorage);
+    ST_Image_readClasses(&r);
+    ST_Image_readHeap(&r);
+    ST_Image_readGlobals(&r);
+    ctx->nilValue = ST_Image_readRef(&r);
+    ctx->trueValue = ST_Image_readRef(&r);
+    ctx->falseValue = ST_Image_readRef(&r);
+    ctx->object.object.class = ST_Image_readRef(&r);
+    ctx->object.object.gcMask = (ST_U8)ST_Image_readSize(&r);
+    ctx->gcDisabled = ST_Image_readSize(&r) != 0;
+    ctx->methodEpoch = ST_Image_readSize(&r);
+    ST_free(ctx, r.symbols);
+    ST_free(ctx, r.classes);
+    ST_free(ctx, r.nodes);
+    if (r.objectStarts) {
+        ST_free(ctx, r.objectStarts);
+    }
+    if (r.failed) {
+        ST_Context_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+ST_Object ST_loadImage(const ST_Configuration *config, const ST_U8 *data,
+                       ST_Size len) {
+    return ST_Image_load(config, data, len, false, ST_IMAGE_CODE_COPIED);
+}
+
+#ifdef ST_BOOT_IMAGE
+/* For the boot image, which is static: the context keeps its code and
+   symbol names there rather than copies */
+static ST_Context *ST_Image_loadStatic(const ST_Configuration *config,
+                                      const ST_U8 *data, ST_Size len) {
+    return ST_Image_load(config, data, len, false, ST_IMAGE_CODE_IN_IMAGE);
+}
+#endif
+
+/* Clones live on their own, apart from any arena */
+static ST_Configuration ST_Context_cloneConfig(const ST_Context *ctx) {
+    ST_Configuration config = ctx->config;
+    config.memory.userAllocFn = NULL;
+    config.memory.userFreeFn = NULL;
+    config.memory.releaseFn = NULL;
+    config.memory.user = NULL;
+    return config;
+}
+
+/* A snapshot restored straight away, through a buffer that only lives for
+   the copy. Clones that share the code must not outlive the context. */
+static ST_Context *ST_Context_clone(ST_Context *ctx, bool shareCode) {
+    const ST_Image_Code code =
+        shareCode ? ST_IMAGE_CODE_SHARED : ST_IMAGE_CODE_COPIED;
+    const ST_Size size = ST_Image_save(ctx, NULL, 0, true, code);
+    const ST_Configuration config = ST_Context_cloneConfig(ctx);
+    ST_U8 *image;
+    ST_Context *clone;
+    if (!size) {
+        return NULL;
+    }
+    image = ST_alloc(ctx, size);
+    clone = ST_Image_save(ctx, image, size, true, code) == size
+                ? ST_Image_load(&config, image, size, true, code)
+                : NULL;
+    ST_free(ctx, image);
+    return clone;
+}
+
+ST_Object ST_cloneContext(ST_Object context) {
+    return ST_Context_clone(context, false);
+}
+
+struct ST_Snapshot {
+    ST_Configuration config;
+    ST_Size size;
+    /* Followed by the image */
+};
+
+ST_Snapshot *ST_snapshotContext(ST_Object context) {
+    ST_Context *ctx = context;
+    const ST_Size size =
+        ST_Image_save(ctx, NULL, 0, true, ST_IMAGE_CODE_IN_IMAGE);
+    ST_Snapshot *snapshot;
+    if (!size) {
+        return NULL;
+    }
+    snapshot = ctx->config.memory.allocFn(sizeof *snapshot + size);
+    if (!snapshot) {
+        return NULL;
+    }
+    snapshot->config = ST_Context_cloneConfig(ctx);
+    snapshot->size = size;
+    if (ST_Image_save(ctx, (ST_U8 *)(snapshot + 1), size, true,
+                      ST_IMAGE_CODE_IN_IMAGE) != size) {
+        ST_releaseSnapshot(snapshot);
+        return NULL;
+    }
+    return snapshot;
+}
+
+ST_Object ST_cloneSnapshot(const ST_Snapshot *snapshot) {
+    return ST_Image_load(&snapshot->config, (const ST_U8 *)(snapshot + 1),
+                         snapshot->size, true, ST_IMAGE_CODE_IN_IMAGE);
+}
+
+void ST_releaseSnapshot(ST_Snapshot *snapshot) {
+    snapshot->config.memory.freeFn(snapshot);
+}
+
+/*//////////////////////////////////////////////////////////////////////////////
+// Checkpoints
+/////////////////////////////////////////////////////////////////////////////*/
+
+typedef struct ST_Checkpoint_Global {
+    ST_Object symbol;
+    ST_Internal_Object *value;
+} ST_Checkpoint_Global;
+
+typedef struct ST_Checkpoint_Class {
+    ST_Class *class;
+    ST_BiNode **methods;
+    ST_Size methodCount;
+} ST_Checkpoint_Class;
+
+/* The heap is copied, the trees kept as their nodes in order, and the pools
+   marked so everything allocated since goes back in one go. */
+typedef struct ST_Checkpoint {
+    ST_U8 *heap;
+    ST_Size heapSize;
+    ST_Internal_Object *nilValue;
+    ST_Internal_Object *trueValue;
+    ST_Internal_Object *falseValue;
+    bool gcDisabled;
+    ST_Pool_Mark gvarMark;
+    ST_Pool_Mark methodMark;
+    ST_Pool_Mark strmapMark;
+    ST_Pool_Mark classMark;
+    ST_Pool_Mark symbolMark;
+    ST_BiNode **symbols;
+    ST_Size symbolCount;
+    ST_BiNode **globalNodes;
+    ST_Checkpoint_Global *globals;
+    ST_Size globalCount;
+    ST_Checkpoint_Class *classes;
+    ST_Size classCount;
+    ST_BiNode **methods;
+    /* Methods were defined since if the epoch moved on */
+    ST_Size methodEpoch;
+    struct ST_Loader *loaders;
+    ST_LinkedCode *linkedCode;
+    ST_Size workerStarts;
+} ST_Checkpoint;
+
+typedef struct ST_Checkpoint_Visitor {
     ST_Visitor visitor;
     ST_Context *ctx;
-    ST_GC_CompactionBreak *cpList;
-} ST_GC_RemapVisitor;
+    ST_BiNode **nodes;
+    ST_Size count;
+    ST_Checkpoint_Class *classes;
+} ST_Checkpoint_Visitor;
+
+static void ST_Checkpoint_collectNode(ST_Visitor *visitor, void *node) {
+    ST_Checkpoint_Visitor *v = (ST_Checkpoint_Visitor *)visitor;
+    if (v->nodes) {
+        v->nodes[v->count] = node;
+    }
+    ++v->count;
+}
 
-static void ST_GC_remapGVar(ST_Visitor *visitor, void *gvar) {
-    ((ST_GlobalVarMap_Entry *)gvar)->value =
-        ST_GC_remapObjectAddr(((ST_GC_RemapVisitor *)visitor)->ctx,
-                              ((ST_GC_RemapVisitor *)visitor)->cpList,
-                              ((ST_GlobalVarMap_Entry *)gvar)->value);
+/* The nodes of a tree in order, the array is NULL for an empty tree */
+static ST_BiNode **ST_Checkpoint_collectTree(ST_Context *ctx, ST_BiNode *root,
+                                             ST_Size *count) {
+    ST_Checkpoint_Visitor visitor;
+    visitor.visitor.visit = ST_Checkpoint_collectNode;
+    visitor.nodes = NULL;
+    visitor.count = 0;
+    ST_BST_traverse(root, (ST_Visitor *)&visitor);
+    *count = visitor.count;
+    if (!visitor.count) {
+        return NULL;
+    }
+    visitor.nodes = ST_alloc(ctx, visitor.count * sizeof *visitor.nodes);
+    visitor.count = 0;
+    ST_BST_traverse(root, (ST_Visitor *)&visitor);
+    return visitor.nodes;
 }
 
-static void ST_GC_remapGVarsAfterCompact(ST_Context *ctx,
-                                         ST_GC_CompactionBreak *brLstEnd) {
-    ST_GC_RemapVisitor visitor;
-    visitor.cpList = brLstEnd;
+/* Pool elements that are classes, counted and then collected */
+static void ST_Checkpoint_collectClass(ST_Visitor *visitor, void *element) {
+    ST_Checkpoint_Visitor *v = (ST_Checkpoint_Visitor *)visitor;
+    ST_Class *class = element;
+    if (!class->object.class) {
+        return;
+    }
+    if (v->classes) {
+        v->classes[v->count].class = class;
+        v->classes[v->count].methods = ST_Checkpoint_collectTree(
+            v->ctx, (ST_BiNode *)class->methodTree,
+            &v->classes[v->count].methodCount);
+    }
+    ++v->count;
+}
+
+static void ST_Checkpoint_collectClasses(ST_Context *ctx,
+                                         ST_Checkpoint *checkpoint) {
+    ST_Checkpoint_Visitor visitor;
+    ST_Pool_Mark everything;
+    everything.slabs = NULL;
+    visitor.visitor.visit = ST_Checkpoint_collectClass;
     visitor.ctx = ctx;
-    visitor.visitor.visit = ST_GC_remapGVar;
-    ST_BST_traverse((ST_BiNode *)ctx->globalScope, (ST_Visitor *)&visitor);
+    visitor.classes = NULL;
+    visitor.count = 0;
+    ST_Pool_visitSince(&ctx->classPool, &everything, (ST_Visitor *)&visitor);
+    checkpoint->classCount = visitor.count;
+    visitor.classes =
+        ST_alloc(ctx, (visitor.count + 1) * sizeof *visitor.classes);
+    visitor.count = 0;
+    ST_Pool_visitSince(&ctx->classPool, &everything, (ST_Visitor *)&visitor);
+    checkpoint->classes = visitor.classes;
 }
 
-static void ST_GC_remapStackAfterCompact(ST_Context *ctx,
-                                         ST_GC_CompactionBreak *brLstEnd) {
-    const ST_Size stackSize = ST_stackSize(ctx);
+static void ST_Checkpoint_free(ST_Context *ctx) {
+    ST_Checkpoint *checkpoint = ctx->checkpoint;
     ST_Size i;
-    for (i = 0; i < stackSize; ++i) {
-        ctx->operandStack.base[i] =
-            ST_GC_remapObjectAddr(ctx, brLstEnd, ctx->operandStack.base[i]);
+    if (!checkpoint) {
+        return;
+    }
+    for (i = 0; i < checkpoint->classCount; ++i) {
+        if (checkpoint->classes[i].methods) {
+            ST_free(ctx, checkpoint->classes[i].methods);
+        }
+    }
+    ST_free(ctx, checkpoint->classes);
+    if (checkpoint->symbols) {
+        ST_free(ctx, checkpoint->symbols);
     }
+    if (checkpoint->globalNodes) {
+        ST_free(ctx, checkpoint->globalNodes);
+        ST_free(ctx, checkpoint->globals);
+    }
+    ST_free(ctx, checkpoint->heap);
+    ST_free(ctx, checkpoint);
+    ctx->checkpoint = NULL;
 }
 
-static void ST_GC_compact(ST_Context *ctx) {
-    struct ST_GC_CompactionState cpState;
-    ST_GC_CompactionBreak *brListEnd;
-    cpState.breakList = NULL;
-    ST_Pool_init(ctx, &cpState.breakPool, sizeof(ST_GC_CompactionBreak), 128);
-    ST_GC_compactHeap(ctx, &cpState);
-    brListEnd =
-        (ST_GC_CompactionBreak *)ST_List_end((ST_BiNode *)cpState.breakList);
-    ST_GC_remapIVars(ctx, brListEnd);
-    ST_GC_remapGVarsAfterCompact(ctx, brListEnd);
-    ST_GC_remapStackAfterCompact(ctx, brListEnd);
-    ST_Pool_release(ctx, &cpState.breakPool);
+int ST_checkpointContext(ST_Object context) {
+    ST_Context *ctx = context;
+    ST_Checkpoint *checkpoint;
+    ST_Size i;
+    if (ctx->stackFrame->parent || ST_stackSize(ctx) || ctx->processes) {
+        return 0;
+    }
+    ST_Checkpoint_free(ctx);
+    checkpoint = ST_alloc(ctx, sizeof *checkpoint);
+    checkpoint->heapSize = ctx->heap.end - ctx->heap.begin;
+    checkpoint->heap = ST_alloc(ctx, checkpoint->heapSize + 1);
+    ST_memcpy(ctx, checkpoint->heap, ctx->heap.begin, checkpoint->heapSize);
+    checkpoint->nilValue = ctx->nilValue;
+    checkpoint->trueValue = ctx->trueValue;
+    checkpoint->falseValue = ctx->falseValue;
+    checkpoint->gcDisabled = ctx->gcDisabled;
+    checkpoint->symbols = ST_Checkpoint_collectTree(
+        ctx, (ST_BiNode *)ctx->symbolRegistry, &checkpoint->symbolCount);
+    checkpoint->globalNodes = ST_Checkpoint_collectTree(
+        ctx, (ST_BiNode *)ctx->globalScope, &checkpoint->globalCount);
+    checkpoint->globals = NULL;
+    if (checkpoint->globalCount) {
+        checkpoint->globals = ST_alloc(
+            ctx, checkpoint->globalCount * sizeof *checkpoint->globals);
+    }
+    for (i = 0; i < checkpoint->globalCount; ++i) {
+        ST_GlobalVarMap_Entry *entry =
+            (ST_GlobalVarMap_Entry *)checkpoint->globalNodes[i];
+        checkpoint->globals[i].symbol = entry->header.symbol;
+        checkpoint->globals[i].value = entry->value;
+    }
+    ST_Checkpoint_collectClasses(ctx, checkpoint);
+    checkpoint->methodEpoch = ctx->methodEpoch;
+    checkpoint->loaders = ctx->loaders;
+    checkpoint->linkedCode = ctx->linkedCode;
+    checkpoint->workerStarts = ctx->workerStarts;
+    ST_Pool_mark(&ctx->gvarNodePool, &checkpoint->gvarMark);
+    ST_Pool_mark(&ctx->methodNodePool, &checkpoint->methodMark);
+    ST_Pool_mark(&ctx->strmapNodePool, &checkpoint->strmapMark);
+    ST_Pool_mark(&ctx->classPool, &checkpoint->classMark);
+    ST_Pool_mark(&ctx->symbolPool, &checkpoint->symbolMark);
+    ctx->checkpoint = checkpoint;
+    return 1;
 }
 
-void ST_GC_run(ST_Object ctx) {
-    ST_GC_mark(ctx);
-    ST_GC_compact(ctx);
+/* Walks the symbols in order alongside those of the checkpoint, which they
+   include, and frees the names of the others */
+static void ST_Checkpoint_freeSymbol(ST_Visitor *visitor, void *node) {
+    ST_Checkpoint_Visitor *v = (ST_Checkpoint_Visitor *)visitor;
+    if (v->count < v->ctx->checkpoint->symbolCount &&
+        v->nodes[v->count] == node) {
+        ++v->count;
+    } else {
+        ST_Context_freeName(v->ctx, ((ST_StringMap_Entry *)node)->key);
+    }
 }
 
-static struct ST_Internal_Object *ST_GC_allocInstance(ST_Context *ctx,
-                                                      const ST_Class *class) {
-    const ST_Size allocSize = class->instanceSize;
-    const bool outOfMemory =
-        (ST_Size)(ctx->heap.end - ctx->heap.begin) + allocSize >=
-        ctx->config.memory.heapCapacity;
-    ST_Internal_Object *result;
-    if (UNEXPECTED(outOfMemory)) {
-        ST_GC_run(ctx);
+/* Classes are never freed, only their instance variable names were
+   allocated on their own */
+static void ST_Checkpoint_freeClass(ST_Visitor *visitor, void *element) {
+    ST_Class *class = element;
+    if (class->object.class && class->instanceVariableNames) {
+        ST_free(((ST_Checkpoint_Visitor *)visitor)->ctx,
+                class->instanceVariableNames);
     }
-    result = (ST_Internal_Object *)ctx->heap.end;
-    ctx->heap.end += allocSize;
-    return result;
 }
 
-/*//////////////////////////////////////////////////////////////////////////////
-// Bytecode loading
-/////////////////////////////////////////////////////////////////////////////*/
+/* Processes and suspended runs go, with their frames and stacks */
+static void ST_Checkpoint_discardRuns(ST_Context *ctx) {
+    while (ctx->processes) {
+        ST_Scheduler_free(ctx, ctx->processes);
+    }
+    ST_memset(ctx, ctx->ready, 0, sizeof ctx->ready);
+    ctx->delayed.first = ctx->delayed.last = NULL;
+    ctx->receiving.first = ctx->receiving.last = NULL;
+    ctx->pending.first = ctx->pending.last = NULL;
+    while (ctx->stackFrame->parent) {
+        ST_popStackFrame(ctx);
+    }
+    ctx->operandStack.top = ctx->operandStack.base;
+    ctx->operandStack.overflowed = false;
+    while (ctx->suspended) {
+        ST_Suspension *suspension = ctx->suspended;
+        ctx->suspended = suspension->next;
+        ST_free(ctx, suspension);
+    }
+}
 
-ST_Code ST_VM_load(ST_Object ctx, const ST_U8 *data, ST_Size len) {
-    /* Note: symbol table is a list of null-terminated symbol strings, where
-       the final symbol in the table is followed by two terminators. */
-    ST_Code code;
-    ST_Size i, symbCount = 0;
-    for (i = 0;; ++i) {
-        if (data[i] == '\0') {
-            symbCount += 1;
-            if (data[i + 1] == '\0') {
-                break;
-            }
+static void ST_Checkpoint_restoreSymbols(ST_Context *ctx,
+                                         ST_Checkpoint *checkpoint) {
+    ST_Checkpoint_Visitor visitor;
+    if (!ST_Pool_touched(&ctx->strmapNodePool, &checkpoint->strmapMark)) {
+        return;
+    }
+    visitor.visitor.visit = ST_Checkpoint_freeSymbol;
+    visitor.ctx = ctx;
+    visitor.nodes = checkpoint->symbols;
+    visitor.count = 0;
+    ST_BST_traverse((ST_BiNode *)ctx->symbolRegistry, (ST_Visitor *)&visitor);
+    ctx->symbolRegistry = (ST_StringMap_Entry *)ST_BST_build(
+        checkpoint->symbols, checkpoint->symbolCount);
+    ST_Pool_rewind(ctx, &ctx->strmapNodePool, &checkpoint->strmapMark);
+    ST_Pool_rewind(ctx, &ctx->symbolPool, &checkpoint->symbolMark);
+}
+
+/* Entries of removed globals may hold others by now */
+static void ST_Checkpoint_restoreGlobals(ST_Context *ctx,
+                                         ST_Checkpoint *checkpoint) {
+    ST_Size i;
+    for (i = 0; i < checkpoint->globalCount; ++i) {
+        ST_GlobalVarMap_Entry *entry =
+            (ST_GlobalVarMap_Entry *)checkpoint->globalNodes[i];
+        entry->header.symbol = checkpoint->globals[i].symbol;
+        entry->value = checkpoint->globals[i].value;
+    }
+    if (ST_Pool_touched(&ctx->gvarNodePool, &checkpoint->gvarMark)) {
+        ctx->globalScope = (ST_GlobalVarMap_Entry *)ST_BST_build(
+            checkpoint->globalNodes, checkpoint->globalCount);
+        ST_Pool_rewind(ctx, &ctx->gvarNodePool, &checkpoint->gvarMark);
+    }
+}
+
+/* Sends and prepared sends that cached a method look it up again, as after
+   any definition, also when only classes went: their memory gets reused. */
+static void ST_Checkpoint_restoreClasses(ST_Context *ctx,
+                                         ST_Checkpoint *checkpoint) {
+    const bool classesFreed =
+        ST_Pool_touched(&ctx->classPool, &checkpoint->classMark);
+    ST_Size i;
+    if (ctx->methodEpoch != checkpoint->methodEpoch) {
+        for (i = 0; i < checkpoint->classCount; ++i) {
+            ST_Checkpoint_Class *saved = &checkpoint->classes[i];
+            saved->class->methodTree = (ST_MethodMap_Entry *)ST_BST_build(
+                saved->methods, saved->methodCount);
         }
+        ST_Pool_rewind(ctx, &ctx->methodNodePool, &checkpoint->methodMark);
+    } else if (!classesFreed) {
+        return;
     }
-    len -= i + 1;
-    code.symbTab = ST_alloc(ctx, sizeof(ST_Object) * symbCount);
-    for (i = 0; i < symbCount; ++i) {
-        code.symbTab[i] = ST_symb(ctx, (const char *)data);
-        data += ST_strlen((const char *)data) + 1;
+    if (classesFreed) {
+        ST_Checkpoint_Visitor visitor;
+        visitor.visitor.visit = ST_Checkpoint_freeClass;
+        visitor.ctx = ctx;
+        ST_Pool_visitSince(&ctx->classPool, &checkpoint->classMark,
+                           (ST_Visitor *)&visitor);
+        ST_Pool_rewind(ctx, &ctx->classPool, &checkpoint->classMark);
     }
-    ++data;
-    code.length = len;
-    code.instructions = ST_alloc(ctx, len);
-    ST_memcpy(ctx, code.instructions, data, len);
-    return code;
+    checkpoint->methodEpoch = ++ctx->methodEpoch;
+}
+
+int ST_resetContext(ST_Object context) {
+    ST_Context *ctx = context;
+    ST_Checkpoint *checkpoint = ctx->checkpoint;
+    if (!checkpoint || ctx->vmDepth) {
+        return 0;
+    }
+    ST_Checkpoint_discardRuns(ctx);
+    /* Workers started since may run code that goes now */
+    if (ctx->workerStarts != checkpoint->workerStarts) {
+        ST_stopWorkers(ctx);
+    }
+    ST_VM_releaseLoaders(ctx, checkpoint->loaders);
+    ST_VM_releaseLinkedCode(ctx, checkpoint->linkedCode);
+    ST_Checkpoint_restoreSymbols(ctx, checkpoint);
+    ST_Checkpoint_restoreGlobals(ctx, checkpoint);
+    ST_Checkpoint_restoreClasses(ctx, checkpoint);
+    ST_memcpy(ctx, ctx->heap.begin, checkpoint->heap, checkpoint->heapSize);
+    ctx->heap.end = ctx->heap.begin + checkpoint->heapSize;
+    ctx->nilValue = checkpoint->nilValue;
+    ctx->trueValue = checkpoint->trueValue;
+    ctx->falseValue = checkpoint->falseValue;
+    ctx->gcDisabled = checkpoint->gcDisabled;
+    return 1;
 }
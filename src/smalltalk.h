@@ -29,6 +29,39 @@ typedef ST_Object (*ST_Method)(ST_Object, ST_Object, ST_Object[]);
 void ST_setMethod(ST_Object context, ST_Object targetClass, ST_Object symbol,
                   ST_Method method, ST_U8 argc);
 
+/* Defines a native class in one go, from a static table of its primitives,
+   as the global name: cheaper than ST_setMethod for each. ivarNames is
+   NULL-terminated, or NULL if the class adds no instance variables.
+   Returns the class, or nil if it adds instance variables to a class that
+   keeps native data in its instances, like Semaphore. */
+typedef struct ST_MethodDef {
+    const char *selector;
+    ST_Method method;
+    ST_U8 argc;
+} ST_MethodDef;
+ST_Object ST_defineClass(ST_Object context, ST_Object superclass,
+                         const char *name, const char *const ivarNames[],
+                         const ST_MethodDef methods[], ST_Size methodCount);
+
+/* Prepared sends, for messages the host sends over and over: the method
+   targetClass answers symbol with is looked up once, and again only after
+   methods were defined since. ST_invokePrepared is ST_sendMsg for the
+   prepared message, and falls back to it for receivers of other classes,
+   such as subclasses' instances and Arrays (each has a class of its own).
+   The class has to outlive the prepared send. */
+typedef struct ST_PreparedSend {
+    ST_Object targetClass;
+    ST_Object symbol;
+    ST_U8 argc;
+    /* What the lookup found, and the count of method definitions then */
+    void *method;
+    ST_Size epoch;
+} ST_PreparedSend;
+ST_PreparedSend ST_prepareSend(ST_Object context, ST_Object targetClass,
+                               ST_Object symbol, ST_U8 argc);
+ST_Object ST_invokePrepared(ST_Object context, ST_PreparedSend *send,
+                            ST_Object receiver, ST_Object argv[]);
+
 /* Shortcuts, technically you could do all these with message sends though. */
 ST_Object ST_getClass(ST_Object context, ST_Object object);
 ST_Object ST_getSuper(ST_Object context, ST_Object object);
@@ -67,27 +100,328 @@ typedef struct ST_Configuration {
         ST_Size stackCapacity;
         /* Heap capacity in units of bytes */
         ST_Size heapCapacity;
+        /* Stack capacity of each process, see ST_fork */
+        ST_Size processStackCapacity;
+        /* If set, the context allocates through these instead of allocFn
+           and freeFn, passing them user. If releaseFn is set too,
+           ST_destroyContext calls it rather than freeing allocations one by
+           one. Mailboxes, messages, shared code and clones outlive the
+           context, so they still use allocFn and freeFn. */
+        void *(*userAllocFn)(void *user, size_t);
+        void (*userFreeFn)(void *user, void *);
+        void (*releaseFn)(void *user);
+        void *user;
     } memory;
 } ST_Configuration;
 
 #define ST_DEFAULT_CONFIG                                                      \
     {                                                                          \
-        { malloc, free, memcpy, memmove, memset, 1024, 10000 }                 \
+        {                                                                      \
+            malloc, free, memcpy, memmove, memset, 1024, 10000, 128, NULL,     \
+                NULL, NULL, NULL                                               \
+        }                                                                      \
     }
 
+/* A bump allocator for short-lived contexts: it takes memory in chunks of
+   chunkSize bytes from the allocFn of config, never frees single
+   allocations, and gives all chunks back at once. Larger allocations get a
+   chunk of their own.
+
+       ST_Configuration config = ST_DEFAULT_CONFIG;
+       ST_Arena *arena = ST_createArena(&config, 64 * 1024);
+       ST_useArena(&config, arena);
+       ctx = ST_createContext(&config);
+       ...
+       ST_destroyContext(ctx);
+
+   ST_useArena makes the context allocate from the arena, and destroying the
+   context destroys the arena. An arena serves one context; if creating the
+   context fails, destroy the arena with ST_destroyArena. */
+typedef struct ST_Arena ST_Arena;
+ST_Arena *ST_createArena(const ST_Configuration *config, ST_Size chunkSize);
+void ST_destroyArena(ST_Arena *arena);
+void ST_useArena(ST_Configuration *config, ST_Arena *arena);
+
+/* Contexts share no mutable state, so each can run on its own thread in
+   parallel with the others (the runtime keeps none, and the boot image and
+   other tables are read-only). A single context isn't thread-safe: even
+   reads like ST_getGlobal reorganise its search trees, so only use it from
+   one thread at a time. Shared code (see ST_VM_loadShared) is read-only
+   once loaded, and any number of threads can link it at once. The
+   configuration's allocator has to be thread-safe, as malloc is. */
 ST_Object ST_createContext(const ST_Configuration *config);
 void ST_destroyContext(ST_Object context);
 
+/* Green threads. A process sends one message, with its own frames and
+   operand stack, and is scheduled round-robin among the ready processes of
+   the highest priority. It runs until it finishes, waits on a Semaphore or
+   a Delay, yields (Process yield), or has run out its time slice of
+   instructions at a send; a process made ready at a higher priority than
+   the running one preempts it. Smalltalk code forks with fork: and
+   fork:at:, e.g. "worker fork: #run".
+
+   Processes only run inside ST_runProcesses, which runs them until none is
+   ready and returns how many are left, waiting. Time is what the host
+   passes as now (in milliseconds, from any epoch), Delays expire on the
+   first call at or after their wakeup time, and if any process waits on
+   one, *wakeup is set to the earliest. Outside a process, and in code a
+   primitive runs with ST_sendMsg, nothing can wait: Semaphore>>wait and
+   Delay>>wait return false unless the Semaphore has a signal to take.
+
+   ST_fork returns nil if the receiver and arguments don't fit on a process
+   stack (processStackCapacity). A process that overflows its stack later
+   is terminated, and compiled methods it sends to on the way out answer
+   nil. */
+enum {
+    ST_PRIORITY_LOWEST = 0,
+    ST_PRIORITY_DEFAULT = 4,
+    ST_PRIORITY_HIGHEST = 7
+};
+ST_Object ST_fork(ST_Object context, ST_Object receiver, ST_Object symbol,
+                  ST_U8 argc, ST_Object argv[], ST_U8 priority);
+ST_Size ST_runProcesses(ST_Object context, ST_Size now, ST_Size *wakeup);
+
+/* Asynchronous primitives. A host primitive that starts slow work (I/O, a
+   request to another thread...) calls ST_pending and returns right away,
+   with any value: the process that sent the message waits for the work,
+   while the others keep running. When the work completes, ST_resume hands
+   the process the value its send answers, and makes it ready to run in the
+   next ST_runProcesses.
+
+   ST_pending returns the token to resume with, or 0 if the code can't wait
+   (see ST_runProcesses), in which case the primitive has to complete
+   before it returns. ST_resume returns 0 if no process waits for the
+   token, e.g. because it was terminated. Called before the primitive that
+   got the token returns, ST_resume cancels the wait and the primitive's
+   return value stands. Only call either on the context's thread, between
+   ST_runProcesses calls or from primitives. util/async.hpp builds C++20
+   coroutine primitives on top. */
+ST_Size ST_pending(ST_Object context);
+int ST_resume(ST_Object context, ST_Size token, ST_Object value);
+
+/* Actors: contexts on separate threads message each other through
+   mailboxes, which any number of contexts can post to from any thread
+   without locking, but only one context at a time receives from.
+
+   ST_postMessage copies the value into a flat buffer that moves to the
+   receiver whole. Objects the value refers to are copied along, except
+   symbols and classes, which go by name, and mailboxes, which are shared.
+   Returns 0 if the value can't be copied (it holds a Process, a Semaphore
+   or the context) or the buffer can't be allocated. ST_receiveMessage
+   copies the next message into the context, returning NULL if there's
+   none, and nil if it doesn't fit in the heap or names a class the context
+   doesn't have.
+
+   In Smalltalk, Mailbox>>post: posts, and Mailbox>>receive waits in a
+   process until a message arrives: ST_runProcesses hands the messages that
+   arrived to the processes waiting for them, call it again when there may
+   be more. Elsewhere receive answers nil if there's no message. Expose a
+   mailbox to Smalltalk with ST_wrapMailbox, e.g. as a global; images can't
+   be saved while the heap holds one. Destroy a mailbox once no context uses
+   it, undelivered messages go with it. */
+typedef struct ST_Mailbox ST_Mailbox;
+ST_Mailbox *ST_createMailbox(const ST_Configuration *config);
+void ST_destroyMailbox(ST_Mailbox *mailbox);
+int ST_postMessage(ST_Object context, ST_Mailbox *mailbox, ST_Object value);
+ST_Object ST_receiveMessage(ST_Object context, ST_Mailbox *mailbox);
+ST_Object ST_wrapMailbox(ST_Object context, ST_Mailbox *mailbox);
+
+/* Parallel collections. Array>>parallelCollect: #selector,
+   parallelSelect: #selector and parallelInject: initial into: #selector
+   split the Array into a slice per worker context and send the selector to
+   each element (or, for inject, to the running value with the element) in
+   the workers, in parallel. The slices and results are copied between
+   contexts like messages (see ST_postMessage), so the results hold copies
+   of the elements, and the selector can't rely on state outside them.
+   inject folds each slice on its own and then the slices' results from
+   initial, so its selector has to be associative, as + is. Without workers
+   the work runs in the context itself, in one slice.
+
+   ST_startWorkers makes count workers as clones of the context (see
+   ST_cloneContext), replacing any it had, so define classes and methods
+   the selectors need first. Unlike other clones, the workers run the
+   code the context loaded where it is, like linked shared code, instead
+   of copies. It returns 0 if the context couldn't be cloned. The library
+   doesn't create threads: runJobs calls job(data, i) for every i below
+   count, each on any thread (a pool's, or new ones), and returns once all
+   calls have. The workers are destroyed with the context. */
+typedef void (*ST_Job)(void *data, ST_Size index);
+typedef void (*ST_RunJobs)(void *host, ST_Job job, void *data, ST_Size count);
+int ST_startWorkers(ST_Object context, ST_Size count, ST_RunJobs runJobs,
+                    void *host);
+
+/* Images snapshot a context (heap, classes, methods, symbols, globals and
+   the code methods were compiled from) in the host's native layout, so that
+   ST_loadImage can restore them with bulk copies and pointer fixups rather
+   than by rerunning the code that built them. The library doesn't do file
+   I/O, so images go through caller supplied buffers.
+
+   ST_saveImage returns the image size, and writes the image only if it fits
+   in capacity (pass a NULL buffer to get the size). Returns 0 if the context
+   can't be saved: while code is running or processes are left, or if a
+   method is a primitive the runtime doesn't define itself. Host primitives
+   have to be set again after loading. ST_loadImage returns NULL if the
+   image is malformed, comes from a different build or doesn't fit in
+   config's heap. */
+ST_Size ST_saveImage(ST_Object context, ST_U8 *buffer, ST_Size capacity);
+ST_Object ST_loadImage(const ST_Configuration *config, const ST_U8 *data,
+                       ST_Size len);
+
+/* A new context with a copy of context's state, as if saved and loaded as
+   an image, except that host primitives carry over too. Warm a template
+   context once (load code, define classes, set globals), then clone it per
+   request rather than building each one from scratch. The clone shares
+   nothing with the template and uses its configuration, but allocates with
+   allocFn and freeFn even if the template uses userAllocFn. Returns NULL if
+   the template couldn't be saved for other reasons. */
+ST_Object ST_cloneContext(ST_Object context);
+
+/* For many clones of a template that no longer changes: ST_snapshotContext
+   saves the template once, and ST_cloneSnapshot restores it, which only
+   costs a load. The clones run the code from the snapshot rather than
+   copies of it, release the snapshot after every clone is destroyed.
+   Restoring only reads the snapshot, so any thread can clone it. Returns
+   NULL if the template couldn't be saved, as for ST_cloneContext. */
+typedef struct ST_Snapshot ST_Snapshot;
+ST_Snapshot *ST_snapshotContext(ST_Object context);
+ST_Object ST_cloneSnapshot(const ST_Snapshot *snapshot);
+void ST_releaseSnapshot(ST_Snapshot *snapshot);
+
+/* A cheaper way to serve each request from the same warmed context: take a
+   checkpoint once after setup, and reset the context after each request.
+
+   ST_checkpointContext records the heap, globals, symbols, classes and
+   their methods, replacing any earlier checkpoint. Like ST_saveImage it
+   fails, returning 0, while code runs or processes are left.
+
+   ST_resetContext puts the context back as it was at the checkpoint.
+   Objects, symbols, classes and methods made since are dropped at once,
+   processes are terminated and suspended runs discarded (see
+   ST_VM_executeFor), and code loaded or linked since is released, as are
+   workers started since. The
+   memory they took is kept for the next request. Objects the host held,
+   and prepared sends for classes made since, are invalid afterwards.
+   Returns 0 without a checkpoint, or while code runs. */
+int ST_checkpointContext(ST_Object context);
+int ST_resetContext(ST_Object context);
+
 const char *ST_Symbol_toString(ST_Object context, ST_Object symbol);
 
+/* Whether any class in the context has a method for the selector. In a
+   fresh context, whether the runtime itself defines one. */
+int ST_definesSelector(ST_Object context, ST_Object symbol);
+
 typedef struct ST_Code {
     ST_Object *symbTab;
-    ST_U8 *instructions;
+    ST_Size symbolCount;
+    const ST_U8 *instructions;
     ST_Size length;
+    /* Counts the methods the code defined as it ran, which sends the
+       compiler bound directly to a method tell it by, see opcode.h */
+    ST_Size methodsDefined;
+    /* Optional debug section, NULL if the code has none. */
+    const ST_U8 *debugInfo;
+    ST_Size debugLength;
+    /* Nonzero while ST_VM_feed may still add instructions, running off the
+       end then suspends the code rather than completing it. */
+    ST_U8 loading;
 } ST_Code;
 
+/* Code comes in a container with checksummed sections, or in the older
+   bare format, see opcode.h. Malformed or damaged code loads as empty
+   code. */
 ST_Code ST_VM_load(ST_Object context, const ST_U8 *data, ST_Size len);
-void ST_VM_execute(ST_Object context, const ST_Code *code, ST_Size offset);
+
+/* Like ST_VM_load, but the code keeps pointing into data rather than a
+   copy, e.g. to run a read-only memory mapped file. Only the symbol table is
+   allocated. data must stay valid and unchanged while the code is in use,
+   including methods it defined. Compressed code can't run in place, and is
+   decompressed into a copy as by ST_VM_load. */
+ST_Code ST_VM_loadInPlace(ST_Object context, const ST_U8 *data, ST_Size len);
+
+/* Code loaded once per process and shared read-only by any number of
+   contexts, each linking it with ST_VM_link. The instructions and debug
+   section are copied once, linking only builds the context's own symbol
+   table. ST_VM_loadShared returns NULL if the code is malformed or damaged.
+   Linked code lives as long as the context, release the shared code after
+   every context that linked it is destroyed. */
+typedef struct ST_SharedCode ST_SharedCode;
+ST_SharedCode *ST_VM_loadShared(const ST_Configuration *config,
+                                const ST_U8 *data, ST_Size len);
+ST_Code *ST_VM_link(ST_Object context, const ST_SharedCode *code);
+void ST_VM_releaseShared(ST_SharedCode *code);
+
+void ST_VM_execute(ST_Object context, ST_Code *code, ST_Size offset);
+
+/* Budgeted runs, to bound the time a script takes. ST_VM_executeFor runs
+   the code like ST_VM_execute, but stops at the first send after
+   maxInstructions instructions, or after ST_VM_interrupt was called, which
+   any thread can do while it runs. Returns 1 if the code completed, and 0
+   if it stopped: its frames then stay on the stack, and ST_VM_continue
+   runs it on with a new budget, or other code can run in the meantime.
+   Stopped runs nest like calls, ST_VM_continue continues the one that
+   stopped last, and returns 1 if there is none. The count includes the
+   instructions of code that primitives run, but runs only stop once back
+   in the code itself. An interrupt that comes while no budgeted run is
+   going stops the next one at its first send. From primitives, and in
+   processes, ST_VM_executeFor runs the code to completion and
+   ST_VM_continue does nothing. */
+int ST_VM_executeFor(ST_Object context, ST_Code *code, ST_Size offset,
+                     ST_Size maxInstructions);
+int ST_VM_continue(ST_Object context, ST_Size maxInstructions);
+void ST_VM_interrupt(ST_Object context);
+
+/* Incremental loading, for code that arrives in chunks (a pipe, a
+   decompressor...). Symbols are interned as they arrive, and
+   ST_VM_runLoaded runs the top level instructions that arrived whole and
+   haven't run yet, so a program can start while the rest is loading. Only
+   the instructions are kept, the caller's chunks can be reused right away.
+
+   Between runs the code waits in its own stack frame, keeping whatever its
+   statements left on the stack. Other code can run in the meantime, but
+   streamed programs nest like calls: one started after another has to
+   complete before the earlier one can run again.
+
+   ST_VM_finishLoad ends loading and returns the code, which lives as long as
+   the context. Call ST_VM_runLoaded after it to run what's left. If the
+   code turns out to be damaged nothing more runs, and the code is empty.
+
+   Containers only run once their symbols arrived intact, but the code
+   section's checksum is only known at its end: running early runs unchecked
+   instructions.
+
+   ST_VM_limitLoad caps what the loader keeps at maxBytes at any time, the
+   copy while a buffer grows included: the instructions, the symbol table,
+   and what it buffers until it's whole (a symbol name, a container's
+   header, debug or compressed code section). A feed that would need more
+   fails the load, as for damaged code, so code from an untrusted stream
+   takes no more than that however long it runs on. Interned symbols belong
+   to the context and don't count. Without a limit, the loader takes
+   whatever the code needs. */
+typedef struct ST_Loader ST_Loader;
+ST_Loader *ST_VM_beginLoad(ST_Object context);
+void ST_VM_limitLoad(ST_Loader *loader, ST_Size maxBytes);
+void ST_VM_feed(ST_Loader *loader, const ST_U8 *data, ST_Size len);
+void ST_VM_runLoaded(ST_Loader *loader);
+ST_Code *ST_VM_finishLoad(ST_Loader *loader);
+
+/* The debug section of a container, which bare code has no room for. It
+   holds a string count and that many null-terminated strings (file and
+   method names), then an entry count and the entries. Each entry starts a
+   range of code that runs up to the next entry, and holds four LEB128
+   numbers: the offset delta from the previous entry, the zigzag encoded
+   line delta, and the string indices of the file and method. Counts are
+   LEB128 too. */
+typedef struct ST_SourceLocation {
+    const char *file;
+    const char *method;
+    ST_U32 line;
+} ST_SourceLocation;
+
+/* Maps an instruction offset back to source. Decodes the debug section on
+   each call, so code that never asks pays nothing beyond the load. The file
+   is NULL if the offset isn't covered. */
+ST_SourceLocation ST_VM_sourceLocation(const ST_Code *code, ST_Size offset);
 
 #endif /* SMALLTALK_H */
 
@@ -0,0 +1,146 @@
+#include "../src/smalltalk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum { CHUNK_SIZE = 64 * 1024, ELEMENTS = 100 };
+
+static ST_Size allocations;
+static ST_Size outstanding;
+
+static void *countedAlloc(size_t size) {
+    ++allocations;
+    ++outstanding;
+    return malloc(size);
+}
+
+static void countedFree(void *memory) {
+    --outstanding;
+    free(memory);
+}
+
+static ST_Configuration makeConfig(void) {
+    ST_Configuration config = ST_DEFAULT_CONFIG;
+    config.memory.allocFn = countedAlloc;
+    config.memory.freeFn = countedFree;
+    allocations = 0;
+    outstanding = 0;
+    return config;
+}
+
+/* Builds an Array of fresh symbols and collects garbage */
+static int exercise(ST_Object ctx) {
+    ST_Object argv[2];
+    ST_S32 i;
+    char name[16];
+    argv[0] = ST_getInteger(ctx, ELEMENTS);
+    ST_setGlobal(ctx, ST_symb(ctx, "Names"),
+                 ST_sendMsg(ctx, ST_getGlobal(ctx, ST_symb(ctx, "Array")),
+                            ST_symb(ctx, "new:"), 1, argv));
+    for (i = 0; i < ELEMENTS; ++i) {
+        sprintf(name, "name%d", (int)i);
+        argv[0] = ST_getInteger(ctx, i);
+        argv[1] = ST_symb(ctx, name);
+        ST_sendMsg(ctx, ST_getGlobal(ctx, ST_symb(ctx, "Names")),
+                   ST_symb(ctx, "at:put:"), 2, argv);
+    }
+    ST_GC_run(ctx);
+    argv[0] = ST_getInteger(ctx, ELEMENTS - 1);
+    return ST_sendMsg(ctx, ST_getGlobal(ctx, ST_symb(ctx, "Names")),
+                      ST_symb(ctx, "at:"), 1, argv) ==
+           ST_symb(ctx, "name99");
+}
+
+/* The same work without an arena, to compare with */
+static ST_Size mallocAllocations(void) {
+    ST_Configuration config = makeConfig();
+    ST_Object ctx = ST_createContext(&config);
+    ST_Size count;
+    exercise(ctx);
+    count = allocations;
+    ST_destroyContext(ctx);
+    return count;
+}
+
+/* A context allocates a few chunks, and destroying it frees them all */
+static int checkArena(ST_Size withoutArena) {
+    ST_Configuration config = makeConfig();
+    ST_Arena *arena = ST_createArena(&config, CHUNK_SIZE);
+    ST_Object ctx;
+    int success;
+    ST_useArena(&config, arena);
+    ctx = ST_createContext(&config);
+    success = ctx && exercise(ctx) && allocations * 4 < withoutArena;
+    ST_destroyContext(ctx);
+    return success && outstanding == 0;
+}
+
+/* Clones allocate on their own and outlive the arena */
+static int checkClone(void) {
+    ST_Configuration config = makeConfig();
+    ST_Arena *arena = ST_createArena(&config, CHUNK_SIZE);
+    ST_Object ctx, clone;
+    int success;
+    ST_useArena(&config, arena);
+    ctx = ST_createContext(&config);
+    ST_setGlobal(ctx, ST_symb(ctx, "Answer"), ST_getInteger(ctx, 42));
+    clone = ST_cloneContext(ctx);
+    ST_destroyContext(ctx);
+    /* Whatever is left is the clone's */
+    success = clone && outstanding > 10 && exercise(clone) &&
+              ST_unboxInt(clone, ST_getGlobal(clone, ST_symb(clone,
+                                                             "Answer"))) ==
+                  42;
+    if (clone) {
+        ST_destroyContext(clone);
+    }
+    return success;
+}
+
+/* Parallel collection operations pass the elements as messages, which
+   don't come from the arena */
+static int checkParallel(void) {
+    ST_Configuration config = makeConfig();
+    ST_Arena *arena = ST_createArena(&config, CHUNK_SIZE);
+    ST_Object ctx, argv[2];
+    ST_S32 i, sum = 0;
+    int success = 1;
+    ST_useArena(&config, arena);
+    ctx = ST_createContext(&config);
+    argv[0] = ST_getInteger(ctx, ELEMENTS);
+    ST_setGlobal(ctx, ST_symb(ctx, "Numbers"),
+                 ST_sendMsg(ctx, ST_getGlobal(ctx, ST_symb(ctx, "Array")),
+                            ST_symb(ctx, "new:"), 1, argv));
+    for (i = 0; i < ELEMENTS; ++i) {
+        argv[0] = ST_getInteger(ctx, i);
+        argv[1] = ST_getInteger(ctx, i);
+        ST_sendMsg(ctx, ST_getGlobal(ctx, ST_symb(ctx, "Numbers")),
+                   ST_symb(ctx, "at:put:"), 2, argv);
+    }
+    for (i = 0; i < ELEMENTS && success; ++i) {
+        argv[0] = ST_getInteger(ctx, 0);
+        argv[1] = ST_symb(ctx, "+");
+        sum = ST_unboxInt(
+            ctx, ST_sendMsg(ctx, ST_getGlobal(ctx, ST_symb(ctx, "Numbers")),
+                            ST_symb(ctx, "parallelInject:into:"), 2, argv));
+        success = sum == ELEMENTS * (ELEMENTS - 1) / 2;
+    }
+    ST_destroyContext(ctx);
+    return success && outstanding == 0;
+}
+
+int main() {
+    if (!checkArena(mallocAllocations())) {
+        puts("contexts don't allocate from arenas, or leak them");
+        return EXIT_FAILURE;
+    }
+    if (!checkClone()) {
+        puts("clones of contexts that use arenas are broken");
+        return EXIT_FAILURE;
+    }
+    if (!checkParallel()) {
+        puts("parallel collection operations leak messages with arenas");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
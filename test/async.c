@@ -0,0 +1,129 @@
+#include "../src/opcode.h"
+#include "../src/smalltalk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Worker := Object subclass: #Worker.
+   Worker>>run Result := self fetch.
+   Worker>>runNow Result := self fetchNow. */
+static const ST_U8 program[] = {
+    'W', 'o', 'r', 'k', 'e', 'r', '\0', 'O', 'b', 'j', 'e', 'c', 't', '\0',
+    's', 'u', 'b', 'c', 'l', 'a', 's', 's', ':', '\0', 'r', 'u', 'n', '\0',
+    'f', 'e', 't', 'c', 'h', '\0', 'R', 'e', 's', 'u', 'l', 't', '\0', 'r',
+    'u', 'n', 'N', 'o', 'w', '\0', 'f', 'e', 't', 'c', 'h', 'N', 'o', 'w',
+    '\0', '\0', ST_VM_OP_PUSHSYMBOL, 0, 0, ST_VM_OP_GETGLOBAL, 1, 0,
+    ST_VM_OP_SENDMSG, 2, 0, ST_VM_OP_SETGLOBAL, 0, 0, ST_VM_OP_GETGLOBAL, 0,
+    0, ST_VM_OP_SETMETHOD, 3, 0, 0, 6, 0, 0, 0, ST_VM_OP_DUP,
+    ST_VM_OP_SENDMSG8, 4, ST_VM_OP_SETGLOBAL8, 5, ST_VM_OP_RETURN,
+    ST_VM_OP_GETGLOBAL, 0, 0, ST_VM_OP_SETMETHOD, 6, 0, 0, 6, 0, 0, 0,
+    ST_VM_OP_DUP, ST_VM_OP_SENDMSG8, 7, ST_VM_OP_SETGLOBAL8, 5,
+    ST_VM_OP_RETURN};
+
+enum { MAX_TOKENS = 4 };
+
+static ST_Size tokens[MAX_TOKENS];
+static ST_Size tokenCount;
+
+/* Starts "slow work", the test completes it */
+static ST_Object fetch(ST_Object ctx, ST_Object self, ST_Object argv[]) {
+    tokens[tokenCount++] = ST_pending(ctx);
+    return ST_getNil(ctx);
+}
+
+/* Work that turns out to be done already */
+static ST_Object fetchNow(ST_Object ctx, ST_Object self, ST_Object argv[]) {
+    if (!ST_resume(ctx, ST_pending(ctx), ST_getNil(ctx))) {
+        return ST_getNil(ctx);
+    }
+    return ST_getInteger(ctx, 7);
+}
+
+static ST_Object setup(ST_Code *code) {
+    ST_Configuration config = ST_DEFAULT_CONFIG;
+    ST_Object ctx = ST_createContext(&config);
+    ST_Object cWorker;
+    *code = ST_VM_load(ctx, program, sizeof program);
+    ST_VM_execute(ctx, code, 0);
+    cWorker = ST_getGlobal(ctx, ST_symb(ctx, "Worker"));
+    ST_setMethod(ctx, cWorker, ST_symb(ctx, "fetch"), fetch, 0);
+    ST_setMethod(ctx, cWorker, ST_symb(ctx, "fetchNow"), fetchNow, 0);
+    tokenCount = 0;
+    return ctx;
+}
+
+static ST_Object forkWorker(ST_Object ctx, const char *selector) {
+    return ST_fork(ctx, ST_getGlobal(ctx, ST_symb(ctx, "Worker")),
+                   ST_symb(ctx, selector), 0, NULL, ST_PRIORITY_DEFAULT);
+}
+
+static ST_S32 result(ST_Object ctx) {
+    ST_Object value = ST_getGlobal(ctx, ST_symb(ctx, "Result"));
+    return value == ST_getNil(ctx) ? -1 : ST_unboxInt(ctx, value);
+}
+
+/* Two processes wait on their own work, completed out of order */
+static int checkResume(void) {
+    ST_Code code;
+    ST_Object ctx = setup(&code);
+    int success;
+    forkWorker(ctx, "run");
+    forkWorker(ctx, "run");
+    success = ST_runProcesses(ctx, 0, NULL) == 2 && tokenCount == 2 &&
+              tokens[0] && tokens[1] && tokens[0] != tokens[1] &&
+              result(ctx) == -1;
+    success = success && ST_resume(ctx, tokens[1], ST_getInteger(ctx, 41)) &&
+              ST_runProcesses(ctx, 0, NULL) == 1 && result(ctx) == 41;
+    success = success && ST_resume(ctx, tokens[0], ST_getInteger(ctx, 42)) &&
+              ST_runProcesses(ctx, 0, NULL) == 0 && result(ctx) == 42;
+    success = success && !ST_resume(ctx, tokens[0], ST_getNil(ctx));
+    ST_destroyContext(ctx);
+    return success;
+}
+
+/* Resuming before the primitive returns, and outside a process */
+static int checkImmediate(void) {
+    ST_Code code;
+    ST_Object ctx = setup(&code);
+    int success;
+    forkWorker(ctx, "runNow");
+    success = ST_runProcesses(ctx, 0, NULL) == 0 && result(ctx) == 7;
+    ST_sendMsg(ctx, ST_getGlobal(ctx, ST_symb(ctx, "Worker")),
+               ST_symb(ctx, "fetch"), 0, NULL);
+    success = success && tokenCount == 1 && tokens[0] == 0;
+    ST_destroyContext(ctx);
+    return success;
+}
+
+/* Terminated processes don't wait anymore */
+static int checkTerminate(void) {
+    ST_Code code;
+    ST_Object ctx = setup(&code);
+    ST_Object process;
+    int success;
+    ST_setGlobal(ctx, ST_symb(ctx, "P"), forkWorker(ctx, "run"));
+    success = ST_runProcesses(ctx, 0, NULL) == 1;
+    process = ST_getGlobal(ctx, ST_symb(ctx, "P"));
+    ST_sendMsg(ctx, process, ST_symb(ctx, "terminate"), 0, NULL);
+    success = success && ST_runProcesses(ctx, 0, NULL) == 0 &&
+              !ST_resume(ctx, tokens[0], ST_getInteger(ctx, 1)) &&
+              result(ctx) == -1;
+    ST_destroyContext(ctx);
+    return success;
+}
+
+int main() {
+    if (!checkResume()) {
+        puts("pending processes don't resume with their values");
+        return EXIT_FAILURE;
+    }
+    if (!checkImmediate()) {
+        puts("primitives that don't end up waiting are broken");
+        return EXIT_FAILURE;
+    }
+    if (!checkTerminate()) {
+        puts("terminated pending processes can still be resumed");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
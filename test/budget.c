@@ -0,0 +1,188 @@
+#include "../src/opcode.h"
+#include "../src/smalltalk.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+    SYM_Worker,
+    SYM_Object,
+    SYM_subclass,
+    SYM_many,
+    SYM_tick,
+    SYM_nested,
+    SYM_Done
+};
+
+static const char symbols[] = "Worker\0Object\0subclass:\0many\0tick\0"
+                              "nested\0Done\0";
+
+enum { TICKS = 1000, INTERRUPT_AT = 50 };
+
+static ST_Size tickCount;
+static ST_Size interruptAt;
+
+static void *interrupt(void *ctx) {
+    ST_VM_interrupt(ctx);
+    return NULL;
+}
+
+/* Interrupts from another thread at interruptAt */
+static ST_Object tick(ST_Object ctx, ST_Object self, ST_Object argv[]) {
+    pthread_t thread;
+    if (++tickCount == interruptAt &&
+        pthread_create(&thread, NULL, interrupt, ctx) == 0) {
+        pthread_join(thread, NULL);
+    }
+    return ST_getNil(ctx);
+}
+
+/* Runs code whose budget can't stop it until it returns */
+static ST_Object nested(ST_Object ctx, ST_Object self, ST_Object argv[]) {
+    return ST_sendMsg(ctx, self, ST_symb(ctx, "many"), 0, NULL);
+}
+
+static ST_U8 *emit8(ST_U8 *out, ST_U8 op, ST_U8 symbol) {
+    *out++ = op;
+    *out++ = symbol;
+    return out;
+}
+
+static ST_U8 *begin(ST_U8 *out) {
+    memcpy(out, symbols, sizeof symbols);
+    return out + sizeof symbols;
+}
+
+static ST_U8 *tickOnce(ST_U8 *out, ST_U8 receiver) {
+    out = receiver ? emit8(out, ST_VM_OP_GETGLOBAL8, SYM_Worker)
+                   : (*out++ = ST_VM_OP_DUP, out);
+    out = emit8(out, ST_VM_OP_SENDMSG8, SYM_tick);
+    *out++ = ST_VM_OP_POP;
+    return out;
+}
+
+/* Worker := Object subclass: #Worker.
+   Worker>>many, TICKS times self tick. */
+static ST_Size makeSetup(ST_U8 *program) {
+    ST_U8 *out = begin(program), *length;
+    ST_U32 bodyLength;
+    int i;
+    *out++ = ST_VM_OP_PUSHSYMBOL8;
+    *out++ = SYM_Worker;
+    out = emit8(out, ST_VM_OP_GETGLOBAL8, SYM_Object);
+    out = emit8(out, ST_VM_OP_SENDMSG8, SYM_subclass);
+    out = emit8(out, ST_VM_OP_SETGLOBAL8, SYM_Worker);
+    out = emit8(out, ST_VM_OP_GETGLOBAL8, SYM_Worker);
+    *out++ = ST_VM_OP_SETMETHOD;
+    *out++ = SYM_many;
+    *out++ = 0;
+    *out++ = 0;
+    length = out;
+    out += 4;
+    for (i = 0; i < TICKS; ++i) {
+        out = tickOnce(out, 0);
+    }
+    *out++ = ST_VM_OP_RETURN;
+    bodyLength = out - (length + 4);
+    memcpy(length, &bodyLength, sizeof bodyLength);
+    return out - program;
+}
+
+/* TICKS times Worker tick, or Worker nested. Done := true. */
+static ST_Size makeScript(ST_U8 *program, int nesting) {
+    ST_U8 *out = begin(program);
+    int i;
+    if (nesting) {
+        out = emit8(out, ST_VM_OP_GETGLOBAL8, SYM_Worker);
+        out = emit8(out, ST_VM_OP_SENDMSG8, SYM_nested);
+        *out++ = ST_VM_OP_POP;
+    } else {
+        for (i = 0; i < TICKS; ++i) {
+            out = tickOnce(out, 1);
+        }
+    }
+    *out++ = ST_VM_OP_PUSHTRUE;
+    out = emit8(out, ST_VM_OP_SETGLOBAL8, SYM_Done);
+    return out - program;
+}
+
+static ST_U8 program[sizeof symbols + 8 * TICKS];
+
+/* Outlives makeContext, Worker>>many points into it */
+static ST_Code setup;
+
+static ST_Object makeContext(ST_Code *script, int nesting) {
+    ST_Configuration config = ST_DEFAULT_CONFIG;
+    ST_Object ctx = ST_createContext(&config), cWorker;
+    setup = ST_VM_load(ctx, program, makeSetup(program));
+    ST_VM_execute(ctx, &setup, 0);
+    cWorker = ST_getGlobal(ctx, ST_symb(ctx, "Worker"));
+    ST_setMethod(ctx, cWorker, ST_symb(ctx, "tick"), tick, 0);
+    ST_setMethod(ctx, cWorker, ST_symb(ctx, "nested"), nested, 0);
+    *script = ST_VM_load(ctx, program, makeScript(program, nesting));
+    tickCount = 0;
+    interruptAt = 0;
+    return ctx;
+}
+
+static int done(ST_Object ctx) {
+    return ST_getGlobal(ctx, ST_symb(ctx, "Done")) == ST_getTrue(ctx);
+}
+
+/* Each tick takes 3 instructions, and the run stops at the first send after
+   the budget ran out, that of the next tick. Other code can run while it's
+   stopped. */
+static int checkBudget(void) {
+    ST_Code script;
+    ST_Object ctx = makeContext(&script, 0);
+    int success = !ST_VM_executeFor(ctx, &script, 0, 300) &&
+                  tickCount == 101 && !done(ctx);
+    ST_sendMsg(ctx, ST_getGlobal(ctx, ST_symb(ctx, "Worker")),
+               ST_symb(ctx, "tick"), 0, NULL);
+    success = success && !ST_VM_continue(ctx, 30) && tickCount == 112 &&
+              ST_VM_continue(ctx, (ST_Size)-1) && tickCount == TICKS + 1 &&
+              done(ctx) && ST_VM_continue(ctx, 1);
+    ST_destroyContext(ctx);
+    return success;
+}
+
+static int checkInterrupt(void) {
+    ST_Code script;
+    ST_Object ctx = makeContext(&script, 0);
+    int success;
+    interruptAt = INTERRUPT_AT;
+    success = !ST_VM_executeFor(ctx, &script, 0, (ST_Size)-1) &&
+              tickCount == INTERRUPT_AT &&
+              ST_VM_continue(ctx, (ST_Size)-1) && tickCount == TICKS &&
+              done(ctx);
+    ST_destroyContext(ctx);
+    return success;
+}
+
+/* Code a primitive runs completes before the run stops */
+static int checkNested(void) {
+    ST_Code script;
+    ST_Object ctx = makeContext(&script, 1);
+    int success = !ST_VM_executeFor(ctx, &script, 0, 10) &&
+                  tickCount == TICKS && !done(ctx) &&
+                  ST_VM_continue(ctx, 10) && done(ctx);
+    ST_destroyContext(ctx);
+    return success;
+}
+
+int main() {
+    if (!checkBudget()) {
+        puts("runs don't stop when their budget runs out");
+        return EXIT_FAILURE;
+    }
+    if (!checkInterrupt()) {
+        puts("runs don't stop when interrupted");
+        return EXIT_FAILURE;
+    }
+    if (!checkNested()) {
+        puts("runs stop inside code primitives run");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,420 @@
+#include "../src/opcode.h"
+#include "../src/smalltalk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Foo := Object subclass: #Foo.
+   Foo>>getTrue ^true.
+   Result := Foo new getTrue. */
+#define PROGRAM_PREFIX                                                         \
+    'F', 'o', 'o', '\0', 'O', 'b', 'j', 'e', 'c', 't', '\0', 's', 'u', 'b',    \
+        'c', 'l', 'a', 's', 's', ':', '\0', 'g', 'e', 't', 'T', 'r', 'u', 'e', \
+        '\0', 'n', 'e', 'w', '\0', 'R', 'e', 's', 'u', 'l', 't', '\0', '\0',   \
+        ST_VM_OP_PUSHSYMBOL, 0, 0, ST_VM_OP_GETGLOBAL, 1, 0,                   \
+        ST_VM_OP_SENDMSG, 2, 0, ST_VM_OP_SETGLOBAL, 0, 0,                      \
+        ST_VM_OP_GETGLOBAL, 0, 0, ST_VM_OP_SETMETHOD, 3, 0, 0, 3, 0, 0, 0,     \
+        /* offset 23 */ ST_VM_OP_POP, ST_VM_OP_PUSHTRUE, ST_VM_OP_RETURN,      \
+        ST_VM_OP_GETGLOBAL, 0, 0, ST_VM_OP_SENDMSG, 4, 0
+
+static const ST_U8 sendProgram[] = {PROGRAM_PREFIX, ST_VM_OP_SENDMSG, 3, 0,
+                                    ST_VM_OP_SETGLOBAL, 5, 0};
+
+static const ST_U8 directProgram[] = {
+    PROGRAM_PREFIX, ST_VM_OP_SENDDIRECT, 3, 0, /* Foo */ 0, 0, /* argc */ 0,
+    /* definition */ 0, 0, 23, 0, 0, 0, ST_VM_OP_SETGLOBAL, 5, 0};
+
+static const ST_U8 inlineProgram[] = {
+    PROGRAM_PREFIX, ST_VM_OP_INLINEGUARD, 3, 0, /* Foo */ 0, 0,
+    /* definition */ 0, 0, 2, 0, 0, 0, ST_VM_OP_POP, ST_VM_OP_PUSHTRUE,
+    ST_VM_OP_SETGLOBAL, 5, 0};
+
+/* The guard names a definition that never ran, so the send must happen
+   instead of the (wrong) inlined body. */
+static const ST_U8 inlineFallbackProgram[] = {
+    PROGRAM_PREFIX, ST_VM_OP_INLINEGUARD, 3, 0, /* Foo */ 0, 0,
+    /* definition */ 1, 0, 2, 0, 0, 0, ST_VM_OP_POP, ST_VM_OP_PUSHFALSE,
+    ST_VM_OP_SETGLOBAL, 5, 0};
+
+/* A line table for sendProgram: top level code on lines 1 and 3 of
+   test.st, getTrue on line 2. */
+static const ST_U8 lineTable[] = {
+    /* strings */ 3, 't', 'e', 's', 't', '.', 's', 't', '\0', 'd', 'o', 'I',
+    't', '\0', 'g', 'e', 't', 'T', 'r', 'u', 'e', '\0',
+    /* entries */ 3, 0, 2, 0, 1, 23, 2, 0, 2, 3, 2, 0, 1};
+
+/* Where sendProgram's symbols and code are */
+enum {
+    SYMBOLS_SIZE = 40,
+    CODE_OFFSET = SYMBOLS_SIZE + 1,
+    CODE_SIZE = sizeof sendProgram - CODE_OFFSET,
+    DEBUG_SIZE = sizeof lineTable
+};
+
+static ST_U32 crc32c(const ST_U8 *data, ST_Size len) {
+    ST_U32 crc = 0xffffffffu;
+    int bit;
+    while (len--) {
+        crc ^= *data++;
+        for (bit = 0; bit < 8; ++bit) {
+            crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78u : crc >> 1;
+        }
+    }
+    return ~crc;
+}
+
+static ST_U8 *putU32(ST_U8 *out, ST_U32 value) {
+    int i;
+    for (i = 0; i < 4; ++i) {
+        *out++ = (value >> (8 * i)) & 0xff;
+    }
+    return out;
+}
+
+static ST_U8 *putSection(ST_U8 *entry, ST_U32 id, ST_Size offset,
+                         const ST_U8 *data, ST_Size len) {
+    entry = putU32(entry, id);
+    entry = putU32(entry, offset);
+    entry = putU32(entry, len);
+    return putU32(entry, crc32c(data, len));
+}
+
+/* sendProgram and its line table as a container, led by a
+   section of an unknown kind with a bad checksum, which loaders must skip
+   without reading. */
+static ST_Size makeContainer(ST_U8 *out) {
+    static const ST_U8 unknown[] = {1, 2, 3, 4};
+    const ST_Size headerSize = 8 + 4 * 16 + 4;
+    ST_Size offset = headerSize;
+    ST_U8 *entry = out + 8;
+    out[0] = 0x89, out[1] = 'S', out[2] = 'T', out[3] = 'B';
+    out[4] = 1, out[5] = 0, out[6] = 4, out[7] = 0;
+    entry = putSection(entry, 99, offset, unknown, sizeof unknown);
+    entry[-1] ^= 0xff;
+    memcpy(out + offset, unknown, sizeof unknown);
+    offset += sizeof unknown;
+    entry = putSection(entry, ST_VM_SECTION_SYMBOLS, offset, sendProgram,
+                       SYMBOLS_SIZE);
+    memcpy(out + offset, sendProgram, SYMBOLS_SIZE);
+    offset += SYMBOLS_SIZE;
+    entry = putSection(entry, ST_VM_SECTION_CODE, offset,
+                       sendProgram + CODE_OFFSET, CODE_SIZE);
+    memcpy(out + offset, sendProgram + CODE_OFFSET, CODE_SIZE);
+    offset += CODE_SIZE;
+    entry = putSection(entry, ST_VM_SECTION_DEBUG, offset, lineTable,
+                       DEBUG_SIZE);
+    memcpy(out + offset, lineTable, DEBUG_SIZE);
+    offset += DEBUG_SIZE;
+    putU32(entry, crc32c(out, headerSize - 4));
+    return offset;
+}
+
+/* sendProgram with its code as an LZ4 block of literals only. The block
+   claims to decompress to CODE_SIZE + sizeError bytes. */
+static ST_Size makeCompressed(ST_U8 *out, int sizeError) {
+    const ST_Size headerSize = 8 + 2 * 16 + 4;
+    ST_U8 packed[8 + CODE_SIZE];
+    ST_Size packedSize = 0;
+    ST_U8 *entry = out + 8;
+    putU32(packed, CODE_SIZE + sizeError);
+    packedSize += 4;
+    packed[packedSize++] = 0xf0;
+    packed[packedSize++] = CODE_SIZE - 15;
+    memcpy(packed + packedSize, sendProgram + CODE_OFFSET, CODE_SIZE);
+    packedSize += CODE_SIZE;
+    out[0] = 0x89, out[1] = 'S', out[2] = 'T', out[3] = 'B';
+    out[4] = 1, out[5] = 0, out[6] = 2, out[7] = 0;
+    entry = putSection(entry, ST_VM_SECTION_SYMBOLS, headerSize, sendProgram,
+                       SYMBOLS_SIZE);
+    memcpy(out + headerSize, sendProgram, SYMBOLS_SIZE);
+    entry = putSection(entry, ST_VM_SECTION_CODE_LZ4,
+                       headerSize + SYMBOLS_SIZE, packed, packedSize);
+    memcpy(out + headerSize + SYMBOLS_SIZE, packed, packedSize);
+    putU32(entry, crc32c(out, headerSize - 4));
+    return headerSize + SYMBOLS_SIZE + packedSize;
+}
+
+typedef ST_Code (*Loader)(ST_Object, const ST_U8 *, ST_Size);
+
+static int runWith(Loader load, const ST_U8 *data, ST_Size len) {
+    ST_Configuration config = ST_DEFAULT_CONFIG;
+    ST_Object context = ST_createContext(&config);
+    ST_Code code = load(context, data, len);
+    int success;
+    ST_VM_execute(context, &code, 0);
+    success = ST_getGlobal(context, ST_symb(context, "Result")) ==
+              ST_getTrue(context);
+    ST_destroyContext(context);
+    return success;
+}
+
+static int run(const ST_U8 *data, ST_Size len) {
+    return runWith(ST_VM_load, data, len);
+}
+
+static int checkLocation(const ST_Code *code, ST_Size offset,
+                         const char *method, ST_U32 line) {
+    const ST_SourceLocation location = ST_VM_sourceLocation(code, offset);
+    return location.file && strcmp(location.file, "test.st") == 0 &&
+           strcmp(location.method, method) == 0 && location.line == line;
+}
+
+static int checkLines(void) {
+    ST_Configuration config = ST_DEFAULT_CONFIG;
+    ST_Object context = ST_createContext(&config);
+    ST_U8 container[256];
+    const ST_Size len = makeContainer(container);
+    ST_Code code = ST_VM_load(context, container, len);
+    int success = checkLocation(&code, 0, "doIt", 1) &&
+                  checkLocation(&code, 23, "getTrue", 2) &&
+                  checkLocation(&code, 25, "getTrue", 2) &&
+                  checkLocation(&code, 32, "doIt", 3) &&
+                  !ST_VM_sourceLocation(&code, code.length).file;
+    ST_VM_execute(context, &code, 0);
+    success = success && ST_getGlobal(context, ST_symb(context, "Result")) ==
+                             ST_getTrue(context);
+    ST_destroyContext(context);
+    return success;
+}
+
+/* Feeds the code in chunks of chunkSize bytes, running what arrived whole
+   after each one if runEarly is set. */
+static int runStreamed(const ST_U8 *data, ST_Size len, ST_Size chunkSize,
+                       int runEarly, int hasLines) {
+    ST_Configuration config = ST_DEFAULT_CONFIG;
+    ST_Object context = ST_createContext(&config);
+    ST_Loader *loader = ST_VM_beginLoad(context);
+    ST_Code *code;
+    ST_Size i;
+    int success;
+    for (i = 0; i < len; i += chunkSize) {
+        ST_VM_feed(loader, data + i, len - i < chunkSize ? len - i : chunkSize);
+        if (runEarly) {
+            ST_VM_runLoaded(loader);
+        }
+    }
+    code = ST_VM_finishLoad(loader);
+    ST_VM_runLoaded(loader);
+    success = ST_getGlobal(context, ST_symb(context, "Result")) ==
+                  ST_getTrue(context) &&
+              code->symbolCount == 6 &&
+              (!hasLines || checkLocation(code, 23, "getTrue", 2));
+    ST_destroyContext(context);
+    return success;
+}
+
+/* One copy of the code, linked into several contexts */
+static int checkShared(const ST_U8 *data, ST_Size len) {
+    enum { CONTEXTS = 3 };
+    ST_Configuration config = ST_DEFAULT_CONFIG;
+    ST_SharedCode *shared = ST_VM_loadShared(&config, data, len);
+    ST_Object contexts[CONTEXTS];
+    ST_Code *codes[CONTEXTS];
+    int i, success = shared != NULL;
+    for (i = 0; i < CONTEXTS && success; ++i) {
+        contexts[i] = ST_createContext(&config);
+        codes[i] = ST_VM_link(contexts[i], shared);
+        ST_VM_execute(contexts[i], codes[i], 0);
+        success = ST_getGlobal(contexts[i], ST_symb(contexts[i], "Result")) ==
+                      ST_getTrue(contexts[i]) &&
+                  codes[i]->instructions == codes[0]->instructions &&
+                  codes[i]->symbTab[0] == ST_symb(contexts[i], "Foo");
+    }
+    while (i--) {
+        ST_destroyContext(contexts[i]);
+    }
+    if (shared) {
+        ST_VM_releaseShared(shared);
+    }
+    return success;
+}
+
+static int checkContainer(void) {
+    ST_U8 container[256];
+    const ST_Size len = makeContainer(container);
+    ST_Configuration config = ST_DEFAULT_CONFIG;
+    ST_Object context;
+    ST_Code code;
+    if (!run(container, len) ||
+        !runWith(ST_VM_loadInPlace, container, len) ||
+        !runStreamed(container, len, 1, 1, 1) ||
+        !runStreamed(container, len, 9, 1, 1) ||
+        !runStreamed(container, len, 7, 0, 1) ||
+        !checkShared(container, len)) {
+        puts("container returned wrong value");
+        return 0;
+    }
+    context = ST_createContext(&config);
+    code = ST_VM_load(context, container, len);
+    if (!checkLocation(&code, 23, "getTrue", 2)) {
+        puts("container line table lookup failed");
+        return 0;
+    }
+    ST_destroyContext(context);
+    container[len - DEBUG_SIZE - 1] ^= 1;
+    if (run(container, len) || runStreamed(container, len, 3, 1, 0)) {
+        puts("ran a damaged container");
+        return 0;
+    }
+    container[len - DEBUG_SIZE - 1] ^= 1;
+    if (run(container, len - 1)) {
+        puts("ran a truncated container");
+        return 0;
+    }
+    return 1;
+}
+
+static int checkCompressed(void) {
+    ST_U8 container[256];
+    ST_Size len = makeCompressed(container, 0);
+    int i;
+    if (!run(container, len) ||
+        !runWith(ST_VM_loadInPlace, container, len) ||
+        !runStreamed(container, len, 1, 1, 0) ||
+        !runStreamed(container, len, 11, 0, 0) ||
+        !checkShared(container, len)) {
+        puts("compressed code returned wrong value");
+        return 0;
+    }
+    for (i = -1; i <= 1; i += 2) {
+        len = makeCompressed(container, i);
+        if (run(container, len) || runStreamed(container, len, 4, 1, 0)) {
+            puts("ran code that decompressed to the wrong size");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Live bytes of the contexts that allocate through trackedAlloc, and the
+   most there were */
+static ST_Size liveBytes, peakBytes;
+
+typedef union Block {
+    size_t size;
+    double align;
+    void *pointer;
+} Block;
+
+static void *trackedAlloc(void *user, size_t size) {
+    Block *block = malloc(sizeof(Block) + size);
+    block->size = size;
+    liveBytes += size;
+    if (liveBytes > peakBytes) {
+        peakBytes = liveBytes;
+    }
+    return block + 1;
+}
+
+static void trackedFree(void *user, void *memory) {
+    Block *block = (Block *)memory - 1;
+    liveBytes -= block->size;
+    free(block);
+}
+
+enum {
+    LOAD_LIMIT = 4096,
+    /* The loader itself and the symbols it interned */
+    LOADER_OVERHEAD = 1024,
+    ENDLESS = 1 << 20
+};
+
+/* Feeds data, then ENDLESS more bytes of filler, to a loader limited to
+   LOAD_LIMIT. Returns whether the load failed, taking no more memory than
+   that on the way. */
+static int failsWithin(const ST_U8 *data, ST_Size len, ST_U8 filler) {
+    ST_Configuration config = ST_DEFAULT_CONFIG;
+    ST_U8 chunk[1000];
+    ST_Object context;
+    ST_Loader *loader;
+    ST_Size fed, before;
+    int failed;
+    config.memory.userAllocFn = trackedAlloc;
+    config.memory.userFreeFn = trackedFree;
+    context = ST_createContext(&config);
+    before = peakBytes = liveBytes;
+    loader = ST_VM_beginLoad(context);
+    ST_VM_limitLoad(loader, LOAD_LIMIT);
+    ST_VM_feed(loader, data, len);
+    memset(chunk, filler, sizeof chunk);
+    for (fed = 0; fed < ENDLESS; fed += sizeof chunk) {
+        ST_VM_feed(loader, chunk, sizeof chunk);
+    }
+    failed = ST_VM_finishLoad(loader)->length == 0 &&
+             peakBytes - before <= LOAD_LIMIT + LOADER_OVERHEAD;
+    ST_destroyContext(context);
+    return failed;
+}
+
+/* Code that fits loads as without a limit, while a symbol name, code or a
+   compressed section that outgrows it fails the load */
+static int checkLoadLimit(void) {
+    ST_Configuration config = ST_DEFAULT_CONFIG;
+    ST_Object context = ST_createContext(&config);
+    ST_Loader *loader = ST_VM_beginLoad(context);
+    ST_U8 container[256];
+    const ST_Size len = makeCompressed(container, ENDLESS);
+    int success;
+    ST_VM_limitLoad(loader, LOAD_LIMIT);
+    ST_VM_feed(loader, sendProgram, sizeof sendProgram);
+    ST_VM_finishLoad(loader);
+    ST_VM_runLoaded(loader);
+    success = ST_getGlobal(context, ST_symb(context, "Result")) ==
+              ST_getTrue(context);
+    ST_destroyContext(context);
+    return success && failsWithin(sendProgram, 0, 'a') &&
+           failsWithin(sendProgram, CODE_OFFSET, ST_VM_OP_PUSHNIL) &&
+           failsWithin(container, len, 0);
+}
+
+int main() {
+    ST_Configuration config = ST_DEFAULT_CONFIG;
+    if (!run(sendProgram, sizeof sendProgram)) {
+        puts("compiled method send returned wrong value");
+        return EXIT_FAILURE;
+    }
+    if (!run(directProgram, sizeof directProgram)) {
+        puts("direct send returned wrong value");
+        return EXIT_FAILURE;
+    }
+    if (!run(inlineProgram, sizeof inlineProgram)) {
+        puts("inlined send returned wrong value");
+        return EXIT_FAILURE;
+    }
+    if (!run(inlineFallbackProgram, sizeof inlineFallbackProgram)) {
+        puts("inline guard didn't fall back to a send");
+        return EXIT_FAILURE;
+    }
+    if (!runWith(ST_VM_loadInPlace, sendProgram, sizeof sendProgram)) {
+        puts("code loaded in place returned wrong value");
+        return EXIT_FAILURE;
+    }
+    if (!runStreamed(sendProgram, sizeof sendProgram, 1, 1, 0) ||
+        !runStreamed(inlineProgram, sizeof inlineProgram, 5, 1, 0)) {
+        puts("streamed code returned wrong value");
+        return EXIT_FAILURE;
+    }
+    if (!checkContainer()) {
+        return EXIT_FAILURE;
+    }
+    if (!checkShared(sendProgram, sizeof sendProgram)) {
+        puts("shared code returned wrong value");
+        return EXIT_FAILURE;
+    }
+    if (!checkCompressed()) {
+        return EXIT_FAILURE;
+    }
+    if (ST_VM_loadShared(&config, sendProgram, SYMBOLS_SIZE)) {
+        puts("shared an unterminated symbol table");
+        return EXIT_FAILURE;
+    }
+    if (!checkLines()) {
+        puts("line table lookup failed");
+        return EXIT_FAILURE;
+    }
+    if (!checkLoadLimit()) {
+        puts("the streaming loader went past its limit");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,132 @@
+#include "programs.hpp"
+
+#include "../util/cache.hpp"
+#include "../util/optimizer.hpp"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* Box>>answer, #answer DUP POP RETURN, and Answer := Box new answer */
+static st::Program makeProgram(const char *answer) {
+    Assembler a;
+    a.subclass("Box");
+    size_t method = a.beginMethod("Box", "answer");
+    a.op(ST_VM_OP_PUSHSYMBOL, answer)
+        .op(ST_VM_OP_DUP)
+        .op(ST_VM_OP_POP)
+        .op(ST_VM_OP_RETURN)
+        .endMethod(method);
+    a.op(ST_VM_OP_GETGLOBAL, "Box")
+        .op(ST_VM_OP_SENDMSG, "new")
+        .op(ST_VM_OP_SENDMSG, "answer")
+        .op(ST_VM_OP_SETGLOBAL, "Answer");
+    return a.program;
+}
+
+/* What bcopt does with a cache */
+static std::vector<uint8_t> compile(st::CompileCache &cache,
+                                    const std::vector<uint8_t> &source,
+                                    bool &hit) {
+    const std::string key = st::CompileCache::key(source, "bcopt");
+    std::vector<uint8_t> compiled;
+    hit = cache.lookup(key, compiled);
+    if (!hit) {
+        st::Program program = st::decode(source);
+        st::optimize(program);
+        compiled = st::encode(program);
+        cache.store(key, compiled);
+    }
+    return compiled;
+}
+
+static std::vector<std::string> entries(const std::string &directory) {
+    std::vector<std::string> names;
+    DIR *dir = opendir(directory.c_str());
+    while (struct dirent *dent = readdir(dir)) {
+        if (dent->d_name[0] != '.') {
+            names.push_back(directory + "/" + dent->d_name);
+        }
+    }
+    closedir(dir);
+    return names;
+}
+
+static void removeAll(const std::string &directory) {
+    for (auto &path : entries(directory)) {
+        remove(path.c_str());
+    }
+    rmdir(directory.c_str());
+}
+
+/* Cached results run like the source, and only match their own source */
+static int checkHits(const std::string &directory) {
+    const std::vector<const char *> globals = {"Answer"};
+    const std::vector<uint8_t> source = st::encode(makeProgram("answer"));
+    const std::vector<uint8_t> other = st::encode(makeProgram("other"));
+    st::CompileCache cache(directory, 1 << 20);
+    bool hit;
+    const std::vector<uint8_t> compiled = compile(cache, source, hit);
+    int success = !hit && compiled.size() < source.size();
+    success = success && compile(cache, source, hit) == compiled && hit &&
+              run(compiled, globals) == run(source, globals) &&
+              run(compiled, globals)[0] == "#answer";
+    success = success && run(compile(cache, other, hit), globals)[0] ==
+                             "#other" &&
+              !hit;
+    success = success && st::CompileCache::key(source, "bcopt") !=
+                             st::CompileCache::key(source, "bcopt -x");
+    removeAll(directory);
+    return success;
+}
+
+/* A damaged entry misses, and is replaced */
+static int checkDamage(const std::string &directory) {
+    const std::vector<uint8_t> source = st::encode(makeProgram("answer"));
+    st::CompileCache cache(directory, 1 << 20);
+    bool hit;
+    const std::vector<uint8_t> compiled = compile(cache, source, hit);
+    const std::string path = entries(directory).front();
+    std::vector<uint8_t> entry = st::readFile(path);
+    entry.back() ^= 0xff;
+    st::writeFile(path, entry);
+    int success = compile(cache, source, hit) == compiled && !hit;
+    success = success && compile(cache, source, hit) == compiled && hit;
+    removeAll(directory);
+    return success;
+}
+
+/* The cache stays within its size */
+static int checkEviction(const std::string &directory) {
+    const std::vector<uint8_t> first = st::encode(makeProgram("first"));
+    const std::vector<uint8_t> second = st::encode(makeProgram("second"));
+    st::CompileCache cache(directory, first.size() + 64);
+    bool hit;
+    compile(cache, first, hit);
+    compile(cache, second, hit);
+    const int success = entries(directory).size() == 1;
+    removeAll(directory);
+    return success;
+}
+
+int main() {
+    char directory[] = "/tmp/st-cache-XXXXXX";
+    if (!mkdtemp(directory)) {
+        puts("can't make a cache directory");
+        return EXIT_FAILURE;
+    }
+    if (!checkHits(directory)) {
+        puts("cached code differs from the source, or the wrong one hit");
+        return EXIT_FAILURE;
+    }
+    if (!checkDamage(directory)) {
+        puts("damaged cache entries were used");
+        return EXIT_FAILURE;
+    }
+    if (!checkEviction(directory)) {
+        puts("the cache outgrew its size");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
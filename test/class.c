@@ -30,8 +30,107 @@ int testClass(ST_Object context) {
     return EXIT_SUCCESS;
 }
 
+static ST_Object answerOne(ST_Object context, ST_Object self,
+                           ST_Object argv[]) {
+    return ST_getInteger(context, 1);
+}
+
+static ST_Object answerTwo(ST_Object context, ST_Object self,
+                           ST_Object argv[]) {
+    return ST_getInteger(context, 2);
+}
+
+/* Prepared before the method exists, and used on a subclass's instance that
+   overrides it */
+int testPreparedSend(ST_Object context) {
+    ST_Object subcSymb = ST_symb(context, "subclass:");
+    ST_Object newSymb = ST_symb(context, "new");
+    ST_Object answerSymb = ST_symb(context, "answer");
+    ST_Object widjetName = ST_symb(context, "Widjet");
+    ST_Object gadgetName = ST_symb(context, "Gadget");
+    ST_Object widjetClass =
+        ST_sendMsg(context, ST_getGlobal(context, ST_symb(context, "Object")),
+                   subcSymb, 1, &widjetName);
+    ST_Object gadgetClass =
+        ST_sendMsg(context, widjetClass, subcSymb, 1, &gadgetName);
+    ST_PreparedSend send =
+        ST_prepareSend(context, widjetClass, answerSymb, 0);
+    ST_Object *locals = ST_pushLocals(context, 2);
+    int success;
+    locals[0] = ST_sendMsg(context, widjetClass, newSymb, 0, NULL);
+    locals[1] = ST_sendMsg(context, gadgetClass, newSymb, 0, NULL);
+    ST_setMethod(context, widjetClass, answerSymb, answerOne, 0);
+    success =
+        ST_unboxInt(context, ST_invokePrepared(context, &send, locals[0],
+                                               NULL)) == 1 &&
+        ST_unboxInt(context, ST_invokePrepared(context, &send, locals[1],
+                                               NULL)) == 1;
+    ST_setMethod(context, gadgetClass, answerSymb, answerTwo, 0);
+    success =
+        success &&
+        ST_unboxInt(context, ST_invokePrepared(context, &send, locals[0],
+                                               NULL)) == 1 &&
+        ST_unboxInt(context, ST_invokePrepared(context, &send, locals[1],
+                                               NULL)) == 2;
+    ST_popLocals(context);
+    ST_destroyContext(context);
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static ST_Object answerSelf(ST_Object context, ST_Object self,
+                            ST_Object argv[]) {
+    return self;
+}
+
+static ST_Object answerArg(ST_Object context, ST_Object self,
+                           ST_Object argv[]) {
+    return argv[0];
+}
+
+static const char *const pointIvars[] = {"x", "y", NULL};
+
+static const ST_MethodDef pointMethods[] = {
+    {"one", answerOne, 0},  {"two", answerTwo, 0}, {"yourself", answerSelf, 0},
+    {"with:", answerArg, 1}, {"one", answerTwo, 0}, {"alsoOne", answerOne, 0}};
+
+/* Every method answers, and the first of two definitions wins */
+int testDefineClass(ST_Object context) {
+    ST_Object object = ST_getGlobal(context, ST_symb(context, "Object"));
+    ST_Object point =
+        ST_defineClass(context, object, "Point", pointIvars, pointMethods,
+                       sizeof pointMethods / sizeof pointMethods[0]);
+    ST_Object *locals = ST_pushLocals(context, 1);
+    ST_Object arg = ST_getTrue(context);
+    int success;
+    locals[0] = ST_sendMsg(context, point, ST_symb(context, "new"), 0, NULL);
+    success =
+        ST_getGlobal(context, ST_symb(context, "Point")) == point &&
+        ST_getSuper(context, locals[0]) == object &&
+        ST_unboxInt(context, ST_sendMsg(context, locals[0],
+                                        ST_symb(context, "one"), 0, NULL)) ==
+            1 &&
+        ST_unboxInt(context, ST_sendMsg(context, locals[0],
+                                        ST_symb(context, "two"), 0, NULL)) ==
+            2 &&
+        ST_unboxInt(context, ST_sendMsg(context, locals[0],
+                                        ST_symb(context, "alsoOne"), 0,
+                                        NULL)) == 1 &&
+        ST_sendMsg(context, locals[0], ST_symb(context, "yourself"), 0,
+                   NULL) == locals[0] &&
+        ST_sendMsg(context, locals[0], ST_symb(context, "with:"), 1, &arg) ==
+            arg;
+    ST_popLocals(context);
+    ST_destroyContext(context);
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 int main() {
     ST_Configuration config = ST_DEFAULT_CONFIG;
-    ST_Object context = ST_createContext(&config);
-    return testClass(context);
+    if (testClass(ST_createContext(&config)) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    if (testPreparedSend(ST_createContext(&config)) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    return testDefineClass(ST_createContext(&config));
 }
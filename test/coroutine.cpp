@@ -0,0 +1,162 @@
+#include "../src/opcode.h"
+#include "../util/async.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+/* The program of test/async.c, with st::Async primitives instead:
+   Worker := Object subclass: #Worker.
+   Worker>>run Result := self fetch.
+   Worker>>runNow Result := self fetchNow. */
+static const ST_U8 program[] = {
+    'W', 'o', 'r', 'k', 'e', 'r', '\0', 'O', 'b', 'j', 'e', 'c', 't', '\0',
+    's', 'u', 'b', 'c', 'l', 'a', 's', 's', ':', '\0', 'r', 'u', 'n', '\0',
+    'f', 'e', 't', 'c', 'h', '\0', 'R', 'e', 's', 'u', 'l', 't', '\0', 'r',
+    'u', 'n', 'N', 'o', 'w', '\0', 'f', 'e', 't', 'c', 'h', 'N', 'o', 'w',
+    '\0', '\0', ST_VM_OP_PUSHSYMBOL, 0, 0, ST_VM_OP_GETGLOBAL, 1, 0,
+    ST_VM_OP_SENDMSG, 2, 0, ST_VM_OP_SETGLOBAL, 0, 0, ST_VM_OP_GETGLOBAL, 0,
+    0, ST_VM_OP_SETMETHOD, 3, 0, 0, 6, 0, 0, 0, ST_VM_OP_DUP,
+    ST_VM_OP_SENDMSG8, 4, ST_VM_OP_SETGLOBAL8, 5, ST_VM_OP_RETURN,
+    ST_VM_OP_GETGLOBAL, 0, 0, ST_VM_OP_SETMETHOD, 6, 0, 0, 6, 0, 0, 0,
+    ST_VM_OP_DUP, ST_VM_OP_SENDMSG8, 7, ST_VM_OP_SETGLOBAL8, 5,
+    ST_VM_OP_RETURN};
+
+/* "Slow work": suspends until the test completes it with a value */
+struct Download {
+    ST_S32 value = 0;
+
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> handle);
+    ST_S32 await_resume() { return value; }
+};
+
+struct Started {
+    std::coroutine_handle<> handle;
+    Download *download;
+};
+
+static std::vector<Started> started;
+static int liveFrames;
+
+void Download::await_suspend(std::coroutine_handle<> handle) {
+    started.push_back({handle, this});
+}
+
+static void complete(size_t i, ST_S32 value) {
+    started[i].download->value = value;
+    started[i].handle.resume();
+}
+
+/* Counts the coroutine frames that haven't been freed */
+struct Frame {
+    Frame() { ++liveFrames; }
+    ~Frame() { --liveFrames; }
+};
+
+static st::Async download(ST_Object ctx) {
+    Frame frame;
+    const ST_S32 value = co_await Download();
+    co_return ST_getInteger(ctx, 40 + value);
+}
+
+static st::Async downloadNow(ST_Object ctx) {
+    Frame frame;
+    co_return ST_getInteger(ctx, 7);
+}
+
+static ST_Object fetch(ST_Object ctx, ST_Object self, ST_Object argv[]) {
+    return st::await(ctx, download(ctx));
+}
+
+static ST_Object fetchNow(ST_Object ctx, ST_Object self, ST_Object argv[]) {
+    return st::await(ctx, downloadNow(ctx));
+}
+
+static ST_Object setup(ST_Code *code) {
+    ST_Configuration config = ST_DEFAULT_CONFIG;
+    ST_Object ctx = ST_createContext(&config);
+    *code = ST_VM_load(ctx, program, sizeof program);
+    ST_VM_execute(ctx, code, 0);
+    ST_Object cWorker = ST_getGlobal(ctx, ST_symb(ctx, "Worker"));
+    ST_setMethod(ctx, cWorker, ST_symb(ctx, "fetch"), fetch, 0);
+    ST_setMethod(ctx, cWorker, ST_symb(ctx, "fetchNow"), fetchNow, 0);
+    started.clear();
+    return ctx;
+}
+
+static void forkWorker(ST_Object ctx, const char *selector) {
+    ST_fork(ctx, ST_getGlobal(ctx, ST_symb(ctx, "Worker")),
+            ST_symb(ctx, selector), 0, NULL, ST_PRIORITY_DEFAULT);
+}
+
+static ST_S32 result(ST_Object ctx) {
+    ST_Object value = ST_getGlobal(ctx, ST_symb(ctx, "Result"));
+    return value == ST_getNil(ctx) ? -1 : ST_unboxInt(ctx, value);
+}
+
+/* Two processes wait on their own coroutines, completed out of order, and
+   the finished coroutines free themselves */
+static int checkResume(void) {
+    ST_Code code;
+    ST_Object ctx = setup(&code);
+    forkWorker(ctx, "run");
+    forkWorker(ctx, "run");
+    int success = ST_runProcesses(ctx, 0, NULL) == 2 &&
+                  started.size() == 2 && liveFrames == 2 && result(ctx) == -1;
+    if (success) {
+        complete(1, 1);
+        success = ST_runProcesses(ctx, 0, NULL) == 1 && result(ctx) == 41;
+    }
+    if (success) {
+        complete(0, 2);
+        success = ST_runProcesses(ctx, 0, NULL) == 0 && result(ctx) == 42;
+    }
+    ST_destroyContext(ctx);
+    return success && liveFrames == 0;
+}
+
+/* A coroutine that doesn't suspend answers its value right away */
+static int checkImmediate(void) {
+    ST_Code code;
+    ST_Object ctx = setup(&code);
+    forkWorker(ctx, "runNow");
+    const int success = ST_runProcesses(ctx, 0, NULL) == 0 &&
+                        result(ctx) == 7 && started.empty();
+    ST_destroyContext(ctx);
+    return success && liveFrames == 0;
+}
+
+/* Outside a process nothing can wait: the send answers nil, and the
+   coroutine's value is dropped when it completes */
+static int checkCantWait(void) {
+    ST_Code code;
+    ST_Object ctx = setup(&code);
+    ST_Object answer =
+        ST_sendMsg(ctx, ST_getGlobal(ctx, ST_symb(ctx, "Worker")),
+                   ST_symb(ctx, "fetch"), 0, NULL);
+    int success = answer == ST_getNil(ctx) && started.size() == 1;
+    if (success) {
+        complete(0, 1);
+        success = result(ctx) == -1;
+    }
+    ST_destroyContext(ctx);
+    return success && liveFrames == 0;
+}
+
+int main() {
+    if (!checkResume()) {
+        puts("coroutine primitives don't resume their processes");
+        return EXIT_FAILURE;
+    }
+    if (!checkImmediate()) {
+        puts("coroutines that don't suspend are broken");
+        return EXIT_FAILURE;
+    }
+    if (!checkCantWait()) {
+        puts("coroutines that can't wait are broken");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,291 @@
+#include "../src/opcode.h"
+#include "../src/smalltalk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Foo := Object subclass: #Foo.
+   Foo>>getTrue ^true. */
+static const ST_U8 program[] = {
+    'F', 'o', 'o', '\0', 'O', 'b', 'j', 'e', 'c', 't', '\0', 's', 'u', 'b',
+    'c', 'l', 'a', 's', 's', ':', '\0', 'g', 'e', 't', 'T', 'r', 'u', 'e',
+    '\0', '\0', ST_VM_OP_PUSHSYMBOL, 0, 0, ST_VM_OP_GETGLOBAL, 1, 0,
+    ST_VM_OP_SENDMSG, 2, 0, ST_VM_OP_SETGLOBAL, 0, 0, ST_VM_OP_GETGLOBAL, 0,
+    0, ST_VM_OP_SETMETHOD, 3, 0, 0, 3, 0, 0, 0, ST_VM_OP_POP,
+    ST_VM_OP_PUSHTRUE, ST_VM_OP_RETURN};
+
+static ST_Object makeInteger(ST_Object ctx, ST_S32 value) {
+    ST_Object cInt = ST_getGlobal(ctx, ST_symb(ctx, "Integer"));
+    ST_Object integer = ST_sendMsg(ctx, cInt, ST_symb(ctx, "new"), 0, NULL);
+    ST_Object raw = (ST_Object)(intptr_t)value;
+    ST_sendMsg(ctx, integer, ST_symb(ctx, "rawSet:"), 1, &raw);
+    return integer;
+}
+
+/* Builds some state worth restoring: a class defined by bytecode, a global
+   holding an instance, and a global array holding an Integer. */
+static ST_Object buildContext(ST_Code *code) {
+    ST_Configuration config = ST_DEFAULT_CONFIG;
+    ST_Object ctx = ST_createContext(&config);
+    ST_Object cFoo, cArray, array, argv[2];
+    *code = ST_VM_load(ctx, program, sizeof program);
+    ST_VM_execute(ctx, code, 0);
+    cFoo = ST_getGlobal(ctx, ST_symb(ctx, "Foo"));
+    ST_setGlobal(ctx, ST_symb(ctx, "AFoo"),
+                 ST_sendMsg(ctx, cFoo, ST_symb(ctx, "new"), 0, NULL));
+    cArray = ST_getGlobal(ctx, ST_symb(ctx, "Array"));
+    argv[0] = makeInteger(ctx, 3);
+    array = ST_sendMsg(ctx, cArray, ST_symb(ctx, "new:"), 1, argv);
+    ST_setGlobal(ctx, ST_symb(ctx, "AnArray"), array);
+    argv[0] = makeInteger(ctx, 1);
+    argv[1] = makeInteger(ctx, 42);
+    ST_sendMsg(ctx, array, ST_symb(ctx, "at:put:"), 2, argv);
+    return ctx;
+}
+
+static int checkContext(ST_Object ctx) {
+    ST_Object foo = ST_getGlobal(ctx, ST_symb(ctx, "AFoo"));
+    ST_Object array = ST_getGlobal(ctx, ST_symb(ctx, "AnArray"));
+    ST_Object index = makeInteger(ctx, 1);
+    ST_Object element, sum;
+    if (ST_sendMsg(ctx, foo, ST_symb(ctx, "getTrue"), 0, NULL) !=
+        ST_getTrue(ctx)) {
+        puts("restored compiled method returned wrong value");
+        return 0;
+    }
+    if (strcmp(ST_repr(ctx, foo), "Foo") != 0) {
+        puts("restored instance has the wrong class");
+        return 0;
+    }
+    element = ST_sendMsg(ctx, array, ST_symb(ctx, "at:"), 1, &index);
+    if (ST_unboxInt(ctx, element) != 42) {
+        puts("restored array lost its contents");
+        return 0;
+    }
+    sum = ST_sendMsg(ctx, element, ST_symb(ctx, "+"), 1, &index);
+    if (ST_unboxInt(ctx, sum) != 43) {
+        puts("restored Integer primitives are broken");
+        return 0;
+    }
+    /* Compaction moves objects, so look everything up again */
+    ST_GC_run(ctx);
+    array = ST_getGlobal(ctx, ST_symb(ctx, "AnArray"));
+    index = makeInteger(ctx, 1);
+    element = ST_sendMsg(ctx, array, ST_symb(ctx, "at:"), 1, &index);
+    if (ST_unboxInt(ctx, element) != 42) {
+        puts("restored context doesn't survive gc");
+        return 0;
+    }
+    return 1;
+}
+
+static ST_Object answer(ST_Object ctx, ST_Object self, ST_Object argv[]) {
+    return makeInteger(ctx, 42);
+}
+
+/* A clone restores the template's state, keeps its host primitives and is
+   independent of it */
+static int checkClone(void) {
+    ST_Code code;
+    ST_Object template = buildContext(&code);
+    ST_Object clone, cFoo, foo, answered;
+    int success;
+    ST_setMethod(template, ST_getGlobal(template, ST_symb(template, "Foo")),
+                 ST_symb(template, "answer"), answer, 0);
+    clone = ST_cloneContext(template);
+    if (!clone) {
+        puts("failed to clone context");
+        return 0;
+    }
+    ST_setGlobal(clone, ST_symb(clone, "AFoo"), ST_getNil(clone));
+    success = ST_getGlobal(template, ST_symb(template, "AFoo")) !=
+              ST_getNil(template);
+    ST_destroyContext(template);
+    cFoo = ST_getGlobal(clone, ST_symb(clone, "Foo"));
+    foo = ST_sendMsg(clone, cFoo, ST_symb(clone, "new"), 0, NULL);
+    ST_setGlobal(clone, ST_symb(clone, "AFoo"), foo);
+    answered = ST_sendMsg(clone, foo, ST_symb(clone, "answer"), 0, NULL);
+    success = success && ST_unboxInt(clone, answered) == 42;
+    if (!success) {
+        puts("clone isn't independent of its template");
+    }
+    success = success && checkContext(clone);
+    ST_destroyContext(clone);
+    return success;
+}
+
+/* Clones of a snapshot outlive the template, and are independent of each
+   other */
+static int checkSnapshot(void) {
+    ST_Code code;
+    ST_Object template = buildContext(&code);
+    ST_Object first, second, answered;
+    ST_Snapshot *snapshot;
+    int success;
+    ST_setMethod(template, ST_getGlobal(template, ST_symb(template, "Foo")),
+                 ST_symb(template, "answer"), answer, 0);
+    snapshot = ST_snapshotContext(template);
+    ST_destroyContext(template);
+    if (!snapshot) {
+        puts("failed to snapshot context");
+        return 0;
+    }
+    first = ST_cloneSnapshot(snapshot);
+    second = ST_cloneSnapshot(snapshot);
+    success = first && second;
+    if (success) {
+        ST_setGlobal(first, ST_symb(first, "AnArray"), ST_getNil(first));
+        answered = ST_sendMsg(second,
+                              ST_getGlobal(second, ST_symb(second, "AFoo")),
+                              ST_symb(second, "answer"), 0, NULL);
+        success = ST_unboxInt(second, answered) == 42 &&
+                  checkContext(second) &&
+                  ST_sendMsg(first, ST_getGlobal(first, ST_symb(first, "AFoo")),
+                             ST_symb(first, "getTrue"), 0,
+                             NULL) == ST_getTrue(first);
+    }
+    if (first) {
+        ST_destroyContext(first);
+    }
+    if (second) {
+        ST_destroyContext(second);
+    }
+    ST_releaseSnapshot(snapshot);
+    if (!success) {
+        puts("clones of a snapshot are broken");
+    }
+    return success;
+}
+
+/* Words of an image in this build's layout, see ST_Image_save: the magic,
+   the size of ST_Size, then the header's counts. References keep their kind
+   in the low bits. */
+enum { REF_SHIFT = 3, REF_HEAP = 1, REF_SYMBOL = 2, REF_CLASS = 3 };
+
+static ST_Size wordAt(const ST_U8 *image, ST_Size at) {
+    ST_Size word;
+    memcpy(&word, image + at, sizeof word);
+    return word;
+}
+
+static void setWordAt(ST_U8 *image, ST_Size at, ST_Size word) {
+    memcpy(image + at, &word, sizeof word);
+}
+
+static int loads(const ST_U8 *image, ST_Size size) {
+    ST_Configuration config = ST_DEFAULT_CONFIG;
+    ST_Object ctx = ST_loadImage(&config, image, size);
+    if (ctx) {
+        ST_destroyContext(ctx);
+    }
+    return ctx != NULL;
+}
+
+/* Where Foo>>getTrue's record starts: its selector, compiled, no
+   arguments, from the only code, at an offset into it, its first
+   definition. Foo's own record ends right before it. 0 if there isn't
+   exactly one. */
+static ST_Size findMethod(const ST_U8 *image, ST_Size size) {
+    const ST_Size w = sizeof(ST_Size);
+    ST_Size at, found = 0, count = 0;
+    for (at = 5 + 5 * w; at + 6 * w <= size; ++at) {
+        if ((wordAt(image, at) & 7) == REF_SYMBOL &&
+            wordAt(image, at + w) == 1 && wordAt(image, at + 2 * w) == 0 &&
+            wordAt(image, at + 3 * w) == 0 &&
+            wordAt(image, at + 4 * w) < sizeof program &&
+            wordAt(image, at + 5 * w) == 0) {
+            found = at;
+            ++count;
+        }
+    }
+    return count == 1 ? found : 0;
+}
+
+/* Images that refer into the middle of an object, to code past the end of
+   a method's, or to superclasses that lead back around don't load */
+static int checkMalformed(ST_U8 *image, ST_Size size) {
+    const ST_Size w = sizeof(ST_Size);
+    const ST_Size classCount = wordAt(image, 5 + 3 * w);
+    /* nil, the first of the context's references at the end */
+    const ST_Size nilAt = size - 7 * w, nilRef = wordAt(image, nilAt);
+    const ST_Size method = findMethod(image, size);
+    ST_Size offset, superRef, i, failures = 0;
+    int success;
+    if (!method || (nilRef & 7) != REF_HEAP) {
+        puts("image layout isn't as expected");
+        return 0;
+    }
+    setWordAt(image, nilAt, nilRef + (1 << REF_SHIFT));
+    success = !loads(image, size);
+    setWordAt(image, nilAt, nilRef);
+    if (!success) {
+        puts("loaded an image referring into an object");
+        return 0;
+    }
+    offset = wordAt(image, method + 4 * w);
+    setWordAt(image, method + 4 * w, 1 << 16);
+    success = !loads(image, size);
+    setWordAt(image, method + 4 * w, offset);
+    if (!success) {
+        puts("loaded an image with a method past the end of its code");
+        return 0;
+    }
+    /* Foo as its own superclass is the one that fails */
+    superRef = wordAt(image, method - 6 * w);
+    for (i = 0; i < classCount; ++i) {
+        setWordAt(image, method - 6 * w, i << REF_SHIFT | REF_CLASS);
+        failures += !loads(image, size);
+    }
+    setWordAt(image, method - 6 * w, superRef);
+    if ((superRef & 7) != REF_CLASS || failures != 1) {
+        puts("loaded an image with a class its own superclass");
+        return 0;
+    }
+    return loads(image, size);
+}
+
+int main() {
+    ST_Configuration config = ST_DEFAULT_CONFIG;
+    ST_Code code;
+    ST_Object ctx = buildContext(&code);
+    ST_Object restored;
+    ST_U8 *image;
+    ST_Size size = ST_saveImage(ctx, NULL, 0);
+    if (!size) {
+        puts("failed to save image");
+        return EXIT_FAILURE;
+    }
+    image = malloc(size);
+    if (ST_saveImage(ctx, image, size) != size) {
+        puts("image size changed between calls");
+        return EXIT_FAILURE;
+    }
+    ST_destroyContext(ctx);
+    restored = ST_loadImage(&config, image, size);
+    if (!restored) {
+        puts("failed to load image");
+        return EXIT_FAILURE;
+    }
+    if (!checkContext(restored)) {
+        return EXIT_FAILURE;
+    }
+    ST_destroyContext(restored);
+    image[0] = 'X';
+    if (ST_loadImage(&config, image, size)) {
+        puts("loaded an image with a bad header");
+        return EXIT_FAILURE;
+    }
+    image[0] = 'S';
+    if (ST_loadImage(&config, image, size / 2)) {
+        puts("loaded a truncated image");
+        return EXIT_FAILURE;
+    }
+    if (!checkMalformed(image, size)) {
+        return EXIT_FAILURE;
+    }
+    free(image);
+    if (!checkClone() || !checkSnapshot()) {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,131 @@
+#include "programs.hpp"
+
+#include "../util/linker.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static std::vector<std::vector<uint8_t>>
+encodeAll(const std::vector<st::Program> &units) {
+    std::vector<std::vector<uint8_t>> encoded;
+    for (auto &unit : units) {
+        encoded.push_back(st::encode(unit));
+    }
+    return encoded;
+}
+
+/* Box := Object subclass: #Box, Box>>name, #box RETURN */
+static st::Program makeBox(void) {
+    Assembler a;
+    a.subclass("Box");
+    size_t method = a.beginMethod("Box", "name");
+    a.op(ST_VM_OP_PUSHSYMBOL, "box").op(ST_VM_OP_RETURN).endMethod(method);
+    return a.program;
+}
+
+/* Crate, like Box, but the rest of it uses what Box defines: Crate>>name,
+   #crate RETURN, and Box>>size, #small RETURN. Then the globals. */
+static st::Program makeCrate(void) {
+    Assembler a;
+    a.subclass("Crate");
+    size_t method = a.beginMethod("Crate", "name");
+    a.op(ST_VM_OP_PUSHSYMBOL, "crate").op(ST_VM_OP_RETURN).endMethod(method);
+    method = a.beginMethod("Box", "size");
+    a.op(ST_VM_OP_PUSHSYMBOL, "small").op(ST_VM_OP_RETURN).endMethod(method);
+    a.send("BoxName", "Box", "name")
+        .send("CrateName", "Crate", "name")
+        .send("BoxSize", "Box", "size");
+    return a.program;
+}
+
+/* The bundle runs like the units one after the other, with each symbol
+   once */
+static int checkLink(void) {
+    const std::vector<st::Program> units = {makeBox(), makeCrate()};
+    const std::vector<const char *> globals = {"BoxName", "CrateName",
+                                               "BoxSize"};
+    const st::Program bundle = st::link(units);
+    const std::vector<std::string> separate = run(encodeAll(units), globals);
+    int success =
+        separate == std::vector<std::string>{"#box", "#crate", "#small"} &&
+        run(bundle, globals) == separate &&
+        bundle.code.size() == units[0].code.size() + units[1].code.size();
+    for (size_t i = 0; i < bundle.symbols.size(); ++i) {
+        for (size_t j = i + 1; j < bundle.symbols.size(); ++j) {
+            success = success && bundle.symbols[i] != bundle.symbols[j];
+        }
+    }
+    return success;
+}
+
+/* First := #first, then a RETURN, which only skips the rest of its unit:
+   Second := #second, and Third := #third in the next one */
+static int checkReturn(void) {
+    Assembler first, second;
+    first.op(ST_VM_OP_PUSHSYMBOL, "first")
+        .op(ST_VM_OP_SETGLOBAL, "First")
+        .op(ST_VM_OP_PUSHNIL)
+        .op(ST_VM_OP_RETURN)
+        .op(ST_VM_OP_PUSHSYMBOL, "second")
+        .op(ST_VM_OP_SETGLOBAL, "Second");
+    second.op(ST_VM_OP_PUSHSYMBOL, "third").op(ST_VM_OP_SETGLOBAL, "Third");
+    const std::vector<st::Program> units = {first.program, second.program};
+    const std::vector<const char *> globals = {"First", "Second", "Third"};
+    const std::vector<std::string> separate = run(encodeAll(units), globals);
+    return separate ==
+               std::vector<std::string>{"#first", "UndefinedObject",
+                                        "#third"} &&
+           run(st::link(units), globals) == separate;
+}
+
+/* G0 := true ... G299 := true, then Hot := #hot, with Hot read back over
+   and over, and a symbol nothing refers to */
+static st::Program makeGlobals(void) {
+    Assembler a;
+    char name[8];
+    a.symbol("unused");
+    for (int i = 0; i < 300; ++i) {
+        sprintf(name, "G%d", i);
+        a.op(ST_VM_OP_PUSHTRUE).op(ST_VM_OP_SETGLOBAL, name);
+    }
+    a.op(ST_VM_OP_PUSHSYMBOL, "hot").op(ST_VM_OP_SETGLOBAL, "Hot");
+    for (int i = 0; i < 50; ++i) {
+        a.op(ST_VM_OP_GETGLOBAL, "Hot").op(ST_VM_OP_SETGLOBAL, "Hot");
+    }
+    return a.program;
+}
+
+/* The most referenced symbols come first, or the ones the profile counts,
+   and get the short operands, without changing what the code does */
+static int checkOrder(void) {
+    const std::vector<const char *> globals = {"Hot", "G299"};
+    st::Program program = makeGlobals();
+    const std::vector<uint8_t> before = st::encode(program);
+    st::orderSymbolsByFrequency(program, st::SymbolProfile());
+    const std::vector<uint8_t> after = st::encode(program);
+    int success = program.symbols.front() == "Hot" &&
+                  program.symbols.size() == 302 &&
+                  after.size() + 100 <= before.size() &&
+                  run(after, globals) == run(before, globals) &&
+                  run(after, globals)[0] == "#hot";
+    program = makeGlobals();
+    st::orderSymbolsByFrequency(program, st::SymbolProfile{{"G7", 1000}});
+    return success && program.symbols[0] == "G7" &&
+           program.symbols[1] == "Hot";
+}
+
+int main() {
+    if (!checkLink()) {
+        puts("linked units behave differently, or share no symbols");
+        return EXIT_FAILURE;
+    }
+    if (!checkReturn()) {
+        puts("a unit returning ended the whole bundle");
+        return EXIT_FAILURE;
+    }
+    if (!checkOrder()) {
+        puts("symbols weren't ordered by use, or the order broke the code");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
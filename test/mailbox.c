@@ -0,0 +1,237 @@
+#include "../src/opcode.h"
+#include "../src/smalltalk.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Worker := Object subclass: #Worker.
+   Worker>>run Result := Inbox receive. */
+static const ST_U8 program[] = {
+    'W', 'o', 'r', 'k', 'e', 'r', '\0', 'O', 'b', 'j', 'e', 'c', 't', '\0',
+    's', 'u', 'b', 'c', 'l', 'a', 's', 's', ':', '\0', 'r', 'u', 'n', '\0',
+    'I', 'n', 'b', 'o', 'x', '\0', 'r', 'e', 'c', 'e', 'i', 'v', 'e', '\0',
+    'R', 'e', 's', 'u', 'l', 't', '\0', '\0', ST_VM_OP_PUSHSYMBOL, 0, 0,
+    ST_VM_OP_GETGLOBAL, 1, 0, ST_VM_OP_SENDMSG, 2, 0, ST_VM_OP_SETGLOBAL, 0,
+    0, ST_VM_OP_GETGLOBAL, 0, 0, ST_VM_OP_SETMETHOD, 3, 0, 0, 7, 0, 0, 0,
+    ST_VM_OP_GETGLOBAL8, 4, ST_VM_OP_SENDMSG8, 5, ST_VM_OP_SETGLOBAL8, 6,
+    ST_VM_OP_RETURN};
+
+enum { PRODUCERS = 4, MESSAGES = 500, DEPTH = 300000 };
+
+/* Arrays are looked up by name after allocating the index, which may move
+   them */
+static ST_Object at(ST_Object ctx, const char *array, ST_S32 index) {
+    ST_Object argv[1];
+    argv[0] = ST_getInteger(ctx, index);
+    return ST_sendMsg(ctx, ST_getGlobal(ctx, ST_symb(ctx, array)),
+                      ST_symb(ctx, "at:"), 1, argv);
+}
+
+static void atPut(ST_Object ctx, const char *array, ST_S32 index,
+                  ST_Object value) {
+    enum { LOC_value, LOC_count };
+    ST_Object *locals = ST_pushLocals(ctx, LOC_count);
+    ST_Object argv[2];
+    locals[LOC_value] = value;
+    argv[0] = ST_getInteger(ctx, index);
+    argv[1] = locals[LOC_value];
+    ST_sendMsg(ctx, ST_getGlobal(ctx, ST_symb(ctx, array)),
+               ST_symb(ctx, "at:put:"), 2, argv);
+    ST_popLocals(ctx);
+}
+
+/* An Array holding 42, #hello, Integer, true and itself arrives as a copy
+   with the same shape, made of the receiver's objects. */
+static int checkCopy(void) {
+    ST_Configuration config = ST_DEFAULT_CONFIG;
+    ST_Object sender = ST_createContext(&config);
+    ST_Object receiver = ST_createContext(&config);
+    ST_Mailbox *mailbox = ST_createMailbox(&config);
+    ST_Object size = ST_getInteger(sender, 5), semaphore;
+    int success;
+    ST_setGlobal(sender, ST_symb(sender, "Sent"),
+                 ST_sendMsg(sender,
+                            ST_getGlobal(sender, ST_symb(sender, "Array")),
+                            ST_symb(sender, "new:"), 1, &size));
+    atPut(sender, "Sent", 0, ST_getInteger(sender, 42));
+    atPut(sender, "Sent", 1, ST_symb(sender, "hello"));
+    atPut(sender, "Sent", 2, ST_getGlobal(sender, ST_symb(sender, "Integer")));
+    atPut(sender, "Sent", 3, ST_getTrue(sender));
+    atPut(sender, "Sent", 4, ST_getGlobal(sender, ST_symb(sender, "Sent")));
+    semaphore =
+        ST_sendMsg(sender, ST_getGlobal(sender, ST_symb(sender, "Semaphore")),
+                   ST_symb(sender, "new"), 0, NULL);
+    success = !ST_postMessage(sender, mailbox, semaphore) &&
+              !ST_postMessage(sender, mailbox, sender) &&
+              !ST_receiveMessage(receiver, mailbox) &&
+              ST_postMessage(sender, mailbox,
+                             ST_getGlobal(sender, ST_symb(sender, "Sent")));
+    ST_destroyContext(sender);
+    ST_setGlobal(receiver, ST_symb(receiver, "Received"),
+                 ST_receiveMessage(receiver, mailbox));
+    success = success &&
+              ST_unboxInt(receiver, at(receiver, "Received", 0)) == 42 &&
+              at(receiver, "Received", 1) == ST_symb(receiver, "hello") &&
+              at(receiver, "Received", 2) ==
+                  ST_getGlobal(receiver, ST_symb(receiver, "Integer")) &&
+              at(receiver, "Received", 3) == ST_getTrue(receiver) &&
+              at(receiver, "Received", 4) ==
+                  ST_getGlobal(receiver, ST_symb(receiver, "Received")) &&
+              !ST_receiveMessage(receiver, mailbox);
+    ST_destroyContext(receiver);
+    ST_destroyMailbox(mailbox);
+    return success;
+}
+
+/* A chain of DEPTH one-element Arrays, each holding the one before, goes
+   through a mailbox whole: nesting doesn't take the C stack with it. */
+static int checkDeep(void) {
+    ST_Configuration config = ST_DEFAULT_CONFIG;
+    ST_Object sender, receiver, link, one;
+    ST_Mailbox *mailbox;
+    int i, success;
+    config.memory.heapCapacity = 64 * 1024 * 1024;
+    sender = ST_createContext(&config);
+    receiver = ST_createContext(&config);
+    mailbox = ST_createMailbox(&config);
+    for (i = 0; i < DEPTH; ++i) {
+        one = ST_getInteger(sender, 1);
+        ST_setGlobal(sender, ST_symb(sender, "Link"),
+                     ST_sendMsg(sender,
+                                ST_getGlobal(sender, ST_symb(sender, "Array")),
+                                ST_symb(sender, "new:"), 1, &one));
+        atPut(sender, "Link", 0,
+              ST_getGlobal(sender, ST_symb(sender, "Chain")));
+        ST_setGlobal(sender, ST_symb(sender, "Chain"),
+                     ST_getGlobal(sender, ST_symb(sender, "Link")));
+    }
+    success = ST_postMessage(sender, mailbox,
+                             ST_getGlobal(sender, ST_symb(sender, "Chain")));
+    ST_destroyContext(sender);
+    link = success ? ST_receiveMessage(receiver, mailbox) : NULL;
+    for (i = 0; link && link != ST_getNil(receiver); ++i) {
+        ST_setGlobal(receiver, ST_symb(receiver, "Link"), link);
+        link = at(receiver, "Link", 0);
+    }
+    ST_destroyContext(receiver);
+    ST_destroyMailbox(mailbox);
+    return success && i == DEPTH;
+}
+
+/* A process waiting in receive gets the message once the scheduler runs
+   after it arrives, posted from Smalltalk in another context. */
+static int checkReceive(void) {
+    ST_Configuration config = ST_DEFAULT_CONFIG;
+    ST_Object sender = ST_createContext(&config);
+    ST_Object receiver = ST_createContext(&config);
+    ST_Mailbox *mailbox = ST_createMailbox(&config);
+    ST_Code code = ST_VM_load(receiver, program, sizeof program);
+    ST_Object outbox, inbox, result, argv[1];
+    int success;
+    ST_VM_execute(receiver, &code, 0);
+    ST_setGlobal(receiver, ST_symb(receiver, "Inbox"),
+                 ST_wrapMailbox(receiver, mailbox));
+    ST_fork(receiver, ST_getGlobal(receiver, ST_symb(receiver, "Worker")),
+            ST_symb(receiver, "run"), 0, NULL, ST_PRIORITY_DEFAULT);
+    success = ST_runProcesses(receiver, 0, NULL) == 1 &&
+              ST_getGlobal(receiver, ST_symb(receiver, "Result")) ==
+                  ST_getNil(receiver);
+    outbox = ST_wrapMailbox(sender, mailbox);
+    ST_setGlobal(sender, ST_symb(sender, "Outbox"), outbox);
+    argv[0] = ST_getInteger(sender, 7);
+    success = success &&
+              ST_sendMsg(sender, outbox, ST_symb(sender, "post:"), 1, argv) ==
+                  ST_getTrue(sender) &&
+              ST_runProcesses(receiver, 0, NULL) == 0;
+    result = ST_getGlobal(receiver, ST_symb(receiver, "Result"));
+    inbox = ST_getGlobal(receiver, ST_symb(receiver, "Inbox"));
+    /* Nothing waits outside a process, and mailboxes don't go into images */
+    success = success && ST_unboxInt(receiver, result) == 7 &&
+              ST_sendMsg(receiver, inbox, ST_symb(receiver, "receive"), 0,
+                         NULL) == ST_getNil(receiver) &&
+              ST_saveImage(receiver, NULL, 0) == 0;
+    ST_destroyContext(sender);
+    ST_destroyContext(receiver);
+    ST_destroyMailbox(mailbox);
+    return success;
+}
+
+typedef struct Producer {
+    pthread_t thread;
+    ST_Mailbox *mailbox;
+    int id;
+    int success;
+} Producer;
+
+static void *produce(void *arg) {
+    Producer *producer = arg;
+    ST_Configuration config = ST_DEFAULT_CONFIG;
+    ST_Object ctx = ST_createContext(&config);
+    int i;
+    producer->success = 1;
+    for (i = 0; i < MESSAGES; ++i) {
+        producer->success =
+            producer->success &&
+            ST_postMessage(ctx, producer->mailbox,
+                           ST_getInteger(ctx, producer->id * MESSAGES + i));
+    }
+    ST_destroyContext(ctx);
+    return NULL;
+}
+
+/* Producers on their own threads post to one mailbox, every message
+   arrives once, and in order for each producer. */
+static int checkThreads(void) {
+    ST_Configuration config = ST_DEFAULT_CONFIG;
+    ST_Object ctx = ST_createContext(&config);
+    ST_Mailbox *mailbox = ST_createMailbox(&config);
+    Producer producers[PRODUCERS];
+    int next[PRODUCERS];
+    int i, received = 0, started = 0, success = 1;
+    for (i = 0; i < PRODUCERS; ++i) {
+        producers[i].mailbox = mailbox;
+        producers[i].id = i;
+        next[i] = 0;
+        if (pthread_create(&producers[i].thread, NULL, produce,
+                           &producers[i]) == 0) {
+            ++started;
+        }
+    }
+    while (success && received < started * MESSAGES) {
+        ST_Object message = ST_receiveMessage(ctx, mailbox);
+        if (message) {
+            const ST_S32 value = ST_unboxInt(ctx, message);
+            const int id = value / MESSAGES;
+            success = id < started && value % MESSAGES == next[id]++;
+            ++received;
+        }
+    }
+    for (i = 0; i < started; ++i) {
+        pthread_join(producers[i].thread, NULL);
+        success = success && producers[i].success;
+    }
+    ST_destroyContext(ctx);
+    ST_destroyMailbox(mailbox);
+    return success && started == PRODUCERS;
+}
+
+int main() {
+    if (!checkCopy()) {
+        puts("messages don't copy objects between contexts");
+        return EXIT_FAILURE;
+    }
+    if (!checkDeep()) {
+        puts("deeply nested messages don't arrive whole");
+        return EXIT_FAILURE;
+    }
+    if (!checkReceive()) {
+        puts("waiting processes don't receive messages");
+        return EXIT_FAILURE;
+    }
+    if (!checkThreads()) {
+        puts("messages posted from several threads got lost");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
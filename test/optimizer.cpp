@@ -0,0 +1,264 @@
+#include "programs.hpp"
+
+#include "../util/optimizer.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static size_t removedBy(const std::vector<st::PassStats> &stats,
+                        const char *pass) {
+    for (auto &stat : stats) {
+        if (stat.name == pass) {
+            return stat.instructionsRemoved;
+        }
+    }
+    return 0;
+}
+
+/* Box>>answer, DUP POP. #answer SWAP SWAP. RETURN. #dead. RETURN,
+   Box>>noop, nil POP. self RETURN, and top level code that uses both,
+   with a pair of its own to cancel */
+static int checkPasses(void) {
+    Assembler a;
+    a.subclass("Box");
+    size_t method = a.beginMethod("Box", "answer");
+    a.op(ST_VM_OP_DUP)
+        .op(ST_VM_OP_POP)
+        .op(ST_VM_OP_PUSHSYMBOL, "answer")
+        .op(ST_VM_OP_SWAP)
+        .op(ST_VM_OP_SWAP)
+        .op(ST_VM_OP_RETURN)
+        .op(ST_VM_OP_PUSHSYMBOL, "dead")
+        .op(ST_VM_OP_RETURN)
+        .endMethod(method);
+    method = a.beginMethod("Box", "noop");
+    a.op(ST_VM_OP_PUSHNIL)
+        .op(ST_VM_OP_POP)
+        .op(ST_VM_OP_RETURN)
+        .endMethod(method);
+    a.op(ST_VM_OP_GETGLOBAL, "Box")
+        .op(ST_VM_OP_SENDMSG, "new")
+        .op(ST_VM_OP_DUP)
+        .op(ST_VM_OP_SENDMSG, "answer")
+        .op(ST_VM_OP_SETGLOBAL, "Answer")
+        .op(ST_VM_OP_SENDMSG, "noop")
+        .op(ST_VM_OP_SETGLOBAL, "Noop")
+        .op(ST_VM_OP_PUSHTRUE)
+        .op(ST_VM_OP_POP)
+        .op(ST_VM_OP_PUSHFALSE)
+        .op(ST_VM_OP_SETGLOBAL, "Done");
+    const std::vector<const char *> globals = {"Answer", "Noop", "Done"};
+    const std::vector<std::string> before = run(a.program, globals);
+    const size_t length = a.program.code.size();
+    const std::vector<st::PassStats> stats = st::optimize(a.program);
+    return before == std::vector<std::string>{"#answer", "Box", "False"} &&
+           run(a.program, globals) == before &&
+           removedBy(stats, "dead-code") == 2 &&
+           removedBy(stats, "peephole") == 8 &&
+           a.program.code.size() == length - 10;
+}
+
+/* Semaphore>>wait, #x RETURN, which the primitive already has, so
+   Result := Semaphore new wait is still false once devirtualized */
+static int checkRuntimeSelectors(void) {
+    Assembler a;
+    size_t method = a.beginMethod("Semaphore", "wait");
+    a.op(ST_VM_OP_PUSHSYMBOL, "x").op(ST_VM_OP_RETURN).endMethod(method);
+    a.op(ST_VM_OP_GETGLOBAL, "Semaphore")
+        .op(ST_VM_OP_SENDMSG, "new")
+        .op(ST_VM_OP_SENDMSG, "wait")
+        .op(ST_VM_OP_SETGLOBAL, "Result");
+    const std::vector<const char *> globals = {"Result"};
+    const std::vector<std::string> before = run(a.program, globals);
+    return before[0] == "False" && st::devirtualize(a.program) == 0 &&
+           run(a.program, globals) == before;
+}
+
+static ST_Object hostTag(ST_Object ctx, ST_Object self, ST_Object argv[]) {
+    return ST_symb(ctx, "host");
+}
+
+static void defineHostTag(ST_Object ctx) {
+    ST_setMethod(ctx, ST_getGlobal(ctx, ST_symb(ctx, "Object")),
+                 ST_symb(ctx, "tag"), hostTag, 0);
+}
+
+static void defineHostSub(ST_Object ctx) {
+    static const ST_MethodDef methods[] = {{"tag", hostTag, 0}};
+    ST_defineClass(ctx, ST_getGlobal(ctx, ST_symb(ctx, "Object")), "Sub",
+                   nullptr, methods, 1);
+}
+
+/* Object>>tag, POP #tagged RETURN, sent in Tag := Leaf new tag, where Leaf
+   is a subclass of the host's Sub, which overrides tag */
+static Assembler overrideProgram() {
+    Assembler a;
+    size_t method = a.beginMethod("Object", "tag");
+    a.op(ST_VM_OP_POP)
+        .op(ST_VM_OP_PUSHSYMBOL, "tagged")
+        .op(ST_VM_OP_RETURN)
+        .endMethod(method);
+    a.op(ST_VM_OP_PUSHSYMBOL, "Leaf")
+        .op(ST_VM_OP_GETGLOBAL, "Sub")
+        .op(ST_VM_OP_SENDMSG, "subclass:")
+        .op(ST_VM_OP_SETGLOBAL, "Leaf")
+        .op(ST_VM_OP_GETGLOBAL, "Leaf")
+        .op(ST_VM_OP_SENDMSG, "new")
+        .op(ST_VM_OP_SENDMSG, "tag")
+        .op(ST_VM_OP_SETGLOBAL, "Tag");
+    return a;
+}
+
+/* Box>>tag, POP #tagged RETURN, sent in Old := Box new tag, then again in
+   Tag := Box new tag once Box is another class, which only has the host's
+   Object>>tag */
+static Assembler reboundProgram() {
+    Assembler a;
+    a.subclass("Box");
+    size_t method = a.beginMethod("Box", "tag");
+    a.op(ST_VM_OP_POP)
+        .op(ST_VM_OP_PUSHSYMBOL, "tagged")
+        .op(ST_VM_OP_RETURN)
+        .endMethod(method);
+    a.op(ST_VM_OP_GETGLOBAL, "Box")
+        .op(ST_VM_OP_SENDMSG, "new")
+        .op(ST_VM_OP_SENDMSG, "tag")
+        .op(ST_VM_OP_SETGLOBAL, "Old")
+        .subclass("Box")
+        .op(ST_VM_OP_GETGLOBAL, "Box")
+        .op(ST_VM_OP_SENDMSG, "new")
+        .op(ST_VM_OP_SENDMSG, "tag")
+        .op(ST_VM_OP_SETGLOBAL, "Tag");
+    return a;
+}
+
+/* Object>>tag, #tagged RETURN, bound in Tag := Box new tag. A method the
+   host defined first keeps the selector, and the bound send has to find
+   it too. */
+static int checkDevirtualize(void) {
+    Assembler a;
+    a.subclass("Box");
+    size_t method = a.beginMethod("Object", "tag");
+    a.op(ST_VM_OP_PUSHSYMBOL, "tagged").op(ST_VM_OP_RETURN).endMethod(method);
+    a.op(ST_VM_OP_GETGLOBAL, "Box")
+        .op(ST_VM_OP_SENDMSG, "new")
+        .op(ST_VM_OP_SENDMSG, "tag")
+        .op(ST_VM_OP_SETGLOBAL, "Tag");
+    const std::vector<const char *> globals = {"Tag"};
+    const std::vector<std::string> before = run(a.program, globals);
+    const std::vector<std::string> hosted =
+        run(a.program, globals, defineHostTag);
+    if (!(before[0] == "#tagged" && hosted[0] == "#host" &&
+          st::devirtualize(a.program) == 1 &&
+          run(a.program, globals) == before &&
+          run(a.program, globals, defineHostTag) == hosted)) {
+        return 0;
+    }
+    /* The bound send mustn't skip the host's override on Sub, nor run the
+       old Box's method for the new one */
+    Assembler override = overrideProgram();
+    const std::vector<std::string> overridden =
+        run(override.program, globals, defineHostSub);
+    Assembler rebound = reboundProgram();
+    const std::vector<const char *> reboundGlobals = {"Old", "Tag"};
+    const std::vector<std::string> reboundBefore =
+        run(rebound.program, reboundGlobals, defineHostTag);
+    return overridden[0] == "#host" &&
+           st::devirtualize(override.program) == 1 &&
+           run(override.program, globals, defineHostSub) == overridden &&
+           reboundBefore == std::vector<std::string>{"#tagged", "#host"} &&
+           st::devirtualize(rebound.program) == 2 &&
+           run(rebound.program, reboundGlobals, defineHostTag) ==
+               reboundBefore;
+}
+
+static size_t countGuards(const st::Program &program) {
+    size_t guards = 0;
+    for (auto &inst : program.code) {
+        guards += inst.opcode == ST_VM_OP_INLINEGUARD;
+    }
+    return guards;
+}
+
+/* Devirtualizes and inlines the program, and runs it again */
+static std::vector<std::string>
+runInlined(Assembler &a, const std::vector<const char *> &globals,
+           void (*setup)(ST_Object ctx), size_t guards) {
+    st::devirtualize(a.program);
+    st::inlineSends(a.program, 16);
+    if (countGuards(a.program) != guards) {
+        return {};
+    }
+    return run(a.program, globals, setup);
+}
+
+/* Object>>tag, POP #tagged RETURN, inlined into Tag := Box new tag, and
+   into #keep Box new tag POP, where the caller's POP has to stay: when the
+   guard fails, it pops the result of the send instead */
+static int checkInline(void) {
+    Assembler a;
+    a.subclass("Box");
+    size_t method = a.beginMethod("Object", "tag");
+    a.op(ST_VM_OP_POP)
+        .op(ST_VM_OP_PUSHSYMBOL, "tagged")
+        .op(ST_VM_OP_RETURN)
+        .endMethod(method);
+    a.op(ST_VM_OP_GETGLOBAL, "Box")
+        .op(ST_VM_OP_SENDMSG, "new")
+        .op(ST_VM_OP_SENDMSG, "tag")
+        .op(ST_VM_OP_SETGLOBAL, "Tag")
+        .op(ST_VM_OP_PUSHSYMBOL, "keep")
+        .op(ST_VM_OP_GETGLOBAL, "Box")
+        .op(ST_VM_OP_SENDMSG, "new")
+        .op(ST_VM_OP_SENDMSG, "tag")
+        .op(ST_VM_OP_POP)
+        .op(ST_VM_OP_SETGLOBAL, "Kept");
+    const std::vector<const char *> globals = {"Tag", "Kept"};
+    const std::vector<std::string> before = run(a.program, globals);
+    const std::vector<std::string> hosted =
+        run(a.program, globals, defineHostTag);
+    st::devirtualize(a.program);
+    const std::vector<st::InlineReport> reports =
+        st::inlineSends(a.program, 16);
+    st::optimize(a.program);
+    if (!(before == std::vector<std::string>{"#tagged", "#keep"} &&
+          hosted == std::vector<std::string>{"#host", "#keep"} &&
+          reports.size() == 1 && reports[0].sites == 2 &&
+          countGuards(a.program) == 2 && run(a.program, globals) == before &&
+          run(a.program, globals, defineHostTag) == hosted)) {
+        return 0;
+    }
+    /* The guards of checkDevirtualize's other cases */
+    Assembler override = overrideProgram();
+    const std::vector<const char *> tagGlobals = {"Tag"};
+    const std::vector<std::string> overridden =
+        run(override.program, tagGlobals, defineHostSub);
+    Assembler rebound = reboundProgram();
+    const std::vector<const char *> reboundGlobals = {"Old", "Tag"};
+    const std::vector<std::string> reboundBefore =
+        run(rebound.program, reboundGlobals, defineHostTag);
+    return runInlined(override, tagGlobals, defineHostSub, 1) ==
+               overridden &&
+           runInlined(rebound, reboundGlobals, defineHostTag, 2) ==
+               reboundBefore;
+}
+
+int main() {
+    if (!checkPasses()) {
+        puts("optimized code behaves differently, or wasn't optimized");
+        return EXIT_FAILURE;
+    }
+    if (!checkRuntimeSelectors()) {
+        puts("a send the runtime defines was bound to the program");
+        return EXIT_FAILURE;
+    }
+    if (!checkDevirtualize()) {
+        puts("devirtualized sends behave differently");
+        return EXIT_FAILURE;
+    }
+    if (!checkInline()) {
+        puts("inlined sends behave differently");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
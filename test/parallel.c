@@ -0,0 +1,280 @@
+#include "../src/opcode.h"
+#include "../src/smalltalk.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Integer>>squared ^self * self. */
+static const ST_U8 program[] = {
+    'I', 'n', 't', 'e', 'g', 'e', 'r', '\0', 's', 'q', 'u', 'a', 'r', 'e',
+    'd', '\0', '*', '\0', '\0', ST_VM_OP_GETGLOBAL, 0, 0, ST_VM_OP_SETMETHOD,
+    1, 0, 0, 4, 0, 0, 0, ST_VM_OP_DUP, ST_VM_OP_SENDMSG8, 2, ST_VM_OP_RETURN};
+
+enum { WORKERS = 4, LENGTH = 1000, PADDING = 1 << 16, SYMBOLS = 50000 };
+
+static ST_Size allocated;
+
+static void *countingAlloc(size_t size) {
+    allocated += size;
+    return malloc(size);
+}
+
+typedef struct Thread {
+    pthread_t thread;
+    ST_Job job;
+    void *data;
+    ST_Size index;
+} Thread;
+
+static void *runThread(void *arg) {
+    Thread *thread = arg;
+    thread->job(thread->data, thread->index);
+    return NULL;
+}
+
+/* A thread per job, or the calling thread if one can't start */
+static void runJobs(void *host, ST_Job job, void *data, ST_Size count) {
+    Thread threads[WORKERS];
+    int started[WORKERS];
+    ST_Size i;
+    for (i = 0; i < count; ++i) {
+        threads[i].job = job;
+        threads[i].data = data;
+        threads[i].index = i;
+        started[i] =
+            pthread_create(&threads[i].thread, NULL, runThread, &threads[i]) ==
+            0;
+        if (!started[i]) {
+            job(data, i);
+        }
+    }
+    for (i = 0; i < count; ++i) {
+        if (started[i]) {
+            pthread_join(threads[i].thread, NULL);
+        }
+    }
+}
+
+/* The jobs one after the other on the calling thread */
+static void runInline(void *host, ST_Job job, void *data, ST_Size count) {
+    ST_Size i;
+    for (i = 0; i < count; ++i) {
+        job(data, i);
+    }
+}
+
+/* Integer>>padded, PADDING bytes of DUP POP, then ^self */
+static ST_U8 *makePadded(ST_Size *len) {
+    static const ST_U8 header[] = {
+        'I', 'n', 't', 'e', 'g', 'e', 'r', '\0', 'p', 'a', 'd', 'd', 'e', 'd',
+        '\0', '\0', ST_VM_OP_GETGLOBAL, 0, 0, ST_VM_OP_SETMETHOD, 1, 0, 0,
+        (PADDING + 1) & 0xff, (PADDING + 1) >> 8 & 0xff,
+        (PADDING + 1) >> 16 & 0xff, 0};
+    ST_U8 *padded = malloc(sizeof header + PADDING + 1);
+    ST_Size i;
+    memcpy(padded, header, sizeof header);
+    for (i = 0; i < PADDING; i += 2) {
+        padded[sizeof header + i] = ST_VM_OP_DUP;
+        padded[sizeof header + i + 1] = ST_VM_OP_POP;
+    }
+    padded[sizeof header + PADDING] = ST_VM_OP_RETURN;
+    *len = sizeof header + PADDING + 1;
+    return padded;
+}
+
+/* A host primitive, which the workers get along with the classes */
+static ST_Object isOdd(ST_Object ctx, ST_Object self, ST_Object argv[]) {
+    return ST_unboxInt(ctx, self) % 2 ? ST_getTrue(ctx) : ST_getFalse(ctx);
+}
+
+static ST_Object setup(ST_Code *code) {
+    ST_Configuration config = ST_DEFAULT_CONFIG;
+    ST_Object ctx;
+    config.memory.heapCapacity = 200000;
+    ctx = ST_createContext(&config);
+    *code = ST_VM_load(ctx, program, sizeof program);
+    ST_VM_execute(ctx, code, 0);
+    ST_setMethod(ctx, ST_getGlobal(ctx, ST_symb(ctx, "Integer")),
+                 ST_symb(ctx, "isOdd"), isOdd, 0);
+    return ctx;
+}
+
+/* Numbers is an Array of 0 up to length */
+static void makeNumbers(ST_Object ctx, ST_S32 length) {
+    ST_Object argv[2];
+    ST_S32 i;
+    argv[0] = ST_getInteger(ctx, length);
+    ST_setGlobal(ctx, ST_symb(ctx, "Numbers"),
+                 ST_sendMsg(ctx, ST_getGlobal(ctx, ST_symb(ctx, "Array")),
+                            ST_symb(ctx, "new:"), 1, argv));
+    for (i = 0; i < length; ++i) {
+        ST_Object *locals = ST_pushLocals(ctx, 1);
+        locals[0] = ST_getInteger(ctx, i);
+        argv[0] = ST_getInteger(ctx, i);
+        argv[1] = locals[0];
+        ST_sendMsg(ctx, ST_getGlobal(ctx, ST_symb(ctx, "Numbers")),
+                   ST_symb(ctx, "at:put:"), 2, argv);
+        ST_popLocals(ctx);
+    }
+}
+
+static ST_Object send(ST_Object ctx, const char *selector, ST_U8 argc,
+                      ST_Object argv[]) {
+    return ST_sendMsg(ctx, ST_getGlobal(ctx, ST_symb(ctx, "Numbers")),
+                      ST_symb(ctx, selector), argc, argv);
+}
+
+static ST_S32 length(ST_Object ctx, ST_Object array) {
+    return ST_unboxInt(ctx,
+                       ST_sendMsg(ctx, array, ST_symb(ctx, "length"), 0, NULL));
+}
+
+static ST_S32 at(ST_Object ctx, const char *array, ST_S32 index) {
+    ST_Object argv[1];
+    argv[0] = ST_getInteger(ctx, index);
+    return ST_unboxInt(ctx, ST_sendMsg(ctx,
+                                       ST_getGlobal(ctx, ST_symb(ctx, array)),
+                                       ST_symb(ctx, "at:"), 1, argv));
+}
+
+/* Every operation gives the sequential result, in order */
+static int checkOperations(ST_Object ctx, ST_S32 count) {
+    ST_Object argv[2];
+    ST_S32 i;
+    int success;
+    makeNumbers(ctx, count);
+    argv[0] = ST_symb(ctx, "squared");
+    ST_setGlobal(ctx, ST_symb(ctx, "Squares"),
+                 send(ctx, "parallelCollect:", 1, argv));
+    success = length(ctx, ST_getGlobal(ctx, ST_symb(ctx, "Squares"))) == count;
+    for (i = 0; i < count && success; ++i) {
+        success = at(ctx, "Squares", i) == i * i;
+    }
+    argv[0] = ST_symb(ctx, "isOdd");
+    ST_setGlobal(ctx, ST_symb(ctx, "Odd"),
+                 send(ctx, "parallelSelect:", 1, argv));
+    success = success &&
+              length(ctx, ST_getGlobal(ctx, ST_symb(ctx, "Odd"))) == count / 2;
+    for (i = 0; i < count / 2 && success; ++i) {
+        success = at(ctx, "Odd", i) == i * 2 + 1;
+    }
+    argv[0] = ST_getInteger(ctx, 5);
+    argv[1] = ST_symb(ctx, "+");
+    return success &&
+           ST_unboxInt(ctx, send(ctx, "parallelInject:into:", 2, argv)) ==
+               5 + count * (count - 1) / 2;
+}
+
+/* What starting the workers allocates, with or without Integer>>padded
+   loaded, which the workers have to run. Zero if they can't. */
+static ST_Size workerBytes(int padded) {
+    ST_Configuration config = ST_DEFAULT_CONFIG;
+    ST_Object ctx, argv[1];
+    ST_Code code, paddedCode;
+    ST_U8 *paddedProgram = NULL;
+    ST_Size len, bytes;
+    config.memory.allocFn = countingAlloc;
+    config.memory.heapCapacity = 200000;
+    ctx = ST_createContext(&config);
+    code = ST_VM_load(ctx, program, sizeof program);
+    ST_VM_execute(ctx, &code, 0);
+    if (padded) {
+        paddedProgram = makePadded(&len);
+        paddedCode = ST_VM_load(ctx, paddedProgram, len);
+        ST_VM_execute(ctx, &paddedCode, 0);
+    }
+    allocated = 0;
+    if (!ST_startWorkers(ctx, WORKERS, runInline, NULL)) {
+        bytes = 0;
+    } else {
+        bytes = allocated;
+    }
+    if (padded) {
+        makeNumbers(ctx, LENGTH);
+        argv[0] = ST_symb(ctx, "padded");
+        ST_setGlobal(ctx, ST_symb(ctx, "Padded"),
+                     send(ctx, "parallelCollect:", 1, argv));
+        if (at(ctx, "Padded", LENGTH - 1) != LENGTH - 1) {
+            bytes = 0;
+        }
+    }
+    ST_destroyContext(ctx);
+    free(paddedProgram);
+    return bytes;
+}
+
+/* Workers run the code the context loaded, rather than copies of it */
+static int checkSharedCode(void) {
+    const ST_Size bytes = workerBytes(0);
+    const ST_Size paddedBytes = workerBytes(1);
+    return bytes && paddedBytes && paddedBytes < bytes + PADDING;
+}
+
+/* Workers started since a checkpoint go with a reset, the operations run
+   in the context again */
+static int checkReset(void) {
+    ST_Code code;
+    ST_Object ctx = setup(&code);
+    int success = ST_checkpointContext(ctx) &&
+                  ST_startWorkers(ctx, WORKERS, runJobs, NULL) &&
+                  checkOperations(ctx, LENGTH) && ST_resetContext(ctx) &&
+                  checkOperations(ctx, LENGTH);
+    ST_destroyContext(ctx);
+    return success;
+}
+
+/* With many symbols around, which every element's class name is one of:
+   names are looked up once per operation, not once per element */
+static int checkManySymbols(void) {
+    ST_Code code;
+    ST_Object ctx = setup(&code);
+    char name[32];
+    int i, success;
+    for (i = 0; i < SYMBOLS; ++i) {
+        sprintf(name, "symbol%d", i);
+        ST_symb(ctx, name);
+    }
+    success = ST_startWorkers(ctx, WORKERS, runJobs, NULL) &&
+              checkOperations(ctx, LENGTH);
+    ST_destroyContext(ctx);
+    return success;
+}
+
+int main() {
+    ST_Code code;
+    ST_Object ctx = setup(&code);
+    ST_Object argv[1];
+    if (!checkOperations(ctx, LENGTH)) {
+        puts("collection operations without workers are wrong");
+        return EXIT_FAILURE;
+    }
+    if (!ST_startWorkers(ctx, WORKERS, runJobs, NULL)) {
+        puts("workers can't be started");
+        return EXIT_FAILURE;
+    }
+    if (!checkOperations(ctx, LENGTH) || !checkOperations(ctx, WORKERS - 1) ||
+        !checkOperations(ctx, 0)) {
+        puts("parallel collection operations are wrong");
+        return EXIT_FAILURE;
+    }
+    argv[0] = ST_getInteger(ctx, 1);
+    if (send(ctx, "parallelCollect:", 1, argv) != ST_getNil(ctx)) {
+        puts("parallel collection operations take non-symbols");
+        return EXIT_FAILURE;
+    }
+    ST_destroyContext(ctx);
+    if (!checkSharedCode()) {
+        puts("workers copy the code, or can't run it");
+        return EXIT_FAILURE;
+    }
+    if (!checkReset()) {
+        puts("parallel collection operations are wrong after a reset");
+        return EXIT_FAILURE;
+    }
+    if (!checkManySymbols()) {
+        puts("parallel collection operations are wrong with many symbols");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
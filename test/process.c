@@ -0,0 +1,395 @@
+#include "../src/opcode.h"
+#include "../src/smalltalk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+    SYM_Worker,
+    SYM_Object,
+    SYM_subclass,
+    SYM_run,
+    SYM_tick,
+    SYM_waiter,
+    SYM_Sem,
+    SYM_wait,
+    SYM_sleeper,
+    SYM_Nap,
+    SYM_yielder,
+    SYM_Process,
+    SYM_yield,
+    SYM_recurse
+};
+
+static const char symbols[] = "Worker\0Object\0subclass:\0run\0tick\0waiter\0"
+                              "Sem\0wait\0sleeper\0Nap\0yielder\0Process\0"
+                              "yield\0recurse\0";
+
+/* Long enough to be preempted a few times */
+enum { RUN_TICKS = 2000, MAX_TICKS = 8192 };
+
+static char ticks[MAX_TICKS];
+static ST_Size tickCount;
+
+static ST_Object tick(ST_Object ctx, ST_Object self, ST_Object argv[]) {
+    const char *names = "ABC";
+    char name[2] = {0, 0};
+    int i;
+    for (i = 0; i < 3; ++i) {
+        name[0] = names[i];
+        if (ST_getGlobal(ctx, ST_symb(ctx, name)) == self) {
+            break;
+        }
+    }
+    if (tickCount < MAX_TICKS) {
+        ticks[tickCount++] = i < 3 ? names[i] : '?';
+    }
+    return ST_getNil(ctx);
+}
+
+static ST_U8 *emit(ST_U8 *out, ST_U8 op, int symbol) {
+    *out++ = op;
+    if (symbol >= 0) {
+        *out++ = symbol;
+        *out++ = 0;
+    }
+    return out;
+}
+
+static ST_U8 *emit8(ST_U8 *out, ST_U8 op, ST_U8 symbol) {
+    *out++ = op;
+    *out++ = symbol;
+    return out;
+}
+
+/* Worker>>selector, the receiver staying at the bottom of the frame. */
+static ST_U8 *beginMethod(ST_U8 *out, int selector, ST_U8 **length) {
+    out = emit(out, ST_VM_OP_GETGLOBAL, SYM_Worker);
+    out = emit(out, ST_VM_OP_SETMETHOD, selector);
+    *out++ = 0;
+    *length = out;
+    return out + 4;
+}
+
+static void endMethod(ST_U8 *out, ST_U8 *length) {
+    const ST_U32 bodyLength = out - (length + 4);
+    memcpy(length, &bodyLength, sizeof bodyLength);
+}
+
+static ST_U8 *tickOnce(ST_U8 *out) {
+    *out++ = ST_VM_OP_DUP;
+    out = emit8(out, ST_VM_OP_SENDMSG8, SYM_tick);
+    *out++ = ST_VM_OP_POP;
+    return out;
+}
+
+/* Worker := Object subclass: #Worker, then
+   run, RUN_TICKS times self tick;
+   waiter, Sem wait. self tick;
+   sleeper, Nap wait. self tick;
+   yielder, self tick. Process yield. self tick;
+   recurse, self recurse. */
+static ST_Size makeProgram(ST_U8 *out) {
+    ST_U8 *begin = out, *length;
+    int i;
+    memcpy(out, symbols, sizeof symbols);
+    out += sizeof symbols;
+    out = emit(out, ST_VM_OP_PUSHSYMBOL, SYM_Worker);
+    out = emit(out, ST_VM_OP_GETGLOBAL, SYM_Object);
+    out = emit(out, ST_VM_OP_SENDMSG, SYM_subclass);
+    out = emit(out, ST_VM_OP_SETGLOBAL, SYM_Worker);
+
+    out = beginMethod(out, SYM_run, &length);
+    for (i = 0; i < RUN_TICKS; ++i) {
+        out = tickOnce(out);
+    }
+    *out++ = ST_VM_OP_RETURN;
+    endMethod(out, length);
+
+    out = beginMethod(out, SYM_waiter, &length);
+    out = emit8(out, ST_VM_OP_GETGLOBAL8, SYM_Sem);
+    out = emit8(out, ST_VM_OP_SENDMSG8, SYM_wait);
+    *out++ = ST_VM_OP_POP;
+    out = tickOnce(out);
+    *out++ = ST_VM_OP_RETURN;
+    endMethod(out, length);
+
+    out = beginMethod(out, SYM_sleeper, &length);
+    out = emit8(out, ST_VM_OP_GETGLOBAL8, SYM_Nap);
+    out = emit8(out, ST_VM_OP_SENDMSG8, SYM_wait);
+    *out++ = ST_VM_OP_POP;
+    out = tickOnce(out);
+    *out++ = ST_VM_OP_RETURN;
+    endMethod(out, length);
+
+    out = beginMethod(out, SYM_yielder, &length);
+    out = tickOnce(out);
+    out = emit8(out, ST_VM_OP_GETGLOBAL8, SYM_Process);
+    out = emit8(out, ST_VM_OP_SENDMSG8, SYM_yield);
+    *out++ = ST_VM_OP_POP;
+    out = tickOnce(out);
+    *out++ = ST_VM_OP_RETURN;
+    endMethod(out, length);
+
+    out = beginMethod(out, SYM_recurse, &length);
+    *out++ = ST_VM_OP_DUP;
+    out = emit8(out, ST_VM_OP_SENDMSG8, SYM_recurse);
+    *out++ = ST_VM_OP_RETURN;
+    endMethod(out, length);
+    return out - begin;
+}
+
+static ST_U8 program[sizeof symbols + 16 * RUN_TICKS];
+
+/* Loads the program, and sets up workers A, B and C, Sem and a 50ms Nap */
+static ST_Object makeContext(ST_Size heapCapacity) {
+    ST_Configuration config = ST_DEFAULT_CONFIG;
+    ST_Object ctx, cWorker, ms;
+    ST_Code *code;
+    config.memory.heapCapacity = heapCapacity;
+    ctx = ST_createContext(&config);
+    code = malloc(sizeof *code);
+    *code = ST_VM_load(ctx, program, makeProgram(program));
+    ST_VM_execute(ctx, code, 0);
+    cWorker = ST_getGlobal(ctx, ST_symb(ctx, "Worker"));
+    ST_setMethod(ctx, cWorker, ST_symb(ctx, "tick"), tick, 0);
+    ST_setGlobal(ctx, ST_symb(ctx, "A"),
+                 ST_sendMsg(ctx, cWorker, ST_symb(ctx, "new"), 0, NULL));
+    ST_setGlobal(ctx, ST_symb(ctx, "B"),
+                 ST_sendMsg(ctx, cWorker, ST_symb(ctx, "new"), 0, NULL));
+    ST_setGlobal(ctx, ST_symb(ctx, "C"),
+                 ST_sendMsg(ctx, cWorker, ST_symb(ctx, "new"), 0, NULL));
+    ST_setGlobal(ctx, ST_symb(ctx, "Sem"),
+                 ST_sendMsg(ctx, ST_getGlobal(ctx, ST_symb(ctx, "Semaphore")),
+                            ST_symb(ctx, "new"), 0, NULL));
+    ms = ST_getInteger(ctx, 50);
+    ST_setGlobal(ctx, ST_symb(ctx, "Nap"),
+                 ST_sendMsg(ctx, ST_getGlobal(ctx, ST_symb(ctx, "Delay")),
+                            ST_symb(ctx, "forMilliseconds:"), 1, &ms));
+    tickCount = 0;
+    return ctx;
+}
+
+static ST_Object fork(ST_Object ctx, const char *worker, const char *selector,
+                      ST_U8 priority) {
+    return ST_fork(ctx, ST_getGlobal(ctx, ST_symb(ctx, worker)),
+                   ST_symb(ctx, selector), 0, NULL, priority);
+}
+
+static ST_Object global(ST_Object ctx, const char *name) {
+    return ST_getGlobal(ctx, ST_symb(ctx, name));
+}
+
+static ST_Size countTicks(char name) {
+    ST_Size i, count = 0;
+    for (i = 0; i < tickCount; ++i) {
+        count += ticks[i] == name;
+    }
+    return count;
+}
+
+static int checkPreemption(void) {
+    ST_Object ctx = makeContext(10000);
+    ST_Size i, switches = 0;
+    int success;
+    fork(ctx, "A", "run", ST_PRIORITY_DEFAULT);
+    fork(ctx, "B", "run", ST_PRIORITY_DEFAULT);
+    success = ST_runProcesses(ctx, 0, NULL) == 0;
+    for (i = 1; i < tickCount; ++i) {
+        switches += ticks[i] != ticks[i - 1];
+    }
+    success = success && countTicks('A') == RUN_TICKS &&
+              countTicks('B') == RUN_TICKS && switches >= 4;
+    ST_destroyContext(ctx);
+    return success;
+}
+
+static int checkPriorities(void) {
+    ST_Object ctx = makeContext(10000);
+    ST_Size i;
+    int success;
+    fork(ctx, "A", "run", ST_PRIORITY_LOWEST);
+    fork(ctx, "C", "run", ST_PRIORITY_HIGHEST);
+    success = ST_runProcesses(ctx, 0, NULL) == 0 && tickCount == 2 * RUN_TICKS;
+    for (i = 0; i < tickCount; ++i) {
+        success = success && ticks[i] == (i < RUN_TICKS ? 'C' : 'A');
+    }
+    ST_destroyContext(ctx);
+    return success;
+}
+
+static int checkYield(void) {
+    ST_Object ctx = makeContext(10000);
+    int success;
+    fork(ctx, "A", "yielder", ST_PRIORITY_DEFAULT);
+    fork(ctx, "B", "yielder", ST_PRIORITY_DEFAULT);
+    success = ST_runProcesses(ctx, 0, NULL) == 0 && tickCount == 4 &&
+              memcmp(ticks, "ABAB", 4) == 0;
+    ST_destroyContext(ctx);
+    return success;
+}
+
+static int checkSemaphore(void) {
+    ST_Object ctx = makeContext(10000);
+    ST_Object wait = ST_symb(ctx, "wait"), signal = ST_symb(ctx, "signal");
+    int success;
+    fork(ctx, "A", "waiter", ST_PRIORITY_DEFAULT);
+    success = ST_runProcesses(ctx, 0, NULL) == 1 && tickCount == 0;
+    /* The host can't block */
+    success = success && ST_sendMsg(ctx, global(ctx, "Sem"), wait, 0, NULL) ==
+                             ST_getFalse(ctx);
+    success = success && ST_saveImage(ctx, NULL, 0) == 0;
+    ST_sendMsg(ctx, global(ctx, "Sem"), signal, 0, NULL);
+    success = success && ST_runProcesses(ctx, 0, NULL) == 0 && tickCount == 1;
+    /* A signal nobody waited for is kept */
+    ST_sendMsg(ctx, global(ctx, "Sem"), signal, 0, NULL);
+    fork(ctx, "B", "waiter", ST_PRIORITY_DEFAULT);
+    success = success && ST_runProcesses(ctx, 0, NULL) == 0 && tickCount == 2;
+    ST_destroyContext(ctx);
+    return success;
+}
+
+static int checkDelay(void) {
+    ST_Object ctx = makeContext(10000);
+    ST_Size wakeup = 0;
+    int success;
+    fork(ctx, "A", "sleeper", ST_PRIORITY_DEFAULT);
+    success = ST_runProcesses(ctx, 100, &wakeup) == 1 && wakeup == 150;
+    success = success && ST_runProcesses(ctx, 149, NULL) == 1 && !tickCount;
+    success = success && ST_runProcesses(ctx, 150, NULL) == 0 && tickCount == 1;
+    ST_destroyContext(ctx);
+    return success;
+}
+
+static int checkTerminate(void) {
+    ST_Object ctx = makeContext(10000);
+    ST_Object *locals = ST_pushLocals(ctx, 1);
+    int success;
+    locals[0] = fork(ctx, "A", "waiter", ST_PRIORITY_DEFAULT);
+    success = ST_runProcesses(ctx, 0, NULL) == 1;
+    ST_sendMsg(ctx, locals[0], ST_symb(ctx, "terminate"), 0, NULL);
+    success = success &&
+              ST_sendMsg(ctx, locals[0], ST_symb(ctx, "isTerminated"), 0,
+                         NULL) == ST_getTrue(ctx) &&
+              ST_runProcesses(ctx, 0, NULL) == 0 && tickCount == 0;
+    ST_popLocals(ctx);
+    ST_destroyContext(ctx);
+    return success;
+}
+
+/* Many handlers blocked at once, surviving collections while they wait */
+static int checkMany(void) {
+    enum { PROCESSES = 2000 };
+    ST_Object ctx = makeContext(1 << 20);
+    ST_Object signal = ST_symb(ctx, "signal");
+    ST_Object selector = ST_symb(ctx, "waiter");
+    int i, success;
+    for (i = 0; i < PROCESSES; ++i) {
+        /* From Smalltalk, with fork: */
+        ST_sendMsg(ctx, global(ctx, i % 2 ? "A" : "B"), ST_symb(ctx, "fork:"),
+                   1, &selector);
+    }
+    success = ST_runProcesses(ctx, 0, NULL) == PROCESSES;
+    ST_GC_run(ctx);
+    for (i = 0; i < PROCESSES; ++i) {
+        ST_sendMsg(ctx, global(ctx, "Sem"), signal, 0, NULL);
+        if (i % 500 == 0) {
+            ST_GC_run(ctx);
+        }
+    }
+    success = success && ST_runProcesses(ctx, 0, NULL) == 0 &&
+              countTicks('A') == PROCESSES / 2 &&
+              countTicks('B') == PROCESSES / 2;
+    ST_destroyContext(ctx);
+    return success;
+}
+
+/* Subclasses of Semaphore keep the room its primitives write into, and
+   can't put instance variables there */
+static int checkSubclass(void) {
+    static const char *const ivarNames[] = {"owner", NULL};
+    ST_Object ctx = makeContext(10000);
+    ST_Object *locals = ST_pushLocals(ctx, 3);
+    ST_Object name = ST_symb(ctx, "Mutex");
+    int success;
+    locals[0] = ST_sendMsg(ctx, global(ctx, "Semaphore"),
+                           ST_symb(ctx, "subclass:"), 1, &name);
+    locals[1] = ST_sendMsg(ctx, locals[0], ST_symb(ctx, "new"), 0, NULL);
+    locals[2] = ST_sendMsg(ctx, locals[0], ST_symb(ctx, "new"), 0, NULL);
+    ST_sendMsg(ctx, locals[1], ST_symb(ctx, "signal"), 0, NULL);
+    ST_GC_run(ctx);
+    success = ST_getClass(ctx, locals[2]) == locals[0] &&
+              ST_sendMsg(ctx, locals[1], ST_symb(ctx, "wait"), 0, NULL) ==
+                  ST_getTrue(ctx) &&
+              ST_defineClass(ctx, global(ctx, "Semaphore"), "Lock", ivarNames,
+                             NULL, 0) == ST_getNil(ctx);
+    ST_popLocals(ctx);
+    ST_destroyContext(ctx);
+    return success;
+}
+
+/* Forks that don't fit on a process stack fail, and processes that
+   overflow theirs are terminated, leaving the others running */
+static int checkOverflow(void) {
+    ST_Object ctx = makeContext(10000);
+    ST_Object argv[200];
+    int i, success;
+    for (i = 0; i < 200; ++i) {
+        argv[i] = ST_getNil(ctx);
+    }
+    success = ST_fork(ctx, global(ctx, "A"), ST_symb(ctx, "tick"), 200, argv,
+                      ST_PRIORITY_DEFAULT) == ST_getNil(ctx);
+    fork(ctx, "A", "recurse", ST_PRIORITY_DEFAULT);
+    fork(ctx, "B", "yielder", ST_PRIORITY_DEFAULT);
+    success = success && ST_runProcesses(ctx, 0, NULL) == 0 &&
+              tickCount == 2 && memcmp(ticks, "BB", 2) == 0;
+    /* The host's stack too */
+    success = success &&
+              ST_sendMsg(ctx, global(ctx, "A"), ST_symb(ctx, "recurse"), 0,
+                         NULL) == ST_getNil(ctx) &&
+              ST_sendMsg(ctx, global(ctx, "C"), ST_symb(ctx, "yielder"), 0,
+                         NULL) == global(ctx, "C") &&
+              tickCount == 4;
+    ST_destroyContext(ctx);
+    return success;
+}
+
+int main() {
+    if (!checkPreemption()) {
+        puts("processes weren't preempted");
+        return EXIT_FAILURE;
+    }
+    if (!checkPriorities()) {
+        puts("priorities weren't respected");
+        return EXIT_FAILURE;
+    }
+    if (!checkYield()) {
+        puts("yield didn't switch processes");
+        return EXIT_FAILURE;
+    }
+    if (!checkSemaphore()) {
+        puts("semaphore wait/signal failed");
+        return EXIT_FAILURE;
+    }
+    if (!checkDelay()) {
+        puts("delay woke up at the wrong time");
+        return EXIT_FAILURE;
+    }
+    if (!checkTerminate()) {
+        puts("terminated process still ran");
+        return EXIT_FAILURE;
+    }
+    if (!checkMany()) {
+        puts("many waiting processes failed");
+        return EXIT_FAILURE;
+    }
+    if (!checkOverflow()) {
+        puts("stack overflow wasn't contained");
+        return EXIT_FAILURE;
+    }
+    if (!checkSubclass()) {
+        puts("subclasses of Semaphore are broken");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
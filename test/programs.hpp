@@ -0,0 +1,118 @@
+#pragma once
+
+#include "../src/opcode.h"
+#include "../src/smalltalk.h"
+#include "../util/bytecode.hpp"
+
+#include <string.h>
+#include <string>
+#include <vector>
+
+/* Shared by the tests of the bytecode tools: programs are assembled
+   instruction by instruction, then run in a fresh context, before and after
+   a tool has been at them, and the globals they set compared. */
+
+struct Assembler {
+    st::Program program;
+
+    uint16_t symbol(const char *name) {
+        for (uint16_t i = 0; i < program.symbols.size(); ++i) {
+            if (program.symbols[i] == name) {
+                return i;
+            }
+        }
+        program.symbols.push_back(name);
+        return program.symbols.size() - 1;
+    }
+
+    Assembler &op(uint8_t opcode) {
+        st::Instruction inst = st::Instruction();
+        inst.opcode = opcode;
+        program.code.push_back(inst);
+        return *this;
+    }
+
+    Assembler &op(uint8_t opcode, const char *name) {
+        op(opcode);
+        program.code.back().operand = symbol(name);
+        return *this;
+    }
+
+    /* name := Object subclass: #name */
+    Assembler &subclass(const char *name) {
+        return op(ST_VM_OP_PUSHSYMBOL, name)
+            .op(ST_VM_OP_GETGLOBAL, "Object")
+            .op(ST_VM_OP_SENDMSG, "subclass:")
+            .op(ST_VM_OP_SETGLOBAL, name);
+    }
+
+    /* className>>selector, up to the matching endMethod() */
+    size_t beginMethod(const char *className, const char *selector,
+                       uint8_t argc = 0) {
+        op(ST_VM_OP_GETGLOBAL, className).op(ST_VM_OP_SETMETHOD, selector);
+        program.code.back().argc = argc;
+        return program.code.size() - 1;
+    }
+
+    Assembler &endMethod(size_t method) {
+        program.code[method].bodyEnd = program.code.size();
+        return *this;
+    }
+
+    /* global := receiver selector, for a global receiver */
+    Assembler &send(const char *global, const char *receiver,
+                    const char *selector) {
+        return op(ST_VM_OP_GETGLOBAL, receiver)
+            .op(ST_VM_OP_SENDMSG, selector)
+            .op(ST_VM_OP_SETGLOBAL, global);
+    }
+};
+
+/* Symbols print as #name, other objects as their class name */
+inline std::string describe(ST_Object ctx, ST_Object object) {
+    const char *name = ST_Symbol_toString(ctx, object);
+    if (name) {
+        return std::string("#") + name;
+    }
+    name = ST_repr(ctx, object);
+    return name ? name : "?";
+}
+
+/* Runs the encoded programs one after the other in a fresh context, set up
+   by setup if there is one, and describes the globals */
+inline std::vector<std::string>
+run(const std::vector<std::vector<uint8_t>> &units,
+    const std::vector<const char *> &globals,
+    void (*setup)(ST_Object ctx) = nullptr) {
+    ST_Configuration config = ST_DEFAULT_CONFIG;
+    ST_Object ctx = ST_createContext(&config);
+    std::vector<ST_Code> codes;
+    if (setup) {
+        setup(ctx);
+    }
+    std::vector<std::string> results;
+    /* Methods point into their code */
+    codes.reserve(units.size());
+    for (auto &bytes : units) {
+        codes.push_back(ST_VM_load(ctx, bytes.data(), bytes.size()));
+        ST_VM_execute(ctx, &codes.back(), 0);
+    }
+    for (auto global : globals) {
+        results.push_back(
+            describe(ctx, ST_getGlobal(ctx, ST_symb(ctx, global))));
+    }
+    ST_destroyContext(ctx);
+    return results;
+}
+
+inline std::vector<std::string> run(const std::vector<uint8_t> &bytes,
+                                    const std::vector<const char *> &globals,
+                                    void (*setup)(ST_Object ctx) = nullptr) {
+    return run(std::vector<std::vector<uint8_t>>{bytes}, globals, setup);
+}
+
+inline std::vector<std::string> run(const st::Program &program,
+                                    const std::vector<const char *> &globals,
+                                    void (*setup)(ST_Object ctx) = nullptr) {
+    return run(st::encode(program), globals, setup);
+}
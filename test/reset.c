@@ -0,0 +1,119 @@
+#include "../src/smalltalk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum { REQUESTS = 100, SYMBOLS = 50, ARRAYS = 20 };
+
+static ST_Size outstanding;
+
+static void *countedAlloc(size_t size) {
+    ++outstanding;
+    return malloc(size);
+}
+
+static void countedFree(void *memory) {
+    --outstanding;
+    free(memory);
+}
+
+static ST_Object answer(ST_Object ctx, ST_Object self, ST_Object argv[]) {
+    return ST_getInteger(ctx, 42);
+}
+
+static ST_Object one(ST_Object ctx, ST_Object self, ST_Object argv[]) {
+    return ST_getInteger(ctx, 1);
+}
+
+static ST_Object two(ST_Object ctx, ST_Object self, ST_Object argv[]) {
+    return ST_getInteger(ctx, 2);
+}
+
+static const ST_MethodDef workerMethods[] = {{"answer", answer, 0}};
+
+static ST_Object global(ST_Object ctx, const char *name) {
+    return ST_getGlobal(ctx, ST_symb(ctx, name));
+}
+
+static ST_S32 send(ST_Object ctx, const char *receiver, const char *selector) {
+    return ST_unboxInt(ctx, ST_sendMsg(ctx, global(ctx, receiver),
+                                       ST_symb(ctx, selector), 0, NULL));
+}
+
+/* Worker answers 42, Counter is 0 */
+static ST_Object setup(void) {
+    ST_Configuration config = ST_DEFAULT_CONFIG;
+    ST_Object ctx;
+    config.memory.allocFn = countedAlloc;
+    config.memory.freeFn = countedFree;
+    config.memory.heapCapacity = 100000;
+    ctx = ST_createContext(&config);
+    ST_defineClass(ctx, global(ctx, "Object"), "Worker", NULL, workerMethods,
+                   1);
+    ST_setGlobal(ctx, ST_symb(ctx, "Counter"), ST_getInteger(ctx, 0));
+    return ctx;
+}
+
+/* Changes everything a reset restores, and leaves a process behind */
+static int request(ST_Object ctx, ST_S32 round) {
+    ST_MethodDef tempMethods[1];
+    ST_Object argv[1];
+    char name[32];
+    int i;
+    ST_setGlobal(ctx, ST_symb(ctx, "Counter"), ST_getInteger(ctx, round));
+    ST_setGlobal(ctx, ST_symb(ctx, "Extra"), ST_getTrue(ctx));
+    tempMethods[0].selector = "value";
+    tempMethods[0].method = round % 2 ? one : two;
+    tempMethods[0].argc = 0;
+    ST_defineClass(ctx, global(ctx, "Object"), "Temp", NULL, tempMethods, 1);
+    ST_setMethod(ctx, global(ctx, "Worker"), ST_symb(ctx, "extra"),
+                 round % 2 ? one : two, 0);
+    for (i = 0; i < SYMBOLS; ++i) {
+        sprintf(name, "symbol%d_%d", (int)round, i);
+        ST_symb(ctx, name);
+    }
+    for (i = 0; i < ARRAYS; ++i) {
+        argv[0] = ST_getInteger(ctx, 10);
+        ST_sendMsg(ctx, global(ctx, "Array"), ST_symb(ctx, "new:"), 1, argv);
+    }
+    ST_GC_run(ctx);
+    ST_fork(ctx, global(ctx, "Worker"), ST_symb(ctx, "answer"), 0, NULL,
+            ST_PRIORITY_DEFAULT);
+    return ST_unboxInt(ctx, global(ctx, "Counter")) == round &&
+           send(ctx, "Temp", "value") == 2 - round % 2 &&
+           send(ctx, "Worker", "extra") == 2 - round % 2 &&
+           !ST_checkpointContext(ctx);
+}
+
+static int isReset(ST_Object ctx) {
+    return ST_unboxInt(ctx, global(ctx, "Counter")) == 0 &&
+           global(ctx, "Extra") == ST_getNil(ctx) &&
+           global(ctx, "Temp") == ST_getNil(ctx) &&
+           send(ctx, "Worker", "answer") == 42;
+}
+
+/* Every request sees the state of the checkpoint, and after the first one
+   resets reuse the memory rather than allocate more */
+static int checkRequests(void) {
+    ST_Object ctx = setup();
+    ST_Size afterFirst = 0;
+    ST_S32 round;
+    int success = !ST_resetContext(ctx) && ST_checkpointContext(ctx);
+    for (round = 1; round <= REQUESTS && success; ++round) {
+        success = request(ctx, round) && ST_resetContext(ctx) && isReset(ctx);
+        if (round == 1) {
+            afterFirst = outstanding;
+        }
+    }
+    success = success && outstanding == afterFirst;
+    ST_destroyContext(ctx);
+    return success;
+}
+
+int main() {
+    if (!checkRequests()) {
+        puts("contexts don't reset to their checkpoint");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
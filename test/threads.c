@@ -0,0 +1,120 @@
+#include "../src/opcode.h"
+#include "../src/smalltalk.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Foo := Object subclass: #Foo.
+   Foo>>getTrue ^true.
+   Result := Foo new getTrue. */
+static const ST_U8 program[] = {
+    'F', 'o', 'o', '\0', 'O', 'b', 'j', 'e', 'c', 't', '\0', 's', 'u', 'b',
+    'c', 'l', 'a', 's', 's', ':', '\0', 'g', 'e', 't', 'T', 'r', 'u', 'e',
+    '\0', 'n', 'e', 'w', '\0', 'R', 'e', 's', 'u', 'l', 't', '\0', '\0',
+    ST_VM_OP_PUSHSYMBOL, 0, 0, ST_VM_OP_GETGLOBAL, 1, 0, ST_VM_OP_SENDMSG, 2,
+    0, ST_VM_OP_SETGLOBAL, 0, 0, ST_VM_OP_GETGLOBAL, 0, 0, ST_VM_OP_SETMETHOD,
+    3, 0, 0, 3, 0, 0, 0, ST_VM_OP_POP, ST_VM_OP_PUSHTRUE, ST_VM_OP_RETURN,
+    ST_VM_OP_GETGLOBAL, 0, 0, ST_VM_OP_SENDMSG, 4, 0, ST_VM_OP_SENDMSG, 3, 0,
+    ST_VM_OP_SETGLOBAL, 5, 0};
+
+enum { THREADS = 8, ITERATIONS = 50, PROCESSES = 16, GLOBALS = 32 };
+
+typedef struct Worker {
+    pthread_t thread;
+    const ST_SharedCode *code;
+    int id;
+    int success;
+} Worker;
+
+static int checkGlobals(ST_Object ctx, int id) {
+    char name[32];
+    int i;
+    for (i = 0; i < GLOBALS; ++i) {
+        sprintf(name, "global%d_%d", id, i);
+        ST_setGlobal(ctx, ST_symb(ctx, name), ST_getInteger(ctx, id * i));
+    }
+    ST_GC_run(ctx);
+    for (i = 0; i < GLOBALS; ++i) {
+        sprintf(name, "global%d_%d", id, i);
+        if (ST_unboxInt(ctx, ST_getGlobal(ctx, ST_symb(ctx, name))) !=
+            id * i) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int checkProcesses(ST_Object ctx) {
+    ST_Object *locals = ST_pushLocals(ctx, 1);
+    int i, success = 1;
+    locals[0] = ST_sendMsg(ctx, ST_getGlobal(ctx, ST_symb(ctx, "Foo")),
+                           ST_symb(ctx, "new"), 0, NULL);
+    for (i = 0; i < PROCESSES && success; ++i) {
+        success = ST_fork(ctx, locals[0], ST_symb(ctx, "getTrue"), 0, NULL,
+                          ST_PRIORITY_DEFAULT) != NULL;
+    }
+    ST_popLocals(ctx);
+    return success && ST_runProcesses(ctx, 0, NULL) == 0;
+}
+
+/* Saves the context and checks the image restores it */
+static int checkImage(ST_Object ctx) {
+    ST_Configuration config = ST_DEFAULT_CONFIG;
+    const ST_Size size = ST_saveImage(ctx, NULL, 0);
+    ST_U8 *image = malloc(size);
+    ST_Object loaded;
+    int success = size && ST_saveImage(ctx, image, size) == size;
+    loaded = success ? ST_loadImage(&config, image, size) : NULL;
+    success = loaded && ST_getGlobal(loaded, ST_symb(loaded, "Result")) ==
+                            ST_getTrue(loaded);
+    if (loaded) {
+        ST_destroyContext(loaded);
+    }
+    free(image);
+    return success;
+}
+
+/* Each thread runs its own contexts, sharing only the code */
+static void *run(void *arg) {
+    Worker *worker = arg;
+    ST_Configuration config = ST_DEFAULT_CONFIG;
+    int i;
+    worker->success = 1;
+    for (i = 0; i < ITERATIONS && worker->success; ++i) {
+        ST_Object ctx = ST_createContext(&config);
+        ST_VM_execute(ctx, ST_VM_link(ctx, worker->code), 0);
+        worker->success =
+            ST_getGlobal(ctx, ST_symb(ctx, "Result")) == ST_getTrue(ctx) &&
+            checkProcesses(ctx) && checkGlobals(ctx, worker->id) &&
+            checkImage(ctx);
+        ST_destroyContext(ctx);
+    }
+    return NULL;
+}
+
+int main() {
+    ST_Configuration config = ST_DEFAULT_CONFIG;
+    ST_SharedCode *code = ST_VM_loadShared(&config, program, sizeof program);
+    Worker workers[THREADS];
+    int i, started = 0, success = code != NULL;
+    for (i = 0; i < THREADS && success; ++i) {
+        workers[i].code = code;
+        workers[i].id = i;
+        success = pthread_create(&workers[i].thread, NULL, run,
+                                 &workers[i]) == 0;
+        started += success;
+    }
+    for (i = 0; i < started; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        success = success && workers[i].success;
+    }
+    if (code) {
+        ST_VM_releaseShared(code);
+    }
+    if (!success) {
+        puts("independent contexts failed on separate threads");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "../src/smalltalk.h"
+
+#include <coroutine>
+#include <exception>
+
+namespace st {
+
+/* Primitives as C++20 coroutines, on top of ST_pending and ST_resume:
+
+       st::Async fetch(ST_Object ctx, std::string url) {
+           std::string body = co_await download(url);
+           co_return ST_getInteger(ctx, body.size());
+       }
+
+       ST_Object fetchPrimitive(ST_Object ctx, ST_Object self,
+                                ST_Object argv[]) {
+           return st::await(ctx, fetch(ctx, urlOf(ctx, argv[0])));
+       }
+
+   The coroutine runs until it first suspends, and if it completed by then
+   its value is answered right away. Otherwise the sending process waits,
+   and whatever resumes the coroutine (an event loop, a completion callback)
+   must do so on the context's thread between ST_runProcesses calls; the
+   co_return then makes the process ready with that value. ST_Objects move
+   during garbage collection, so don't hold them across a co_await: keep
+   the host data, or a global, instead. If the code can't wait (see
+   ST_pending), the value of a coroutine that suspends is dropped and the
+   send answers nil. */
+class Async {
+public:
+    struct promise_type {
+        ST_Object context = nullptr;
+        ST_Object value = nullptr;
+        ST_Size token = 0;
+        bool detached = false;
+
+        Async get_return_object() {
+            return Async(std::coroutine_handle<promise_type>::from_promise(
+                *this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        struct FinalAwaiter {
+            bool await_ready() noexcept { return false; }
+            /* Detached coroutines hand their value over and free
+               themselves by not suspending */
+            bool await_suspend(
+                std::coroutine_handle<promise_type> handle) noexcept {
+                promise_type &promise = handle.promise();
+                if (!promise.detached) {
+                    return true;
+                }
+                if (promise.token) {
+                    ST_resume(promise.context, promise.token,
+                              promise.value ? promise.value
+                                            : ST_getNil(promise.context));
+                }
+                return false;
+            }
+            void await_resume() noexcept {}
+        };
+        FinalAwaiter final_suspend() noexcept { return {}; }
+
+        void return_value(ST_Object result) { value = result; }
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    Async(Async &&other) noexcept : handle_(other.handle_) {
+        other.handle_ = nullptr;
+    }
+    Async(const Async &) = delete;
+    Async &operator=(const Async &) = delete;
+    ~Async() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+private:
+    explicit Async(std::coroutine_handle<promise_type> handle)
+        : handle_(handle) {}
+
+    friend ST_Object await(ST_Object context, Async task);
+
+    std::coroutine_handle<promise_type> handle_;
+};
+
+/* Starts the coroutine for the primitive that returns this */
+inline ST_Object await(ST_Object context, Async task) {
+    Async::promise_type &promise = task.handle_.promise();
+    promise.context = context;
+    promise.token = ST_pending(context);
+    task.handle_.resume();
+    if (task.handle_.done()) {
+        /* Cancels the wait, the value is answered directly */
+        if (promise.token) {
+            ST_resume(context, promise.token, ST_getNil(context));
+        }
+        return promise.value ? promise.value : ST_getNil(context);
+    }
+    promise.detached = true;
+    task.handle_ = nullptr;
+    return ST_getNil(context);
+}
+
+} // namespace st
@@ -0,0 +1,202 @@
+#include "bytecode.hpp"
+#include "cache.hpp"
+#include "linker.hpp"
+#include "optimizer.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+
+/* Bytecode optimizer: reads one or more programs, runs the passes in
+   optimizer.cpp over each of them on a pool of threads, and links the results
+   into a single output whose symbol table is ordered by reference frequency
+   (or by the counts in a -profile file). -whole-program promises that the
+   inputs are the entire program, which enables devirtualization, and inlining
+   of methods up to -inline-size bytes (0 disables it). With -cache, results
+   are reused across runs for inputs that haven't changed. -compress stores
+   the code LZ4 compressed, which trades a decompression pass at load time
+   (and loading in place) for less I/O. */
+
+struct Options {
+    std::vector<const char *> inputPaths;
+    const char *outputPath = nullptr;
+    const char *cacheDir = nullptr;
+    const char *profilePath = nullptr;
+    uint64_t cacheSize = 64 * 1024 * 1024;
+    size_t inlineSize = 16;
+    unsigned jobs = 0;
+    bool wholeProgram = false;
+    bool printStats = false;
+    bool compress = false;
+};
+
+struct Unit {
+    st::Program program;
+    std::vector<st::PassStats> stats;
+    bool cacheHit = false;
+    std::string error;
+};
+
+static void compile(const Options &options, const char *path, Unit &unit) {
+    try {
+        const std::vector<uint8_t> input = st::readFile(path);
+        std::string cacheKey;
+        if (options.cacheDir) {
+            /* Nothing on the command line changes the output yet, so only the
+               input and the toolchain version go into the key. */
+            st::CompileCache cache(options.cacheDir, options.cacheSize);
+            cacheKey = st::CompileCache::key(input, "bcopt");
+            std::vector<uint8_t> cached;
+            if (cache.lookup(cacheKey, cached)) {
+                unit.program = st::decode(cached);
+                unit.cacheHit = true;
+                return;
+            }
+        }
+        unit.program = st::decode(input);
+        unit.stats = st::optimize(unit.program);
+        if (options.cacheDir) {
+            st::CompileCache(options.cacheDir, options.cacheSize)
+                .store(cacheKey, st::encode(unit.program));
+        }
+    } catch (const std::exception &err) {
+        unit.error = std::string(path) + ": " + err.what();
+    }
+}
+
+static void compileAll(const Options &options, std::vector<Unit> &units) {
+    unsigned jobs = options.jobs;
+    if (!jobs) {
+        jobs = std::max(1u, std::thread::hardware_concurrency());
+    }
+    jobs = std::min<unsigned>(jobs, units.size());
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        size_t i;
+        while ((i = next++) < units.size()) {
+            compile(options, options.inputPaths[i], units[i]);
+        }
+    };
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < jobs; ++i) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (auto &thread : pool) {
+        thread.join();
+    }
+}
+
+static void printStats(const std::vector<Unit> &units, size_t instructions,
+                       size_t bytes) {
+    std::vector<st::PassStats> totals;
+    size_t cacheHits = 0;
+    for (auto &unit : units) {
+        cacheHits += unit.cacheHit;
+        for (size_t p = 0; p < unit.stats.size(); ++p) {
+            if (totals.size() <= p) {
+                totals.push_back({unit.stats[p].name, 0, 0});
+            }
+            totals[p].instructionsRemoved += unit.stats[p].instructionsRemoved;
+            totals[p].bytesSaved += unit.stats[p].bytesSaved;
+        }
+    }
+    for (auto &pass : totals) {
+        std::cerr << std::setw(14) << std::left << pass.name
+                  << pass.instructionsRemoved << " instructions, "
+                  << pass.bytesSaved << " bytes" << std::endl;
+    }
+    if (cacheHits) {
+        std::cerr << std::setw(14) << std::left << "cache" << cacheHits << "/"
+                  << units.size() << " units reused" << std::endl;
+    }
+    std::cerr << std::setw(14) << std::left << "output" << instructions
+              << " instructions, " << bytes << " bytes" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            options.outputPath = argv[++i];
+        } else if (strcmp(argv[i], "-cache") == 0 && i + 1 < argc) {
+            options.cacheDir = argv[++i];
+        } else if (strcmp(argv[i], "-cache-size") == 0 && i + 1 < argc) {
+            options.cacheSize = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "-profile") == 0 && i + 1 < argc) {
+            options.profilePath = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            options.jobs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-inline-size") == 0 && i + 1 < argc) {
+            options.inlineSize = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "-whole-program") == 0) {
+            options.wholeProgram = true;
+        } else if (strcmp(argv[i], "-stats") == 0) {
+            options.printStats = true;
+        } else if (strcmp(argv[i], "-compress") == 0) {
+            options.compress = true;
+        } else {
+            options.inputPaths.push_back(argv[i]);
+        }
+    }
+    if (options.inputPaths.empty() || !options.outputPath) {
+        std::cerr << "usage: bcopt [-stats] [-compress] [-whole-program "
+                     "[-inline-size bytes]] [-j jobs] [-profile file] "
+                     "[-cache dir [-cache-size bytes]] [files...] -o [output]"
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::vector<Unit> units(options.inputPaths.size());
+    compileAll(options, units);
+    std::vector<st::Program> programs;
+    for (auto &unit : units) {
+        if (!unit.error.empty()) {
+            std::cerr << "bcopt: " << unit.error << std::endl;
+            return EXIT_FAILURE;
+        }
+        programs.push_back(std::move(unit.program));
+    }
+    try {
+        st::Program bundle =
+            programs.size() == 1 ? programs.front() : st::link(programs);
+        const size_t devirtualized =
+            options.wholeProgram ? st::devirtualize(bundle) : 0;
+        std::vector<st::InlineReport> inlined;
+        if (options.wholeProgram && options.inlineSize) {
+            inlined = st::inlineSends(bundle, options.inlineSize);
+            /* Inlined code often pairs up with its call site, e.g. a
+               constant whose result gets discarded. */
+            st::optimize(bundle);
+        }
+        st::SymbolProfile profile;
+        if (options.profilePath) {
+            profile = st::readProfile(options.profilePath);
+        }
+        st::orderSymbolsByFrequency(bundle, profile);
+        const std::vector<uint8_t> output =
+            st::encode(bundle, options.compress);
+        st::writeFile(options.outputPath, output);
+        if (options.printStats) {
+            if (options.wholeProgram) {
+                std::cerr << std::setw(14) << std::left << "devirtualize"
+                          << devirtualized << " sends bound" << std::endl;
+                for (auto &report : inlined) {
+                    std::cerr << std::setw(14) << std::left << "inline"
+                              << report.className << ">>" << report.selector
+                              << ", " << report.bodyBytes << " bytes, "
+                              << report.sites << " sites" << std::endl;
+                }
+            }
+            printStats(units, bundle.code.size(), output.size());
+        }
+    } catch (const std::exception &err) {
+        std::cerr << "bcopt: " << err.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,44 @@
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "../src/smalltalk.h"
+
+/* Build time generator for the boot image. Links against a build of the
+   runtime without one, bootstraps a context the slow way, and writes the
+   resulting image out as a C array for smalltalk.c to include. See
+   ST_BOOT_IMAGE in build/CMakeLists.txt. */
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        std::cerr << "usage: bootgen [output header]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    ST_Configuration config = ST_DEFAULT_CONFIG;
+    ST_Object context = ST_createContext(&config);
+    const ST_Size size = ST_saveImage(context, nullptr, 0);
+    if (!size) {
+        std::cerr << "bootgen: failed to save the boot image" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::vector<ST_U8> image;
+    image.resize(size);
+    ST_saveImage(context, image.data(), size);
+    ST_destroyContext(context);
+    std::ofstream output(argv[1]);
+    output << "/* Generated by bootgen, do not edit. */\n\n"
+              "static const ST_U8 ST_bootImage[] = {";
+    for (size_t i = 0; i < image.size(); ++i) {
+        output << (i % 12 ? " " : "\n    ") << "0x" << std::hex
+               << std::setw(2) << std::setfill('0') << (unsigned)image[i]
+               << (i + 1 < image.size() ? "," : "");
+    }
+    output << "};\n";
+    if (!output) {
+        std::cerr << "bootgen: failed to write " << argv[1] << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
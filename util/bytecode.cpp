@@ -0,0 +1,667 @@
+#include "bytecode.hpp"
+
+#include "../src/opcode.h"
+
+#include <algorithm>
+#include <array>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <stdexcept>
+
+namespace st {
+
+size_t instructionSize(uint8_t opcode) {
+    switch (opcode) {
+    case ST_VM_OP_PUSHNIL:
+    case ST_VM_OP_PUSHTRUE:
+    case ST_VM_OP_PUSHFALSE:
+    case ST_VM_OP_PUSHSUPER:
+    case ST_VM_OP_DUP:
+    case ST_VM_OP_POP:
+    case ST_VM_OP_SWAP:
+    case ST_VM_OP_RETURN:
+        return 1;
+
+    case ST_VM_OP_GETGLOBAL:
+    case ST_VM_OP_SETGLOBAL:
+    case ST_VM_OP_GETIVAR:
+    case ST_VM_OP_SETIVAR:
+    case ST_VM_OP_SENDMSG:
+    case ST_VM_OP_PUSHSYMBOL:
+        return 1 + sizeof(uint16_t);
+
+    case ST_VM_OP_SETMETHOD:
+        return 1 + sizeof(uint16_t) + 1 + sizeof(uint32_t);
+
+    case ST_VM_OP_GETGLOBAL8:
+    case ST_VM_OP_SETGLOBAL8:
+    case ST_VM_OP_SENDMSG8:
+    case ST_VM_OP_PUSHSYMBOL8:
+        return 1 + sizeof(uint8_t);
+
+    case ST_VM_OP_SENDDIRECT:
+        return 1 + 3 * sizeof(uint16_t) + 1 + sizeof(uint32_t);
+
+    case ST_VM_OP_INLINEGUARD:
+        return 1 + 3 * sizeof(uint16_t) + sizeof(uint32_t);
+    }
+    throw std::runtime_error("unknown opcode " + std::to_string(opcode));
+}
+
+static uint8_t shortForm(uint8_t opcode) {
+    switch (opcode) {
+    case ST_VM_OP_GETGLOBAL:
+        return ST_VM_OP_GETGLOBAL8;
+    case ST_VM_OP_SETGLOBAL:
+        return ST_VM_OP_SETGLOBAL8;
+    case ST_VM_OP_SENDMSG:
+        return ST_VM_OP_SENDMSG8;
+    case ST_VM_OP_PUSHSYMBOL:
+        return ST_VM_OP_PUSHSYMBOL8;
+    }
+    return opcode;
+}
+
+static uint8_t longForm(uint8_t opcode) {
+    switch (opcode) {
+    case ST_VM_OP_GETGLOBAL8:
+        return ST_VM_OP_GETGLOBAL;
+    case ST_VM_OP_SETGLOBAL8:
+        return ST_VM_OP_SETGLOBAL;
+    case ST_VM_OP_SENDMSG8:
+        return ST_VM_OP_SENDMSG;
+    case ST_VM_OP_PUSHSYMBOL8:
+        return ST_VM_OP_PUSHSYMBOL;
+    }
+    return opcode;
+}
+
+static uint8_t encodedOpcode(const Instruction &inst) {
+    return inst.operand <= UINT8_MAX ? shortForm(inst.opcode) : inst.opcode;
+}
+
+size_t encodedSize(const Instruction &inst) {
+    return instructionSize(encodedOpcode(inst));
+}
+
+bool hasSymbolOperand(uint8_t opcode) {
+    switch (opcode) {
+    case ST_VM_OP_GETGLOBAL:
+    case ST_VM_OP_SETGLOBAL:
+    case ST_VM_OP_SENDMSG:
+    case ST_VM_OP_PUSHSYMBOL:
+    case ST_VM_OP_SETMETHOD:
+    case ST_VM_OP_SENDDIRECT:
+    case ST_VM_OP_INLINEGUARD:
+        return true;
+    }
+    return false;
+}
+
+bool hasClassSymbol(uint8_t opcode) {
+    return opcode == ST_VM_OP_SENDDIRECT || opcode == ST_VM_OP_INLINEGUARD;
+}
+
+bool hasBody(uint8_t opcode) {
+    return opcode == ST_VM_OP_SETMETHOD || opcode == ST_VM_OP_INLINEGUARD;
+}
+
+static uint16_t readU16(const uint8_t *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t readU32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+           ((uint32_t)p[3] << 24);
+}
+
+static void writeU16(std::vector<uint8_t> &out, uint16_t v) {
+    out.push_back(v & 0xff);
+    out.push_back(v >> 8);
+}
+
+static void writeU32(std::vector<uint8_t> &out, uint32_t v) {
+    for (int i = 0; i < 4; ++i) {
+        out.push_back((v >> (8 * i)) & 0xff);
+    }
+}
+
+static const uint8_t containerMagic[] = {0x89, 'S', 'T', 'B'};
+static const size_t containerHeaderSize = sizeof containerMagic + 2 * 2;
+static const size_t containerEntrySize = 4 * 4;
+
+/* CRC32C (Castagnoli), as the VM checks it. */
+uint32_t crc32c(const uint8_t *data, size_t len) {
+    static const std::array<uint32_t, 256> table = [] {
+        std::array<uint32_t, 256> entries;
+        for (uint32_t i = 0; i < entries.size(); ++i) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+            }
+            entries[i] = crc;
+        }
+        return entries;
+    }();
+    uint32_t crc = ~0u;
+    for (size_t i = 0; i < len; ++i) {
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static uint32_t readVarint(const std::vector<uint8_t> &bytes, size_t &pos,
+                           size_t end) {
+    uint32_t value = 0;
+    for (unsigned shift = 0;; shift += 7) {
+        if (pos >= end || shift >= 32) {
+            throw std::runtime_error("truncated debug section");
+        }
+        const uint8_t byte = bytes[pos++];
+        value |= (uint32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+}
+
+static void writeVarint(std::vector<uint8_t> &out, uint32_t v) {
+    while (v >= 0x80) {
+        out.push_back((v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+    out.push_back(v);
+}
+
+/* LZ4 block format: sequences of a token (literal count and match length
+   minus 4, a nibble each, 15 meaning more follow in 255 continued bytes),
+   the literals, and a 16 bit match offset. The last sequence is literals
+   only, and covers at least the last 5 bytes. */
+static void writeLz4Length(std::vector<uint8_t> &out, size_t length) {
+    for (length -= 15; length >= 255; length -= 255) {
+        out.push_back(255);
+    }
+    out.push_back(length);
+}
+
+static void writeLz4Sequence(std::vector<uint8_t> &out, const uint8_t *literals,
+                             size_t literalCount, size_t match,
+                             size_t offset) {
+    const size_t matchCode = match ? match - 4 : 0;
+    out.push_back(std::min<size_t>(literalCount, 15) << 4 |
+                  std::min<size_t>(matchCode, 15));
+    if (literalCount >= 15) {
+        writeLz4Length(out, literalCount);
+    }
+    out.insert(out.end(), literals, literals + literalCount);
+    if (match) {
+        out.push_back(offset & 0xff);
+        out.push_back(offset >> 8);
+        if (matchCode >= 15) {
+            writeLz4Length(out, matchCode);
+        }
+    }
+}
+
+std::vector<uint8_t> lz4Compress(const uint8_t *data, size_t len) {
+    /* Greedy, with a hash table of the last position each 4 byte sequence
+       was seen at. Matches may not start in the last 12 bytes. */
+    const size_t none = SIZE_MAX, minMatch = 4;
+    std::vector<size_t> lastSeen(1 << 14, none);
+    std::vector<uint8_t> out;
+    size_t anchor = 0, pos = 0;
+    while (len >= 12 && pos < len - 12) {
+        const uint32_t sequence = readU32(data + pos);
+        const size_t hash = (sequence * 2654435761u) >> 18;
+        const size_t candidate = lastSeen[hash];
+        lastSeen[hash] = pos;
+        if (candidate == none || pos - candidate > UINT16_MAX ||
+            readU32(data + candidate) != sequence) {
+            ++pos;
+            continue;
+        }
+        size_t matchEnd = pos + minMatch;
+        while (matchEnd < len - 5 &&
+               data[matchEnd] == data[candidate + matchEnd - pos]) {
+            ++matchEnd;
+        }
+        writeLz4Sequence(out, data + anchor, pos - anchor, matchEnd - pos,
+                         pos - candidate);
+        pos = anchor = matchEnd;
+    }
+    writeLz4Sequence(out, data + anchor, len - anchor, 0, 0);
+    return out;
+}
+
+static size_t readLz4Length(const uint8_t *&pos, const uint8_t *end) {
+    size_t length = 0;
+    uint8_t byte;
+    do {
+        if (pos == end) {
+            throw std::runtime_error("truncated compressed code");
+        }
+        byte = *pos++;
+        length += byte;
+    } while (byte == 255);
+    return length;
+}
+
+std::vector<uint8_t> lz4Decompress(const uint8_t *data, size_t len,
+                                   size_t outputSize) {
+    const uint8_t *pos = data, *end = data + len;
+    std::vector<uint8_t> out;
+    out.reserve(outputSize);
+    while (pos < end) {
+        const uint8_t token = *pos++;
+        size_t literals = token >> 4, match = token & 15;
+        if (literals == 15) {
+            literals += readLz4Length(pos, end);
+        }
+        if (literals > (size_t)(end - pos) ||
+            literals > outputSize - out.size()) {
+            throw std::runtime_error("malformed compressed code");
+        }
+        out.insert(out.end(), pos, pos + literals);
+        pos += literals;
+        if (pos == end) {
+            break;
+        }
+        if (end - pos < 2) {
+            throw std::runtime_error("truncated compressed code");
+        }
+        const size_t offset = readU16(pos);
+        pos += 2;
+        if (match == 15) {
+            match += readLz4Length(pos, end);
+        }
+        match += 4;
+        if (!offset || offset > out.size() ||
+            match > outputSize - out.size()) {
+            throw std::runtime_error("malformed compressed code");
+        }
+        for (size_t i = 0; i < match; ++i) {
+            out.push_back(out[out.size() - offset]);
+        }
+    }
+    if (out.size() != outputSize) {
+        throw std::runtime_error("compressed code has the wrong size");
+    }
+    return out;
+}
+
+/* Decodes the line table into instruction offsets, the caller maps them to
+   instruction indices. */
+static void decodeLines(const std::vector<uint8_t> &bytes, size_t pos,
+                        size_t end, std::vector<LineEntry> &lines) {
+    std::vector<std::string> strings(readVarint(bytes, pos, end));
+    for (auto &str : strings) {
+        const size_t start = pos;
+        while (pos < end && bytes[pos]) {
+            ++pos;
+        }
+        if (pos == end) {
+            throw std::runtime_error("truncated debug section");
+        }
+        str.assign(bytes.begin() + start, bytes.begin() + pos++);
+    }
+    const uint32_t count = readVarint(bytes, pos, end);
+    size_t offset = 0;
+    uint32_t line = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        offset += readVarint(bytes, pos, end);
+        const uint32_t lineDelta = readVarint(bytes, pos, end);
+        line += (lineDelta >> 1) ^ -(lineDelta & 1);
+        const uint32_t file = readVarint(bytes, pos, end);
+        const uint32_t method = readVarint(bytes, pos, end);
+        if (file >= strings.size() || method >= strings.size()) {
+            throw std::runtime_error("bad string index in debug section");
+        }
+        lines.push_back({offset, strings[file], line, strings[method]});
+    }
+}
+
+static void encodeLines(const Program &program,
+                        const std::vector<size_t> &offsets,
+                        std::vector<uint8_t> &out) {
+    std::vector<std::string> strings;
+    std::map<std::string, uint32_t> stringIndex;
+    auto intern = [&](const std::string &str) {
+        auto found = stringIndex.find(str);
+        if (found == stringIndex.end()) {
+            found = stringIndex.emplace(str, (uint32_t)strings.size()).first;
+            strings.push_back(str);
+        }
+        return found->second;
+    };
+    std::vector<uint8_t> entries;
+    size_t offset = 0;
+    uint32_t line = 0;
+    for (auto &entry : program.lines) {
+        const size_t entryOffset = offsets[entry.instruction];
+        writeVarint(entries, entryOffset - offset);
+        const uint32_t lineDelta = entry.line - line;
+        writeVarint(entries, (lineDelta << 1) ^ -(lineDelta >> 31));
+        writeVarint(entries, intern(entry.file));
+        writeVarint(entries, intern(entry.method));
+        offset = entryOffset;
+        line = entry.line;
+    }
+    writeVarint(out, strings.size());
+    for (auto &str : strings) {
+        out.insert(out.end(), str.begin(), str.end());
+        out.push_back('\0');
+    }
+    writeVarint(out, program.lines.size());
+    out.insert(out.end(), entries.begin(), entries.end());
+}
+
+/* Bare format: the symbol table, then the instructions. Same rules as
+   ST_VM_load: a list of null-terminated strings, where the final one is
+   followed by a second terminator. */
+static void decodeBare(const std::vector<uint8_t> &bytes, Program &program,
+                       size_t &codeBegin, size_t &codeEnd) {
+    size_t pos = 0, start = 0;
+    while (true) {
+        if (pos + 1 >= bytes.size()) {
+            throw std::runtime_error("unterminated symbol table");
+        }
+        if (bytes[pos] == '\0') {
+            program.symbols.emplace_back(bytes.begin() + start,
+                                         bytes.begin() + pos);
+            start = pos + 1;
+            if (bytes[pos + 1] == '\0') {
+                pos += 2;
+                break;
+            }
+        }
+        ++pos;
+    }
+    codeBegin = pos;
+    codeEnd = bytes.size();
+}
+
+/* Container format, see opcode.h. Unlike the VM, checks every section.
+   Compressed code is decompressed into unpacked, and returns true. */
+static bool decodeContainer(const std::vector<uint8_t> &bytes,
+                            Program &program, size_t &codeBegin,
+                            size_t &codeEnd, std::vector<uint8_t> &unpacked) {
+    if (bytes.size() < containerHeaderSize ||
+        !std::equal(containerMagic, containerMagic + sizeof containerMagic,
+                    bytes.begin())) {
+        throw std::runtime_error("bad container header");
+    }
+    if (readU16(&bytes[4]) != ST_VM_CONTAINER_VERSION) {
+        throw std::runtime_error("unsupported container version");
+    }
+    const size_t tableEnd =
+        containerHeaderSize + readU16(&bytes[6]) * containerEntrySize;
+    if (tableEnd + 4 > bytes.size() ||
+        crc32c(bytes.data(), tableEnd) != readU32(&bytes[tableEnd])) {
+        throw std::runtime_error("damaged container header");
+    }
+    codeBegin = codeEnd = tableEnd + 4;
+    bool seen[ST_VM_SECTION_CODE_LZ4 + 1] = {}, packed = false;
+    for (size_t entry = containerHeaderSize; entry < tableEnd;
+         entry += containerEntrySize) {
+        const uint32_t id = readU32(&bytes[entry]);
+        const size_t offset = readU32(&bytes[entry + 4]);
+        const size_t length = readU32(&bytes[entry + 8]);
+        if (offset > bytes.size() || length > bytes.size() - offset ||
+            crc32c(&bytes[offset], length) != readU32(&bytes[entry + 12])) {
+            throw std::runtime_error("damaged section " + std::to_string(id));
+        }
+        if (id > ST_VM_SECTION_CODE_LZ4 || seen[id]) {
+            continue;
+        }
+        seen[id] = true;
+        if (id == ST_VM_SECTION_SYMBOLS) {
+            if (length && bytes[offset + length - 1]) {
+                throw std::runtime_error("unterminated symbol table");
+            }
+            size_t start = offset;
+            for (size_t pos = offset; pos < offset + length; ++pos) {
+                if (!bytes[pos]) {
+                    program.symbols.emplace_back(bytes.begin() + start,
+                                                 bytes.begin() + pos);
+                    start = pos + 1;
+                }
+            }
+        } else if (id == ST_VM_SECTION_CODE) {
+            codeBegin = offset;
+            codeEnd = offset + length;
+        } else if (id == ST_VM_SECTION_DEBUG) {
+            decodeLines(bytes, offset, offset + length, program.lines);
+        } else if (id == ST_VM_SECTION_CODE_LZ4 && !seen[ST_VM_SECTION_CODE]) {
+            if (length < 4) {
+                throw std::runtime_error("truncated compressed code");
+            }
+            unpacked = lz4Decompress(&bytes[offset + 4], length - 4,
+                                     readU32(&bytes[offset]));
+            codeBegin = 0;
+            codeEnd = unpacked.size();
+            packed = true;
+        }
+    }
+    return packed;
+}
+
+Program decode(const std::vector<uint8_t> &bytes) {
+    Program program;
+    size_t codeBegin, codeEnd;
+    std::vector<uint8_t> unpacked;
+    bool packed = false;
+    if (!bytes.empty() && bytes[0] == containerMagic[0]) {
+        packed =
+            decodeContainer(bytes, program, codeBegin, codeEnd, unpacked);
+    } else {
+        decodeBare(bytes, program, codeBegin, codeEnd);
+    }
+    const std::vector<uint8_t> &code = packed ? unpacked : bytes;
+    size_t pos = codeBegin;
+    std::map<size_t, size_t> indexAtOffset;
+    /* Instruction index -> code offset, resolved once all are decoded. */
+    std::vector<std::pair<size_t, size_t>> pendingBodies, pendingTargets;
+    while (pos < codeEnd) {
+        Instruction inst = Instruction();
+        inst.opcode = longForm(code[pos]);
+        const size_t size = instructionSize(code[pos]);
+        if (pos + size > codeEnd) {
+            throw std::runtime_error("truncated instruction");
+        }
+        if (size == 2) {
+            inst.operand = code[pos + 1];
+        } else if (size > 2) {
+            inst.operand = readU16(&code[pos + 1]);
+        }
+        indexAtOffset[pos - codeBegin] = program.code.size();
+        if (inst.opcode == ST_VM_OP_SETMETHOD) {
+            inst.argc = code[pos + 3];
+            const size_t bodyEnd =
+                pos + size - codeBegin + readU32(&code[pos + 4]);
+            pendingBodies.emplace_back(program.code.size(), bodyEnd);
+        } else if (inst.opcode == ST_VM_OP_SENDDIRECT) {
+            inst.classSymbol = readU16(&code[pos + 3]);
+            inst.argc = code[pos + 5];
+            inst.definition = readU16(&code[pos + 6]);
+            pendingTargets.emplace_back(program.code.size(),
+                                        readU32(&code[pos + 8]));
+        } else if (inst.opcode == ST_VM_OP_INLINEGUARD) {
+            inst.classSymbol = readU16(&code[pos + 3]);
+            inst.definition = readU16(&code[pos + 5]);
+            const size_t bodyEnd =
+                pos + size - codeBegin + readU32(&code[pos + 7]);
+            pendingBodies.emplace_back(program.code.size(), bodyEnd);
+        }
+        if ((hasSymbolOperand(inst.opcode) &&
+             inst.operand >= program.symbols.size()) ||
+            (hasClassSymbol(inst.opcode) &&
+             inst.classSymbol >= program.symbols.size())) {
+            throw std::runtime_error("symbol index out of range");
+        }
+        program.code.push_back(inst);
+        pos += size;
+    }
+    indexAtOffset[pos - codeBegin] = program.code.size();
+    auto resolve = [&](size_t offset) {
+        auto found = indexAtOffset.find(offset);
+        if (found == indexAtOffset.end()) {
+            throw std::runtime_error("offset points mid-instruction");
+        }
+        return found->second;
+    };
+    for (auto &body : pendingBodies) {
+        program.code[body.first].bodyEnd = resolve(body.second);
+    }
+    for (auto &target : pendingTargets) {
+        program.code[target.first].target = resolve(target.second);
+    }
+    for (auto &entry : program.lines) {
+        entry.instruction = resolve(entry.instruction);
+    }
+    return program;
+}
+
+std::vector<uint8_t> encode(const Program &program, bool compressCode) {
+    std::vector<uint8_t> symbols, out, debug, packed;
+    for (auto &symbol : program.symbols) {
+        symbols.insert(symbols.end(), symbol.begin(), symbol.end());
+        symbols.push_back('\0');
+    }
+    std::vector<size_t> offsets;
+    size_t offset = 0;
+    for (auto &inst : program.code) {
+        offsets.push_back(offset);
+        offset += encodedSize(inst);
+    }
+    offsets.push_back(offset);
+    for (size_t i = 0; i < program.code.size(); ++i) {
+        const Instruction &inst = program.code[i];
+        const uint8_t opcode = encodedOpcode(inst);
+        out.push_back(opcode);
+        if (opcode == ST_VM_OP_SETMETHOD) {
+            writeU16(out, inst.operand);
+            out.push_back(inst.argc);
+            writeU32(out, offsets[inst.bodyEnd] - offsets[i + 1]);
+        } else if (opcode == ST_VM_OP_SENDDIRECT) {
+            writeU16(out, inst.operand);
+            writeU16(out, inst.classSymbol);
+            out.push_back(inst.argc);
+            writeU16(out, inst.definition);
+            writeU32(out, offsets[inst.target]);
+        } else if (opcode == ST_VM_OP_INLINEGUARD) {
+            writeU16(out, inst.operand);
+            writeU16(out, inst.classSymbol);
+            writeU16(out, inst.definition);
+            writeU32(out, offsets[inst.bodyEnd] - offsets[i + 1]);
+        } else if (instructionSize(opcode) == 2) {
+            out.push_back((uint8_t)inst.operand);
+        } else if (instructionSize(opcode) > 2) {
+            writeU16(out, inst.operand);
+        }
+    }
+    if (!program.lines.empty()) {
+        encodeLines(program, offsets, debug);
+    }
+    std::vector<std::pair<uint32_t, const std::vector<uint8_t> *>> sections = {
+        {ST_VM_SECTION_SYMBOLS, &symbols}, {ST_VM_SECTION_CODE, &out}};
+    if (compressCode) {
+        writeU32(packed, out.size());
+        const std::vector<uint8_t> block = lz4Compress(out.data(), out.size());
+        packed.insert(packed.end(), block.begin(), block.end());
+        /* Small or random code may not shrink */
+        if (packed.size() < out.size()) {
+            sections.back() = {ST_VM_SECTION_CODE_LZ4, &packed};
+        }
+    }
+    if (!debug.empty()) {
+        sections.emplace_back(ST_VM_SECTION_DEBUG, &debug);
+    }
+    std::vector<uint8_t> container(containerMagic,
+                                   containerMagic + sizeof containerMagic);
+    writeU16(container, ST_VM_CONTAINER_VERSION);
+    writeU16(container, sections.size());
+    size_t sectionOffset = containerHeaderSize +
+                           sections.size() * containerEntrySize +
+                           sizeof(uint32_t);
+    for (auto &section : sections) {
+        writeU32(container, section.first);
+        writeU32(container, sectionOffset);
+        writeU32(container, section.second->size());
+        writeU32(container,
+                 crc32c(section.second->data(), section.second->size()));
+        sectionOffset += section.second->size();
+    }
+    writeU32(container, crc32c(container.data(), container.size()));
+    for (auto &section : sections) {
+        container.insert(container.end(), section.second->begin(),
+                         section.second->end());
+    }
+    return container;
+}
+
+size_t compact(Program &program, const std::vector<bool> &remove) {
+    /* newIndex[i] is the position instruction i (or, if it is removed, the
+       next surviving instruction) ends up at. */
+    std::vector<size_t> newIndex(program.code.size() + 1);
+    size_t kept = 0;
+    for (size_t i = 0; i < program.code.size(); ++i) {
+        newIndex[i] = kept;
+        if (!remove[i]) {
+            ++kept;
+        }
+    }
+    newIndex[program.code.size()] = kept;
+    std::vector<Instruction> result;
+    result.reserve(kept);
+    for (size_t i = 0; i < program.code.size(); ++i) {
+        if (!remove[i]) {
+            Instruction inst = program.code[i];
+            if (hasBody(inst.opcode)) {
+                inst.bodyEnd = newIndex[inst.bodyEnd];
+            } else if (inst.opcode == ST_VM_OP_SENDDIRECT) {
+                inst.target = newIndex[inst.target];
+            }
+            result.push_back(inst);
+        }
+    }
+    const size_t removed = program.code.size() - kept;
+    program.code.swap(result);
+    remapLines(program, newIndex);
+    return removed;
+}
+
+void remapLines(Program &program, const std::vector<size_t> &newIndex) {
+    std::vector<LineEntry> lines;
+    for (auto &entry : program.lines) {
+        const size_t instruction = newIndex[entry.instruction];
+        if (instruction == program.code.size()) {
+            continue;
+        }
+        if (!lines.empty() && lines.back().instruction == instruction) {
+            lines.pop_back();
+        }
+        lines.push_back(entry);
+        lines.back().instruction = instruction;
+    }
+    program.lines.swap(lines);
+}
+
+std::vector<uint8_t> readFile(const std::string &path) {
+    std::ifstream input(path, std::ios::binary);
+    if (!input) {
+        throw std::runtime_error("failed to open " + path);
+    }
+    return std::vector<uint8_t>(std::istreambuf_iterator<char>(input),
+                                std::istreambuf_iterator<char>());
+}
+
+void writeFile(const std::string &path, const std::vector<uint8_t> &bytes) {
+    std::ofstream output(path, std::ios::binary);
+    output.write((const char *)bytes.data(), bytes.size());
+    if (!output) {
+        throw std::runtime_error("failed to write " + path);
+    }
+}
+
+} // namespace st
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/* Host-side model of the bytecode format described in src/opcode.h, shared by
+   the offline tools (optimizer, linker, ...). Programs are decoded into a flat
+   instruction list so passes can delete or rewrite instructions without
+   worrying about byte offsets; encode() recomputes SETMETHOD body lengths. */
+
+namespace st {
+
+/* Bump whenever the tools start producing different output for the same
+   input, so that stale compile cache entries stop matching. */
+constexpr const char *toolchainVersion = "4";
+
+/* Instructions always use the 16 bit operand opcodes; encode() picks the
+   short 8 bit forms where the operand fits, and decode() widens them. */
+struct Instruction {
+    uint8_t opcode;
+    /* Symbol table index, or ivar index for GETIVAR/SETIVAR. */
+    uint16_t operand;
+    /* SETMETHOD and SENDDIRECT: argument count of the method. */
+    uint8_t argc;
+    /* SETMETHOD and INLINEGUARD: the index one past the last instruction of
+       the method body, or of the inlined body. */
+    size_t bodyEnd;
+    /* SENDDIRECT and INLINEGUARD: name of the class defining the target, and
+       the number of the SETMETHOD defining it. SENDDIRECT only: the index of
+       the target's first instruction. */
+    uint16_t classSymbol;
+    uint16_t definition;
+    size_t target;
+};
+
+/* Debug line table entry: the source position of the instructions from
+   instruction up to the next entry. Entries are sorted by instruction. */
+struct LineEntry {
+    size_t instruction;
+    std::string file;
+    uint32_t line;
+    std::string method;
+};
+
+struct Program {
+    std::vector<std::string> symbols;
+    std::vector<Instruction> code;
+    /* Encoded into the optional debug section, see ST_SourceLocation in
+       src/smalltalk.h. */
+    std::vector<LineEntry> lines;
+};
+
+/* Size in bytes of an encoded instruction with the given opcode. */
+size_t instructionSize(uint8_t opcode);
+size_t encodedSize(const Instruction &inst);
+
+/* True for opcodes whose 16 bit operand is a symbol table index. */
+bool hasSymbolOperand(uint8_t opcode);
+
+/* True for SENDDIRECT and INLINEGUARD, which also refer to a symbol through
+   classSymbol. */
+bool hasClassSymbol(uint8_t opcode);
+
+/* True for SETMETHOD and INLINEGUARD. */
+bool hasBody(uint8_t opcode);
+
+/* decode() reads both the container and the older bare format, and throws
+   std::runtime_error on malformed or damaged input. encode() always writes
+   a container, with the code LZ4 compressed if compressCode is set and that
+   makes it smaller. */
+Program decode(const std::vector<uint8_t> &bytes);
+std::vector<uint8_t> encode(const Program &program, bool compressCode = false);
+
+/* CRC32C (Castagnoli) of the bytes, the container's section checksum. */
+uint32_t crc32c(const uint8_t *data, size_t len);
+
+/* One LZ4 block, as in CODE_LZ4 sections. lz4Decompress() throws
+   std::runtime_error unless the block decompresses to outputSize bytes. */
+std::vector<uint8_t> lz4Compress(const uint8_t *data, size_t len);
+std::vector<uint8_t> lz4Decompress(const uint8_t *data, size_t len,
+                                   size_t outputSize);
+
+/* Drop every instruction for which remove[i] is set, keeping SETMETHOD body
+   bounds, SENDDIRECT targets and line entries consistent. Returns the number
+   of instructions removed. */
+size_t compact(Program &program, const std::vector<bool> &remove);
+
+/* Moves line entries to newIndex[entry.instruction], for passes that
+   renumber instructions. Entries that end up sharing an instruction are
+   covered by the last of them. */
+void remapLines(Program &program, const std::vector<size_t> &newIndex);
+
+std::vector<uint8_t> readFile(const std::string &path);
+void writeFile(const std::string &path, const std::vector<uint8_t> &bytes);
+
+} // namespace st
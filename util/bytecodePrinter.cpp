@@ -1,82 +1,112 @@
 #include "../src/opcode.h"
+#include "bytecode.hpp"
 
-#include <fstream>
-#include <iostream>
-#include <vector>
-#include <algorithm>
 #include <iomanip>
-#include <sstream>
-#include "../src/smalltalk.h"
-#include <string.h>
-
-int main(int argc, char** argv) {
-    if (argc != 2) {
-        std::cerr << "usage: stbc-printer [file]" << std::endl;
-        return EXIT_FAILURE;
-    }
-    ST_Configuration config = ST_DEFAULT_CONFIG;
-    ST_Object context = ST_createContext(&config);
-    std::ifstream input(argv[1], std::ios::binary);
-    std::stringstream buffer;
-    buffer << input.rdbuf();
-    std::string programBytes = buffer.str();
-    ST_Code program = ST_VM_load(context,
-                                 (const ST_U8 *)programBytes.c_str(),
-                                 programBytes.size());
-    for (size_t i = 0; i < program.length; ++i) {
-        switch (program.instructions[i]) {
-        case ST_VM_OP_GETGLOBAL: {
-            std::cout << std::setw(14) << std::left << "GETGLOBAL";
-            uint16_t symbolIndex = (uint16_t)program.instructions[i + 1] |
-                                  ((uint16_t)program.instructions[i + 2] << 8);
-            std::cout << ST_Symbol_toString(context, program.symbTab[symbolIndex]) << std::endl;
-            i += 2;
-        } break;
-
-        case ST_VM_OP_SETGLOBAL: {
-            std::cout << std::setw(14) << std::left << "SETGLOBAL";
-            uint16_t symbolIndex = (uint16_t)program.instructions[i + 1] |
-                ((uint16_t)program.instructions[i + 2] << 8);
-            std::cout << ST_Symbol_toString(context, program.symbTab[symbolIndex]) << std::endl;
-            i += 2;
-        } break;
-
-        case ST_VM_OP_PUSHNIL:
-            std::cout << "PUSHNIL" << std::endl;
-            break;
-
-        case ST_VM_OP_PUSHTRUE:
-            std::cout << "PUSHTRUE" << std::endl;
-            break;
-
-        case ST_VM_OP_PUSHFALSE:
-            std::cout << "PUSHFALSE" << std::endl;
-            break;
-
-        case ST_VM_OP_PUSHSYMBOL: {
-            std::cout << std::setw(14) << std::left << "PUSHSYMBOL";
-            uint16_t symbolIndex = (uint16_t)program.instructions[i + 1] |
-                            ((uint16_t)program.instructions[i + 2] << 8);
-            std::cout << ST_Symbol_toString(context, program.symbTab[symbolIndex]) << std::endl;
-            i += 2;
-        } break;
+#include <iostream>
+#include <stdexcept>
+#include <stdlib.h>
 
-        case ST_VM_OP_SENDMSG: {
-            std::cout << std::setw(14) << std::left << "SENDMSG";
-            uint16_t symbolIndex = (uint16_t)program.instructions[i + 1] |
-                ((uint16_t)program.instructions[i + 2] << 8);
-            std::cout << ST_Symbol_toString(context, program.symbTab[symbolIndex]) << std::endl;
-            i += 2;
-        } break;
+/* Prints a program one instruction per line, in either format. Operands are
+   resolved through the decoded program, method and inlined bodies are
+   indented, and the line table shows up as comments where it changes. */
 
-        case ST_VM_OP_DUP:
-            std::cout << "DUP" << std::endl;
-            break;
+static const char *opcodeName(uint8_t opcode) {
+    switch (opcode) {
+    case ST_VM_OP_PUSHNIL:
+        return "PUSHNIL";
+    case ST_VM_OP_PUSHTRUE:
+        return "PUSHTRUE";
+    case ST_VM_OP_PUSHFALSE:
+        return "PUSHFALSE";
+    case ST_VM_OP_PUSHSUPER:
+        return "PUSHSUPER";
+    case ST_VM_OP_DUP:
+        return "DUP";
+    case ST_VM_OP_POP:
+        return "POP";
+    case ST_VM_OP_SWAP:
+        return "SWAP";
+    case ST_VM_OP_RETURN:
+        return "RETURN";
+    case ST_VM_OP_GETGLOBAL:
+        return "GETGLOBAL";
+    case ST_VM_OP_SETGLOBAL:
+        return "SETGLOBAL";
+    case ST_VM_OP_GETIVAR:
+        return "GETIVAR";
+    case ST_VM_OP_SETIVAR:
+        return "SETIVAR";
+    case ST_VM_OP_SENDMSG:
+        return "SENDMSG";
+    case ST_VM_OP_PUSHSYMBOL:
+        return "PUSHSYMBOL";
+    case ST_VM_OP_SETMETHOD:
+        return "SETMETHOD";
+    case ST_VM_OP_SENDDIRECT:
+        return "SENDDIRECT";
+    case ST_VM_OP_INLINEGUARD:
+        return "INLINEGUARD";
+    }
+    /* decode() rejects anything else, and widens the 8 bit forms */
+    return "?";
+}
 
-        default:
-            std::cerr << "printer encountered unknown bytecode" << std::endl;
-            return EXIT_FAILURE;
+static void print(const st::Program &program) {
+    const std::vector<std::string> &symbols = program.symbols;
+    /* Ends of the bodies the current instruction is in, innermost last */
+    std::vector<size_t> bodies;
+    auto line = program.lines.begin();
+    for (size_t i = 0; i < program.code.size(); ++i) {
+        const st::Instruction &inst = program.code[i];
+        while (!bodies.empty() && bodies.back() <= i) {
+            bodies.pop_back();
+        }
+        for (; line != program.lines.end() && line->instruction <= i;
+             ++line) {
+            std::cout << "; " << line->file << ":" << line->line << " "
+                      << line->method << std::endl;
         }
+        std::cout << std::setw(6) << std::right << i << "  "
+                  << std::string(2 * bodies.size(), ' ');
+        if (st::instructionSize(inst.opcode) == 1) {
+            std::cout << opcodeName(inst.opcode) << std::endl;
+            continue;
+        }
+        std::cout << std::setw(14) << std::left << opcodeName(inst.opcode);
+        if (inst.opcode == ST_VM_OP_GETIVAR ||
+            inst.opcode == ST_VM_OP_SETIVAR) {
+            std::cout << inst.operand;
+        } else if (st::hasSymbolOperand(inst.opcode)) {
+            std::cout << symbols[inst.operand];
+        }
+        if (st::hasClassSymbol(inst.opcode)) {
+            std::cout << " " << symbols[inst.classSymbol] << " #"
+                      << inst.definition;
+        }
+        if (inst.opcode == ST_VM_OP_SETMETHOD ||
+            inst.opcode == ST_VM_OP_SENDDIRECT) {
+            std::cout << " argc " << (unsigned)inst.argc;
+        }
+        if (inst.opcode == ST_VM_OP_SENDDIRECT) {
+            std::cout << " -> " << inst.target;
+        }
+        std::cout << std::endl;
+        if (st::hasBody(inst.opcode)) {
+            bodies.push_back(inst.bodyEnd);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        std::cerr << "usage: bcprinter [file]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    try {
+        print(st::decode(st::readFile(argv[1])));
+    } catch (const std::exception &err) {
+        std::cerr << "bcprinter: " << err.what() << std::endl;
+        return EXIT_FAILURE;
     }
     return EXIT_SUCCESS;
 }
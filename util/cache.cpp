@@ -0,0 +1,168 @@
+#include "cache.hpp"
+#include "bytecode.hpp"
+
+#include <algorithm>
+#include <dirent.h>
+#include <fstream>
+#include <iterator>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <utime.h>
+
+namespace st {
+
+static const char entrySuffix[] = ".stc";
+static const char entryMagic[] = {'S', 'T', 'C', 'C'};
+
+/* FNV-1a. Keys use two differently seeded lanes, which makes an accidental
+   collision between two sources unrealistic without pulling in a real
+   cryptographic hash. */
+static uint64_t fnv1a(uint64_t hash, const uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= data[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static uint64_t fnv1a(uint64_t hash, const std::string &str) {
+    return fnv1a(hash, (const uint8_t *)str.c_str(), str.size() + 1);
+}
+
+static std::string toHex(uint64_t value) {
+    static const char digits[] = "0123456789abcdef";
+    std::string result(16, '0');
+    for (int i = 15; i >= 0; --i) {
+        result[i] = digits[value & 0xf];
+        value >>= 4;
+    }
+    return result;
+}
+
+CompileCache::CompileCache(const std::string &directory, uint64_t maxBytes)
+    : directory_(directory), maxBytes_(maxBytes) {
+    mkdir(directory_.c_str(), 0755);
+}
+
+std::string CompileCache::key(const std::vector<uint8_t> &source,
+                              const std::string &flags) {
+    std::string result;
+    for (uint64_t seed : {14695981039346656037ull, 0x6c62272e07bb0142ull}) {
+        uint64_t hash = fnv1a(seed, toolchainVersion);
+        hash = fnv1a(hash, flags);
+        hash = fnv1a(hash, source.data(), source.size());
+        result += toHex(hash);
+    }
+    return result;
+}
+
+std::string CompileCache::pathFor(const std::string &key) const {
+    return directory_ + "/" + key + entrySuffix;
+}
+
+bool CompileCache::lookup(const std::string &key,
+                          std::vector<uint8_t> &result) {
+    const std::string path = pathFor(key);
+    std::ifstream input(path, std::ios::binary);
+    if (!input) {
+        return false;
+    }
+    std::vector<uint8_t> entry((std::istreambuf_iterator<char>(input)),
+                               std::istreambuf_iterator<char>());
+    const size_t headerSize = sizeof entryMagic + sizeof(uint64_t);
+    if (entry.size() < headerSize ||
+        !std::equal(entryMagic, entryMagic + sizeof entryMagic,
+                    entry.begin())) {
+        return false;
+    }
+    uint64_t checksum = 0;
+    for (size_t i = 0; i < sizeof checksum; ++i) {
+        checksum |= (uint64_t)entry[sizeof entryMagic + i] << (8 * i);
+    }
+    const uint8_t *payload = entry.data() + headerSize;
+    const size_t payloadSize = entry.size() - headerSize;
+    if (fnv1a(14695981039346656037ull, payload, payloadSize) != checksum) {
+        /* Torn or corrupted entry, recompile and overwrite it. */
+        return false;
+    }
+    result.assign(payload, payload + payloadSize);
+    utime(path.c_str(), nullptr); /* Refresh LRU position */
+    return true;
+}
+
+void CompileCache::store(const std::string &key,
+                         const std::vector<uint8_t> &compiled) {
+    const std::string path = pathFor(key);
+    /* Unique per writer, threads of one compiler included. */
+    const size_t threadId =
+        std::hash<std::thread::id>()(std::this_thread::get_id());
+    const std::string tmpPath = path + "." + std::to_string(getpid()) + "-" +
+                                std::to_string(threadId) + ".tmp";
+    const uint64_t checksum =
+        fnv1a(14695981039346656037ull, compiled.data(), compiled.size());
+    {
+        std::ofstream output(tmpPath, std::ios::binary);
+        output.write(entryMagic, sizeof entryMagic);
+        for (size_t i = 0; i < sizeof checksum; ++i) {
+            output.put((char)((checksum >> (8 * i)) & 0xff));
+        }
+        output.write((const char *)compiled.data(), compiled.size());
+        if (!output) {
+            remove(tmpPath.c_str());
+            return;
+        }
+    }
+    if (rename(tmpPath.c_str(), path.c_str()) != 0) {
+        remove(tmpPath.c_str());
+        return;
+    }
+    evict();
+}
+
+void CompileCache::evict() {
+    struct Entry {
+        std::string path;
+        uint64_t size;
+        time_t lastUsed;
+    };
+    std::vector<Entry> entries;
+    uint64_t total = 0;
+    DIR *dir = opendir(directory_.c_str());
+    if (!dir) {
+        return;
+    }
+    const size_t suffixLen = sizeof entrySuffix - 1;
+    while (struct dirent *dent = readdir(dir)) {
+        const std::string name = dent->d_name;
+        if (name.size() <= suffixLen ||
+            name.compare(name.size() - suffixLen, suffixLen, entrySuffix)) {
+            continue;
+        }
+        struct stat info;
+        const std::string path = directory_ + "/" + name;
+        if (stat(path.c_str(), &info) == 0) {
+            entries.push_back({path, (uint64_t)info.st_size, info.st_mtime});
+            total += info.st_size;
+        }
+    }
+    closedir(dir);
+    if (total <= maxBytes_) {
+        return;
+    }
+    std::sort(entries.begin(), entries.end(),
+              [](const Entry &lhs, const Entry &rhs) {
+                  return lhs.lastUsed < rhs.lastUsed;
+              });
+    for (auto &entry : entries) {
+        if (total <= maxBytes_) {
+            break;
+        }
+        if (remove(entry.path.c_str()) == 0) {
+            total -= entry.size;
+        }
+    }
+}
+
+} // namespace st
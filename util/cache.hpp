@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace st {
+
+/* On-disk cache of compiled programs. Entries are keyed by a hash of the
+   source text, the toolchain version, and the flags it was compiled with, so
+   changing any of those simply misses. Writes go to a temporary file that is
+   renamed into place, so concurrent compilers never observe a partial entry.
+   When the cache grows past its size limit the least recently used entries
+   are evicted. */
+class CompileCache {
+public:
+    CompileCache(const std::string &directory, uint64_t maxBytes);
+
+    static std::string key(const std::vector<uint8_t> &source,
+                           const std::string &flags);
+
+    bool lookup(const std::string &key, std::vector<uint8_t> &result);
+    void store(const std::string &key, const std::vector<uint8_t> &compiled);
+
+private:
+    std::string pathFor(const std::string &key) const;
+    void evict();
+
+    std::string directory_;
+    uint64_t maxBytes_;
+};
+
+} // namespace st
@@ -0,0 +1,142 @@
+#include "linker.hpp"
+
+#include "../src/opcode.h"
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace st {
+
+/* Where the unit's top level code returns, or its end: there is no jump to
+   the end of the unit, so the linker drops the rest of it instead. It can't
+   run, not even its method definitions, and whatever the unit left on the
+   operand stack stays unused below the next unit's statements. */
+static size_t topLevelEnd(const Program &unit) {
+    size_t pc = 0;
+    while (pc < unit.code.size() &&
+           unit.code[pc].opcode != ST_VM_OP_RETURN) {
+        pc = unit.code[pc].opcode == ST_VM_OP_SETMETHOD
+                 ? unit.code[pc].bodyEnd
+                 : pc + 1;
+    }
+    return pc;
+}
+
+Program link(const std::vector<Program> &units) {
+    Program bundle;
+    std::unordered_map<std::string, uint16_t> symbolIndex;
+    for (auto &unit : units) {
+        std::vector<uint16_t> remap;
+        remap.reserve(unit.symbols.size());
+        for (auto &symbol : unit.symbols) {
+            auto found = symbolIndex.find(symbol);
+            if (found == symbolIndex.end()) {
+                if (bundle.symbols.size() > UINT16_MAX) {
+                    throw std::runtime_error("too many symbols to link");
+                }
+                found = symbolIndex
+                            .emplace(symbol, (uint16_t)bundle.symbols.size())
+                            .first;
+                bundle.symbols.push_back(symbol);
+            }
+            remap.push_back(found->second);
+        }
+        const size_t base = bundle.code.size();
+        const size_t end = topLevelEnd(unit);
+        for (size_t i = 0; i < end; ++i) {
+            Instruction inst = unit.code[i];
+            if (hasSymbolOperand(inst.opcode)) {
+                inst.operand = remap.at(inst.operand);
+            }
+            if (hasBody(inst.opcode)) {
+                inst.bodyEnd += base;
+            }
+            bundle.code.push_back(inst);
+        }
+        for (LineEntry entry : unit.lines) {
+            if (entry.instruction < end) {
+                entry.instruction += base;
+                bundle.lines.push_back(entry);
+            }
+        }
+    }
+    /* Sends bound or inlined against one unit alone aren't safe, another
+       unit may define the same selector. Turn them back into plain sends, and
+       rerun devirtualize() and inlineSends() on the bundle instead. */
+    std::vector<bool> remove(bundle.code.size(), false);
+    for (size_t i = 0; i < bundle.code.size(); ++i) {
+        Instruction &inst = bundle.code[i];
+        if (inst.opcode == ST_VM_OP_INLINEGUARD) {
+            std::fill(remove.begin() + i + 1, remove.begin() + inst.bodyEnd,
+                      true);
+        }
+        if (hasClassSymbol(inst.opcode)) {
+            inst.opcode = ST_VM_OP_SENDMSG;
+        }
+    }
+    compact(bundle, remove);
+    return bundle;
+}
+
+void orderSymbolsByFrequency(Program &program, const SymbolProfile &profile) {
+    std::vector<uint64_t> staticCount(program.symbols.size(), 0);
+    for (auto &inst : program.code) {
+        if (hasSymbolOperand(inst.opcode)) {
+            ++staticCount.at(inst.operand);
+        }
+        if (hasClassSymbol(inst.opcode)) {
+            ++staticCount.at(inst.classSymbol);
+        }
+    }
+    std::vector<uint64_t> dynamicCount(program.symbols.size(), 0);
+    std::vector<size_t> order;
+    for (size_t i = 0; i < program.symbols.size(); ++i) {
+        auto found = profile.find(program.symbols[i]);
+        if (found != profile.end()) {
+            dynamicCount[i] = found->second;
+        }
+        if (staticCount[i]) {
+            order.push_back(i);
+        }
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t lhs, size_t rhs) {
+        if (dynamicCount[lhs] != dynamicCount[rhs]) {
+            return dynamicCount[lhs] > dynamicCount[rhs];
+        }
+        return staticCount[lhs] > staticCount[rhs];
+    });
+    std::vector<uint16_t> remap(program.symbols.size());
+    std::vector<std::string> symbols;
+    for (size_t i = 0; i < order.size(); ++i) {
+        remap[order[i]] = (uint16_t)i;
+        symbols.push_back(std::move(program.symbols[order[i]]));
+    }
+    program.symbols.swap(symbols);
+    for (auto &inst : program.code) {
+        if (hasSymbolOperand(inst.opcode)) {
+            inst.operand = remap[inst.operand];
+        }
+        if (hasClassSymbol(inst.opcode)) {
+            inst.classSymbol = remap[inst.classSymbol];
+        }
+    }
+}
+
+SymbolProfile readProfile(const std::string &path) {
+    /* One "count symbol" pair per line. */
+    std::ifstream input(path);
+    if (!input) {
+        throw std::runtime_error("failed to open " + path);
+    }
+    SymbolProfile profile;
+    uint64_t count;
+    std::string symbol;
+    while (input >> count >> symbol) {
+        profile[symbol] += count;
+    }
+    return profile;
+}
+
+} // namespace st
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "bytecode.hpp"
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace st {
+
+/* Merge separately compiled programs into one bundle. The top level code of
+   each unit runs in the order given, and symbols are merged by name, so the
+   output only depends on the inputs and their order. A RETURN in a unit's
+   top level code ends that unit, not the bundle. */
+Program link(const std::vector<Program> &units);
+
+/* Number of times each symbol was used at runtime, by name. */
+using SymbolProfile = std::map<std::string, uint64_t>;
+
+/* Renumber the symbol table so the most referenced symbols come first, and
+   drop symbols nothing refers to. Symbols are ranked by their count in the
+   profile if there is one, then by the number of instructions referring to
+   them, then by their original position, so the result is deterministic.
+   Since encode() uses one byte operands for the first 256 symbols, this puts
+   the short encodings on the hottest sends and globals. */
+void orderSymbolsByFrequency(Program &program, const SymbolProfile &profile);
+
+SymbolProfile readProfile(const std::string &path);
+
+} // namespace st
@@ -0,0 +1,110 @@
+#include "bytecode.hpp"
+
+#include <chrono>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#include "../src/smalltalk.h"
+
+/* Load time benchmark: writes the program as a plain container and with its
+   code LZ4 compressed (see bcopt -compress), then times loading each the way
+   svm would, uncompressed code mapped and run in place, compressed code read
+   and decompressed into a copy. Files stay in the page cache, so this
+   measures the CPU cost only; compression wins wherever reading the bytes it
+   saves takes longer than decompressing, which the break-even bandwidth
+   puts a number on. */
+
+using Clock = std::chrono::steady_clock;
+
+static void loadMapped(ST_Object context, const std::string &path) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        throw std::runtime_error("can't open " + path);
+    }
+    void *data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        throw std::runtime_error("can't map " + path);
+    }
+    ST_Code code =
+        ST_VM_loadInPlace(context, (const ST_U8 *)data, info.st_size);
+    /* Touch every page, as running it would */
+    volatile ST_U8 sum = 0;
+    for (ST_Size i = 0; i < code.length; i += 4096) {
+        sum += code.instructions[i];
+    }
+    munmap(data, info.st_size);
+}
+
+static void loadRead(ST_Object context, const std::string &path) {
+    const std::vector<uint8_t> data = st::readFile(path);
+    ST_VM_load(context, data.data(), data.size());
+}
+
+/* Seconds per load, over a fresh context every batch so the symbol tables of
+   earlier loads don't pile up. */
+template <typename Load>
+static double timeLoads(const std::string &path, int iterations, Load load) {
+    ST_Configuration config = ST_DEFAULT_CONFIG;
+    const int batch = 64;
+    Clock::duration total{};
+    for (int done = 0; done < iterations; done += batch) {
+        ST_Object context = ST_createContext(&config);
+        const Clock::time_point start = Clock::now();
+        for (int i = done; i < iterations && i < done + batch; ++i) {
+            load(context, path);
+        }
+        total += Clock::now() - start;
+        ST_destroyContext(context);
+    }
+    return std::chrono::duration<double>(total).count() / iterations;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 3) {
+        std::cerr << "usage: loadbench [file] [iterations]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    const int iterations = argc == 3 ? atoi(argv[2]) : 1000;
+    const std::string plainPath = std::string(argv[1]) + ".plain";
+    const std::string packedPath = std::string(argv[1]) + ".lz4";
+    try {
+        const st::Program program = st::decode(st::readFile(argv[1]));
+        const std::vector<uint8_t> plain = st::encode(program);
+        const std::vector<uint8_t> packed = st::encode(program, true);
+        st::writeFile(plainPath, plain);
+        st::writeFile(packedPath, packed);
+        const double plainTime = timeLoads(plainPath, iterations, loadMapped);
+        const double packedTime = timeLoads(packedPath, iterations, loadRead);
+        std::cout << std::setw(12) << std::left << "mmap" << plain.size()
+                  << " bytes, " << plainTime * 1e6 << " us" << std::endl
+                  << std::setw(12) << std::left << "lz4" << packed.size()
+                  << " bytes, " << packedTime * 1e6 << " us" << std::endl;
+        if (packed.size() >= plain.size()) {
+            std::cout << "code doesn't compress, mmap always wins"
+                      << std::endl;
+        } else if (packedTime <= plainTime) {
+            std::cout << "lz4 always wins" << std::endl;
+        } else {
+            const double saved = plain.size() - packed.size();
+            std::cout << "lz4 wins below "
+                      << saved / (packedTime - plainTime) / 1e6 << " MB/s"
+                      << std::endl;
+        }
+    } catch (const std::exception &e) {
+        std::cerr << "loadbench: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    unlink(plainPath.c_str());
+    unlink(packedPath.c_str());
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,352 @@
+#include "optimizer.hpp"
+
+#include "../src/opcode.h"
+#include "../src/smalltalk.h"
+
+#include <map>
+#include <set>
+#include <string>
+#include <string.h>
+
+namespace st {
+
+/* Marks the instructions that can't execute back to back with their
+   predecessor, because a method body starts or ends in between, or because
+   an inline guard may jump to them. */
+static std::vector<bool> findBoundaries(const Program &program) {
+    std::vector<bool> boundary(program.code.size() + 1, false);
+    for (size_t i = 0; i < program.code.size(); ++i) {
+        if (program.code[i].opcode == ST_VM_OP_SETMETHOD) {
+            boundary[i + 1] = true;
+            boundary[program.code[i].bodyEnd] = true;
+        } else if (program.code[i].opcode == ST_VM_OP_INLINEGUARD) {
+            boundary[program.code[i].bodyEnd] = true;
+        }
+    }
+    return boundary;
+}
+
+static bool pushesWithoutSideEffects(uint8_t opcode) {
+    switch (opcode) {
+    case ST_VM_OP_PUSHNIL:
+    case ST_VM_OP_PUSHTRUE:
+    case ST_VM_OP_PUSHFALSE:
+    case ST_VM_OP_PUSHSYMBOL:
+    case ST_VM_OP_GETGLOBAL:
+    case ST_VM_OP_DUP:
+        return true;
+    }
+    return false;
+}
+
+static bool cancels(uint8_t first, uint8_t second) {
+    if (second == ST_VM_OP_POP) {
+        return pushesWithoutSideEffects(first);
+    }
+    return first == ST_VM_OP_SWAP && second == ST_VM_OP_SWAP;
+}
+
+/* DUP/POP, PUSHx/POP and SWAP/SWAP pairs have no net effect on the operand
+   stack. Removing one pair can make a new pair adjacent, hence the fixpoint
+   loop in optimize(). */
+static std::vector<bool> peephole(const Program &program) {
+    const std::vector<bool> boundary = findBoundaries(program);
+    std::vector<bool> remove(program.code.size(), false);
+    for (size_t i = 0; i + 1 < program.code.size(); ++i) {
+        if (boundary[i + 1]) {
+            continue;
+        }
+        if (cancels(program.code[i].opcode, program.code[i + 1].opcode)) {
+            remove[i] = remove[i + 1] = true;
+            ++i;
+        }
+    }
+    return remove;
+}
+
+/* The instruction set has no branches, so within a method body everything
+   after a RETURN is unreachable, including nested method definitions. Top
+   level code is left alone, a RETURN there unwinds into the host. */
+static std::vector<bool> unreachableAfterReturn(const Program &program) {
+    std::vector<bool> remove(program.code.size(), false);
+    for (size_t i = 0; i < program.code.size(); ++i) {
+        const Instruction &inst = program.code[i];
+        if (inst.opcode != ST_VM_OP_SETMETHOD) {
+            continue;
+        }
+        size_t pc = i + 1;
+        while (pc < inst.bodyEnd) {
+            const Instruction &bodyInst = program.code[pc];
+            if (bodyInst.opcode == ST_VM_OP_RETURN) {
+                for (size_t dead = pc + 1; dead < inst.bodyEnd; ++dead) {
+                    remove[dead] = true;
+                }
+                break;
+            }
+            pc = bodyInst.opcode == ST_VM_OP_SETMETHOD ? bodyInst.bodyEnd
+                                                        : pc + 1;
+        }
+    }
+    return remove;
+}
+
+struct Pass {
+    const char *name;
+    std::vector<bool> (*run)(const Program &);
+};
+
+static const Pass passes[] = {
+    {"dead-code", unreachableAfterReturn}, {"peephole", peephole},
+};
+
+std::vector<PassStats> optimize(Program &program) {
+    std::vector<PassStats> stats;
+    for (auto &pass : passes) {
+        stats.push_back({pass.name, 0, 0});
+    }
+    bool progress = true;
+    while (progress) {
+        progress = false;
+        for (size_t p = 0; p < stats.size(); ++p) {
+            const std::vector<bool> remove = passes[p].run(program);
+            size_t bytes = 0;
+            for (size_t i = 0; i < remove.size(); ++i) {
+                if (remove[i]) {
+                    bytes += encodedSize(program.code[i]);
+                }
+            }
+            const size_t removed = compact(program, remove);
+            if (removed) {
+                stats[p].instructionsRemoved += removed;
+                stats[p].bytesSaved += bytes;
+                progress = true;
+            }
+        }
+    }
+    return stats;
+}
+
+/* Selectors the runtime defines methods for, as a fresh context reports
+   them. Sends of these may reach a primitive, so they are never bound
+   statically. */
+static std::set<uint16_t> runtimeSelectors(const Program &program) {
+    std::set<uint16_t> selectors;
+    ST_Configuration config = ST_DEFAULT_CONFIG;
+    ST_Object ctx = ST_createContext(&config);
+    for (uint16_t s = 0; s < program.symbols.size(); ++s) {
+        if (ST_definesSelector(ctx, ST_symb(ctx,
+                                            program.symbols[s].c_str()))) {
+            selectors.insert(s);
+        }
+    }
+    ST_destroyContext(ctx);
+    return selectors;
+}
+
+size_t devirtualize(Program &program) {
+    struct Definition {
+        size_t index;
+        uint16_t ordinal;
+        size_t count;
+    };
+    const std::vector<bool> boundary = findBoundaries(program);
+    std::map<uint16_t, Definition> definitions;
+    std::set<uint16_t> unbindable = runtimeSelectors(program);
+    uint16_t ordinal = 0;
+    for (size_t i = 0; i < program.code.size(); ++i) {
+        const Instruction &inst = program.code[i];
+        if (inst.opcode != ST_VM_OP_SETMETHOD) {
+            continue;
+        }
+        for (size_t j = i + 1; j < inst.bodyEnd; ++j) {
+            if (program.code[j].opcode == ST_VM_OP_SETMETHOD) {
+                /* Methods defining methods run in an order the compiler
+                   can't see, which the definition guard relies on. */
+                return 0;
+            }
+        }
+        /* Only definitions on a class named by a global are understood. */
+        const bool knownTarget =
+            i > 0 && !boundary[i] &&
+            program.code[i - 1].opcode == ST_VM_OP_GETGLOBAL;
+        if (!knownTarget || inst.bodyEnd == i + 1) {
+            unbindable.insert(inst.operand);
+        }
+        auto found = definitions.find(inst.operand);
+        if (found == definitions.end()) {
+            definitions[inst.operand] = {i, ordinal, 1};
+        } else {
+            ++found->second.count;
+        }
+        if (ordinal == UINT16_MAX) {
+            return 0;
+        }
+        ++ordinal;
+        i = inst.bodyEnd - 1;
+    }
+    size_t rewritten = 0;
+    for (auto &inst : program.code) {
+        if (inst.opcode != ST_VM_OP_SENDMSG || unbindable.count(inst.operand)) {
+            continue;
+        }
+        auto found = definitions.find(inst.operand);
+        if (found == definitions.end() || found->second.count != 1) {
+            continue;
+        }
+        inst.opcode = ST_VM_OP_SENDDIRECT;
+        inst.classSymbol = program.code[found->second.index - 1].operand;
+        inst.argc = program.code[found->second.index].argc;
+        inst.definition = found->second.ordinal;
+        inst.target = found->second.index + 1;
+        ++rewritten;
+    }
+    return rewritten;
+}
+
+struct StackEffect {
+    int needs;
+    int net;
+};
+
+/* Operand stack use of the instructions an inlined body may contain. Sends
+   are excluded, their stack effect depends on the method that runs. */
+static bool inlinableEffect(uint8_t opcode, StackEffect &effect) {
+    switch (opcode) {
+    case ST_VM_OP_PUSHNIL:
+    case ST_VM_OP_PUSHTRUE:
+    case ST_VM_OP_PUSHFALSE:
+    case ST_VM_OP_PUSHSYMBOL:
+    case ST_VM_OP_GETGLOBAL:
+        effect = {0, 1};
+        return true;
+
+    case ST_VM_OP_DUP:
+        effect = {1, 1};
+        return true;
+
+    case ST_VM_OP_POP:
+    case ST_VM_OP_SETGLOBAL:
+        effect = {1, -1};
+        return true;
+
+    case ST_VM_OP_PUSHSUPER:
+    case ST_VM_OP_GETIVAR:
+        effect = {1, 0};
+        return true;
+
+    case ST_VM_OP_SWAP:
+        effect = {2, 0};
+        return true;
+
+    case ST_VM_OP_SETIVAR:
+        effect = {2, -2};
+        return true;
+    }
+    return false;
+}
+
+/* Works out the number of stack slots below the result when the method body
+   [begin, end) returns, with the receiver and argc arguments on entry.
+   Returns false if the body can't be inlined. */
+static bool inlineCleanup(const Program &program, size_t begin, size_t end,
+                          uint8_t argc, size_t &cleanup) {
+    if (end == begin || program.code[end - 1].opcode != ST_VM_OP_RETURN) {
+        return false;
+    }
+    int depth = argc + 1;
+    for (size_t i = begin; i + 1 < end; ++i) {
+        StackEffect effect;
+        if (!inlinableEffect(program.code[i].opcode, effect) ||
+            depth < effect.needs) {
+            return false;
+        }
+        depth += effect.net;
+    }
+    if (depth < 1) {
+        return false;
+    }
+    cleanup = depth - 1;
+    return true;
+}
+
+std::vector<InlineReport> inlineSends(Program &program, size_t maxBodyBytes) {
+    struct Candidate {
+        size_t begin;
+        size_t end;
+        size_t cleanup;
+        size_t report;
+    };
+    std::map<size_t, Candidate> candidates; /* By SENDDIRECT target */
+    std::vector<InlineReport> reports;
+    for (auto &inst : program.code) {
+        if (inst.opcode != ST_VM_OP_SENDDIRECT ||
+            candidates.count(inst.target)) {
+            continue;
+        }
+        const Instruction &definition = program.code[inst.target - 1];
+        Candidate candidate = {inst.target, definition.bodyEnd, 0, 0};
+        if (!inlineCleanup(program, candidate.begin, candidate.end,
+                           definition.argc, candidate.cleanup)) {
+            continue;
+        }
+        size_t bytes = 0;
+        for (size_t i = candidate.begin; i + 1 < candidate.end; ++i) {
+            bytes += encodedSize(program.code[i]);
+        }
+        /* The RETURN becomes a SWAP/POP pair per slot to clean up. */
+        bytes += 2 * candidate.cleanup;
+        if (bytes > maxBodyBytes) {
+            continue;
+        }
+        candidate.report = reports.size();
+        reports.push_back({program.symbols[inst.classSymbol],
+                           program.symbols[inst.operand], bytes, 0});
+        candidates[inst.target] = candidate;
+    }
+    if (candidates.empty()) {
+        return reports;
+    }
+    std::vector<Instruction> code;
+    std::vector<size_t> newIndex(program.code.size() + 1);
+    for (size_t i = 0; i < program.code.size(); ++i) {
+        newIndex[i] = code.size();
+        const Instruction &inst = program.code[i];
+        auto found = inst.opcode == ST_VM_OP_SENDDIRECT
+                         ? candidates.find(inst.target)
+                         : candidates.end();
+        if (found == candidates.end()) {
+            code.push_back(inst);
+            continue;
+        }
+        const Candidate &candidate = found->second;
+        Instruction guard = inst;
+        guard.opcode = ST_VM_OP_INLINEGUARD;
+        code.push_back(guard);
+        const size_t guardIndex = code.size() - 1;
+        code.insert(code.end(), program.code.begin() + candidate.begin,
+                    program.code.begin() + candidate.end - 1);
+        for (size_t slot = 0; slot < candidate.cleanup; ++slot) {
+            code.push_back({ST_VM_OP_SWAP, 0, 0, 0, 0, 0, 0});
+            code.push_back({ST_VM_OP_POP, 0, 0, 0, 0, 0, 0});
+        }
+        code[guardIndex].bodyEnd = code.size();
+        ++reports[candidate.report].sites;
+    }
+    newIndex[program.code.size()] = code.size();
+    /* Inlined bodies hold no SETMETHODs or SENDDIRECTs, so only instructions
+       kept from the original program need their indices remapped. */
+    for (size_t i = 0; i < program.code.size(); ++i) {
+        Instruction &inst = code[newIndex[i]];
+        if (inst.opcode == ST_VM_OP_SETMETHOD) {
+            inst.bodyEnd = newIndex[inst.bodyEnd];
+        } else if (inst.opcode == ST_VM_OP_SENDDIRECT) {
+            inst.target = newIndex[inst.target];
+        }
+    }
+    program.code.swap(code);
+    /* Inlined code keeps the line of its call site. */
+    remapLines(program, newIndex);
+    return reports;
+}
+
+} // namespace st
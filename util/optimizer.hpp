@@ -0,0 +1,43 @@
+#pragma once
+
+#include "bytecode.hpp"
+
+#include <string>
+#include <vector>
+
+namespace st {
+
+struct PassStats {
+    std::string name;
+    size_t instructionsRemoved;
+    size_t bytesSaved;
+};
+
+/* Runs every optimization pass over the program until none of them make any
+   further progress, and returns what each pass contributed. */
+std::vector<PassStats> optimize(Program &program);
+
+/* Whole program mode: class hierarchy analysis over every method the program
+   defines. Sends of a selector with exactly one definition, which no class
+   in a fresh context has a method for either, become SENDDIRECT instructions
+   bound to that definition. The VM guards each one, so code loaded later or
+   host defined methods can't make them call the wrong method. Returns the
+   number of sends rewritten. */
+size_t devirtualize(Program &program);
+
+struct InlineReport {
+    std::string className;
+    std::string selector;
+    size_t bodyBytes;
+    size_t sites;
+};
+
+/* Copies the bodies of SENDDIRECT targets into their callers, for methods
+   whose body takes at most maxBodyBytes once inlined. Only bodies without
+   sends qualify (accessors, constants and the like), which also rules out
+   recursion. Each copy sits behind an INLINEGUARD, performing the same checks
+   as SENDDIRECT and falling back to a real send. Run after devirtualize(),
+   returns one report per inlined method. */
+std::vector<InlineReport> inlineSends(Program &program, size_t maxBodyBytes);
+
+} // namespace st
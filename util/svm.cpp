@@ -1,26 +1,123 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
 #include "../src/smalltalk.h"
 
 /* Standalone version of the vm & runtime */
 
+/* Maps the program read-only and runs it in place, so the instructions are
+   never copied and untouched pages are never even read in. Returns false if
+   the file can't be mapped (a pipe, an empty file, ...). */
+static bool runMapped(ST_Object context, const char *path) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || !info.st_size) {
+        close(fd);
+        return false;
+    }
+    void *data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    ST_Code program =
+        ST_VM_loadInPlace(context, (const ST_U8 *)data, info.st_size);
+    ST_VM_execute(context, &program, 0);
+    /* Methods the program defined point into the mapping, so it has to stay
+       until the process exits. */
+    return true;
+}
+
+static std::string readFile(const char *path) {
+    std::ifstream input(path, std::ios::binary);
+    std::stringstream buffer;
+    buffer << input.rdbuf();
+    return buffer.str();
+}
+
+static void run(ST_Object context, const char *path) {
+    if (runMapped(context, path)) {
+        return;
+    }
+    /* Streams anything that can't be mapped, like a pipe, so only one chunk
+       is buffered on this side. It can't run early: a debug section, if the
+       program has one, is only recognised at the end. */
+    std::ifstream input(path, std::ios::binary);
+    ST_Loader *loader = ST_VM_beginLoad(context);
+    std::vector<char> chunk(64 * 1024);
+    while (input.read(chunk.data(), chunk.size()) || input.gcount()) {
+        ST_VM_feed(loader, (const ST_U8 *)chunk.data(), input.gcount());
+    }
+    ST_VM_finishLoad(loader);
+    ST_VM_runLoaded(loader);
+}
+
+static bool saveImage(ST_Object context, const char *path) {
+    const ST_Size size = ST_saveImage(context, nullptr, 0);
+    if (!size) {
+        return false;
+    }
+    std::vector<ST_U8> image;
+    image.resize(size);
+    if (ST_saveImage(context, image.data(), size) != size) {
+        return false;
+    }
+    std::ofstream output(path, std::ios::binary);
+    output.write((const char *)image.data(), image.size());
+    return (bool)output;
+}
+
 int main(int argc, char **argv) {
-    if (argc != 2) {
-        puts("usage: svm [file]");
+    const char *imagePath = nullptr;
+    const char *saveImagePath = nullptr;
+    const char *programPath = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-image") == 0 && i + 1 < argc) {
+            imagePath = argv[++i];
+        } else if (strcmp(argv[i], "-save-image") == 0 && i + 1 < argc) {
+            saveImagePath = argv[++i];
+        } else if (!programPath) {
+            programPath = argv[i];
+        } else {
+            programPath = nullptr;
+            break;
+        }
+    }
+    if (!programPath && !(imagePath && saveImagePath)) {
+        puts("usage: svm [-image file] [-save-image file] [file]");
         return EXIT_FAILURE;
     }
     ST_Configuration config = ST_DEFAULT_CONFIG;
-    ST_Object context = ST_createContext(&config);
-    std::ifstream input(argv[1], std::ios::binary);
-    std::stringstream buffer;
-    buffer << input.rdbuf();
-    std::string programBytes = buffer.str();
-    ST_Code program = ST_VM_load(context,
-                                 (const ST_U8 *)programBytes.c_str(),
-                                 programBytes.size());
-    ST_VM_execute(context, &program, 0);
+    ST_Object context;
+    if (imagePath) {
+        const std::string image = readFile(imagePath);
+        context = ST_loadImage(&config, (const ST_U8 *)image.c_str(),
+                               image.size());
+        if (!context) {
+            std::cerr << "svm: failed to load image " << imagePath
+                      << std::endl;
+            return EXIT_FAILURE;
+        }
+    } else {
+        context = ST_createContext(&config);
+    }
+    if (programPath) {
+        run(context, programPath);
+    }
+    if (saveImagePath && !saveImage(context, saveImagePath)) {
+        std::cerr << "svm: failed to save image " << saveImagePath
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
     return EXIT_SUCCESS;
 }